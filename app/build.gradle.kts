@@ -23,7 +23,7 @@ android {
                 // Disable Vulkan for macOS Emulator (It doesn't support Vulkan)
 //                arguments += "-DGGML_VULKAN=ON"
 //                cppFlags += "-I${rootDir}/app/src/main/cpp/Vulkan-Hpp/Vulkan-Headers/include"
-                cppFlags += "-std=c++11"
+                cppFlags += "-std=c++17"
             }
         }
 
@@ -0,0 +1,499 @@
+#include "LlamaBatchEngine.h"
+#include "LlamaCpp.h"
+#include "LlamaTrace.h"
+#include "common.h"
+
+#include "llama.h"
+#include "log.h"
+
+#include <algorithm>
+#include <utility>
+
+LlamaBatchEngine::~LlamaBatchEngine() {
+    stop();
+    if (threads_active) {
+        threadpools->pause();
+    }
+    for (auto &entry : conversations) {
+        gpt_sampler_free(entry.second.smpl);
+    }
+    if (ctx != nullptr) {
+        llama_batch_free(batch);
+        llama_free(ctx);
+    }
+}
+
+bool LlamaBatchEngine::init(llama_model *model_arg, const gpt_params &params_arg, int32_t n_slots_arg) {
+    model = model_arg;
+    params = params_arg;
+    n_slots = std::max(n_slots_arg, 1);
+    n_ctx_slot = params.n_ctx > 0 ? params.n_ctx : llama_n_ctx_train(model);
+
+    auto cparams = llama_context_params_from_gpt_params(params);
+    cparams.n_ctx = (uint32_t) (n_ctx_slot * n_slots);
+    cparams.n_seq_max = (uint32_t) n_slots;
+
+    ctx = llama_new_context_with_model(model, cparams);
+    if (ctx == nullptr) {
+        LOG_ERR("%s: failed to create context with model '%s'\n", __func__, params.model.c_str());
+        return false;
+    }
+
+    threadpools = LlamaThreadpoolManager::acquire(params.cpuparams, params.cpuparams_batch);
+    if (!threadpools) {
+        llama_free(ctx);
+        ctx = nullptr;
+        return false;
+    }
+    llama_attach_threadpool(ctx, threadpools->getDecode(), threadpools->getBatch());
+
+    n_batch = (int32_t) llama_n_batch(ctx);
+    batch = llama_batch_init(n_batch, 0, 1);
+    stop_matcher = LlamaStopMatcher(params.antiprompt, ctx);
+    chat_formatter = LlamaChatFormatter(model, params.chat_template);
+    input_prefix_tokens = ::llama_tokenize(model, params.input_prefix, false, true);
+    input_suffix_tokens = ::llama_tokenize(model, params.input_suffix, false, true);
+    slot_owner.assign(n_slots, -1);
+
+    LOG_INF("%s: n_slots = %d, n_ctx_slot = %d, n_batch = %d\n", __func__, n_slots, n_ctx_slot, n_batch);
+    return true;
+}
+
+int32_t LlamaBatchEngine::createConversation(const std::string &system_prompt) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const int32_t id = next_conversation_id++;
+    commands.push_back({Command::CREATE, id, system_prompt, 0, nullptr});
+    cv.notify_one();
+    return id;
+}
+
+void LlamaBatchEngine::submit(int32_t conversation_id, const std::string &message, int32_t n_predict, TokenCallback callback) {
+    n_pending++;
+    std::lock_guard<std::mutex> lock(mutex);
+    commands.push_back({Command::SUBMIT, conversation_id, message, n_predict, std::move(callback)});
+    cv.notify_one();
+}
+
+void LlamaBatchEngine::cancel(int32_t conversation_id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    commands.push_back({Command::CANCEL, conversation_id, "", 0, nullptr});
+    cv.notify_one();
+}
+
+void LlamaBatchEngine::closeConversation(int32_t conversation_id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    commands.push_back({Command::CLOSE, conversation_id, "", 0, nullptr});
+    cv.notify_one();
+}
+
+bool LlamaBatchEngine::isIdle() const {
+    return n_pending.load() == 0;
+}
+
+LlamaBatchEngine::Stats LlamaBatchEngine::getStats() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+void LlamaBatchEngine::start() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (running) {
+        return;
+    }
+    running = true;
+    worker = std::thread(&LlamaBatchEngine::run, this);
+}
+
+void LlamaBatchEngine::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running) {
+            return;
+        }
+        running = false;
+        cv.notify_one();
+    }
+    worker.join();
+}
+
+void LlamaBatchEngine::run() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return !running || !commands.empty() || n_pending.load() > 0; });
+            if (!running) {
+                break;
+            }
+        }
+        step();
+    }
+}
+
+void LlamaBatchEngine::applyCommands() {
+    std::deque<Command> queued;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queued.swap(commands);
+    }
+
+    for (auto &command : queued) {
+        switch (command.type) {
+            case Command::CREATE:
+                handleCreate(command.conversation_id, command.text);
+                break;
+            case Command::SUBMIT:
+                handleSubmit(command);
+                break;
+            case Command::CANCEL: {
+                auto it = conversations.find(command.conversation_id);
+                if (it != conversations.end() && it->second.active) {
+                    if (it->second.n_generated > 0) {
+                        finishReply(it->second, /* need_insert_eot= */ true);
+                    } else {
+                        failReply(it->second);
+                    }
+                }
+                break;
+            }
+            case Command::CLOSE: {
+                auto it = conversations.find(command.conversation_id);
+                if (it == conversations.end()) {
+                    break;
+                }
+                if (it->second.active) {
+                    finishReply(it->second, /* need_insert_eot= */ false);
+                }
+                releaseSlot(it->second);
+                gpt_sampler_free(it->second.smpl);
+                conversations.erase(it);
+                break;
+            }
+        }
+    }
+}
+
+void LlamaBatchEngine::handleCreate(int32_t id, const std::string &system_prompt) {
+    Conversation &conversation = conversations[id];
+    conversation.smpl = gpt_sampler_init(model, params.sparams);
+    if (!system_prompt.empty()) {
+        const std::string prompt = params.enable_chat_template
+                                   ? chat_formatter.addAndFormat(conversation.chat_msgs, "system", system_prompt)
+                                   : system_prompt;
+        conversation.tokens = ::llama_tokenize(model, prompt, true, true);
+    }
+}
+
+void LlamaBatchEngine::handleSubmit(Command &command) {
+    auto it = conversations.find(command.conversation_id);
+    if (it == conversations.end() || it->second.active) {
+        LOG_WRN("%s: conversation %d is unknown or busy\n", __func__, command.conversation_id);
+        if (command.callback) {
+            command.callback("", true);
+        }
+        n_pending--;
+        return;
+    }
+    Conversation &conversation = it->second;
+
+    const bool format_chat = params.enable_chat_template;
+    const std::string user_inp = format_chat
+                                 ? chat_formatter.addAndFormat(conversation.chat_msgs, "user", command.text)
+                                 : command.text;
+
+    std::vector<llama_token> line;
+    if (conversation.need_insert_eot && format_chat) {
+        const llama_token eot = llama_token_eot(model);
+        line.push_back(eot == -1 ? llama_token_eos(model) : eot);
+    }
+    // the first tokens of a conversation get the BOS token
+    const bool add_special = conversation.tokens.empty();
+    const auto line_pfx = add_special ? ::llama_tokenize(model, params.input_prefix, true, true) : input_prefix_tokens;
+    const auto line_inp = ::llama_tokenize(model, user_inp, add_special && line_pfx.empty(), format_chat);
+    const auto & line_sfx = input_suffix_tokens;
+    line.insert(line.end(), line_pfx.begin(), line_pfx.end());
+    line.insert(line.end(), line_inp.begin(), line_inp.end());
+    line.insert(line.end(), line_sfx.begin(), line_sfx.end());
+
+    if ((int32_t) (conversation.tokens.size() + line.size()) >= n_ctx_slot) {
+        LOG_WRN("%s: conversation %d does not fit into %d tokens\n", __func__, command.conversation_id, n_ctx_slot);
+        if (format_chat) {
+            conversation.chat_msgs.pop_back();
+        }
+        if (command.callback) {
+            command.callback("", true);
+        }
+        n_pending--;
+        return;
+    }
+
+    conversation.n_tokens_before_message = conversation.tokens.size();
+    conversation.need_insert_eot_before_message = conversation.need_insert_eot;
+    conversation.tokens.insert(conversation.tokens.end(), line.begin(), line.end());
+    conversation.need_insert_eot = false;
+
+    // penalties of the reply take the message into account, like in LlamaGenerationSession
+    gpt_sampler_reset(conversation.smpl);
+    for (const llama_token token : line) {
+        gpt_sampler_accept(conversation.smpl, token, false);
+    }
+
+    conversation.active = true;
+    conversation.n_predict = command.n_predict;
+    conversation.n_generated = 0;
+    conversation.assistant.clear();
+    conversation.stop_state = LlamaStopMatcher::INITIAL_STATE;
+    conversation.callback = std::move(command.callback);
+    conversation.last_used = n_step;
+}
+
+bool LlamaBatchEngine::assignSlot(int32_t id, Conversation &conversation) {
+    int32_t slot = -1;
+    for (int32_t i = 0; i < n_slots; i++) {
+        if (slot_owner[i] < 0) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        if (!evictIdleSlot()) {
+            return false;
+        }
+        return assignSlot(id, conversation);
+    }
+
+    slot_owner[slot] = id;
+    conversation.slot = slot;
+    conversation.n_past = 0;
+    return true;
+}
+
+void LlamaBatchEngine::releaseSlot(Conversation &conversation) {
+    if (conversation.slot < 0) {
+        return;
+    }
+    llama_kv_cache_seq_rm(ctx, conversation.slot, -1, -1);
+    slot_owner[conversation.slot] = -1;
+    conversation.slot = -1;
+    conversation.n_past = 0;
+}
+
+bool LlamaBatchEngine::evictIdleSlot() {
+    Conversation *victim = nullptr;
+    for (int32_t owner : slot_owner) {
+        if (owner < 0) {
+            continue;
+        }
+        Conversation &conversation = conversations.at(owner);
+        if (!conversation.active && (victim == nullptr || conversation.last_used < victim->last_used)) {
+            victim = &conversation;
+        }
+    }
+    if (victim == nullptr) {
+        return false;
+    }
+    releaseSlot(*victim);
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.n_evictions++;
+    return true;
+}
+
+void LlamaBatchEngine::finishReply(Conversation &conversation, bool need_insert_eot) {
+    if (params.enable_chat_template) {
+        chat_formatter.addAndFormat(conversation.chat_msgs, "assistant", conversation.assistant);
+    }
+    conversation.need_insert_eot = need_insert_eot;
+    endReply(conversation);
+}
+
+void LlamaBatchEngine::failReply(Conversation &conversation) {
+    if (params.enable_chat_template) {
+        conversation.chat_msgs.pop_back();
+    }
+    conversation.tokens.resize(conversation.n_tokens_before_message);
+    conversation.need_insert_eot = conversation.need_insert_eot_before_message;
+    if (conversation.n_past > (int32_t) conversation.tokens.size()) {
+        if (conversation.slot >= 0) {
+            llama_kv_cache_seq_rm(ctx, conversation.slot, (llama_pos) conversation.tokens.size(), -1);
+        }
+        conversation.n_past = (int32_t) conversation.tokens.size();
+    }
+    endReply(conversation);
+}
+
+void LlamaBatchEngine::endReply(Conversation &conversation) {
+    conversation.active = false;
+    conversation.i_batch = -1;
+    conversation.last_used = n_step;
+
+    TokenCallback callback = std::move(conversation.callback);
+    conversation.callback = nullptr;
+    if (callback) {
+        callback("", true);
+    }
+    n_pending--;
+}
+
+void LlamaBatchEngine::sample(Conversation &conversation) {
+    const llama_token id = gpt_sampler_sample(conversation.smpl, ctx, conversation.i_batch);
+    gpt_sampler_accept(conversation.smpl, id, true);
+    conversation.i_batch = -1;
+
+    // the token is decoded with the next step, or with the next message if the reply ends here
+    conversation.tokens.push_back(id);
+
+    if (llama_token_is_eog(model, id)) {
+        finishReply(conversation, false);
+        return;
+    }
+
+    const std::string piece = llama_token_to_piece(ctx, id, params.special);
+    conversation.assistant += piece;
+    conversation.n_generated++;
+    if (conversation.callback) {
+        conversation.callback(piece, false);
+    }
+
+    bool stop = conversation.n_predict >= 0 && conversation.n_generated >= conversation.n_predict;
+    if ((int32_t) conversation.tokens.size() >= n_ctx_slot) {
+        LOG_WRN("%s: context of slot %d is full\n", __func__, conversation.slot);
+        stop = true;
+    }
+    if (!stop_matcher.empty()) {
+        const std::string special_piece = params.special ? piece : llama_token_to_piece(ctx, id, true);
+        stop = stop || stop_matcher.isStopToken(id) ||
+               stop_matcher.feed(conversation.stop_state, special_piece.data(), special_piece.size()) >= 0;
+    }
+    if (stop) {
+        finishReply(conversation, true);
+    }
+}
+
+bool LlamaBatchEngine::step() {
+    std::lock_guard<std::mutex> step_lock(step_mutex);
+
+    applyCommands();
+    n_step++;
+
+    // admit waiting replies, evicting idle conversations if all slots are taken
+    for (auto &entry : conversations) {
+        Conversation &conversation = entry.second;
+        if (conversation.active && conversation.slot < 0 && !assignSlot(entry.first, conversation)) {
+            break;
+        }
+    }
+
+    llama_batch_clear(batch);
+    int32_t n_prompt = 0;
+
+    // one token for every slot that is generating, so decoding never waits for a prefill
+    for (auto &entry : conversations) {
+        Conversation &conversation = entry.second;
+        if (!conversation.active || conversation.slot < 0) {
+            continue;
+        }
+        if ((int32_t) conversation.tokens.size() - conversation.n_past == 1 && batch.n_tokens < n_batch) {
+            llama_batch_add(batch, conversation.tokens[conversation.n_past], conversation.n_past, {conversation.slot}, true);
+            conversation.n_batched = 1;
+            conversation.i_batch = batch.n_tokens - 1;
+        }
+    }
+
+    // the rest of the batch is filled with prompt chunks
+    for (auto &entry : conversations) {
+        Conversation &conversation = entry.second;
+        if (!conversation.active || conversation.slot < 0 || conversation.n_batched > 0) {
+            continue;
+        }
+        const int32_t n_left = (int32_t) conversation.tokens.size() - conversation.n_past;
+        const int32_t n_chunk = std::min(n_left, n_batch - batch.n_tokens);
+        if (n_chunk <= 0) {
+            continue;
+        }
+        for (int32_t i = 0; i < n_chunk; i++) {
+            const int32_t pos = conversation.n_past + i;
+            const bool is_last = i == n_left - 1;
+            llama_batch_add(batch, conversation.tokens[pos], pos, {conversation.slot}, is_last);
+        }
+        conversation.n_batched = n_chunk;
+        conversation.i_batch = n_chunk == n_left ? batch.n_tokens - 1 : -1;
+        n_prompt += n_chunk;
+    }
+
+    if (batch.n_tokens == 0) {
+        if (threads_active) {
+            // idle, stop the threads polling for work
+            threadpools->pause();
+            threads_active = false;
+        }
+        return false;
+    }
+    if (!threads_active) {
+        threadpools->resume();
+        threads_active = true;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+    int32_t ret;
+    {
+        std::lock_guard<std::mutex> compute_lock(threadpools->computeMutex());
+        ret = llama_decode(ctx, batch);
+    }
+    const int64_t t_decode_us = ggml_time_us() - t_start_us;
+    LMP_TRACE_SPAN("batch_decode", t_start_us, t_start_us + t_decode_us);
+
+    if (ret != 0) {
+        for (auto &entry : conversations) {
+            Conversation &conversation = entry.second;
+            if (conversation.n_batched > 0) {
+                // drop whatever part of the batch made it into the cache
+                llama_kv_cache_seq_rm(ctx, conversation.slot, conversation.n_past, -1);
+            }
+            conversation.n_batched = 0;
+            conversation.i_batch = -1;
+        }
+        // no room in the KV cache: make some by evicting an idle conversation, otherwise give up
+        // on the reply holding the most cells
+        LOG_WRN("%s: llama_decode failed with %d for %d tokens\n", __func__, ret, batch.n_tokens);
+        if (ret < 0 || !evictIdleSlot()) {
+            Conversation *largest = nullptr;
+            for (auto &entry : conversations) {
+                Conversation &conversation = entry.second;
+                if (conversation.active && conversation.slot >= 0 &&
+                    (largest == nullptr || conversation.n_past > largest->n_past)) {
+                    largest = &conversation;
+                }
+            }
+            if (largest != nullptr) {
+                releaseSlot(*largest);
+                // a conversation still in prefill has no reply to close
+                if (largest->n_generated > 0) {
+                    finishReply(*largest, true);
+                } else {
+                    failReply(*largest);
+                }
+            }
+        }
+        return true;
+    }
+
+    int32_t n_generated = 0;
+    for (auto &entry : conversations) {
+        Conversation &conversation = entry.second;
+        if (conversation.n_batched == 0) {
+            continue;
+        }
+        conversation.n_past += conversation.n_batched;
+        conversation.n_batched = 0;
+        if (conversation.active && conversation.i_batch >= 0) {
+            sample(conversation);
+            n_generated++;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    stats.n_steps++;
+    stats.n_prompt_tokens += n_prompt;
+    stats.n_generated_tokens += n_generated;
+    stats.t_decode_us += t_decode_us;
+    return true;
+}
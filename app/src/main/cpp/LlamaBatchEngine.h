@@ -0,0 +1,181 @@
+#ifndef LMPLAYGROUND_LLAMABATCHENGINE_H
+#define LMPLAYGROUND_LLAMABATCHENGINE_H
+
+#include "LlamaChatFormatter.h"
+#include "LlamaStopMatcher.h"
+#include "LlamaThreadpools.h"
+#include "common.h"
+#include "sampling.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Serves many conversations from a single llama_context.
+//
+// A conversation that is being served occupies a slot, i.e. a KV sequence id. Every step builds
+// one llama_batch with the next token of each generating slot followed by prompt chunks of the
+// slots that are still ingesting, so new requests are prefilled while running ones keep decoding
+// and all of them share the weights and compute buffers of one context.
+// Idle conversations keep their slot until another conversation needs it; the least recently
+// used one is evicted first and ingests its history again on its next turn.
+//
+// All public methods are thread-safe. The engine is driven either by its worker thread
+// (start/stop) or by calling step() directly, callbacks are invoked on the driving thread.
+class LlamaBatchEngine {
+public:
+    // Receives the reply to a message piece by piece, `finished` is set on the last call
+    using TokenCallback = std::function<void(const std::string &piece, bool finished)>;
+
+    struct Stats {
+        int64_t n_steps = 0;
+        int64_t n_prompt_tokens = 0;
+        int64_t n_generated_tokens = 0;
+        int64_t n_evictions = 0;
+        int64_t t_decode_us = 0;
+    };
+
+    LlamaBatchEngine() = default;
+
+    ~LlamaBatchEngine();
+
+    LlamaBatchEngine(const LlamaBatchEngine &) = delete;
+
+    LlamaBatchEngine &operator=(const LlamaBatchEngine &) = delete;
+
+    // Creates a context with room for `n_slots` conversations of params.n_ctx tokens each
+    bool init(llama_model *model, const gpt_params &params, int32_t n_slots);
+
+    // Returns the id of a new conversation, `system_prompt` may be empty
+    int32_t createConversation(const std::string &system_prompt);
+
+    // Queues a user message, the reply is streamed to `callback`.
+    // A negative `n_predict` generates until end of turn or the conversation's context is full.
+    void submit(int32_t conversation_id, const std::string &message, int32_t n_predict, TokenCallback callback);
+
+    // Ends the reply in progress, if any. A reply cancelled before its first token also takes
+    // its message back out of the conversation.
+    void cancel(int32_t conversation_id);
+
+    void closeConversation(int32_t conversation_id);
+
+    // Runs one scheduling step, returns false if there was nothing to decode
+    bool step();
+
+    void start();
+
+    void stop();
+
+    // True when no submitted message is waiting for or receiving a reply
+    bool isIdle() const;
+
+    Stats getStats();
+
+private:
+    struct Conversation {
+        std::vector<llama_chat_msg> chat_msgs;
+        // every token of the conversation, tokens[0, n_past) are in the KV cache of `slot`
+        std::vector<llama_token> tokens;
+        int32_t n_past = 0;
+        int32_t slot = -1;
+        gpt_sampler *smpl = nullptr;
+        // the previous reply was cut short and has to be closed before the next message
+        bool need_insert_eot = false;
+
+        // reply in progress
+        bool active = false;
+        // the conversation before the message of the reply, restored if the reply fails
+        size_t n_tokens_before_message = 0;
+        bool need_insert_eot_before_message = false;
+        int32_t n_predict = -1;
+        int32_t n_generated = 0;
+        std::string assistant;
+        int32_t stop_state = LlamaStopMatcher::INITIAL_STATE;
+        TokenCallback callback;
+
+        // tokens added to the current batch and the index of the sampled one, or -1
+        int32_t n_batched = 0;
+        int32_t i_batch = -1;
+        int64_t last_used = 0;
+    };
+
+    struct Command {
+        enum Type { CREATE, SUBMIT, CANCEL, CLOSE };
+
+        Type type;
+        int32_t conversation_id;
+        std::string text;
+        int32_t n_predict;
+        TokenCallback callback;
+    };
+
+    void applyCommands();
+
+    void handleCreate(int32_t id, const std::string &system_prompt);
+
+    void handleSubmit(Command &command);
+
+    bool assignSlot(int32_t id, Conversation &conversation);
+
+    void releaseSlot(Conversation &conversation);
+
+    // Frees the slot of the least recently used idle conversation
+    bool evictIdleSlot();
+
+    void finishReply(Conversation &conversation, bool need_insert_eot);
+
+    // Ends a reply that has not generated anything, its message is taken back out of the
+    // conversation so that the history stays as it was before
+    void failReply(Conversation &conversation);
+
+    void endReply(Conversation &conversation);
+
+    void sample(Conversation &conversation);
+
+    void run();
+
+    llama_model *model = nullptr;
+    llama_context *ctx = nullptr;
+    gpt_params params;
+    llama_batch batch = {};
+    std::shared_ptr<LlamaThreadpools> threadpools;
+    LlamaStopMatcher stop_matcher;
+    LlamaChatFormatter chat_formatter;
+    std::vector<llama_token> input_prefix_tokens;
+    std::vector<llama_token> input_suffix_tokens;
+    // resumed while there is something to decode
+    bool threads_active = false;
+
+    int32_t n_slots = 0;
+    int32_t n_ctx_slot = 0;
+    int32_t n_batch = 0;
+
+    // conversation id that owns each slot, or -1
+    std::vector<int32_t> slot_owner;
+    // ordered by id, so waiting requests are admitted in creation order
+    std::map<int32_t, Conversation> conversations;
+    int64_t n_step = 0;
+
+    // serializes step() callers
+    std::mutex step_mutex;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Command> commands;
+    int32_t next_conversation_id = 0;
+    Stats stats;
+    bool running = false;
+    std::thread worker;
+
+    // submitted messages whose reply has not finished yet
+    std::atomic<int32_t> n_pending{0};
+};
+
+#endif //LMPLAYGROUND_LLAMABATCHENGINE_H
@@ -0,0 +1,114 @@
+#include "LlamaBatchRunner.h"
+
+#include "ggml.h"
+#include "json.hpp"
+#include "log.h"
+
+#include <algorithm>
+#include <exception>
+#include <memory>
+
+using json = nlohmann::ordered_json;
+
+struct LlamaBatchRunner::Request {
+    json id;
+    int32_t conversation = -1;
+    std::string text;
+    int32_t n_tokens = 0;
+    int64_t t_submit_us = 0;
+};
+
+LlamaBatchRunner::LlamaBatchRunner(LlamaBatchEngine &engine_arg, int32_t n_in_flight_arg)
+        : engine(engine_arg), n_in_flight(std::max(n_in_flight_arg, 1)) {
+}
+
+void LlamaBatchRunner::setDefaults(const std::string &system_prompt, int32_t n_predict) {
+    default_system_prompt = system_prompt;
+    default_n_predict = n_predict;
+}
+
+bool LlamaBatchRunner::run(std::istream &input, std::ostream &output) {
+    const LlamaBatchEngine::Stats before = engine.getStats();
+    const int64_t t_start_us = ggml_time_us();
+
+    fill(input, output);
+    // the callbacks run on this thread and submit the next requests as slots free up
+    while (!engine.isIdle()) {
+        engine.step();
+    }
+
+    const LlamaBatchEngine::Stats after = engine.getStats();
+    stats.n_steps += after.n_steps - before.n_steps;
+    stats.n_prompt_tokens += after.n_prompt_tokens - before.n_prompt_tokens;
+    stats.n_generated_tokens += after.n_generated_tokens - before.n_generated_tokens;
+    stats.t_decode_us += after.t_decode_us - before.t_decode_us;
+    stats.t_total_us += ggml_time_us() - t_start_us;
+    output.flush();
+    return !output.fail();
+}
+
+LlamaBatchRunner::Stats LlamaBatchRunner::getStats() const {
+    return stats;
+}
+
+void LlamaBatchRunner::fill(std::istream &input, std::ostream &output) {
+    std::string line;
+    while (n_running < n_in_flight && std::getline(input, line)) {
+        n_lines++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        stats.n_requests++;
+
+        auto request = std::make_shared<Request>();
+        request->id = n_lines;
+        std::string prompt;
+        std::string system_prompt = default_system_prompt;
+        int32_t n_predict = default_n_predict;
+        try {
+            const json object = json::parse(line);
+            if (object.contains("id")) {
+                request->id = object.at("id");
+            }
+            prompt = object.at("prompt").get<std::string>();
+            system_prompt = object.value("system", system_prompt);
+            n_predict = object.value("n_predict", n_predict);
+        } catch (const std::exception &e) {
+            LOG_WRN("%s: line %lld is not a valid request: %s\n", __func__, (long long) n_lines, e.what());
+            stats.n_errors++;
+            // the message may quote ill-formed UTF-8 of the line
+            const json error = {{"id", request->id}, {"error", e.what()}};
+            writeLine(output, error.dump(-1, ' ', false, json::error_handler_t::replace));
+            continue;
+        }
+
+        request->conversation = engine.createConversation(system_prompt);
+        request->t_submit_us = ggml_time_us();
+        n_running++;
+        engine.submit(request->conversation, prompt, n_predict,
+                      [this, request, &input, &output](const std::string &piece, bool finished) {
+            if (!finished) {
+                request->text += piece;
+                request->n_tokens++;
+                return;
+            }
+            const json result = {
+                    {"id", request->id},
+                    {"text", request->text},
+                    {"n_tokens", request->n_tokens},
+                    {"time_ms", (ggml_time_us() - request->t_submit_us) / 1000},
+            };
+            // a reply cut off by n_predict may end in the middle of a UTF-8 sequence
+            writeLine(output, result.dump(-1, ' ', false, json::error_handler_t::replace));
+            engine.closeConversation(request->conversation);
+            n_running--;
+            fill(input, output);
+        });
+    }
+}
+
+void LlamaBatchRunner::writeLine(std::ostream &output, const std::string &line) {
+    // a line per finished request, so a consumer can follow the file while the job runs
+    output << line << '\n';
+    output.flush();
+}
@@ -0,0 +1,66 @@
+#ifndef LMPLAYGROUND_LLAMABATCHRUNNER_H
+#define LMPLAYGROUND_LLAMABATCHRUNNER_H
+
+#include "LlamaBatchEngine.h"
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+
+// Runs a file of independent prompts through a LlamaBatchEngine, e.g. for offline jobs.
+//
+// Every request is a JSON object on its own line:
+//   {"id": ..., "prompt": "...", "system": "...", "n_predict": N}
+// where only "prompt" is required; "id" defaults to the line number. Each request is a new
+// conversation of the engine, formatted with the model's chat template like the interactive ones.
+//
+// Up to `n_in_flight` requests are submitted at once, normally the number of engine slots. When
+// a reply is complete its result is written as a line of its own:
+//   {"id": ..., "text": "...", "n_tokens": N, "time_ms": T}
+// or {"id": ..., "error": "..."} for a line that is not a valid request; a prompt that does not
+// fit into the context of a slot gets an empty text. The conversation is closed and the next
+// request takes the freed slot with the next engine step. Results are in the order the replies
+// finish, not in the input order.
+class LlamaBatchRunner {
+public:
+    struct Stats {
+        int64_t n_requests = 0;
+        int64_t n_errors = 0;
+        int64_t n_steps = 0;
+        int64_t n_prompt_tokens = 0;
+        int64_t n_generated_tokens = 0;
+        int64_t t_decode_us = 0;
+        int64_t t_total_us = 0;
+    };
+
+    LlamaBatchRunner(LlamaBatchEngine &engine, int32_t n_in_flight);
+
+    // Used by the requests that do not set "system" or "n_predict"
+    void setDefaults(const std::string &system_prompt, int32_t n_predict);
+
+    // Drives the engine from the calling thread until every request of `input` is answered.
+    // Returns false if writing `output` failed.
+    bool run(std::istream &input, std::ostream &output);
+
+    Stats getStats() const;
+
+private:
+    struct Request;
+
+    // Submits requests from `input` until n_in_flight are running or the input ends
+    void fill(std::istream &input, std::ostream &output);
+
+    void writeLine(std::ostream &output, const std::string &line);
+
+    LlamaBatchEngine &engine;
+    int32_t n_in_flight;
+    std::string default_system_prompt;
+    int32_t default_n_predict = -1;
+
+    int32_t n_running = 0;
+    int64_t n_lines = 0;
+    Stats stats;
+};
+
+#endif //LMPLAYGROUND_LLAMABATCHRUNNER_H
@@ -0,0 +1,62 @@
+#include "LlamaChatFormatter.h"
+#include "common.h"
+
+#include "log.h"
+
+#include <utility>
+
+LlamaChatFormatter::LlamaChatFormatter(const llama_model *model_arg, std::string chat_template_arg) :
+        model(model_arg),
+        chat_template(std::move(chat_template_arg)) {
+}
+
+std::string LlamaChatFormatter::addAndFormat(std::vector<llama_chat_msg> &chat_msgs,
+                                             const std::string &role,
+                                             const std::string &content) {
+    return addAndFormat(chat_msgs, role, content, role == "user");
+}
+
+std::string LlamaChatFormatter::addAndFormat(std::vector<llama_chat_msg> &chat_msgs,
+                                             const std::string &role,
+                                             const std::string &content,
+                                             bool add_ass) {
+    // the window starts at the last user message, so it is a well-formed conversation on its own
+    size_t window_start = chat_msgs.size();
+    while (window_start > 0 && chat_msgs[window_start - 1].role != "user") {
+        window_start--;
+    }
+    if (!incremental || window_start == 0) {
+        // nothing to skip
+        return addAndFormatFull(chat_msgs, role, content, add_ass);
+    }
+    window_start--;
+
+    const llama_chat_msg new_msg{role, content};
+    const std::vector<llama_chat_msg> window(chat_msgs.begin() + (long) window_start, chat_msgs.end());
+    std::string formatted = llama_chat_format_single(model, chat_template, window, new_msg, add_ass);
+
+    if (n_verified < VERIFY_MESSAGES) {
+        const std::string full = llama_chat_format_single(model, chat_template, chat_msgs, new_msg, add_ass);
+        if (full != formatted) {
+            LOG_INF("%s: the chat template depends on earlier messages, formatting in full\n", __func__);
+            incremental = false;
+            formatted = full;
+        }
+        n_verified++;
+    }
+
+    chat_msgs.push_back(new_msg);
+    LOG_DBG("formatted: '%s'\n", formatted.c_str());
+    return formatted;
+}
+
+std::string LlamaChatFormatter::addAndFormatFull(std::vector<llama_chat_msg> &chat_msgs,
+                                                 const std::string &role,
+                                                 const std::string &content,
+                                                 bool add_ass) {
+    const llama_chat_msg new_msg{role, content};
+    std::string formatted = llama_chat_format_single(model, chat_template, chat_msgs, new_msg, add_ass);
+    chat_msgs.push_back(new_msg);
+    LOG_DBG("formatted: '%s'\n", formatted.c_str());
+    return formatted;
+}
@@ -0,0 +1,47 @@
+#ifndef LMPLAYGROUND_LLAMACHATFORMATTER_H
+#define LMPLAYGROUND_LLAMACHATFORMATTER_H
+
+#include "common.h"
+
+#include <string>
+#include <vector>
+
+// Formats chat messages one at a time without re-rendering the whole history.
+//
+// llama_chat_format_single() renders the full history twice per message to diff out the new
+// part, so its cost grows with the conversation. Chat templates render each message on its
+// own, except around the system prompt and the first turn, so the delta is computed against
+// a window that starts at the last user message instead. The first few turns are also
+// formatted the slow way and compared; a template that produces a different delta is always
+// formatted in full.
+class LlamaChatFormatter {
+public:
+    LlamaChatFormatter() = default;
+
+    LlamaChatFormatter(const llama_model *model, std::string chat_template);
+
+    // Appends a message to `chat_msgs` and returns the text it adds to the formatted
+    // conversation, same as the full formatting
+    std::string addAndFormat(std::vector<llama_chat_msg> &chat_msgs, const std::string &role, const std::string &content);
+
+    // Same with an explicit `add_ass`, which is otherwise set for user messages: earlier turns of
+    // a conversation leave it out, the assistant messages following them format the prefix
+    std::string addAndFormat(std::vector<llama_chat_msg> &chat_msgs, const std::string &role, const std::string &content,
+                             bool add_ass);
+
+    // Formats against the whole history, like llama_chat_format_single()
+    std::string addAndFormatFull(std::vector<llama_chat_msg> &chat_msgs, const std::string &role, const std::string &content,
+                                 bool add_ass);
+
+private:
+    // windowed deltas compared with full ones before the template is trusted
+    static const int VERIFY_MESSAGES = 4;
+
+    const llama_model *model = nullptr;
+    std::string chat_template;
+
+    int n_verified = 0;
+    bool incremental = true;
+};
+
+#endif //LMPLAYGROUND_LLAMACHATFORMATTER_H
@@ -0,0 +1,50 @@
+#include "LlamaCpp.h"
+#include "common.h"
+
+#include "llama.h"
+#include "log.h"
+
+#include <cstdio>
+
+gpt_params initLlamaCpp() {
+    gpt_params params;
+
+    gpt_init();
+
+    if (params.logits_all) {
+        printf("\n************\n");
+        printf("%s: please use the 'perplexity' tool for perplexity calculations\n", __func__);
+        printf("************\n\n");
+    }
+
+    if (params.embedding) {
+        printf("\n************\n");
+        printf("%s: embeddings are computed by LlamaModel::createEmbeddingSession(), generation sessions ignore this flag\n", __func__);
+        printf("************\n\n");
+    }
+
+    if (params.n_ctx != 0 && params.n_ctx < 8) {
+        LOG("%s: warning: minimum context size is 8, using minimum size.\n", __func__);
+        params.n_ctx = 8;
+    }
+
+    if (params.rope_freq_base != 0.0) {
+        LOG("%s: warning: changing RoPE frequency base to %g.\n", __func__, params.rope_freq_base);
+    }
+
+    if (params.rope_freq_scale != 0.0) {
+        LOG("%s: warning: scaling RoPE frequency by %g.\n", __func__, params.rope_freq_scale);
+    }
+
+    LOG("%s: build = %d (%s)\n",      __func__, LLAMA_BUILD_NUMBER, LLAMA_COMMIT);
+    LOG("%s: built with %s for %s\n", __func__, LLAMA_COMPILER, LLAMA_BUILD_TARGET);
+
+    LOG("%s: llama backend init\n", __func__);
+    llama_backend_init();
+    llama_numa_init(params.numa);
+
+    // keeps decode off the little cores until LlamaModel::tuneThreads() measured better
+    LlamaThreadTuner::apply(LlamaThreadTuner::defaultProfile(LlamaThreadTuner::readTopology()), params);
+
+    return params;
+}
@@ -8,44 +8,217 @@
 #include "common.h"
 #include "sampling.h"
 
-extern gpt_params g_params;
+#include "LlamaBatchEngine.h"
+#include "LlamaChatFormatter.h"
+#include "LlamaEmbeddingSession.h"
+#include "LlamaFastSampler.h"
+#include "LlamaGrammarCache.h"
+#include "LlamaMemoryPlanner.h"
+#include "LlamaMetrics.h"
+#include "LlamaOutputRing.h"
+#include "LlamaPieceTable.h"
+#include "LlamaPromptCache.h"
+#include "LlamaSpeculative.h"
+#include "LlamaStopMatcher.h"
+#include "LlamaThreadTuner.h"
+#include "LlamaThreadpools.h"
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <thread>
+
+// Initializes the llama.cpp backend and returns the default parameters for this device
+gpt_params initLlamaCpp();
 
 class LlamaGenerationSession {
 public:
-    using ResponseCallback = std::function<void(const std::string&)>;
+    // Receives output text; the view is only valid for the duration of the call
+    using ResponseCallback = std::function<void(std::string_view)>;
 
     LlamaGenerationSession();
 
     ~LlamaGenerationSession();
 
-    void init(llama_model *model, gpt_params params);
+    // `history` holds earlier turns of the conversation ("user" and "assistant" messages), they
+    // are ingested with the system prompt before the first addMessage()
+    void init(llama_model *model, gpt_params params, const std::vector<llama_chat_msg> &history = {});
+
+    // Restores the KV state of the system prompt from the cache, or schedules saving it
+    // once the prompt has been ingested
+    void attachPromptCache(const LlamaPromptCache &cache, uint64_t model_hash);
+
+    // Detokenizes through `table` instead of llama_token_to_piece(), it must outlive the session
+    void attachPieceTable(const LlamaPieceTable &table);
+
+    // Compiles grammars through `cache`, it must outlive the session
+    void attachGrammarCache(LlamaGrammarCache &cache);
+
+    // Constrains the reply to the last added message to a GBNF grammar with a `root` rule,
+    // call it after addMessage(). An empty grammar removes the constraint. Returns false if
+    // the grammar can not be parsed, the reply is unconstrained then.
+    bool setGrammar(const std::string &gbnf);
+
+    // Same as setGrammar() with the grammar of a JSON schema
+    bool setJsonSchema(const std::string &schema);
+
+    // Enables speculative decoding with drafts from `draft_model`, which must share the vocabulary
+    bool attachDraftModel(llama_model *draft_model);
+
+    // Enables speculative decoding with drafts looked up in the session's own token history
+    bool attachPromptLookup();
 
     void printReport();
 
     int generate(const ResponseCallback& callback);
 
+    // Runs generate() until the turn is over or stopGeneration() is called, coalescing the
+    // output into chunks of at least `flush_bytes` bytes or one chunk per `flush_interval_us`.
+    // Chunks never end in the middle of a UTF-8 sequence.
+    int generateChunked(const ResponseCallback& callback, size_t flush_bytes, int64_t flush_interval_us);
+
+    // Runs generate() until the turn is over or stopGeneration() is called, writing the output
+    // into the output ring. The ring stream is closed when the call returns.
+    int generateToRing();
+
+    // Output ring shared with the reader (the UI)
+    LlamaOutputRing& getOutputRing();
+
+    // Thread-safe, makes generateChunked()/generateToRing() return after the current token
+    void stopGeneration();
+
+    // Status of pollAsync() while the worker runs
+    static const int ASYNC_RUNNING = -1;
+    // Status of a generation cancelled before its reply started, the message was rolled back
+    static const int STATUS_CANCELLED = 2;
+
+    // Runs generateToRing() on a worker thread and returns right away. Returns false if a
+    // generation is running already. Wait for it before the next addMessage().
+    bool startAsync();
+
+    // Thread-safe, stops the running generation, in the middle of a llama_decode() call if
+    // needed. A turn cancelled before the first token of its reply is rolled back as if the
+    // message had never been added, a started reply is kept like with stopGeneration().
+    void cancel();
+
+    // ASYNC_RUNNING while the worker runs, afterwards the status of the generation
+    int pollAsync() const;
+
+    // Waits for the worker and returns the status of the generation
+    int waitAsync();
+
     void addMessage(const char *string);
 
+    // Closes a reply the caller cut short, e.g. at a token budget: the next message follows an
+    // end of turn token, like after a reply that ended by itself. Does nothing if it did.
+    void endReply();
+
     std::string getReport();
 
+    llama_perf_context_data getPerfData();
+
+    // Latency histograms and counters since the session was created, read it between turns
+    LlamaSessionMetrics getMetrics();
+
+    // Tokens generated since the last addMessage()
+    const std::vector<llama_token> &getReplyTokens() const;
+
+    // Writes the conversation state to `path`. Repeated snapshots to the same path only
+    // append the KV cells and history produced since the previous one.
+    bool saveSnapshot(const std::string &path);
+
+    // Replaces the conversation state with the one stored at `path`
+    bool restoreSnapshot(const std::string &path);
+
 private:
+    // sequence used to export and import ranges of the KV cache of sequence 0
+    static const llama_seq_id SNAPSHOT_SCRATCH_SEQ = 1;
+    static const size_t OUTPUT_RING_CAPACITY = 64 * 1024;
+    // minimal acceptance probability of the last draft token when adapting the draft length
+    static constexpr float SPEC_P_MIN = 0.3f;
+    // n-gram sizes matched by prompt lookup, longer matches are tried first
+    static const int32_t PROMPT_LOOKUP_N_MIN = 2;
+    static const int32_t PROMPT_LOOKUP_N_MAX = 4;
+
+    // One step of generate(), runs with the threadpools resumed and locked
+    int generateStep(const ResponseCallback& callback);
+
+    void pauseThreads();
+
+    // ggml_abort_callback, aborts llama_decode() once cancel() was called
+    static bool abortCallback(void *data);
+
+    // Restores the state before the last addMessage() after a cancel(), see cancel(). Returns
+    // false if the message, or part of it, stays in the conversation.
+    bool rollbackCancelled();
+
+    void acceptToken(llama_token id, bool accept_grammar);
+
+    // Text of a token, valid until the next call
+    std::string_view tokenPiece(llama_token token, bool special);
+
+    void resetSampler();
+
+    // Samples logits `idx` with the fast sampler if it handles the sampler params, with the chain otherwise
+    llama_token sampleUnconstrained(int idx);
+
+    // Decodes the pending token together with a draft and queues the accepted tokens.
+    // Returns 0 on success, 1 on a decode error and -1 if there is nothing to speculate on.
+    int speculate();
+
+    void setDrafter(std::unique_ptr<LlamaDraftProposer> proposer);
+
+    // Makes room for `n_needed` more tokens by evicting the oldest whole turns, keeping the
+    // system prompt. Returns false if evicting every finished turn would not be enough.
+    bool evictTurns(int n_needed);
+
+    // Drops the queued tokens that were accepted but not generated yet, e.g. when the turn ended
+    void discardSpeculation();
+
+    bool writeSnapshot(const std::string &path, bool rewrite);
+
     llama_model *model = nullptr;
     llama_context *ctx = nullptr;
     gpt_sampler *smpl = nullptr;
     gpt_params params;
 
-    ggml_threadpool * threadpool = nullptr;
-    ggml_threadpool * threadpool_batch = nullptr;
+    // same tokens as the chain of smpl, see LlamaFastSampler
+    LlamaFastSampler fast_sampler;
+    bool fast_sampler_enabled = false;
+
+    LlamaGrammarCache *grammar_cache = nullptr;
+    LlamaGrammarSampler grammar_sampler;
+
+    // shared with other sessions using the same thread settings, resumed for the duration of a turn
+    std::shared_ptr<LlamaThreadpools> threadpools;
+    bool threads_active = false;
 
     bool is_antiprompt        = false;
+    std::atomic<bool> stop_requested{false};
+    std::atomic<bool> cancel_requested{false};
+    std::thread async_worker;
+    std::atomic<int> async_status{0};
+    std::unique_ptr<LlamaOutputRing> output_ring;
 
     int n_past             = 0;
     int n_remain           = 0;
     int n_consumed         = 0;
     int n_session_consumed = 0;
 
+    // system prompt tokens at the beginning of embd_inp, followed by the history given to init()
+    int n_prompt_tokens = 0;
+    bool has_history = false;
+    std::string prompt_cache_path;
+    const LlamaPromptCache *prompt_cache = nullptr;
+    const LlamaPieceTable *piece_table = nullptr;
+    std::string piece_scratch;
+    bool need_save_prompt_cache = false;
+
     int n_ctx_train = 0;
     uint32_t n_ctx = 0;
+    ggml_type kv_type_k = GGML_TYPE_F16;
+    ggml_type kv_type_v = GGML_TYPE_F16;
     bool display = false;
     bool is_interacting = true;
     bool input_echo = true;
@@ -57,11 +230,77 @@ private:
     int ga_n = 0;
     int ga_w = 0;
 
+    // a user message and the reply to it, from the position of its first token in the KV cache
+    // and the index of its first message in chat_msgs
+    struct TurnSpan {
+        int pos_start;
+        size_t msg_start;
+    };
+    // turns in the KV cache, oldest first; everything before the first one is the system prompt
+    std::vector<TurnSpan> turns;
+
+    // state before the last addMessage(), restored when the turn is cancelled before its reply;
+    // invalid once positions in the KV cache were shifted
+    struct TurnCheckpoint {
+        bool valid = false;
+        int n_past = 0;
+        int n_consumed = 0;
+        int n_remain = 0;
+        int n_session_consumed = 0;
+        bool need_insert_eot = false;
+        std::vector<llama_token> embd;
+        size_t n_embd_inp = 0;
+        size_t n_spec_history = 0;
+        size_t n_chat_msgs = 0;
+        size_t n_turns = 0;
+    };
+    TurnCheckpoint checkpoint;
+
+    // last tokens accepted by the sampler, and how many of them came after the last reset
+    std::vector<llama_token> sampler_prev;
+    int n_sampler_since_reset = 0;
+
+    // speculative decoding, see speculate()
+    std::unique_ptr<LlamaDraftProposer> drafter;
+    llama_batch spec_batch = {};
+    // every token decoded into ctx, in order
+    std::vector<llama_token> spec_history;
+    // accepted tokens waiting to be generated one per generate() call, the first
+    // spec_n_in_kv of them (counting the pending one in embd) are in the KV cache already
+    std::deque<llama_token> spec_accepted;
+    int spec_n_in_kv = 0;
+    int spec_n_draft = 0;
+    float spec_acceptance = 0.5f;
+    int64_t spec_n_rounds = 0;
+    int64_t spec_n_drafted = 0;
+    int64_t spec_n_accepted = 0;
+    int64_t spec_n_generated = 0;
+    int64_t spec_t_us = 0;
+
+    LlamaSessionMetrics metrics;
+    // when the current turn was added, and when its last token was generated (0 before the first)
+    int64_t t_turn_start_us = 0;
+    int64_t t_last_token_us = 0;
+
+    // what the snapshot at snapshot_path already contains
+    std::string snapshot_path;
+    int snapshot_n_past = 0;
+    size_t snapshot_n_embd_inp = 0;
+    size_t snapshot_n_chat_msgs = 0;
+    // set when cells already written were shifted or removed
+    bool snapshot_needs_rewrite = true;
+
+    std::vector<llama_token> reply_tokens;
     std::vector<int>   input_tokens;
     std::vector<int>   output_tokens;
     std::ostringstream output_ss;
-    std::vector<std::vector<llama_token>> antiprompt_ids;
+    // antiprompts, and the matcher state of the current reply
+    LlamaStopMatcher stop_matcher;
+    int32_t stop_state = LlamaStopMatcher::INITIAL_STATE;
     std::vector<llama_chat_msg> chat_msgs;
+    LlamaChatFormatter chat_formatter;
+    std::vector<llama_token> input_prefix_tokens;
+    std::vector<llama_token> input_suffix_tokens;
     std::ostringstream assistant_ss;
 
     std::vector<llama_token> session_tokens;
@@ -76,7 +315,23 @@ public:
     LlamaModel() = default;
     ~LlamaModel() = default;
 
-    LlamaGenerationSession* createGenerationSession();
+    // Sessions sample with `seed`, or with params.sparams.seed of loadModel() when it is
+    // LLAMA_DEFAULT_SEED; the sampler is seeded randomly if both are
+    LlamaGenerationSession* createGenerationSession(uint32_t seed = LLAMA_DEFAULT_SEED);
+
+    // Creates a session continuing `messages`: an optional "system" message, which replaces the
+    // system prompt of loadModel(), followed by "user" and "assistant" turns. Without a "system"
+    // message the session starts with the system prompt of loadModel().
+    LlamaGenerationSession* createGenerationSession(const std::vector<llama_chat_msg> &messages,
+                                                    uint32_t seed = LLAMA_DEFAULT_SEED);
+
+    // Creates an engine serving up to `n_slots` conversations at once from a single context,
+    // each of them with the context size of a regular session
+    LlamaBatchEngine* createBatchEngine(int32_t n_slots);
+
+    // Creates a session computing embeddings with the loaded model, in a context of its own
+    LlamaEmbeddingSession* createEmbeddingSession();
+
     void loadModel(const gpt_params& params,
                    const std::string &modelPath,
                    std::string input_prefix,
@@ -84,17 +339,52 @@ public:
                    std::vector<std::string> antiprompt,
                    int32_t n_ctx,
                    int32_t n_gpu_layers,
+                   uint64_t memory_budget,
                    llama_progress_callback progress_callback,
                    void* progress_callback_user_data);
 
     uint64_t getModelSize();
 
+    // Context size and KV cache type sessions are created with, chosen at load time as the
+    // largest that fits the memory budget (n_ctx is an upper bound, 0 means the training context)
+    const LlamaMemoryPlan &getMemoryPlan() const;
+
+    void setPromptCacheDirectory(const std::string &directory);
+
+    // Loads a smaller model of the same family, sessions created afterwards draft with it.
+    // The memory plan is made again with the draft taking part of the budget, so call it
+    // before setKvCacheType(). Returns false if the draft does not fit next to the model.
+    bool loadDraftModel(const std::string &path);
+
+    // Sessions created afterwards draft by prompt lookup, unless a draft model is loaded
+    void setPromptLookup(bool enabled);
+
+    // Picks the thread counts and cores of sessions created afterwards with short benchmarks,
+    // or takes them from the profile cached in `cache_directory` for this device and model
+    LlamaThreadProfile tuneThreads(const std::string &cache_directory);
+
+    // Overrides the planned KV cache type of sessions created afterwards ("f16", "q8_0",
+    // "q4_0", ...), the context size is kept. Returns false if the model does not support it.
+    bool setKvCacheType(const std::string &type_k, const std::string &type_v);
+
     void unloadModel();
 
 private:
+    void setMemoryPlan(const LlamaMemoryPlan &plan);
+
     // Private members for the model, like the model data, etc.
     llama_model *model = nullptr;
+    llama_model *draft_model = nullptr;
+    bool prompt_lookup = false;
     gpt_params params;
+    uint64_t model_hash = 0;
+    LlamaPromptCache prompt_cache;
+    LlamaMemoryPlan memory_plan;
+    // loadModel() arguments the plan was made for, to plan again when a draft model is loaded
+    int32_t plan_n_ctx_max = 0;
+    uint64_t plan_budget_bytes = 0;
+    LlamaPieceTable piece_table;
+    LlamaGrammarCache grammar_cache;
 };
 
 #endif //LMPLAYGROUND_LLAMACPP_H
@@ -0,0 +1,138 @@
+#include "LlamaEmbeddingSession.h"
+#include "common.h"
+
+#include "llama.h"
+#include "log.h"
+
+#include <algorithm>
+
+LlamaEmbeddingSession::~LlamaEmbeddingSession() {
+    if (ctx != nullptr) {
+        llama_batch_free(batch);
+        llama_free(ctx);
+    }
+}
+
+bool LlamaEmbeddingSession::init(llama_model *model_arg, const gpt_params &params) {
+    model = model_arg;
+    n_embd = llama_n_embd(model);
+    encoder_only = llama_model_has_encoder(model) && !llama_model_has_decoder(model);
+
+    // non-causal models attend over the whole sequence, so a sequence can not be split
+    // between ubatches and the ubatch is as large as the batch
+    const auto n_ctx_train = (uint32_t) llama_n_ctx_train(model);
+    auto cparams = llama_context_params_from_gpt_params(params);
+    cparams.embeddings = true;
+    cparams.n_ctx = std::min(EMBED_BATCH, n_ctx_train > 0 ? n_ctx_train : EMBED_BATCH);
+    cparams.n_batch = cparams.n_ctx;
+    cparams.n_ubatch = cparams.n_ctx;
+    cparams.n_seq_max = EMBED_MAX_SEQ;
+    cparams.pooling_type = LLAMA_POOLING_TYPE_UNSPECIFIED;
+
+    ctx = llama_new_context_with_model(model, cparams);
+    if (ctx != nullptr && llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_NONE) {
+        // a generative model, pool its per-token outputs
+        llama_free(ctx);
+        cparams.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        ctx = llama_new_context_with_model(model, cparams);
+    }
+    if (ctx == nullptr) {
+        LOG_ERR("%s: failed to create context with model '%s'\n", __func__, params.model.c_str());
+        return false;
+    }
+    if (llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_RANK) {
+        LOG_ERR("%s: the model is a reranker, it has no embeddings\n", __func__);
+        llama_free(ctx);
+        ctx = nullptr;
+        return false;
+    }
+
+    threadpools = LlamaThreadpoolManager::acquire(params.cpuparams, params.cpuparams_batch);
+    if (!threadpools) {
+        llama_free(ctx);
+        ctx = nullptr;
+        return false;
+    }
+    llama_attach_threadpool(ctx, threadpools->getDecode(), threadpools->getBatch());
+
+    n_batch = (int32_t) llama_n_batch(ctx);
+    n_seq_max = (int32_t) EMBED_MAX_SEQ;
+    batch = llama_batch_init(n_batch, 0, 1);
+    LOG_INF("%s: n_embd = %d, n_batch = %d, pooling = %d\n", __func__, n_embd, n_batch, llama_pooling_type(ctx));
+    return true;
+}
+
+int32_t LlamaEmbeddingSession::dimension() const {
+    return n_embd;
+}
+
+std::vector<float> LlamaEmbeddingSession::embed(const std::vector<std::string> &texts) {
+    std::vector<float> output;
+    if (ctx == nullptr) {
+        return output;
+    }
+    output.reserve(texts.size() * n_embd);
+
+    threadpools->resume();
+    bool ok = true;
+    int32_t n_seq = 0;
+    llama_batch_clear(batch);
+    for (const auto &text : texts) {
+        std::vector<llama_token> tokens = ::llama_tokenize(model, text, true, false);
+        if ((int32_t) tokens.size() > n_batch) {
+            LOG_WRN("%s: truncating a text of %zu tokens to %d\n", __func__, tokens.size(), n_batch);
+            tokens.resize(n_batch);
+        }
+        if (tokens.empty()) {
+            // keeps the output aligned with the input
+            tokens.push_back(llama_token_bos(model));
+        }
+
+        if (batch.n_tokens + (int32_t) tokens.size() > n_batch || n_seq == n_seq_max) {
+            ok = decodeBatch(n_seq, output);
+            if (!ok) {
+                break;
+            }
+            n_seq = 0;
+            llama_batch_clear(batch);
+        }
+        for (size_t i = 0; i < tokens.size(); i++) {
+            llama_batch_add(batch, tokens[i], (llama_pos) i, {n_seq}, true);
+        }
+        n_seq++;
+    }
+    if (ok && n_seq > 0) {
+        ok = decodeBatch(n_seq, output);
+    }
+    threadpools->pause();
+
+    if (!ok) {
+        output.clear();
+    }
+    return output;
+}
+
+bool LlamaEmbeddingSession::decodeBatch(int32_t n_seq, std::vector<float> &output) {
+    {
+        std::lock_guard<std::mutex> lock(threadpools->computeMutex());
+        // decoder models keep the sequences of the previous batch in the KV cache
+        llama_kv_cache_clear(ctx);
+        const int32_t ret = encoder_only ? llama_encode(ctx, batch) : llama_decode(ctx, batch);
+        if (ret != 0) {
+            LOG_ERR("%s: failed to decode %d sequences, ret = %d\n", __func__, n_seq, ret);
+            return false;
+        }
+    }
+
+    const size_t offset = output.size();
+    output.resize(offset + (size_t) n_seq * n_embd);
+    for (int32_t seq = 0; seq < n_seq; seq++) {
+        const float *embd = llama_get_embeddings_seq(ctx, seq);
+        if (embd == nullptr) {
+            LOG_ERR("%s: no embedding for sequence %d\n", __func__, seq);
+            return false;
+        }
+        llama_embd_normalize(embd, output.data() + offset + (size_t) seq * n_embd, n_embd, 2);
+    }
+    return true;
+}
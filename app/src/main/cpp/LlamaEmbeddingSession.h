@@ -0,0 +1,50 @@
+#ifndef LMPLAYGROUND_LLAMAEMBEDDINGSESSION_H
+#define LMPLAYGROUND_LLAMAEMBEDDINGSESSION_H
+
+#include "common.h"
+
+#include "LlamaThreadpools.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Computes pooled, L2-normalized embeddings of texts.
+//
+// Texts are packed into one llama_batch per decode, each with its own sequence id, so a
+// call with many short texts costs a few large decodes instead of one small decode per text.
+// Models without a pooling type of their own are mean-pooled.
+class LlamaEmbeddingSession {
+public:
+    LlamaEmbeddingSession() = default;
+
+    ~LlamaEmbeddingSession();
+
+    bool init(llama_model *model, const gpt_params &params);
+
+    // Embedding size
+    int32_t dimension() const;
+
+    // Returns texts.size() * dimension() floats, the embedding of text i at i * dimension(),
+    // or an empty vector on failure. Texts longer than the batch are truncated.
+    std::vector<float> embed(const std::vector<std::string> &texts);
+
+private:
+    // tokens and sequences per decode
+    static const uint32_t EMBED_BATCH = 2048;
+    static const uint32_t EMBED_MAX_SEQ = 64;
+
+    // Decodes the batch and appends the normalized embeddings of its n_seq sequences
+    bool decodeBatch(int32_t n_seq, std::vector<float> &output);
+
+    llama_model *model = nullptr;
+    llama_context *ctx = nullptr;
+    llama_batch batch = {};
+    std::shared_ptr<LlamaThreadpools> threadpools;
+    int32_t n_batch = 0;
+    int32_t n_seq_max = 0;
+    int32_t n_embd = 0;
+    bool encoder_only = false;
+};
+
+#endif //LMPLAYGROUND_LLAMAEMBEDDINGSESSION_H
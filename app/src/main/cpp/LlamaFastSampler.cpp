@@ -0,0 +1,345 @@
+#include "LlamaFastSampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// logits per block of the single pass, a block whose max is below the k-th best is skipped
+const size_t BLOCK_SIZE = 64;
+
+float blockMax(const float *x, size_t n) {
+    size_t i = 0;
+    float result = -INFINITY;
+#if defined(__ARM_NEON)
+    float32x4_t max0 = vdupq_n_f32(-INFINITY);
+    float32x4_t max1 = vdupq_n_f32(-INFINITY);
+    for (; i + 8 <= n; i += 8) {
+        max0 = vmaxq_f32(max0, vld1q_f32(x + i));
+        max1 = vmaxq_f32(max1, vld1q_f32(x + i + 4));
+    }
+    result = vmaxvq_f32(vmaxq_f32(max0, max1));
+#elif defined(__SSE2__)
+    __m128 max0 = _mm_set1_ps(-INFINITY);
+    __m128 max1 = _mm_set1_ps(-INFINITY);
+    for (; i + 8 <= n; i += 8) {
+        max0 = _mm_max_ps(max0, _mm_loadu_ps(x + i));
+        max1 = _mm_max_ps(max1, _mm_loadu_ps(x + i + 4));
+    }
+    __m128 max = _mm_max_ps(max0, max1);
+    max = _mm_max_ps(max, _mm_shuffle_ps(max, max, _MM_SHUFFLE(1, 0, 3, 2)));
+    max = _mm_max_ps(max, _mm_shuffle_ps(max, max, _MM_SHUFFLE(2, 3, 0, 1)));
+    result = _mm_cvtss_f32(max);
+#endif
+    for (; i < n; i++) {
+        result = std::max(result, x[i]);
+    }
+    return result;
+}
+
+// the comparator of the chain's top-k
+bool logitGreater(const llama_token_data &a, const llama_token_data &b) {
+    return a.logit > b.logit;
+}
+
+// llama_sampler_softmax_impl() on sorted candidates
+void softmax(std::vector<llama_token_data> &candidates) {
+    const float max_l = candidates[0].logit;
+    float cum_sum = 0.0f;
+    for (auto &candidate : candidates) {
+        const float p = expf(candidate.logit - max_l);
+        candidate.p = p;
+        cum_sum += p;
+    }
+    for (auto &candidate : candidates) {
+        candidate.p /= cum_sum;
+    }
+}
+
+}
+
+bool LlamaFastSampler::init(int32_t n_vocab_arg, llama_token token_eos_arg, llama_token token_nl_arg,
+                            const gpt_sampler_params &params_arg, uint32_t seed) {
+    n_vocab = n_vocab_arg;
+    token_eos = token_eos_arg;
+    token_nl = token_nl_arg;
+    params = params_arg;
+
+    if (params.mirostat != 0 || !params.grammar.empty() || n_vocab <= 0) {
+        return false;
+    }
+    if (params.temp <= 0.0f) {
+        // with n_probs the chain runs top-k before the greedy pick
+        greedy = params.n_probs == 0;
+        if (!greedy) {
+            return false;
+        }
+    } else {
+        if (params.dynatemp_range > 0.0f) {
+            return false;
+        }
+        // every later stage then works on the sorted top-k
+        if (params.samplers.empty() || params.samplers[0] != GPT_SAMPLER_TYPE_TOP_K ||
+            params.top_k <= 0 || params.top_k > MAX_TOP_K) {
+            return false;
+        }
+        for (size_t i = 1; i < params.samplers.size(); i++) {
+            switch (params.samplers[i]) {
+                case GPT_SAMPLER_TYPE_TOP_P:
+                case GPT_SAMPLER_TYPE_MIN_P:
+                case GPT_SAMPLER_TYPE_TEMPERATURE:
+                    break;
+                case GPT_SAMPLER_TYPE_TFS_Z:
+                    if (params.tfs_z < 1.0f) {
+                        return false;
+                    }
+                    break;
+                case GPT_SAMPLER_TYPE_TYPICAL_P:
+                    if (params.typ_p < 1.0f) {
+                        return false;
+                    }
+                    break;
+                default:
+                    return false;
+            }
+        }
+        top_k = std::min(params.top_k, n_vocab);
+    }
+
+    has_penalties = params.penalty_last_n > 0 &&
+                    !(params.penalty_repeat == 1.0f && params.penalty_freq == 0.0f && params.penalty_present == 0.0f);
+    adjusted_index.assign(n_vocab, -1);
+    token_counts.assign(n_vocab, 0);
+    top.reserve(top_k + 1);
+    reset(seed);
+    return true;
+}
+
+void LlamaFastSampler::reset(uint32_t seed) {
+    rng.seed(seed);
+}
+
+llama_token LlamaFastSampler::sample(const float *logits, const llama_token *last_tokens, size_t n_last_tokens) {
+    applyAdjustments(logits, last_tokens, n_last_tokens);
+
+    llama_token token;
+    if (greedy) {
+        token = sampleGreedy(logits);
+        n_fast++;
+    } else {
+        selectTopK(logits);
+        candidates.assign(top.begin(), top.begin() + std::min((size_t) top_k, top.size()));
+        const size_t position = sampleCandidates();
+        const float logit = top[position].logit;
+        const bool tied = (position > 0 && top[position - 1].logit == logit) ||
+                          (position + 1 < top.size() && top[position + 1].logit == logit);
+        if (tied) {
+            token = selectTopKSorted(logits, position);
+            n_slow++;
+        } else {
+            token = top[position].id;
+            n_fast++;
+        }
+    }
+
+    clearAdjustments();
+    return token;
+}
+
+int64_t LlamaFastSampler::getFastSamples() const {
+    return n_fast;
+}
+
+int64_t LlamaFastSampler::getSlowSamples() const {
+    return n_slow;
+}
+
+LlamaFastSampler::Adjusted &LlamaFastSampler::adjustedEntry(const float *logits, llama_token token) {
+    int32_t &index = adjusted_index[token];
+    if (index < 0) {
+        index = (int32_t) adjusted.size();
+        adjusted.push_back({token, logits[token]});
+    }
+    return adjusted[index];
+}
+
+void LlamaFastSampler::applyAdjustments(const float *logits, const llama_token *last_tokens, size_t n_last_tokens) {
+    // llama_sampler_logit_bias_apply()
+    for (const auto &bias : params.logit_bias) {
+        if (bias.token >= 0 && bias.token < n_vocab) {
+            adjustedEntry(logits, bias.token).logit += bias.bias;
+        }
+    }
+
+    // llama_sampler_penalties_apply()
+    if (params.ignore_eos && token_eos >= 0) {
+        adjustedEntry(logits, token_eos).logit = -INFINITY;
+    }
+    if (!has_penalties) {
+        return;
+    }
+    const size_t n_window = std::min((size_t) params.penalty_last_n, n_last_tokens);
+    const llama_token *window = last_tokens + n_last_tokens - n_window;
+    for (size_t i = 0; i < n_window; i++) {
+        token_counts[window[i]]++;
+    }
+    for (size_t i = 0; i < n_window; i++) {
+        const llama_token token = window[i];
+        const int32_t count = token_counts[token];
+        if (count == 0) {
+            // done at its first occurrence
+            continue;
+        }
+        token_counts[token] = 0;
+        // the chain penalizes the newline and then restores its logit
+        if (!params.penalize_nl && token == token_nl) {
+            continue;
+        }
+        float &logit = adjustedEntry(logits, token).logit;
+        if (logit <= 0) {
+            logit *= params.penalty_repeat;
+        } else {
+            logit /= params.penalty_repeat;
+        }
+        logit -= float(count) * params.penalty_freq + float(count > 0) * params.penalty_present;
+    }
+}
+
+void LlamaFastSampler::clearAdjustments() {
+    for (const auto &entry : adjusted) {
+        adjusted_index[entry.token] = -1;
+    }
+    adjusted.clear();
+}
+
+llama_token LlamaFastSampler::sampleGreedy(const float *logits) {
+    // llama_sampler_greedy_apply(): the first token with the largest logit
+    llama_token best_token = 0;
+    float best = logitOf(logits, 0);
+    for (size_t start = 1; start < (size_t) n_vocab; start += BLOCK_SIZE) {
+        const size_t n = std::min(BLOCK_SIZE, (size_t) n_vocab - start);
+        // a later token has to be strictly larger, adjusted tokens are compared below
+        if (blockMax(logits + start, n) <= best) {
+            continue;
+        }
+        for (size_t i = start; i < start + n; i++) {
+            if (logits[i] > best && adjusted_index[i] < 0) {
+                best = logits[i];
+                best_token = (llama_token) i;
+            }
+        }
+    }
+    for (const auto &entry : adjusted) {
+        if (entry.token != 0 && (entry.logit > best || (entry.logit == best && entry.token < best_token))) {
+            best = entry.logit;
+            best_token = entry.token;
+        }
+    }
+    return best_token;
+}
+
+void LlamaFastSampler::selectTopK(const float *logits) {
+    // the k + 1 best unadjusted tokens in a min-heap, the one after the top-k tells whether
+    // the k-th is tied
+    const size_t n_keep = (size_t) top_k + 1;
+    top.clear();
+    for (size_t start = 0; start < (size_t) n_vocab; start += BLOCK_SIZE) {
+        const size_t n = std::min(BLOCK_SIZE, (size_t) n_vocab - start);
+        if (top.size() == n_keep && blockMax(logits + start, n) <= top.front().logit) {
+            continue;
+        }
+        for (size_t i = start; i < start + n; i++) {
+            if (adjusted_index[i] >= 0) {
+                continue;
+            }
+            if (top.size() < n_keep) {
+                top.push_back({(llama_token) i, logits[i], 0.0f});
+                std::push_heap(top.begin(), top.end(), logitGreater);
+            } else if (logits[i] > top.front().logit) {
+                std::pop_heap(top.begin(), top.end(), logitGreater);
+                top.back() = {(llama_token) i, logits[i], 0.0f};
+                std::push_heap(top.begin(), top.end(), logitGreater);
+            }
+        }
+    }
+    for (const auto &entry : adjusted) {
+        top.push_back({entry.token, entry.logit, 0.0f});
+    }
+    std::sort(top.begin(), top.end(), logitGreater);
+    top.resize(std::min(n_keep, top.size()));
+}
+
+llama_token LlamaFastSampler::selectTopKSorted(const float *logits, size_t position) {
+    // what llama_sampler_top_k_impl() does on the array gpt_sampler_sample() builds
+    vocab_candidates.resize(n_vocab);
+    for (llama_token token = 0; token < n_vocab; token++) {
+        vocab_candidates[token] = {token, logitOf(logits, token), 0.0f};
+    }
+    std::partial_sort(vocab_candidates.begin(), vocab_candidates.begin() + top_k, vocab_candidates.end(), logitGreater);
+    return vocab_candidates[position].id;
+}
+
+size_t LlamaFastSampler::sampleCandidates() {
+    const auto min_keep = (size_t) params.min_keep;
+    for (size_t stage = 1; stage < params.samplers.size(); stage++) {
+        switch (params.samplers[stage]) {
+            case GPT_SAMPLER_TYPE_TOP_P: {
+                // llama_sampler_top_p_apply()
+                if (params.top_p >= 1.0f) {
+                    break;
+                }
+                softmax(candidates);
+                float cum_sum = 0.0f;
+                size_t last_idx = candidates.size();
+                for (size_t i = 0; i < candidates.size(); ++i) {
+                    cum_sum += candidates[i].p;
+                    if (cum_sum >= params.top_p && i + 1 >= min_keep) {
+                        last_idx = i + 1;
+                        break;
+                    }
+                }
+                candidates.resize(last_idx);
+                break;
+            }
+            case GPT_SAMPLER_TYPE_MIN_P: {
+                // llama_sampler_min_p_apply() on sorted candidates
+                if (params.min_p <= 0.0f || candidates.empty()) {
+                    break;
+                }
+                const float min_logit = candidates[0].logit + logf(params.min_p);
+                size_t i = 1;
+                for (; i < candidates.size(); ++i) {
+                    if (candidates[i].logit < min_logit && i >= min_keep) {
+                        break;
+                    }
+                }
+                candidates.resize(i);
+                break;
+            }
+            case GPT_SAMPLER_TYPE_TEMPERATURE:
+                // llama_sampler_temp_impl()
+                for (auto &candidate : candidates) {
+                    candidate.logit /= params.temp;
+                }
+                break;
+            default:
+                // tail free and typical sampling are disabled, see init()
+                break;
+        }
+    }
+
+    // llama_sampler_softmax_impl() and llama_sample_dist()
+    softmax(candidates);
+    probs.clear();
+    for (const auto &candidate : candidates) {
+        probs.push_back(candidate.p);
+    }
+    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    return (size_t) dist(rng);
+}
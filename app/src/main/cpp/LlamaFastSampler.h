@@ -0,0 +1,102 @@
+#ifndef LMPLAYGROUND_LLAMAFASTSAMPLER_H
+#define LMPLAYGROUND_LLAMAFASTSAMPLER_H
+
+#include "common.h"
+
+#include "llama.h"
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+// Sampler for the common chain of gpt_sampler_init(): logit bias, penalties, top-k, top-p,
+// min-p and temperature, or greedy sampling.
+//
+// The chain builds a candidate for every token of the vocabulary and runs each stage over
+// all of them. Here one pass over the logits selects the few candidates that can make it
+// through top-k, skipping blocks of logits below the current k-th best with a vectorized
+// max, and everything else runs on those candidates only. Bias and penalties only change
+// the logits of a few tokens, which are merged in separately.
+//
+// The sampled tokens are the same as those of the chain with the same seed: every stage
+// repeats the floating point operations of its llama.cpp counterpart in the same order.
+// The stages only look at the sorted logits, not at the tokens, so they pick the same
+// position as the chain's. Only the order of equal logits after the chain's std::partial_sort
+// is implementation-defined, so if the logit at that position is not unique the full
+// vocabulary is partially sorted the same way the chain does it.
+class LlamaFastSampler {
+public:
+    // largest top-k the chain handles with std::partial_sort, it bucket sorts beyond
+    static const int32_t MAX_TOP_K = 128;
+
+    // Returns false if the parameters need a stage this sampler does not implement, the
+    // chain has to be used then. `seed` is the seed of the chain, gpt_sampler_get_seed().
+    bool init(int32_t n_vocab, llama_token token_eos, llama_token token_nl,
+              const gpt_sampler_params &params, uint32_t seed);
+
+    // Same as the chain after gpt_sampler_reset()
+    void reset(uint32_t seed);
+
+    // Samples from `logits` of n_vocab values. `last_tokens` are the tokens accepted since
+    // the last reset, the penalties apply to the last penalty_last_n of them.
+    llama_token sample(const float *logits, const llama_token *last_tokens, size_t n_last_tokens);
+
+    // Samples taken by the single pass, and by partially sorting the vocabulary because of a tie
+    int64_t getFastSamples() const;
+
+    int64_t getSlowSamples() const;
+
+private:
+    // Logit of a token after its logit bias and penalties, see applyAdjustments()
+    struct Adjusted {
+        llama_token token;
+        float logit;
+    };
+
+    // Computes the logits of the few tokens the bias and penalty stages of the chain change
+    void applyAdjustments(const float *logits, const llama_token *last_tokens, size_t n_last_tokens);
+
+    Adjusted &adjustedEntry(const float *logits, llama_token token);
+
+    float logitOf(const float *logits, llama_token token) const {
+        const int32_t index = adjusted_index[token];
+        return index < 0 ? logits[token] : adjusted[index].logit;
+    }
+
+    void clearAdjustments();
+
+    llama_token sampleGreedy(const float *logits);
+
+    // Fills `top` with the top-k and the best token after them, sorted
+    void selectTopK(const float *logits);
+
+    // Token at `position` after the chain's top-k, if its logit is equal to another one
+    llama_token selectTopKSorted(const float *logits, size_t position);
+
+    // The chain's stages after top-k on `candidates`, returns the position of the sampled one
+    size_t sampleCandidates();
+
+    int32_t n_vocab = 0;
+    llama_token token_eos = LLAMA_TOKEN_NULL;
+    llama_token token_nl = LLAMA_TOKEN_NULL;
+    gpt_sampler_params params;
+    int32_t top_k = 0;
+    bool greedy = false;
+    bool has_penalties = false;
+    std::mt19937 rng;
+
+    std::vector<Adjusted> adjusted;
+    // per token, its index in `adjusted` or -1
+    std::vector<int32_t> adjusted_index;
+    // per token, its occurrences in the penalty window while the penalties are computed
+    std::vector<int32_t> token_counts;
+    std::vector<llama_token_data> top;
+    std::vector<llama_token_data> candidates;
+    std::vector<llama_token_data> vocab_candidates;
+    std::vector<float> probs;
+
+    int64_t n_fast = 0;
+    int64_t n_slow = 0;
+};
+
+#endif //LMPLAYGROUND_LLAMAFASTSAMPLER_H
@@ -2,10 +2,10 @@
 // Created by Andrew Druk on 22.01.2024.
 //
 
-#include <jni.h>
 #include <string>
 
 #include "LlamaCpp.h"
+#include "LlamaTrace.h"
 #include "common.h"
 
 #include "console.h"
@@ -27,23 +27,22 @@
 #include <mutex>
 
 #include <unistd.h>
-#include <android/log.h>
-#include <asm-generic/fcntl.h>
 #include <fcntl.h>
 
 int32_t generate_random_int32() {
     int32_t random_value;
     int fd = open("/dev/urandom", O_RDONLY);
     if (fd < 0) {
-        __android_log_write(ANDROID_LOG_ERROR, "Llama", "Can't open /dev/urandom");
+        LOG_ERR("%s: can't open /dev/urandom\n", __func__);
         return 0;
     }
     if (read(fd, &random_value, sizeof(random_value)) != sizeof(random_value)) {
-        __android_log_write(ANDROID_LOG_ERROR, "Llama", "Can't read from /dev/urandom");
+        LOG_ERR("%s: can't read from /dev/urandom\n", __func__);
+        close(fd);
         return 0;
     }
     close(fd);
-    __android_log_print(ANDROID_LOG_ERROR, "Llama", "Generated random seed %d", random_value);
+    LOG_INF("%s: generated random seed %d\n", __func__, random_value);
     return random_value;
 }
 
@@ -90,23 +89,44 @@ static void write_logfile(
     fclose(logfile);
 }
 
-static std::string chat_add_and_format(struct llama_model * model, std::vector<llama_chat_msg> & chat_msgs, const std::string & role, const std::string & content) {
-    llama_chat_msg new_msg{role, content};
-    auto formatted = llama_chat_format_single(model, g_params.chat_template, chat_msgs, new_msg, role == "user");
-    chat_msgs.push_back({role, content});
-    LOG_DBG("formatted: '%s'\n", formatted.c_str());
-    return formatted;
+// Length of the longest prefix of `text` that does not end inside a UTF-8 sequence
+static size_t utf8_complete_prefix(const std::string & text) {
+    const size_t size = text.size();
+    // a sequence is at most 4 bytes long, so only the last 3 bytes can belong to an unfinished one
+    for (size_t back = 1; back <= std::min<size_t>(3, size); back++) {
+        const auto c = (unsigned char) text[size - back];
+        if ((c & 0xC0) == 0x80) {
+            // continuation byte, keep looking for the lead byte
+            continue;
+        }
+        size_t expected = 1;
+        if ((c & 0xE0) == 0xC0) {
+            expected = 2;
+        } else if ((c & 0xF0) == 0xE0) {
+            expected = 3;
+        } else if ((c & 0xF8) == 0xF0) {
+            expected = 4;
+        }
+        return expected > back ? size - back : size;
+    }
+    return size;
 }
 
-void LlamaGenerationSession::init(llama_model *model_arg, gpt_params params_arg) {
+void LlamaGenerationSession::init(llama_model *model_arg, gpt_params params_arg, const std::vector<llama_chat_msg> &history) {
     // load the model and apply lora adapter, if any
     LOG_INF("%s: load the model and apply lora adapter, if any\n", __func__);
     params = std::move(params_arg);
     model = model_arg;
+    output_ring = std::make_unique<LlamaOutputRing>(OUTPUT_RING_CAPACITY);
 
     llama_init_result iparams;
     auto cparams = llama_context_params_from_gpt_params(params);
 
+    // one extra sequence is used as scratch space by snapshots
+    cparams.n_seq_max = std::max(cparams.n_seq_max, (uint32_t) SNAPSHOT_SCRATCH_SEQ + 1);
+    kv_type_k = cparams.type_k;
+    kv_type_v = cparams.type_v;
+
     llama_context * lctx = llama_new_context_with_model(model, cparams);
     if (lctx == NULL) {
         LOG_ERR("%s: failed to create context with model '%s'\n", __func__, params.model.c_str());
@@ -195,45 +215,32 @@ void LlamaGenerationSession::init(llama_model *model_arg, gpt_params params_arg)
     iparams.context = lctx;
 
     ctx = lctx;
+    llama_set_abort_callback(ctx, abortCallback, this);
     auto & sparams = params.sparams;
-    sparams.seed = generate_random_int32();
-
-    LOG_INF("%s: llama threadpool init, n_threads = %d\n", __func__, (int) params.cpuparams.n_threads);
-
-    struct ggml_threadpool_params tpp_batch =
-            ggml_threadpool_params_from_cpu_params(params.cpuparams_batch);
-    struct ggml_threadpool_params tpp =
-            ggml_threadpool_params_from_cpu_params(params.cpuparams);
+    if (sparams.seed == LLAMA_DEFAULT_SEED) {
+        sparams.seed = generate_random_int32();
+    }
 
     set_process_priority(params.cpuparams.priority);
 
-    if (!ggml_threadpool_params_match(&tpp, &tpp_batch)) {
-        threadpool_batch = ggml_threadpool_new(&tpp_batch);
-        if (!threadpool_batch) {
-            LOG_ERR("%s: batch threadpool create failed : n_threads %d\n", __func__, tpp_batch.n_threads);
-            return;
-        }
-
-        // Start the non-batch threadpool in the paused state
-        tpp.paused = true;
-    }
-
-    threadpool = ggml_threadpool_new(&tpp);
-    if (!threadpool) {
-        LOG_ERR("%s: threadpool create failed : n_threads %d\n", __func__, tpp.n_threads);
+    threadpools = LlamaThreadpoolManager::acquire(params.cpuparams, params.cpuparams_batch);
+    if (!threadpools) {
         return;
     }
 
-    llama_attach_threadpool(ctx, threadpool, threadpool_batch);
+    llama_attach_threadpool(ctx, threadpools->getDecode(), threadpools->getBatch());
 
     n_ctx_train = llama_n_ctx_train(model);
     n_ctx = llama_n_ctx(ctx);
+    stop_matcher = LlamaStopMatcher(params.antiprompt, ctx);
 
     smpl = gpt_sampler_init(model, sparams);
     if (!smpl) {
         LOG_ERR("%s: failed to initialize sampling subsystem\n", __func__);
         return;
     }
+    fast_sampler_enabled = fast_sampler.init(llama_n_vocab(model), llama_token_eos(model), llama_token_nl(model),
+                                             sparams, gpt_sampler_get_seed(smpl));
 
     if (n_ctx > n_ctx_train) {
         LOG_WRN("%s: model was trained on only %d context tokens (%d specified)\n", __func__, n_ctx_train, n_ctx);
@@ -261,11 +268,22 @@ void LlamaGenerationSession::init(llama_model *model_arg, gpt_params params_arg)
     }
 
     LOG_DBG("n_ctx: %d, add_bos: %d\n", n_ctx, add_bos);
+
+    // the same on every turn
+    chat_formatter = LlamaChatFormatter(model, params.chat_template);
+    input_prefix_tokens = ::llama_tokenize(ctx, params.input_prefix, false, true);
+    input_suffix_tokens = ::llama_tokenize(ctx, params.input_suffix, false, true);
     {
-        auto prompt = (params.conversation && params.enable_chat_template && !params.prompt.empty())
-                      ? chat_add_and_format(model, chat_msgs, "system", params.prompt) // format the system prompt in conversation mode
+        const bool format_chat = params.conversation && params.enable_chat_template;
+        auto prompt = (format_chat && !params.prompt.empty())
+                      ? chat_formatter.addAndFormat(chat_msgs, "system", params.prompt) // format the system prompt in conversation mode
                       : params.prompt;
-        if (params.interactive_first || !params.prompt.empty() || session_tokens.empty()) {
+        // earlier turns of a conversation continued from elsewhere, ingested like the system prompt
+        for (const auto &msg : history) {
+            prompt += format_chat ? chat_formatter.addAndFormat(chat_msgs, msg.role, msg.content, false) : msg.content;
+        }
+        has_history = !history.empty();
+        if (params.interactive_first || !prompt.empty() || session_tokens.empty()) {
             LOG_DBG("tokenize the prompt\n");
             embd_inp = ::llama_tokenize(ctx, prompt, true, true);
         } else {
@@ -276,6 +294,7 @@ void LlamaGenerationSession::init(llama_model *model_arg, gpt_params params_arg)
         LOG_DBG("prompt: \"%s\"\n", prompt.c_str());
         LOG_DBG("tokens: %s\n", string_from(ctx, embd_inp).c_str());
     }
+    n_prompt_tokens = (int) embd_inp.size();
 
     is_antiprompt        = false;
     input_echo           = true;
@@ -289,6 +308,7 @@ void LlamaGenerationSession::init(llama_model *model_arg, gpt_params params_arg)
     LOG_INF("sampler seed: %u\n",     gpt_sampler_get_seed(smpl));
     LOG_INF("sampler params: \n%s\n", sparams.print().c_str());
     LOG_INF("sampler chain: %s\n",    gpt_sampler_print(smpl).c_str());
+    LOG_INF("sampler fast path: %s\n", fast_sampler_enabled ? "enabled" : "disabled, the sampler params need the chain");
 
     LOG_INF("generate: n_ctx = %d, n_batch = %d, n_predict = %d, n_keep = %d\n", n_ctx, params.n_batch, params.n_predict, params.n_keep);
 
@@ -300,7 +320,284 @@ void LlamaGenerationSession::init(llama_model *model_arg, gpt_params params_arg)
     ga_w = params.grp_attn_w;
 }
 
+void LlamaGenerationSession::attachPieceTable(const LlamaPieceTable &table) {
+    piece_table = &table;
+}
+
+void LlamaGenerationSession::attachGrammarCache(LlamaGrammarCache &cache) {
+    grammar_cache = &cache;
+}
+
+bool LlamaGenerationSession::setGrammar(const std::string &gbnf) {
+    if (gbnf.empty()) {
+        grammar_sampler.start(nullptr);
+        return true;
+    }
+    if (grammar_cache == nullptr) {
+        return false;
+    }
+    std::shared_ptr<const LlamaGrammar> grammar = grammar_cache->getGrammar(gbnf);
+    grammar_sampler.start(grammar);
+    return grammar != nullptr;
+}
+
+bool LlamaGenerationSession::setJsonSchema(const std::string &schema) {
+    if (schema.empty()) {
+        grammar_sampler.start(nullptr);
+        return true;
+    }
+    if (grammar_cache == nullptr) {
+        return false;
+    }
+    std::shared_ptr<const LlamaGrammar> grammar = grammar_cache->getJsonSchema(schema);
+    grammar_sampler.start(grammar);
+    return grammar != nullptr;
+}
+
+std::string_view LlamaGenerationSession::tokenPiece(llama_token token, bool special) {
+    LMP_TRACE_SCOPE("detokenize");
+    if (piece_table != nullptr) {
+        return piece_table->piece(token, special);
+    }
+    piece_scratch = llama_token_to_piece(ctx, token, special);
+    return piece_scratch;
+}
+
+void LlamaGenerationSession::attachPromptCache(const LlamaPromptCache &cache, uint64_t model_hash) {
+    // only a non-empty system prompt is worth caching, not one followed by a particular history
+    if (ctx == nullptr || params.prompt.empty() || n_prompt_tokens == 0 || has_history) {
+        return;
+    }
+
+    // an empty template means the one embedded in the model, which is covered by model_hash
+    const std::vector<llama_token> prompt_tokens(embd_inp.begin(), embd_inp.begin() + n_prompt_tokens);
+    prompt_cache = &cache;
+    const LlamaPromptCacheLayout layout = {kv_type_k, kv_type_v, llama_n_ctx(ctx), params.flash_attn};
+    prompt_cache_path = cache.getPath(model_hash, params.chat_template, layout, prompt_tokens);
+
+    if (cache.load(ctx, prompt_cache_path, prompt_tokens)) {
+        LOG_INF("%s: restored %d prompt tokens from %s\n", __func__, n_prompt_tokens, prompt_cache_path.c_str());
+        // generate() skips the matching prefix of embd_inp instead of decoding it again
+        session_tokens = prompt_tokens;
+        n_session_consumed = 0;
+    } else {
+        need_save_prompt_cache = true;
+    }
+}
+
+bool LlamaGenerationSession::attachDraftModel(llama_model *draft_model) {
+    if (ctx == nullptr || params.n_draft <= 0) {
+        return false;
+    }
+    if (!LlamaDraftModelProposer::isCompatible(model, draft_model)) {
+        LOG_WRN("%s: the draft model vocabulary does not match the target model\n", __func__);
+        return false;
+    }
+    auto proposer = std::make_unique<LlamaDraftModelProposer>();
+    if (!proposer->init(draft_model, params, threadpools->getDecode(), threadpools->getBatch(), abortCallback, this)) {
+        return false;
+    }
+    setDrafter(std::move(proposer));
+    return true;
+}
+
+bool LlamaGenerationSession::attachPromptLookup() {
+    if (ctx == nullptr || params.n_draft <= 0) {
+        return false;
+    }
+    setDrafter(std::make_unique<LlamaNgramProposer>(PROMPT_LOOKUP_N_MIN, PROMPT_LOOKUP_N_MAX));
+    return true;
+}
+
+void LlamaGenerationSession::setDrafter(std::unique_ptr<LlamaDraftProposer> proposer) {
+    if (drafter) {
+        llama_batch_free(spec_batch);
+    }
+    drafter = std::move(proposer);
+    spec_batch = llama_batch_init(params.n_draft + 1, 0, 1);
+    spec_n_draft = params.n_draft;
+    LOG_INF("%s: speculative decoding (%s) with up to %d draft tokens\n", __func__, drafter->name(), params.n_draft);
+}
+
+int LlamaGenerationSession::speculate() {
+    // only a sampled token followed by sampling can be speculated on, and self-extend
+    // rewrites positions in a way the batch below does not account for
+    if (!drafter || embd.size() != 1 || (int) embd_inp.size() > n_consumed || is_interacting || ga_n != 1 ||
+        n_session_consumed < (int) session_tokens.size() || need_save_prompt_cache ||
+        n_past + spec_n_draft + 2 >= (int) n_ctx) {
+        return -1;
+    }
+
+    LMP_TRACE_SCOPE("speculate");
+    const int64_t t_start_us = ggml_time_us();
+    const llama_token id = embd[0];
+    const std::vector<llama_token> draft = drafter->propose(spec_history, id, spec_n_draft);
+    if (draft.empty()) {
+        return -1;
+    }
+
+    llama_batch_clear(spec_batch);
+    llama_batch_add(spec_batch, id, n_past, {0}, true);
+    for (size_t i = 0; i < draft.size(); i++) {
+        llama_batch_add(spec_batch, draft[i], n_past + 1 + (int) i, {0}, true);
+    }
+    const int ret = llama_decode(ctx, spec_batch);
+    if (ret != 0) {
+        // the status of an aborted decode differs between llama.cpp versions
+        if (cancel_requested.load(std::memory_order_relaxed)) {
+            // the cells of the batch may have been written partially
+            llama_kv_cache_seq_rm(ctx, 0, n_past, -1);
+        } else {
+            LOG_ERR("%s : failed to eval\n", __func__);
+        }
+        return 1;
+    }
+    spec_history.push_back(id);
+
+    // sample as if the tokens had been decoded one by one, the draft holds as long as it
+    // agrees with the target; the first disagreement is the target's own next token
+    int n_accepted = 0;
+    for (size_t i = 0; i <= draft.size(); i++) {
+        const int64_t t_sample_us = ggml_time_us();
+        const llama_token token = grammar_sampler.sample(ctx, (int) i, [this, i] {
+            return sampleUnconstrained((int) i);
+        });
+        const int64_t t_sample_end_us = ggml_time_us();
+        metrics.sampler.record(t_sample_end_us - t_sample_us);
+        LMP_TRACE_SPAN("sample", t_sample_us, t_sample_end_us);
+        acceptToken(token, /* accept_grammar= */ true);
+        spec_accepted.push_back(token);
+        if (i == draft.size() || token != draft[i]) {
+            break;
+        }
+        n_accepted++;
+        spec_history.push_back(token);
+        if (llama_token_is_eog(model, token)) {
+            break;
+        }
+    }
+
+    // the cells of the rejected part of the draft
+    llama_kv_cache_seq_rm(ctx, 0, n_past + 1 + n_accepted, -1);
+    n_past += 1 + n_accepted;
+    spec_n_in_kv = n_accepted;
+
+    spec_n_rounds++;
+    spec_n_drafted += (int64_t) draft.size();
+    spec_n_accepted += n_accepted;
+    spec_n_generated += (int64_t) spec_accepted.size();
+    spec_t_us += ggml_time_us() - t_start_us;
+
+    // adapt the draft length: draft as long as the last token still has a fair chance, i.e.
+    // acceptance^n_draft >= SPEC_P_MIN with the per-token acceptance averaged over recent rounds
+    spec_acceptance = 0.9f * spec_acceptance + 0.1f * (float) n_accepted / (float) draft.size();
+    int n_draft = params.n_draft;
+    if (spec_acceptance < 0.99f) {
+        n_draft = spec_acceptance > SPEC_P_MIN ? (int) (logf(SPEC_P_MIN) / logf(spec_acceptance)) : 1;
+    }
+    spec_n_draft = std::max(1, std::min(n_draft, params.n_draft));
+    return 0;
+}
+
+bool LlamaGenerationSession::evictTurns(int n_needed) {
+    // the last turn is the one in progress
+    if (turns.size() < 2) {
+        return false;
+    }
+
+    // free at least half of the conversation, like the plain context shift, so that
+    // eviction does not have to run again a few tokens later
+    const int pos_keep = turns[0].pos_start;
+    const int n_target = std::max(n_past + n_needed - (int) n_ctx + 1, (n_past - pos_keep) / 2);
+
+    size_t n_evict = 1;
+    while (n_evict < turns.size() - 1 && turns[n_evict].pos_start - pos_keep < n_target) {
+        n_evict++;
+    }
+    const int n_discard = turns[n_evict].pos_start - pos_keep;
+    if (n_past - n_discard + n_needed >= (int) n_ctx) {
+        return false;
+    }
+
+    LOG_DBG("context full, evicting %zu turns: n_past = %d, n_ctx = %d, n_discard = %d\n",
+            n_evict, n_past, n_ctx, n_discard);
+
+    llama_kv_cache_seq_rm (ctx, 0, pos_keep,             pos_keep + n_discard);
+    llama_kv_cache_seq_add(ctx, 0, pos_keep + n_discard, n_past, -n_discard);
+    n_past -= n_discard;
+    metrics.n_context_shifts++;
+    metrics.n_shift_tokens_discarded += n_discard;
+
+    // keep the chat history in sync, the next message is formatted against what is left
+    const size_t msg_begin = std::min(turns[0].msg_start, chat_msgs.size());
+    const size_t msg_end = std::min(turns[n_evict].msg_start, chat_msgs.size());
+    chat_msgs.erase(chat_msgs.begin() + msg_begin, chat_msgs.begin() + msg_end);
+
+    turns.erase(turns.begin(), turns.begin() + n_evict);
+    for (auto & turn : turns) {
+        turn.pos_start -= n_discard;
+        turn.msg_start -= msg_end - msg_begin;
+    }
+    snapshot_needs_rewrite = true;
+    checkpoint.valid = false;
+
+    LOG_DBG("after eviction: n_past = %d, turns = %zu, messages = %zu\n", n_past, turns.size(), chat_msgs.size());
+    return true;
+}
+
+void LlamaGenerationSession::discardSpeculation() {
+    if (spec_n_in_kv > 0) {
+        llama_kv_cache_seq_rm(ctx, 0, n_past - spec_n_in_kv, -1);
+        n_past -= spec_n_in_kv;
+        spec_history.resize(spec_history.size() - spec_n_in_kv);
+        spec_n_in_kv = 0;
+    }
+    spec_accepted.clear();
+}
+
 int LlamaGenerationSession::generate(const LlamaGenerationSession::ResponseCallback& callback) {
+    if (!threadpools) {
+        return 1;
+    }
+    if (!threads_active) {
+        threadpools->resume();
+        threads_active = true;
+    }
+    int status;
+    {
+        LMP_TRACE_SCOPE("generate");
+        std::lock_guard<std::mutex> lock(threadpools->computeMutex());
+        status = generateStep(callback);
+    }
+    if (status != 0) {
+        // the turn is over, stop the threads polling for work while the user types
+        pauseThreads();
+    }
+    return status;
+}
+
+void LlamaGenerationSession::pauseThreads() {
+    if (threads_active) {
+        threadpools->pause();
+        threads_active = false;
+    }
+}
+
+int LlamaGenerationSession::generateStep(const LlamaGenerationSession::ResponseCallback& callback) {
+    if (spec_n_in_kv > 0) {
+        // the pending token was decoded when its draft was verified
+        spec_n_in_kv--;
+        embd.clear();
+    } else {
+        const int spec_status = speculate();
+        if (spec_status == 1) {
+            return 1;
+        }
+        if (spec_status == 0) {
+            embd.clear();
+        }
+    }
+
     // predict
     if (!embd.empty()) {
         // Note: (n_ctx - 4) here is to match the logic for commandline prompt handling via
@@ -333,18 +630,33 @@ int LlamaGenerationSession::generate(const LlamaGenerationSession::ResponseCallb
                         return 1;
                     }
 
-                    const int n_left    = n_past - params.n_keep;
-                    const int n_discard = n_left/2;
+                    if (!evictTurns((int) embd.size())) {
+                        // the turn in progress fills the context on its own, cut through it
+                        const int n_left    = n_past - params.n_keep;
+                        const int n_discard = n_left/2;
 
-                    LOG_DBG("context full, swapping: n_past = %d, n_left = %d, n_ctx = %d, n_keep = %d, n_discard = %d\n",
-                            n_past, n_left, n_ctx, params.n_keep, n_discard);
+                        LOG_DBG("context full, swapping: n_past = %d, n_left = %d, n_ctx = %d, n_keep = %d, n_discard = %d\n",
+                                n_past, n_left, n_ctx, params.n_keep, n_discard);
 
-                    llama_kv_cache_seq_rm (ctx, 0, params.n_keep            , params.n_keep + n_discard);
-                    llama_kv_cache_seq_add(ctx, 0, params.n_keep + n_discard, n_past, -n_discard);
+                        llama_kv_cache_seq_rm (ctx, 0, params.n_keep            , params.n_keep + n_discard);
+                        llama_kv_cache_seq_add(ctx, 0, params.n_keep + n_discard, n_past, -n_discard);
 
-                    n_past -= n_discard;
+                        n_past -= n_discard;
+                        snapshot_needs_rewrite = true;
+                        checkpoint.valid = false;
+                        metrics.n_context_shifts++;
+                        metrics.n_shift_tokens_discarded += n_discard;
 
-                    LOG_DBG("after swap: n_past = %d\n", n_past);
+                        for (auto & turn : turns) {
+                            if (turn.pos_start >= params.n_keep + n_discard) {
+                                turn.pos_start -= n_discard;
+                            } else if (turn.pos_start > params.n_keep) {
+                                turn.pos_start = params.n_keep;
+                            }
+                        }
+
+                        LOG_DBG("after swap: n_past = %d\n", n_past);
+                    }
 
                     LOG_DBG("embd: %s\n", string_from(ctx, embd).c_str());
                 }
@@ -366,6 +678,8 @@ int LlamaGenerationSession::generate(const LlamaGenerationSession::ResponseCallb
                 llama_kv_cache_seq_add(ctx, 0, ga_i + ib*bd + ga_w, n_past + ib*bd,      dd);
 
                 n_past -= bd;
+                snapshot_needs_rewrite = true;
+                checkpoint.valid = false;
 
                 ga_i += ga_w/ga_n;
 
@@ -382,6 +696,7 @@ int LlamaGenerationSession::generate(const LlamaGenerationSession::ResponseCallb
                     break;
                 }
 
+                spec_history.push_back(embd[i]);
                 n_past++;
                 n_session_consumed++;
 
@@ -403,12 +718,34 @@ int LlamaGenerationSession::generate(const LlamaGenerationSession::ResponseCallb
 
             LOG_DBG("eval: %s\n", string_from(ctx, embd).c_str());
 
-            if (llama_decode(ctx, llama_batch_get_one(&embd[i], n_eval, n_past, 0))) {
-                LOG_ERR("%s : failed to eval\n", __func__);
+            const int64_t t_decode_us = ggml_time_us();
+            const int ret = llama_decode(ctx, llama_batch_get_one(&embd[i], n_eval, n_past, 0));
+            if (ret != 0) {
+                // the status of an aborted decode differs between llama.cpp versions
+                if (cancel_requested.load(std::memory_order_relaxed)) {
+                    // cancelled, the cells of the batch may have been written partially; the
+                    // tokens that did not make it stay pending
+                    llama_kv_cache_seq_rm(ctx, 0, n_past, -1);
+                    embd.erase(embd.begin(), embd.begin() + i);
+                    LOG_INF("%s: decode cancelled at n_past = %d\n", __func__, n_past);
+                } else {
+                    LOG_ERR("%s : failed to eval\n", __func__);
+                }
                 return 1;
             }
+            if (n_eval > 1) {
+                // prompt tokens, a single token is a generated one and counted per token below
+                llama_synchronize(ctx);
+                const int64_t t_decode_end_us = ggml_time_us();
+                metrics.prefill_chunk.record(t_decode_end_us - t_decode_us);
+                metrics.n_prefill_tokens += n_eval;
+                LMP_TRACE_SPAN("prefill", t_decode_us, t_decode_end_us);
+            } else {
+                LMP_TRACE_SPAN("decode", t_decode_us, ggml_time_us());
+            }
 
             n_past += n_eval;
+            spec_history.insert(spec_history.end(), embd.begin() + i, embd.begin() + i + n_eval);
 
             LOG_DBG("n_past = %d\n", n_past);
             // Display total tokens alongside total time
@@ -416,18 +753,53 @@ int LlamaGenerationSession::generate(const LlamaGenerationSession::ResponseCallb
                 LOG_DBG("\n\033[31mTokens consumed so far = %d / %d \033[0m\n", n_past, n_ctx);
             }
         }
+
+        // the KV cache holds exactly the system prompt at this point, see the consumption loop below
+        if (need_save_prompt_cache && n_consumed == n_prompt_tokens) {
+            const std::vector<llama_token> prompt_tokens(embd_inp.begin(), embd_inp.begin() + n_prompt_tokens);
+            if (prompt_cache->save(ctx, prompt_cache_path, prompt_tokens)) {
+                LOG_INF("%s: saved %d prompt tokens to %s\n", __func__, n_prompt_tokens, prompt_cache_path.c_str());
+            }
+            need_save_prompt_cache = false;
+        }
     }
 
     embd.clear();
 
+    // token sampled by this step, if any
+    llama_token sampled_id = LLAMA_TOKEN_NULL;
+
     if ((int) embd_inp.size() <= n_consumed && !is_interacting) {
-        const llama_token id = gpt_sampler_sample(smpl, ctx, -1);
+        llama_token id;
+        if (!spec_accepted.empty()) {
+            // sampled and accepted by speculate() already
+            id = spec_accepted.front();
+            spec_accepted.pop_front();
+        } else {
+            const int64_t t_sample_us = ggml_time_us();
+            id = grammar_sampler.sample(ctx, -1, [this] { return sampleUnconstrained(-1); });
+            const int64_t t_sample_end_us = ggml_time_us();
+            metrics.sampler.record(t_sample_end_us - t_sample_us);
+            LMP_TRACE_SPAN("sample", t_sample_us, t_sample_end_us);
+            acceptToken(id, /* accept_grammar= */ true);
+        }
 
-        gpt_sampler_accept(smpl, id, /* accept_grammar= */ true);
+        const int64_t t_now_us = ggml_time_us();
+        if (t_last_token_us == 0) {
+            if (t_turn_start_us > 0) {
+                metrics.ttft_last_us = t_now_us - t_turn_start_us;
+                metrics.ttft.record(metrics.ttft_last_us);
+            }
+        } else {
+            metrics.decode.record(t_now_us - t_last_token_us);
+        }
+        t_last_token_us = t_now_us;
 
         //LOG_DBG("last: %s\n", string_from(ctx, smpl->prev.to_vector()).c_str());
 
         embd.push_back(id);
+        sampled_id = id;
+        reply_tokens.push_back(id);
 
         // echo this to console
         input_echo = true;
@@ -444,22 +816,26 @@ int LlamaGenerationSession::generate(const LlamaGenerationSession::ResponseCallb
 
             // push the prompt in the sampling context in order to apply repetition penalties later
             // for the prompt, we don't apply grammar rules
-            gpt_sampler_accept(smpl, embd_inp[n_consumed], /* accept_grammar= */ false);
+            acceptToken(embd_inp[n_consumed], /* accept_grammar= */ false);
 
             ++n_consumed;
             if ((int) embd.size() >= params.n_batch) {
                 break;
             }
+            // stop at the end of the system prompt, so its state can be saved on its own
+            if (need_save_prompt_cache && n_consumed == n_prompt_tokens) {
+                break;
+            }
         }
     }
 
     // display text
     if (input_echo && display) {
         for (auto id : embd) {
-            const std::string token_str = llama_token_to_piece(ctx, id, params.special);
+            const std::string_view token_str = tokenPiece(id, params.special);
 
             // Console/Stream Output
-            LOG("%s", token_str.c_str());
+            LOG("%.*s", (int) token_str.size(), token_str.data());
             if (callback != nullptr) {
                 callback(token_str);
             }
@@ -485,49 +861,27 @@ int LlamaGenerationSession::generate(const LlamaGenerationSession::ResponseCallb
 
     // if not currently processing queued inputs;
     if ((int) embd_inp.size() <= n_consumed) {
-        // check for reverse prompt in the last n_prev tokens
-        if (!params.antiprompt.empty()) {
-            const int n_prev = 32;
-            const std::string last_output = gpt_sampler_prev_str(smpl, ctx, n_prev);
-
-            is_antiprompt = false;
-            // Check if each of the reverse prompts appears at the end of the output.
-            // If we're not running interactively, the reverse prompt might be tokenized with some following characters
-            // so we'll compensate for that by widening the search window a bit.
-            for (std::string & antiprompt : params.antiprompt) {
-                size_t extra_padding = params.interactive ? 0 : 2;
-                size_t search_start_pos = last_output.length() > static_cast<size_t>(antiprompt.length() + extra_padding)
-                                          ? last_output.length() - static_cast<size_t>(antiprompt.length() + extra_padding)
-                                          : 0;
-
-                if (last_output.find(antiprompt, search_start_pos) != std::string::npos) {
-                    if (params.interactive) {
-                        is_interacting = true;
-                    }
-                    is_antiprompt = true;
-                    break;
-                }
-            }
-
-            // check for reverse prompt using special tokens
-            llama_token last_token = gpt_sampler_last(smpl);
-            for (std::vector<llama_token> ids: antiprompt_ids) {
-                if (ids.size() == 1 && last_token == ids[0]) {
-                    if (params.interactive) {
-                        is_interacting = true;
-                    }
-                    is_antiprompt = true;
-                    break;
+        // with speculation the sampler may already be ahead of the token being emitted
+        const llama_token last_token = sampled_id != LLAMA_TOKEN_NULL ? sampled_id : gpt_sampler_last(smpl);
+
+        // check for reverse prompts in the newly generated text only, the matcher carries
+        // partial matches over from the previous pieces
+        is_antiprompt = false;
+        if (sampled_id != LLAMA_TOKEN_NULL && !stop_matcher.empty()) {
+            LMP_TRACE_SCOPE("stop_check");
+            const std::string_view piece = tokenPiece(last_token, true);
+            if (stop_matcher.isStopToken(last_token) ||
+                stop_matcher.feed(stop_state, piece.data(), piece.size()) >= 0) {
+                if (params.interactive) {
+                    is_interacting = true;
                 }
-            }
-
-            if (is_antiprompt) {
-                LOG_DBG("found antiprompt: %s\n", last_output.c_str());
+                is_antiprompt = true;
+                LOG_DBG("found antiprompt: %.*s\n", (int) piece.size(), piece.data());
             }
         }
 
         // deal with end of generation tokens in interactive mode
-        if (llama_token_is_eog(model, gpt_sampler_last(smpl))) {
+        if (llama_token_is_eog(model, last_token)) {
             LOG_DBG("found an EOG token\n");
 
             if (params.interactive) {
@@ -539,7 +893,7 @@ int LlamaGenerationSession::generate(const LlamaGenerationSession::ResponseCallb
                 }
 
                 if (params.enable_chat_template) {
-                    chat_add_and_format(model, chat_msgs, "assistant", assistant_ss.str());
+                    chat_formatter.addAndFormat(chat_msgs, "assistant", assistant_ss.str());
                 }
                 is_interacting = true;
                 LOG("\n");
@@ -548,13 +902,12 @@ int LlamaGenerationSession::generate(const LlamaGenerationSession::ResponseCallb
 
         // if current token is not EOG, we add it to current assistant message
         if (params.conversation) {
-            const auto id = gpt_sampler_last(smpl);
-            assistant_ss << llama_token_to_piece(ctx, id, false);
+            assistant_ss << tokenPiece(last_token, false);
         }
 
         if (n_past > 0) {
             if (is_interacting) {
-                gpt_sampler_reset(smpl);
+                resetSampler();
             }
             is_interacting = false;
         }
@@ -576,9 +929,167 @@ int LlamaGenerationSession::generate(const LlamaGenerationSession::ResponseCallb
     return (n_remain != 0 && !is_antiprompt) ? 0 : 1;
 }
 
+int LlamaGenerationSession::generateChunked(const ResponseCallback& callback, size_t flush_bytes, int64_t flush_interval_us) {
+    std::string pending;
+    // the first chunk goes out right away to keep time-to-first-token low
+    int64_t t_last_flush_us = 0;
+
+    auto flush = [&](bool force) {
+        const size_t n_flush = force ? pending.size() : utf8_complete_prefix(pending);
+        if (n_flush == 0) {
+            return;
+        }
+        callback(std::string_view(pending.data(), n_flush));
+        pending.erase(0, n_flush);
+        t_last_flush_us = ggml_time_us();
+    };
+
+    int status = 0;
+    while (!stop_requested.load(std::memory_order_relaxed)) {
+        status = generate([&](std::string_view piece) {
+            pending += piece;
+            if (pending.size() >= flush_bytes || ggml_time_us() - t_last_flush_us >= flush_interval_us) {
+                flush(false);
+            }
+        });
+        if (status != 0) {
+            break;
+        }
+    }
+    flush(true);
+    pauseThreads();
+    return status;
+}
+
+int LlamaGenerationSession::generateToRing() {
+    LlamaOutputRing &ring = getOutputRing();
+
+    int status = 0;
+    while (!stop_requested.load(std::memory_order_relaxed)) {
+        status = generate([&ring](std::string_view piece) {
+            ring.write(piece.data(), piece.size());
+        });
+        if (status != 0) {
+            break;
+        }
+    }
+    ring.close();
+    pauseThreads();
+    return status;
+}
+
+bool LlamaGenerationSession::startAsync() {
+    if (async_worker.joinable()) {
+        if (async_status.load(std::memory_order_acquire) == ASYNC_RUNNING) {
+            return false;
+        }
+        async_worker.join();
+    }
+    async_status.store(ASYNC_RUNNING, std::memory_order_relaxed);
+    async_worker = std::thread([this]() {
+        int status = generateToRing();
+        if (cancel_requested.load(std::memory_order_relaxed) && rollbackCancelled()) {
+            status = STATUS_CANCELLED;
+        }
+        async_status.store(status, std::memory_order_release);
+    });
+    return true;
+}
+
+void LlamaGenerationSession::cancel() {
+    cancel_requested.store(true, std::memory_order_relaxed);
+    stopGeneration();
+}
+
+int LlamaGenerationSession::pollAsync() const {
+    return async_status.load(std::memory_order_acquire);
+}
+
+int LlamaGenerationSession::waitAsync() {
+    if (async_worker.joinable()) {
+        async_worker.join();
+    }
+    return async_status.load(std::memory_order_acquire);
+}
+
+bool LlamaGenerationSession::abortCallback(void *data) {
+    return static_cast<LlamaGenerationSession *>(data)->cancel_requested.load(std::memory_order_relaxed);
+}
+
+bool LlamaGenerationSession::rollbackCancelled() {
+    if (!reply_tokens.empty()) {
+        // the reply has started, keep it like stopGeneration() does; the next message closes it
+        need_insert_eot = true;
+        return false;
+    }
+    if (!checkpoint.valid) {
+        // the context was shifted since, only drop the input that is not in the KV cache yet
+        LOG_WRN("%s: positions changed during the turn, keeping the decoded part of the message\n", __func__);
+        embd.clear();
+        embd_inp.resize(n_consumed);
+        return false;
+    }
+
+    llama_kv_cache_seq_rm(ctx, 0, checkpoint.n_past, -1);
+    n_past = checkpoint.n_past;
+    n_consumed = checkpoint.n_consumed;
+    n_remain = checkpoint.n_remain;
+    n_session_consumed = checkpoint.n_session_consumed;
+    need_insert_eot = checkpoint.need_insert_eot;
+    embd = checkpoint.embd;
+    embd_inp.resize(checkpoint.n_embd_inp);
+    spec_history.resize(checkpoint.n_spec_history);
+    chat_msgs.resize(checkpoint.n_chat_msgs);
+    turns.resize(checkpoint.n_turns);
+    resetSampler();
+    grammar_sampler.start(nullptr);
+    snapshot_needs_rewrite = true;
+    checkpoint.valid = false;
+    LOG_INF("%s: rolled the cancelled turn back to n_past = %d\n", __func__, n_past);
+    return true;
+}
+
+void LlamaGenerationSession::endReply() {
+    // a reply that ended by itself left the session waiting for input
+    if (is_interacting || reply_tokens.empty()) {
+        return;
+    }
+    need_insert_eot = true;
+    if (params.enable_chat_template) {
+        chat_formatter.addAndFormat(chat_msgs, "assistant", assistant_ss.str());
+    }
+    is_interacting = true;
+}
+
+LlamaOutputRing& LlamaGenerationSession::getOutputRing() {
+    return *output_ring;
+}
+
+void LlamaGenerationSession::stopGeneration() {
+    stop_requested.store(true, std::memory_order_relaxed);
+    // unblocks a writer waiting for a reader that is gone
+    output_ring->close();
+}
+
 void LlamaGenerationSession::addMessage(const char *string) {
+    LMP_TRACE_SCOPE("addMessage");
+    discardSpeculation();
+    cancel_requested.store(false, std::memory_order_relaxed);
+    checkpoint = {ga_n == 1, n_past, n_consumed, n_remain, n_session_consumed, need_insert_eot, embd,
+                  embd_inp.size(), spec_history.size(), chat_msgs.size(), turns.size()};
     is_interacting = true;
 
+    // the new turn starts after everything that is still waiting to be decoded
+    const int turn_pos_start = n_past + (int) embd.size() + (int) embd_inp.size() - n_consumed;
+    stop_requested.store(false, std::memory_order_relaxed);
+    stop_state = LlamaStopMatcher::INITIAL_STATE;
+    output_ring->open();
+    t_turn_start_us = ggml_time_us();
+    t_last_token_us = 0;
+    reply_tokens.clear();
+    // a grammar constrains a single reply
+    grammar_sampler.start(nullptr);
+
     if (n_past > 0) {
         LOG_DBG("waiting for user input\n");
 
@@ -610,18 +1121,24 @@ void LlamaGenerationSession::addMessage(const char *string) {
 
             const size_t original_size = embd_inp.size();
 
+            turns.push_back({turn_pos_start, chat_msgs.size()});
+
             if (params.escape) {
                 string_process_escapes(buffer);
             }
 
             bool format_chat = params.conversation && params.enable_chat_template;
             std::string user_inp = format_chat
-                                   ? chat_add_and_format(model, chat_msgs, "user", buffer)
+                                   ? chat_formatter.addAndFormat(chat_msgs, "user", buffer)
                                    : std::move(buffer);
             // TODO: one inconvenient of current chat template implementation is that we can't distinguish between user input and special tokens (prefix/postfix)
-            const auto line_pfx = ::llama_tokenize(ctx, params.input_prefix, false, true);
-            const auto line_inp = ::llama_tokenize(ctx, user_inp,            false, format_chat);
-            const auto line_sfx = ::llama_tokenize(ctx, params.input_suffix, false, true);
+            const auto & line_pfx = input_prefix_tokens;
+            std::vector<llama_token> line_inp;
+            {
+                LMP_TRACE_SCOPE("tokenize");
+                line_inp = ::llama_tokenize(ctx, user_inp, false, format_chat);
+            }
+            const auto & line_sfx = input_suffix_tokens;
 
             LOG_DBG("input tokens: %s\n", string_from(ctx, line_inp).c_str());
 
@@ -639,7 +1156,7 @@ void LlamaGenerationSession::addMessage(const char *string) {
             for (size_t i = original_size; i < embd_inp.size(); ++i) {
                 const llama_token token = embd_inp[i];
                 output_tokens.push_back(token);
-                output_ss << llama_token_to_piece(ctx, token);
+                output_ss << tokenPiece(token, true);
             }
 
             // reset assistant message
@@ -655,7 +1172,7 @@ void LlamaGenerationSession::addMessage(const char *string) {
     }
 
     if (n_past > 0) {
-        gpt_sampler_reset(smpl);
+        resetSampler();
         is_interacting = false;
     }
 
@@ -673,15 +1190,49 @@ void LlamaGenerationSession::addMessage(const char *string) {
     }
 }
 
+void LlamaGenerationSession::acceptToken(llama_token id, bool accept_grammar) {
+    gpt_sampler_accept(smpl, id, accept_grammar);
+    if (accept_grammar) {
+        grammar_sampler.accept(id);
+    }
+
+    sampler_prev.push_back(id);
+    const size_t n_prev_max = std::max(params.sparams.n_prev, params.sparams.penalty_last_n);
+    if (sampler_prev.size() > n_prev_max) {
+        sampler_prev.erase(sampler_prev.begin(), sampler_prev.end() - n_prev_max);
+    }
+    n_sampler_since_reset = std::min(n_sampler_since_reset + 1, (int) sampler_prev.size());
+}
+
+void LlamaGenerationSession::resetSampler() {
+    gpt_sampler_reset(smpl);
+    fast_sampler.reset(gpt_sampler_get_seed(smpl));
+    n_sampler_since_reset = 0;
+}
+
+llama_token LlamaGenerationSession::sampleUnconstrained(int idx) {
+    if (!fast_sampler_enabled) {
+        return gpt_sampler_sample(smpl, ctx, idx);
+    }
+    // the chain's penalties see the tokens accepted since its last reset
+    const size_t n_window = std::min((size_t) std::max(params.sparams.penalty_last_n, 0), (size_t) n_sampler_since_reset);
+    return fast_sampler.sample(llama_get_logits_ith(ctx, idx), sampler_prev.data() + sampler_prev.size() - n_window, n_window);
+}
+
 LlamaGenerationSession::LlamaGenerationSession() = default;
 
 LlamaGenerationSession::~LlamaGenerationSession() {
+    if (async_worker.joinable()) {
+        cancel();
+        async_worker.join();
+    }
+    if (drafter) {
+        drafter.reset();
+        llama_batch_free(spec_batch);
+    }
+    pauseThreads();
     gpt_sampler_free(smpl);
     llama_free(ctx);
-    llama_backend_free();
-
-    ggml_threadpool_free(threadpool);
-    ggml_threadpool_free(threadpool_batch);
 }
 
 void LlamaGenerationSession::printReport() {
@@ -695,8 +1246,50 @@ std::string LlamaGenerationSession::getReport() {
     std::ostringstream report;
     report << "load time = " << timings.t_load_ms << " ms\n\n";
     report << "prompt eval time = " << timings.t_p_eval_ms << " ms / " << timings.n_p_eval << " tokens\n";
-    report << "(" << 1e3 / timings.t_p_eval_ms * timings.n_p_eval << " tokens per second)\n\n";
+    report << "(" << (timings.t_p_eval_ms > 0.0 ? 1e3 / timings.t_p_eval_ms * timings.n_p_eval : 0.0)
+           << " tokens per second)\n\n";
     report << "eval time = " << timings.t_eval_ms << " ms / " << timings.n_eval << " runs\n";
-    report << "(" << 1e3 / timings.t_eval_ms * timings.n_eval << " tokens per second)\n\n";
+    report << "(" << (timings.t_eval_ms > 0.0 ? 1e3 / timings.t_eval_ms * timings.n_eval : 0.0)
+           << " tokens per second)\n\n";
+    if (metrics.decode.count() > 0) {
+        report << "time to first token = " << metrics.ttft_last_us / 1e3 << " ms (p90 "
+               << metrics.ttft.percentile(0.9) / 1e3 << " ms)\n";
+        report << "token latency p50 / p90 / p99 = " << metrics.decode.percentile(0.5) / 1e3 << " / "
+               << metrics.decode.percentile(0.9) / 1e3 << " / " << metrics.decode.percentile(0.99) / 1e3 << " ms\n\n";
+    }
+    const uint64_t kv_bytes_per_token = LlamaMemoryPlanner::kvBytes(model, 1, kv_type_k, kv_type_v);
+    report << "kv cache = " << ggml_type_name(kv_type_k) << " / " << ggml_type_name(kv_type_v) << ", "
+           << kv_bytes_per_token / 1024.0 << " KiB per token\n";
+    report << "(" << kv_bytes_per_token * n_ctx / 1024.0 / 1024.0 << " MiB for " << n_ctx << " tokens, "
+           << kv_bytes_per_token * llama_get_kv_cache_used_cells(ctx) / 1024.0 / 1024.0 << " MiB in use)\n\n";
+    if (spec_n_rounds > 0) {
+        report << "speculative decoding (" << drafter->name() << ") = " << spec_n_accepted << " / " << spec_n_drafted
+               << " draft tokens accepted (" << 100.0 * spec_n_accepted / std::max<int64_t>(spec_n_drafted, 1) << "%)\n";
+        report << "(" << 1e6 * spec_n_generated / std::max<int64_t>(spec_t_us, 1) << " tokens per second effective, draft length "
+               << spec_n_draft << ")\n\n";
+    }
+    if (grammar_sampler.getSampled() > 0) {
+        report << "grammar = " << grammar_sampler.getResampled() << " / " << grammar_sampler.getSampled()
+               << " tokens resampled, " << grammar_sampler.getMaskHits() << " mask cache hits\n\n";
+    }
+    if (fast_sampler_enabled) {
+        report << "sampler fast path = " << fast_sampler.getFastSamples() << " tokens, "
+               << fast_sampler.getSlowSamples() << " with tied logits sorted in full\n\n";
+    }
     return report.str();
 }
+
+const std::vector<llama_token> &LlamaGenerationSession::getReplyTokens() const {
+    return reply_tokens;
+}
+
+LlamaSessionMetrics LlamaGenerationSession::getMetrics() {
+    LlamaSessionMetrics result = metrics;
+    result.kv_used = llama_get_kv_cache_used_cells(ctx);
+    result.kv_size = n_ctx;
+    return result;
+}
+
+llama_perf_context_data LlamaGenerationSession::getPerfData() {
+    return llama_perf_context(ctx);
+}
@@ -0,0 +1,266 @@
+#include "LlamaGrammarCache.h"
+#include "LlamaPromptCache.h"
+
+#include "json-schema-to-grammar.h"
+#include "llama-grammar.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
+
+std::shared_ptr<LlamaGrammar> LlamaGrammar::parse(const llama_model *model, const std::string &gbnf, uint64_t key) {
+    // llama_sampler_init_grammar() returns a sampler that constrains nothing when the grammar
+    // fails to parse, so the rules are parsed on their own first
+    llama_grammar *parsed = llama_grammar_init_impl(nullptr, gbnf.c_str(), "root");
+    if (parsed == nullptr) {
+        LOG_ERR("%s: failed to parse the grammar, see the errors above\n", __func__);
+        return nullptr;
+    }
+    llama_grammar_free_impl(parsed);
+
+    llama_sampler *prototype = llama_sampler_init_grammar(model, gbnf.c_str(), "root");
+    if (prototype == nullptr) {
+        return nullptr;
+    }
+
+    std::shared_ptr<LlamaGrammar> grammar(new LlamaGrammar());
+    grammar->prototype = prototype;
+    grammar->key = key;
+    grammar->n_vocab = llama_n_vocab(model);
+    // every reply starts in this state
+    grammar->storeMask(key, computeMask(prototype, grammar->n_vocab));
+    return grammar;
+}
+
+LlamaGrammar::~LlamaGrammar() {
+    llama_sampler_free(prototype);
+}
+
+llama_sampler *LlamaGrammar::instantiate() const {
+    // copies the parsed rules, much cheaper than parsing them again
+    return llama_sampler_clone(prototype);
+}
+
+uint64_t LlamaGrammar::getKey() const {
+    return key;
+}
+
+int32_t LlamaGrammar::getVocabSize() const {
+    return n_vocab;
+}
+
+uint64_t LlamaGrammar::nextState(uint64_t state_key, llama_token token) {
+    return LlamaPromptCache::hash(&token, sizeof(token), state_key);
+}
+
+std::shared_ptr<const LlamaGrammar::TokenMask> LlamaGrammar::findMask(uint64_t state_key) const {
+    std::lock_guard<std::mutex> lock(masks_mutex);
+    auto it = masks.find(state_key);
+    if (it == masks.end()) {
+        return nullptr;
+    }
+    it->second.n_found++;
+    return it->second.mask;
+}
+
+void LlamaGrammar::storeMask(uint64_t state_key, std::shared_ptr<const TokenMask> mask) const {
+    std::lock_guard<std::mutex> lock(masks_mutex);
+    if (masks.size() >= MAX_MASKS && masks.find(state_key) == masks.end()) {
+        auto least_found = std::min_element(masks.begin(), masks.end(), [](const auto &a, const auto &b) {
+            return a.second.n_found < b.second.n_found;
+        });
+        masks.erase(least_found);
+    }
+    masks[state_key].mask = std::move(mask);
+}
+
+std::shared_ptr<const LlamaGrammar::TokenMask> LlamaGrammar::computeMask(llama_sampler *grammar, int32_t n_vocab) {
+    std::vector<llama_token_data> candidates((size_t) n_vocab);
+    for (llama_token token = 0; token < n_vocab; token++) {
+        candidates[token] = {token, 0.0f, 0.0f};
+    }
+    llama_token_data_array cur_p = {candidates.data(), candidates.size(), -1, false};
+    llama_sampler_apply(grammar, &cur_p);
+
+    auto mask = std::make_shared<TokenMask>(((size_t) n_vocab + 63) / 64, 0);
+    for (size_t i = 0; i < cur_p.size; i++) {
+        if (cur_p.data[i].logit != -INFINITY) {
+            const auto token = (size_t) cur_p.data[i].id;
+            (*mask)[token / 64] |= (uint64_t) 1 << (token % 64);
+        }
+    }
+    return mask;
+}
+
+void LlamaGrammarCache::setModel(const llama_model *model_arg) {
+    std::lock_guard<std::mutex> lock(mutex);
+    model = model_arg;
+    entries.clear();
+}
+
+std::shared_ptr<const LlamaGrammar> LlamaGrammarCache::getGrammar(const std::string &gbnf) {
+    return get(LlamaPromptCache::hash(gbnf.data(), gbnf.size(), 0), gbnf, false);
+}
+
+std::shared_ptr<const LlamaGrammar> LlamaGrammarCache::getJsonSchema(const std::string &schema) {
+    return get(LlamaPromptCache::hash(schema.data(), schema.size(), 1), schema, true);
+}
+
+void LlamaGrammarCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+}
+
+std::shared_ptr<const LlamaGrammar> LlamaGrammarCache::get(uint64_t key, const std::string &text, bool is_schema) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (model == nullptr) {
+        return nullptr;
+    }
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if ((*it)->getKey() == key) {
+            entries.splice(entries.begin(), entries, it);
+            return entries.front();
+        }
+    }
+
+    std::string gbnf;
+    if (is_schema) {
+        try {
+            gbnf = json_schema_to_grammar(nlohmann::ordered_json::parse(text));
+        } catch (const std::exception &e) {
+            LOG_ERR("%s: invalid JSON schema: %s\n", __func__, e.what());
+            return nullptr;
+        }
+    } else {
+        gbnf = text;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+    std::shared_ptr<const LlamaGrammar> grammar = LlamaGrammar::parse(model, gbnf, key);
+    if (!grammar) {
+        return nullptr;
+    }
+    LOG_INF("%s: compiled a grammar of %zu bytes in %.2f ms\n", __func__, gbnf.size(),
+            (ggml_time_us() - t_start_us) / 1000.0);
+
+    entries.push_front(grammar);
+    if (entries.size() > CAPACITY) {
+        entries.pop_back();
+    }
+    return grammar;
+}
+
+LlamaGrammarSampler::~LlamaGrammarSampler() {
+    start(nullptr);
+}
+
+void LlamaGrammarSampler::start(std::shared_ptr<const LlamaGrammar> grammar_arg) {
+    if (state != nullptr) {
+        llama_sampler_free(state);
+        state = nullptr;
+    }
+    grammar = std::move(grammar_arg);
+    if (grammar) {
+        state = grammar->instantiate();
+        state_key = grammar->getKey();
+        depth = 0;
+    }
+}
+
+bool LlamaGrammarSampler::isActive() const {
+    return state != nullptr;
+}
+
+llama_token LlamaGrammarSampler::sample(llama_context *ctx, int idx, const std::function<llama_token()> &sample_logits) {
+    const llama_token id = sample_logits();
+    if (state == nullptr) {
+        return id;
+    }
+    n_sampled++;
+
+    std::shared_ptr<const LlamaGrammar::TokenMask> mask;
+    if (depth <= LlamaGrammar::MASK_MAX_DEPTH) {
+        mask = grammar->findMask(state_key);
+    }
+    if (isAllowed(id, mask.get())) {
+        return id;
+    }
+
+    n_resampled++;
+    if (!mask) {
+        mask = LlamaGrammar::computeMask(state, grammar->getVocabSize());
+        if (depth <= LlamaGrammar::MASK_MAX_DEPTH) {
+            grammar->storeMask(state_key, mask);
+        }
+    }
+
+    // the sampler chain reads the logits again
+    float *logits = llama_get_logits_ith(ctx, idx);
+    bool any_allowed = false;
+    for (llama_token token = 0; token < grammar->getVocabSize(); token++) {
+        if (LlamaGrammar::isAllowed(*mask, token)) {
+            any_allowed = true;
+        } else {
+            logits[token] = -INFINITY;
+        }
+    }
+    if (!any_allowed) {
+        // a dead end: the reply ends here, and the grammar is dropped for the rest of the turn
+        // so that the end of generation token is not fed to it, which llama.cpp aborts on
+        LOG_ERR("%s: the grammar allows no token, ending the reply\n", __func__);
+        start(nullptr);
+        return endOfGeneration(llama_get_model(ctx));
+    }
+    return sample_logits();
+}
+
+void LlamaGrammarSampler::accept(llama_token token) {
+    if (state == nullptr) {
+        return;
+    }
+    llama_sampler_accept(state, token);
+    state_key = LlamaGrammar::nextState(state_key, token);
+    depth++;
+}
+
+int64_t LlamaGrammarSampler::getSampled() const {
+    return n_sampled;
+}
+
+int64_t LlamaGrammarSampler::getResampled() const {
+    return n_resampled;
+}
+
+int64_t LlamaGrammarSampler::getMaskHits() const {
+    return n_mask_hits;
+}
+
+llama_token LlamaGrammarSampler::endOfGeneration(const llama_model *model) {
+    // some models have no EOS token, or only an EOT one
+    const llama_token eot = llama_token_eot(model);
+    if (eot != LLAMA_TOKEN_NULL) {
+        return eot;
+    }
+    const llama_token eos = llama_token_eos(model);
+    if (eos != LLAMA_TOKEN_NULL) {
+        return eos;
+    }
+    for (llama_token token = 0; token < llama_n_vocab(model); token++) {
+        if (llama_token_is_eog(model, token)) {
+            return token;
+        }
+    }
+    return eos;
+}
+
+bool LlamaGrammarSampler::isAllowed(llama_token token, const LlamaGrammar::TokenMask *mask) {
+    if (mask != nullptr) {
+        n_mask_hits++;
+        return LlamaGrammar::isAllowed(*mask, token);
+    }
+    llama_token_data data = {token, 0.0f, 0.0f};
+    llama_token_data_array cur_p = {&data, 1, -1, false};
+    llama_sampler_apply(state, &cur_p);
+    return data.logit != -INFINITY;
+}
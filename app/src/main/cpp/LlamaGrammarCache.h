@@ -0,0 +1,162 @@
+#ifndef LMPLAYGROUND_LLAMAGRAMMARCACHE_H
+#define LMPLAYGROUND_LLAMAGRAMMARCACHE_H
+
+#include "common.h"
+#include "sampling.h"
+
+#include "llama.h"
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A GBNF grammar parsed for one model, shared by the sessions constrained by it.
+//
+// Masks of allowed tokens are kept for the first few states of a reply, which every reply
+// constrained by the grammar passes through. llama.cpp does not expose the grammar stacks,
+// so a state is identified by a hash of the tokens accepted since the start: the same state
+// reached by different tokens has entries of its own, which is why deeper states, where the
+// paths diverge, are not kept. The mask of the start state is computed with the grammar, the
+// others when a token sampled in them is rejected. The MAX_MASKS most often used ones are kept.
+class LlamaGrammar {
+public:
+    using TokenMask = std::vector<uint64_t>;
+
+    // states up to this many tokens after the start have their masks kept
+    static const int32_t MASK_MAX_DEPTH = 8;
+
+    // Returns nullptr if the grammar can not be parsed
+    static std::shared_ptr<LlamaGrammar> parse(const llama_model *model, const std::string &gbnf, uint64_t key);
+
+    ~LlamaGrammar();
+
+    LlamaGrammar(const LlamaGrammar &) = delete;
+
+    LlamaGrammar &operator=(const LlamaGrammar &) = delete;
+
+    // A grammar sampler at the start state, freed by the caller
+    llama_sampler *instantiate() const;
+
+    uint64_t getKey() const;
+
+    int32_t getVocabSize() const;
+
+    // Key of the state after `token` in the state `state_key`
+    static uint64_t nextState(uint64_t state_key, llama_token token);
+
+    // Thread-safe, nullptr if the mask of the state is not known
+    std::shared_ptr<const TokenMask> findMask(uint64_t state_key) const;
+
+    // Thread-safe, evicts the least often found mask if MAX_MASKS masks are kept already
+    void storeMask(uint64_t state_key, std::shared_ptr<const TokenMask> mask) const;
+
+    // Tokens the sampler accepts in its current state
+    static std::shared_ptr<const TokenMask> computeMask(llama_sampler *grammar, int32_t n_vocab);
+
+    static bool isAllowed(const TokenMask &mask, llama_token token) {
+        return (mask[(size_t) token / 64] >> ((size_t) token % 64)) & 1;
+    }
+
+private:
+    static const size_t MAX_MASKS = 64;
+
+    struct MaskEntry {
+        std::shared_ptr<const TokenMask> mask;
+        uint64_t n_found = 0;
+    };
+
+    LlamaGrammar() = default;
+
+    llama_sampler *prototype = nullptr;
+    uint64_t key = 0;
+    int32_t n_vocab = 0;
+
+    mutable std::mutex masks_mutex;
+    mutable std::unordered_map<uint64_t, MaskEntry> masks;
+};
+
+// Grammars by content hash, so the same grammar or JSON schema is parsed once per model
+// however many sessions and turns use it. Keeps the CAPACITY most recently used ones.
+class LlamaGrammarCache {
+public:
+    static const size_t CAPACITY = 16;
+
+    void setModel(const llama_model *model);
+
+    // Thread-safe, returns nullptr if the grammar can not be parsed
+    std::shared_ptr<const LlamaGrammar> getGrammar(const std::string &gbnf);
+
+    // Thread-safe, returns nullptr if the schema is not valid JSON or not supported
+    std::shared_ptr<const LlamaGrammar> getJsonSchema(const std::string &schema);
+
+    void clear();
+
+private:
+    std::shared_ptr<const LlamaGrammar> get(uint64_t key, const std::string &text, bool is_schema);
+
+    const llama_model *model = nullptr;
+
+    std::mutex mutex;
+    // most recently used first
+    std::list<std::shared_ptr<const LlamaGrammar>> entries;
+};
+
+// Constrains the tokens sampled by a session to a grammar.
+//
+// A token is first sampled without the grammar and only checked against it, which is a
+// lookup in the state's mask if it is known and one token through the grammar otherwise.
+// Only if the grammar rejects it, the logits of all rejected tokens are masked and the
+// token is sampled again, so constrained decoding costs about as much as unconstrained as
+// long as the model mostly follows the grammar by itself.
+class LlamaGrammarSampler {
+public:
+    LlamaGrammarSampler() = default;
+
+    ~LlamaGrammarSampler();
+
+    LlamaGrammarSampler(const LlamaGrammarSampler &) = delete;
+
+    LlamaGrammarSampler &operator=(const LlamaGrammarSampler &) = delete;
+
+    // Starts constraining at the start state of `grammar`, nullptr stops constraining
+    void start(std::shared_ptr<const LlamaGrammar> grammar);
+
+    bool isActive() const;
+
+    // Samples a token of logits `idx` that the grammar accepts. `sample_logits` samples logits
+    // `idx` without the grammar, it is called again after the rejected tokens were masked. If
+    // the grammar allows no token, stops constraining and returns an end of generation token.
+    llama_token sample(llama_context *ctx, int idx, const std::function<llama_token()> &sample_logits);
+
+    // Advances the grammar state, the token must be accepted by the grammar
+    void accept(llama_token token);
+
+    int64_t getSampled() const;
+
+    // Tokens sampled again with the rejected ones masked
+    int64_t getResampled() const;
+
+    // Checks and resamples answered by a known mask
+    int64_t getMaskHits() const;
+
+private:
+    bool isAllowed(llama_token token, const LlamaGrammar::TokenMask *mask);
+
+    static llama_token endOfGeneration(const llama_model *model);
+
+    std::shared_ptr<const LlamaGrammar> grammar;
+    llama_sampler *state = nullptr;
+    uint64_t state_key = 0;
+    int32_t depth = 0;
+
+    int64_t n_sampled = 0;
+    int64_t n_resampled = 0;
+    int64_t n_mask_hits = 0;
+};
+
+#endif //LMPLAYGROUND_LLAMAGRAMMARCACHE_H
@@ -0,0 +1,697 @@
+#include "LlamaHttpServer.h"
+#include "LlamaCpp.h"
+
+#include "json.hpp"
+#include "log.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <exception>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using json = nlohmann::ordered_json;
+
+// A chat completion, parsed by the event loop and run by the worker
+struct LlamaHttpServer::Job {
+    uint64_t key = 0;
+    std::string id;
+    int64_t created = 0;
+    std::vector<llama_chat_msg> messages;
+    bool stream = false;
+    int32_t max_tokens = -1;
+    std::string json_schema;
+    std::atomic<bool> cancelled{false};
+
+    // guarded by the server mutex: written by the worker, taken by the event loop
+    std::string output;
+    bool done = false;
+};
+
+struct LlamaHttpServer::Connection {
+    uint64_t key = 0;
+    int fd = -1;
+
+    std::string in;
+    // 0 until the headers are complete
+    size_t header_size = 0;
+    size_t content_length = 0;
+    std::string method;
+    std::string path;
+
+    std::string out;
+    size_t out_offset = 0;
+    // the response is complete once `out` is written
+    bool write_and_close = false;
+    bool want_write = false;
+    std::shared_ptr<LlamaHttpServer::Job> job;
+};
+
+namespace {
+
+const char *statusText(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Payload Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 501: return "Not Implemented";
+        case 503: return "Service Unavailable";
+        default: return "Internal Server Error";
+    }
+}
+
+std::string responseHead(int status, const char *content_type) {
+    return "HTTP/1.1 " + std::to_string(status) + " " + statusText(status) + "\r\n"
+           "Content-Type: " + content_type + "\r\n"
+           "Cache-Control: no-cache\r\n"
+           "Connection: close\r\n";
+}
+
+std::string jsonResponse(int status, const std::string &body) {
+    return responseHead(status, "application/json") +
+           "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+// a reply cut off by max_tokens may end in the middle of a UTF-8 sequence, and paths and
+// parse errors carry raw client bytes; a throwing dump() would take down the event loop
+std::string dumpJson(const json &value) {
+    return value.dump(-1, ' ', false, json::error_handler_t::replace);
+}
+
+std::string errorBody(const std::string &message) {
+    return dumpJson(json{{"error", {{"message", message}, {"type", "invalid_request_error"}}}});
+}
+
+// "content" is a string or an array of parts, of which only text is supported
+std::string messageContent(const json &content) {
+    if (content.is_string()) {
+        return content.get<std::string>();
+    }
+    std::string text;
+    for (const auto &part : content) {
+        if (part.at("type").get<std::string>() != "text") {
+            throw std::invalid_argument("only text content is supported");
+        }
+        text += part.at("text").get<std::string>();
+    }
+    return text;
+}
+
+bool sameMessages(const std::vector<llama_chat_msg> &a, const std::vector<llama_chat_msg> &b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const auto &x, const auto &y) {
+        return x.role == y.role && x.content == y.content;
+    });
+}
+
+}
+
+LlamaHttpServer::LlamaHttpServer(LlamaModel &model_arg, std::string model_name_arg, int32_t default_max_tokens_arg)
+        : model(model_arg), model_name(std::move(model_name_arg)), default_max_tokens(default_max_tokens_arg) {
+}
+
+LlamaHttpServer::~LlamaHttpServer() {
+    stop();
+    if (tcp_fd >= 0) {
+        close(tcp_fd);
+    }
+    if (unix_fd >= 0) {
+        close(unix_fd);
+        unlink(unix_path.c_str());
+    }
+}
+
+bool LlamaHttpServer::listenTcp(uint16_t port_arg) {
+    tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (tcp_fd < 0) {
+        LOG_ERR("%s: socket failed: %s\n", __func__, strerror(errno));
+        return false;
+    }
+    const int reuse = 1;
+    setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    // loopback only, the server has no authentication
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port_arg);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(tcp_fd, (sockaddr *) &addr, addr_len) != 0 || listen(tcp_fd, SOMAXCONN) != 0 ||
+        getsockname(tcp_fd, (sockaddr *) &addr, &addr_len) != 0) {
+        LOG_ERR("%s: failed to listen on 127.0.0.1:%u: %s\n", __func__, port_arg, strerror(errno));
+        close(tcp_fd);
+        tcp_fd = -1;
+        return false;
+    }
+    port = ntohs(addr.sin_port);
+    LOG_INF("%s: listening on http://127.0.0.1:%u\n", __func__, port);
+    return true;
+}
+
+bool LlamaHttpServer::listenUnix(const std::string &path) {
+    sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        LOG_ERR("%s: socket path too long: %s\n", __func__, path.c_str());
+        return false;
+    }
+    unix_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (unix_fd < 0) {
+        LOG_ERR("%s: socket failed: %s\n", __func__, strerror(errno));
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    // left behind by a server that was killed
+    unlink(path.c_str());
+    if (bind(unix_fd, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(unix_fd, SOMAXCONN) != 0) {
+        LOG_ERR("%s: failed to listen on %s: %s\n", __func__, path.c_str(), strerror(errno));
+        close(unix_fd);
+        unix_fd = -1;
+        return false;
+    }
+    unix_path = path;
+    LOG_INF("%s: listening on %s\n", __func__, path.c_str());
+    return true;
+}
+
+uint16_t LlamaHttpServer::getPort() const {
+    return port;
+}
+
+bool LlamaHttpServer::start() {
+    if (running.load() || (tcp_fd < 0 && unix_fd < 0)) {
+        return false;
+    }
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wake_fd < 0) {
+        LOG_ERR("%s: failed to create the event loop: %s\n", __func__, strerror(errno));
+        return false;
+    }
+    auto add = [this](int fd, uint64_t key) {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = key;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    };
+    if (tcp_fd >= 0) {
+        add(tcp_fd, KEY_TCP);
+    }
+    if (unix_fd >= 0) {
+        add(unix_fd, KEY_UNIX);
+    }
+    add(wake_fd, KEY_WAKE);
+
+    running = true;
+    loop_thread = std::thread(&LlamaHttpServer::runLoop, this);
+    worker_thread = std::thread(&LlamaHttpServer::runWorker, this);
+    return true;
+}
+
+void LlamaHttpServer::stop() {
+    if (!running.exchange(false)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (running_session != nullptr) {
+            running_session->cancel();
+        }
+        cv.notify_one();
+    }
+    const uint64_t one = 1;
+    write(wake_fd, &one, sizeof(one));
+    loop_thread.join();
+    worker_thread.join();
+
+    jobs.clear();
+    session.reset();
+    close(epoll_fd);
+    close(wake_fd);
+    epoll_fd = -1;
+    wake_fd = -1;
+}
+
+void LlamaHttpServer::runLoop() {
+    std::vector<epoll_event> events(64);
+    while (running.load()) {
+        const int n_events = epoll_wait(epoll_fd, events.data(), (int) events.size(), -1);
+        if (n_events < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERR("%s: epoll_wait failed: %s\n", __func__, strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n_events; i++) {
+            const uint64_t key = events[i].data.u64;
+            if (key == KEY_TCP) {
+                acceptClients(tcp_fd);
+            } else if (key == KEY_UNIX) {
+                acceptClients(unix_fd);
+            } else if (key == KEY_WAKE) {
+                uint64_t value;
+                while (read(wake_fd, &value, sizeof(value)) > 0) {
+                }
+                collectOutput();
+            } else {
+                auto it = connections.find(key);
+                if (it == connections.end()) {
+                    continue;
+                }
+                Connection &connection = *it->second;
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    closeConnection(key);
+                    continue;
+                }
+                if ((events[i].events & (EPOLLIN | EPOLLRDHUP)) && !readRequest(connection)) {
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT) {
+                    writeResponse(connection);
+                }
+            }
+        }
+    }
+
+    std::vector<uint64_t> keys;
+    for (const auto &entry : connections) {
+        keys.push_back(entry.first);
+    }
+    for (const uint64_t key : keys) {
+        closeConnection(key);
+    }
+}
+
+void LlamaHttpServer::acceptClients(int listen_fd) {
+    while (true) {
+        const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                LOG_WRN("%s: accept failed: %s\n", __func__, strerror(errno));
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (connections.size() >= MAX_CONNECTIONS) {
+            const std::string response = jsonResponse(503, errorBody("too many connections"));
+            send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+            close(fd);
+            continue;
+        }
+
+        auto connection = std::make_unique<Connection>();
+        connection->key = next_key++;
+        connection->fd = fd;
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.u64 = connection->key;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close(fd);
+            continue;
+        }
+        connections.emplace(connection->key, std::move(connection));
+    }
+}
+
+bool LlamaHttpServer::readRequest(Connection &connection) {
+    char buffer[16 * 1024];
+    while (true) {
+        const ssize_t n = recv(connection.fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            // anything after the request is ignored
+            if (!connection.job && !connection.write_and_close) {
+                connection.in.append(buffer, (size_t) n);
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        // the client went away, or the connection failed
+        closeConnection(connection.key);
+        return false;
+    }
+    if (connection.job || connection.write_and_close) {
+        return true;
+    }
+
+    const int status = parseRequest(connection);
+    if (status == NEED_MORE) {
+        return connection.out.empty() || writeResponse(connection);
+    }
+    if (status != 0) {
+        return respond(connection, status, errorBody(statusText(status)));
+    }
+    return dispatch(connection);
+}
+
+int LlamaHttpServer::parseRequest(Connection &connection) {
+    std::string &in = connection.in;
+    if (connection.header_size == 0) {
+        const size_t header_end = in.find("\r\n\r\n");
+        if (header_end == std::string::npos) {
+            return in.size() > MAX_HEADER_BYTES ? 431 : NEED_MORE;
+        }
+        connection.header_size = header_end + 4;
+
+        // request line: METHOD SP PATH SP HTTP/1.x
+        const size_t line_end = in.find("\r\n");
+        const size_t method_end = in.find(' ');
+        const size_t path_end = method_end < line_end ? in.find(' ', method_end + 1) : std::string::npos;
+        if (path_end == std::string::npos || path_end > line_end || in.compare(path_end + 1, 7, "HTTP/1.") != 0) {
+            return 400;
+        }
+        connection.method = in.substr(0, method_end);
+        connection.path = in.substr(method_end + 1, path_end - method_end - 1);
+        connection.path = connection.path.substr(0, connection.path.find('?'));
+
+        bool expect_continue = false;
+        size_t pos = line_end + 2;
+        while (pos < header_end) {
+            const size_t end = in.find("\r\n", pos);
+            const size_t colon = in.find(':', pos);
+            if (colon == std::string::npos || colon > end) {
+                return 400;
+            }
+            std::string name = in.substr(pos, colon - pos);
+            std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+            const size_t value_start = in.find_first_not_of(" \t", colon + 1);
+            const std::string value = value_start < end ? in.substr(value_start, end - value_start) : "";
+            if (name == "content-length") {
+                connection.content_length = std::strtoull(value.c_str(), nullptr, 10);
+                if (connection.content_length > MAX_BODY_BYTES) {
+                    return 413;
+                }
+            } else if (name == "transfer-encoding") {
+                return 501;
+            } else if (name == "expect") {
+                expect_continue = true;
+            }
+            pos = end + 2;
+        }
+        // curl waits for this before sending a large body
+        if (expect_continue && in.size() < connection.header_size + connection.content_length) {
+            connection.out += "HTTP/1.1 100 Continue\r\n\r\n";
+        }
+    }
+    return in.size() < connection.header_size + connection.content_length ? NEED_MORE : 0;
+}
+
+bool LlamaHttpServer::dispatch(Connection &connection) {
+    const std::string &path = connection.path;
+    const bool is_get = connection.method == "GET";
+    if (path == "/health") {
+        return is_get ? respond(connection, 200, json{{"status", "ok"}}.dump()) : respond(connection, 405, errorBody("use GET"));
+    }
+    if (path == "/v1/models") {
+        const json models = {
+                {"object", "list"},
+                {"data", json::array({{{"id", model_name}, {"object", "model"}, {"owned_by", "lmplayground"}}})},
+        };
+        return is_get ? respond(connection, 200, dumpJson(models)) : respond(connection, 405, errorBody("use GET"));
+    }
+    if (path == "/v1/chat/completions") {
+        return connection.method == "POST" ? startCompletion(connection) : respond(connection, 405, errorBody("use POST"));
+    }
+    return respond(connection, 404, errorBody("unknown path " + path));
+}
+
+bool LlamaHttpServer::startCompletion(Connection &connection) {
+    auto job = std::make_shared<Job>();
+    try {
+        const json request = json::parse(connection.in.begin() + (long) connection.header_size,
+                                         connection.in.begin() + (long) (connection.header_size + connection.content_length));
+        const json &messages = request.at("messages");
+        if (!messages.is_array() || messages.empty()) {
+            return respond(connection, 400, errorBody("\"messages\" must be a non-empty array"));
+        }
+        for (const auto &message : messages) {
+            std::string role = message.at("role").get<std::string>();
+            if (role == "developer") {
+                role = "system";
+            }
+            if (role != "user" && role != "assistant" && !(role == "system" && job->messages.empty())) {
+                return respond(connection, 400, errorBody("unsupported message role " + role));
+            }
+            job->messages.push_back({role, messageContent(message.at("content"))});
+        }
+        if (job->messages.back().role != "user") {
+            return respond(connection, 400, errorBody("the last message must be a user message"));
+        }
+        job->stream = request.value("stream", false);
+        job->max_tokens = request.value("max_completion_tokens", request.value("max_tokens", default_max_tokens));
+        if (request.contains("response_format")) {
+            const json &format = request.at("response_format");
+            const std::string type = format.at("type").get<std::string>();
+            if (type == "json_schema") {
+                job->json_schema = format.at("json_schema").at("schema").dump();
+            } else if (type == "json_object") {
+                job->json_schema = R"({"type": "object"})";
+            }
+        }
+    } catch (const std::exception &e) {
+        return respond(connection, 400, errorBody(std::string("invalid request: ") + e.what()));
+    }
+
+    job->key = connection.key;
+    job->id = "chatcmpl-" + std::to_string(++n_requests);
+    job->created = (int64_t) time(nullptr);
+    connection.job = job;
+    connection.in.clear();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(std::move(job));
+    cv.notify_one();
+    return true;
+}
+
+void LlamaHttpServer::collectOutput() {
+    std::vector<uint64_t> keys;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        keys.swap(ready);
+    }
+    for (const uint64_t key : keys) {
+        auto it = connections.find(key);
+        if (it == connections.end() || !it->second->job) {
+            continue;
+        }
+        Connection &connection = *it->second;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            connection.out += connection.job->output;
+            connection.job->output.clear();
+            connection.write_and_close = connection.job->done;
+        }
+        writeResponse(connection);
+    }
+}
+
+bool LlamaHttpServer::writeResponse(Connection &connection) {
+    while (connection.out_offset < connection.out.size()) {
+        const ssize_t n = send(connection.fd, connection.out.data() + connection.out_offset,
+                               connection.out.size() - connection.out_offset, MSG_NOSIGNAL);
+        if (n > 0) {
+            connection.out_offset += (size_t) n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        closeConnection(connection.key);
+        return false;
+    }
+
+    if (connection.out_offset == connection.out.size()) {
+        connection.out.clear();
+        connection.out_offset = 0;
+        if (connection.write_and_close) {
+            closeConnection(connection.key);
+            return false;
+        }
+    }
+
+    // wait for the socket to drain only while there is something left to write
+    const bool want_write = !connection.out.empty();
+    if (want_write != connection.want_write) {
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLRDHUP | (want_write ? (uint32_t) EPOLLOUT : 0u);
+        event.data.u64 = connection.key;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection.fd, &event);
+        connection.want_write = want_write;
+    }
+    return true;
+}
+
+bool LlamaHttpServer::respond(Connection &connection, int status, const std::string &body) {
+    connection.out += jsonResponse(status, body);
+    connection.write_and_close = true;
+    return writeResponse(connection);
+}
+
+void LlamaHttpServer::closeConnection(uint64_t key) {
+    auto it = connections.find(key);
+    if (it == connections.end()) {
+        return;
+    }
+    Connection &connection = *it->second;
+    if (connection.job) {
+        // no-op if the completion is over already
+        connection.job->cancelled = true;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (running_job == connection.job && running_session != nullptr) {
+            running_session->cancel();
+        }
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection.fd, nullptr);
+    close(connection.fd);
+    connections.erase(it);
+}
+
+void LlamaHttpServer::runWorker() {
+    while (true) {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return !running.load() || !jobs.empty(); });
+            if (!running.load()) {
+                break;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        if (!job->cancelled.load()) {
+            complete(job);
+        }
+    }
+}
+
+void LlamaHttpServer::complete(const std::shared_ptr<Job> &job) {
+    const std::vector<llama_chat_msg> history(job->messages.begin(), job->messages.end() - 1);
+    if (!session || !session_reusable || !sameMessages(session_messages, history)) {
+        // free the old context before creating the new one
+        session.reset();
+        session.reset(model.createGenerationSession(history));
+        session_messages = history;
+    }
+    // until the reply is known to be complete
+    session_reusable = false;
+
+    session->addMessage(job->messages.back().content.c_str());
+    if (!job->json_schema.empty() && !session->setJsonSchema(job->json_schema)) {
+        emit(*job, jsonResponse(400, errorBody("the JSON schema is not supported")), true);
+        return;
+    }
+
+    auto chunk = [&](const json &delta, const json &finish_reason) {
+        const json data = {
+                {"id", job->id},
+                {"object", "chat.completion.chunk"},
+                {"created", job->created},
+                {"model", model_name},
+                {"choices", json::array({{{"index", 0}, {"delta", delta}, {"finish_reason", finish_reason}}})},
+        };
+        return "data: " + dumpJson(data) + "\n\n";
+    };
+
+    if (job->stream) {
+        emit(*job, responseHead(200, "text/event-stream") + "\r\n" +
+                   chunk({{"role", "assistant"}, {"content", ""}}, nullptr), false);
+    }
+
+    const llama_perf_context_data perf_before = session->getPerfData();
+    {
+        // stop() either sees the session and cancels it or is seen here
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!running.load()) {
+            return;
+        }
+        running_job = job;
+        running_session = session.get();
+    }
+    std::string text;
+    bool length = false;
+    session->generateChunked([&](std::string_view piece) {
+        text.append(piece.data(), piece.size());
+        if (job->stream) {
+            emit(*job, chunk({{"content", std::string(piece)}}, nullptr), false);
+        }
+        if (job->max_tokens >= 0 && (int32_t) session->getReplyTokens().size() >= job->max_tokens) {
+            length = true;
+            session->stopGeneration();
+        }
+    }, 1, 0);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running_job.reset();
+        running_session = nullptr;
+    }
+    if (job->cancelled.load()) {
+        return;
+    }
+
+    // a reply cut short would have to be closed first, the next request gets a new session then
+    if (!length) {
+        session_messages = job->messages;
+        session_messages.push_back({"assistant", text});
+        session_reusable = true;
+    }
+
+    const char *finish_reason = length ? "length" : "stop";
+    if (job->stream) {
+        emit(*job, chunk(json::object(), finish_reason) + "data: [DONE]\n\n", true);
+        return;
+    }
+    const llama_perf_context_data perf_after = session->getPerfData();
+    const int32_t n_prompt = perf_after.n_p_eval - perf_before.n_p_eval;
+    const auto n_completion = (int32_t) session->getReplyTokens().size();
+    const json response = {
+            {"id", job->id},
+            {"object", "chat.completion"},
+            {"created", job->created},
+            {"model", model_name},
+            {"choices", json::array({{
+                    {"index", 0},
+                    {"message", {{"role", "assistant"}, {"content", text}}},
+                    {"finish_reason", finish_reason},
+            }})},
+            {"usage", {
+                    {"prompt_tokens", n_prompt},
+                    {"completion_tokens", n_completion},
+                    {"total_tokens", n_prompt + n_completion},
+            }},
+    };
+    emit(*job, jsonResponse(200, dumpJson(response)), true);
+}
+
+void LlamaHttpServer::emit(Job &job, const std::string &data, bool done) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job.output += data;
+        job.done = done;
+        ready.push_back(job.key);
+    }
+    const uint64_t one = 1;
+    write(wake_fd, &one, sizeof(one));
+}
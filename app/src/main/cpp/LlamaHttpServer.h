@@ -0,0 +1,141 @@
+#ifndef LMPLAYGROUND_LLAMAHTTPSERVER_H
+#define LMPLAYGROUND_LLAMAHTTPSERVER_H
+
+#include "common.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class LlamaGenerationSession;
+class LlamaModel;
+
+// OpenAI-compatible HTTP/1.1 server on the loopback interface or a Unix socket, so that other
+// processes can use a loaded model without loading it again.
+//
+// Serves POST /v1/chat/completions, streamed as server-sent events with "stream": true, and
+// GET /v1/models and /health. Every response closes its connection.
+//
+// One event loop thread does all socket I/O and request parsing with non-blocking sockets on
+// epoll, a worker thread runs the completions one at a time on a LlamaGenerationSession. The
+// worker only appends the output of a request to a buffer and wakes the loop, so a slow client
+// never holds up decoding. A request whose messages continue the conversation of the previous
+// one, which is what chat clients send, only adds its last message to the session; any other
+// conversation gets a new session. A client that disconnects cancels its completion, also in
+// the middle of the prompt.
+class LlamaHttpServer {
+public:
+    // max_tokens of requests that do not limit the reply
+    static const int32_t DEFAULT_MAX_TOKENS = 1024;
+
+    LlamaHttpServer(LlamaModel &model, std::string model_name, int32_t default_max_tokens = DEFAULT_MAX_TOKENS);
+
+    ~LlamaHttpServer();
+
+    LlamaHttpServer(const LlamaHttpServer &) = delete;
+
+    LlamaHttpServer &operator=(const LlamaHttpServer &) = delete;
+
+    // Listens on 127.0.0.1:`port`, port 0 picks a free one, see getPort()
+    bool listenTcp(uint16_t port);
+
+    // Listens on a Unix socket at `path`, replacing a stale socket file
+    bool listenUnix(const std::string &path);
+
+    uint16_t getPort() const;
+
+    // Starts serving on the event loop and worker threads
+    bool start();
+
+    void stop();
+
+private:
+    struct Job;
+    struct Connection;
+
+    static const int MAX_CONNECTIONS = 64;
+    static const size_t MAX_HEADER_BYTES = 16 * 1024;
+    static const size_t MAX_BODY_BYTES = 8 * 1024 * 1024;
+    // epoll keys of the listening sockets and the wake-up eventfd, connections count from here
+    static const uint64_t KEY_TCP = 0;
+    static const uint64_t KEY_UNIX = 1;
+    static const uint64_t KEY_WAKE = 2;
+    static const uint64_t KEY_FIRST_CONNECTION = 3;
+    static const int NEED_MORE = -1;
+
+    void runLoop();
+
+    void acceptClients(int listen_fd);
+
+    // Returns false if the connection was closed
+    bool readRequest(Connection &connection);
+
+    // 0 once the request is complete, NEED_MORE or the HTTP status of an invalid request
+    int parseRequest(Connection &connection);
+
+    // Returns false if the connection was closed
+    bool dispatch(Connection &connection);
+
+    // Returns false if the connection was closed
+    bool startCompletion(Connection &connection);
+
+    // Moves the output of the worker to the connections it belongs to
+    void collectOutput();
+
+    // Returns false if the connection was closed
+    bool writeResponse(Connection &connection);
+
+    // Returns false if the connection was closed
+    bool respond(Connection &connection, int status, const std::string &body);
+
+    void closeConnection(uint64_t key);
+
+    void runWorker();
+
+    void complete(const std::shared_ptr<Job> &job);
+
+    // Appends to the output of `job` and wakes the event loop
+    void emit(Job &job, const std::string &data, bool done);
+
+    LlamaModel &model;
+    std::string model_name;
+    int32_t default_max_tokens;
+
+    int tcp_fd = -1;
+    int unix_fd = -1;
+    std::string unix_path;
+    uint16_t port = 0;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    std::atomic<bool> running{false};
+    std::thread loop_thread;
+    std::thread worker_thread;
+
+    // event loop thread only
+    std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections;
+    uint64_t next_key = KEY_FIRST_CONNECTION;
+    uint64_t n_requests = 0;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<Job>> jobs;
+    // connections with new output of their job
+    std::vector<uint64_t> ready;
+    // the completion in progress, cancelled when its client goes away
+    std::shared_ptr<Job> running_job;
+    LlamaGenerationSession *running_session = nullptr;
+
+    // worker thread only: the session and the messages it holds, if a request can continue them
+    std::unique_ptr<LlamaGenerationSession> session;
+    std::vector<llama_chat_msg> session_messages;
+    bool session_reusable = false;
+};
+
+#endif //LMPLAYGROUND_LLAMAHTTPSERVER_H
@@ -0,0 +1,168 @@
+#include "LlamaMemoryPlanner.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+// Reads an integer metadata value of the model's architecture, e.g. "attention.head_count_kv"
+static int64_t arch_meta_int(const llama_model *model, const char *key, int64_t fallback) {
+    char arch[64];
+    if (llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch)) < 0) {
+        return fallback;
+    }
+    const std::string full_key = std::string(arch) + "." + key;
+    char value[32];
+    if (llama_model_meta_val_str(model, full_key.c_str(), value, sizeof(value)) < 0) {
+        return fallback;
+    }
+    return std::strtoll(value, nullptr, 10);
+}
+
+uint64_t LlamaMemoryPlanner::availableMemory() {
+    FILE *file = fopen("/proc/meminfo", "r");
+    if (file == nullptr) {
+        return 0;
+    }
+    uint64_t available_kb = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        if (sscanf(line, "MemAvailable: %" SCNu64 " kB", &available_kb) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return available_kb * 1024;
+}
+
+// KV cache types supported by the CPU backend
+static const ggml_type KV_CACHE_TYPES[] = {
+        GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q5_1, GGML_TYPE_Q5_0, GGML_TYPE_Q4_1, GGML_TYPE_Q4_0,
+};
+
+bool LlamaMemoryPlanner::parseKvCacheType(const std::string &name, ggml_type &type) {
+    for (ggml_type candidate : KV_CACHE_TYPES) {
+        if (name == ggml_type_name(candidate)) {
+            type = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool LlamaMemoryPlanner::isKvCacheTypeSupported(const llama_model *model, ggml_type type_k, ggml_type type_v) {
+    const int64_t n_head = std::max(llama_n_head(model), 1);
+    const int64_t n_embd_head_k = arch_meta_int(model, "attention.key_length", llama_n_embd(model) / n_head);
+    const int64_t n_embd_head_v = arch_meta_int(model, "attention.value_length", llama_n_embd(model) / n_head);
+    // every head is stored as whole quantization blocks
+    return n_embd_head_k % ggml_blck_size(type_k) == 0 && n_embd_head_v % ggml_blck_size(type_v) == 0;
+}
+
+uint64_t LlamaMemoryPlanner::kvBytes(const llama_model *model, int32_t n_ctx, ggml_type type_k, ggml_type type_v) {
+    const int64_t n_layer = llama_n_layer(model);
+    const int64_t n_head = std::max(llama_n_head(model), 1);
+    const int64_t n_head_kv = arch_meta_int(model, "attention.head_count_kv", n_head);
+    const int64_t n_embd_head_k = arch_meta_int(model, "attention.key_length", llama_n_embd(model) / n_head);
+    const int64_t n_embd_head_v = arch_meta_int(model, "attention.value_length", llama_n_embd(model) / n_head);
+
+    const uint64_t per_token = ggml_row_size(type_k, n_embd_head_k * n_head_kv) +
+                               ggml_row_size(type_v, n_embd_head_v * n_head_kv);
+    return per_token * (uint64_t) n_layer * (uint64_t) n_ctx;
+}
+
+uint64_t LlamaMemoryPlanner::computeBytes(const llama_model *model, int32_t n_ctx, int32_t n_ubatch, bool flash_attn) {
+    const uint64_t n_embd = llama_n_embd(model);
+    const uint64_t n_head = std::max(llama_n_head(model), 1);
+    const uint64_t n_vocab = llama_n_vocab(model);
+
+    // KQ scores of all heads, the flash attention kernel works on tiles instead
+    const uint64_t attention = flash_attn ? 0 : (uint64_t) n_ctx * n_ubatch * n_head * sizeof(float);
+    // residual stream, normalized copy and the feed-forward expansion (~4x n_embd)
+    const uint64_t activations = (uint64_t) n_ubatch * n_embd * 8 * sizeof(float);
+    const uint64_t logits = (uint64_t) n_ubatch * n_vocab * sizeof(float);
+    return attention + activations + logits;
+}
+
+uint64_t LlamaMemoryPlanner::draftBytes(const llama_model *draft_model, int32_t n_ctx, int32_t n_ubatch) {
+    return llama_model_size(draft_model) + kvBytes(draft_model, n_ctx, GGML_TYPE_F16, GGML_TYPE_F16) +
+           computeBytes(draft_model, n_ctx, std::min(n_ubatch, n_ctx), false);
+}
+
+LlamaMemoryPlan LlamaMemoryPlanner::plan(const llama_model *model,
+                                         int32_t n_ctx_max,
+                                         uint64_t budget_bytes,
+                                         int32_t n_ubatch,
+                                         uint64_t draft_bytes) {
+    LlamaMemoryPlan result;
+    result.weights_bytes = llama_model_size(model);
+    result.draft_bytes = draft_bytes;
+    result.budget_bytes = budget_bytes > 0
+            ? budget_bytes
+            : (uint64_t) (availableMemory() * DEFAULT_BUDGET_FRACTION);
+
+    const int32_t n_ctx_train = llama_n_ctx_train(model);
+    int32_t n_ctx_limit = n_ctx_max > 0 ? std::min(n_ctx_max, n_ctx_train) : n_ctx_train;
+    n_ctx_limit = std::max(n_ctx_limit, MIN_CTX);
+
+    // the weights are mmapped and count towards the budget once they are paged in
+    const uint64_t fixed_bytes = result.weights_bytes + result.draft_bytes;
+    const uint64_t budget = result.budget_bytes > fixed_bytes ? result.budget_bytes - fixed_bytes : 0;
+
+    auto fill = [&](int32_t n_ctx, ggml_type type, bool flash_attn) {
+        LlamaMemoryPlan candidate = result;
+        candidate.n_ctx = n_ctx;
+        candidate.type_k = type;
+        candidate.type_v = type;
+        candidate.flash_attn = flash_attn;
+        candidate.kv_bytes = kvBytes(model, n_ctx, type, type);
+        candidate.compute_bytes = computeBytes(model, n_ctx, std::min(n_ubatch, n_ctx), flash_attn);
+        candidate.fits = candidate.kv_bytes + candidate.compute_bytes <= budget;
+        return candidate;
+    };
+
+    // largest context of a KV cache type that fits, 0 if none does
+    auto largest = [&](ggml_type type, bool flash_attn) {
+        if (fill(n_ctx_limit, type, flash_attn).fits) {
+            return n_ctx_limit;
+        }
+        // lo always fits, or is the sentinel one step below the smallest context
+        const int32_t none = MIN_CTX / CTX_GRANULARITY - 1;
+        int32_t lo = none;
+        int32_t hi = n_ctx_limit / CTX_GRANULARITY;
+        while (lo < hi) {
+            const int32_t mid = (lo + hi + 1) / 2;
+            if (fill(mid * CTX_GRANULARITY, type, flash_attn).fits) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        return lo == none ? 0 : lo * CTX_GRANULARITY;
+    };
+
+    // an F16 cache is exact, a Q8_0 one is only used when it buys a larger context
+    const int32_t n_ctx_f16 = largest(GGML_TYPE_F16, false);
+    if (n_ctx_f16 == n_ctx_limit) {
+        result = fill(n_ctx_f16, GGML_TYPE_F16, false);
+    } else {
+        const int32_t n_ctx_q8 = largest(GGML_TYPE_Q8_0, true);
+        if (n_ctx_q8 > n_ctx_f16) {
+            result = fill(n_ctx_q8, GGML_TYPE_Q8_0, true);
+        } else if (n_ctx_f16 > 0) {
+            result = fill(n_ctx_f16, GGML_TYPE_F16, false);
+        } else {
+            result = fill(MIN_CTX, GGML_TYPE_Q8_0, true);
+        }
+    }
+
+    LOG_INF("%s: n_ctx = %d (%s), weights = %.1f MiB, draft = %.1f MiB, kv = %.1f MiB, compute = %.1f MiB, budget = %.1f MiB%s\n",
+            __func__, result.n_ctx, ggml_type_name(result.type_k),
+            result.weights_bytes / 1024.0 / 1024.0, result.draft_bytes / 1024.0 / 1024.0, result.kv_bytes / 1024.0 / 1024.0,
+            result.compute_bytes / 1024.0 / 1024.0, result.budget_bytes / 1024.0 / 1024.0,
+            result.fits ? "" : ", does not fit");
+    return result;
+}
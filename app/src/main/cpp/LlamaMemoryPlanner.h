@@ -0,0 +1,72 @@
+#ifndef LMPLAYGROUND_LLAMAMEMORYPLANNER_H
+#define LMPLAYGROUND_LLAMAMEMORYPLANNER_H
+
+#include "ggml.h"
+#include "llama.h"
+
+#include <cstdint>
+#include <string>
+
+// Memory a session needs besides the model weights, and the context size it was sized for
+struct LlamaMemoryPlan {
+    int32_t n_ctx = 0;
+    ggml_type type_k = GGML_TYPE_F16;
+    ggml_type type_v = GGML_TYPE_F16;
+    // a quantized V cache is only supported with flash attention
+    bool flash_attn = false;
+
+    uint64_t weights_bytes = 0;
+    // weights, KV cache and compute buffers of a draft model, see LlamaModel::loadDraftModel()
+    uint64_t draft_bytes = 0;
+    uint64_t kv_bytes = 0;
+    uint64_t compute_bytes = 0;
+    uint64_t budget_bytes = 0;
+
+    // false if even the smallest context exceeds the budget, n_ctx is the smallest one then
+    bool fits = false;
+};
+
+// Picks the largest context (and KV cache type) whose KV cache and compute buffers fit in a
+// memory budget next to the weights. Sizes are computed from the model's dimensions, so the
+// plan is made before any context is created.
+class LlamaMemoryPlanner {
+public:
+    // Share of the available memory used when no explicit budget is given; the rest is left
+    // to the app itself and to the system, so the process is not the first one to be killed
+    static constexpr double DEFAULT_BUDGET_FRACTION = 0.7;
+
+    static constexpr int32_t MIN_CTX = 512;
+    // contexts are planned in multiples of this
+    static constexpr int32_t CTX_GRANULARITY = 256;
+
+    // MemAvailable from /proc/meminfo, 0 if it can not be read
+    static uint64_t availableMemory();
+
+    // `n_ctx_max` <= 0 means up to the training context of the model, `budget_bytes` == 0
+    // means DEFAULT_BUDGET_FRACTION of the available memory. `draft_bytes` is taken off the
+    // budget before the context is sized, see draftBytes().
+    static LlamaMemoryPlan plan(const llama_model *model,
+                                int32_t n_ctx_max,
+                                uint64_t budget_bytes,
+                                int32_t n_ubatch,
+                                uint64_t draft_bytes = 0);
+
+    // Memory of a draft model with an F16 KV cache of `n_ctx` cells: weights, KV cache and
+    // compute buffers
+    static uint64_t draftBytes(const llama_model *draft_model, int32_t n_ctx, int32_t n_ubatch);
+
+    static uint64_t kvBytes(const llama_model *model, int32_t n_ctx, ggml_type type_k, ggml_type type_v);
+
+    // Parses a KV cache type name ("f16", "q8_0", "q4_0", ...)
+    static bool parseKvCacheType(const std::string &name, ggml_type &type);
+
+    // True if the model's attention heads can be stored as `type_k`/`type_v` blocks;
+    // a quantized V cache additionally needs flash attention
+    static bool isKvCacheTypeSupported(const llama_model *model, ggml_type type_k, ggml_type type_v);
+
+    // Estimate of the CPU compute buffer: the attention scores of one ubatch dominate without
+    // flash attention, plus activations and the logits
+    static uint64_t computeBytes(const llama_model *model, int32_t n_ctx, int32_t n_ubatch, bool flash_attn);
+};
+
+#endif //LMPLAYGROUND_LLAMAMEMORYPLANNER_H
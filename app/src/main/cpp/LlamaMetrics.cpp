@@ -0,0 +1,96 @@
+#include "LlamaMetrics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+int LlamaLatencyHistogram::bucketIndex(int64_t us) {
+    if (us < SUB_BUCKETS) {
+        return (int) std::max<int64_t>(us, 0);
+    }
+    // position of the highest bit, at least SUB_BUCKET_BITS here
+    const int exponent = 63 - __builtin_clzll((unsigned long long) us);
+    const int sub = (int) (us >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    const int index = SUB_BUCKETS + (exponent - SUB_BUCKET_BITS) * SUB_BUCKETS + sub;
+    return std::min(index, BUCKETS - 1);
+}
+
+int64_t LlamaLatencyHistogram::bucketUpperBound(int index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    const int exponent = (index - SUB_BUCKETS) / SUB_BUCKETS + SUB_BUCKET_BITS;
+    const int64_t sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+    const int64_t width = int64_t(1) << (exponent - SUB_BUCKET_BITS);
+    return (int64_t(1) << exponent) + (sub + 1) * width - 1;
+}
+
+void LlamaLatencyHistogram::record(int64_t us) {
+    buckets[bucketIndex(us)]++;
+    n++;
+    sum += us;
+    max_us = std::max(max_us, us);
+}
+
+int64_t LlamaLatencyHistogram::percentile(double p) const {
+    if (n == 0) {
+        return 0;
+    }
+    // rank of the quantile, 1-based
+    const auto rank = (uint64_t) std::max(1.0, std::ceil(p * (double) n));
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return std::min(bucketUpperBound(i), max_us);
+        }
+    }
+    return max_us;
+}
+
+std::vector<int64_t> LlamaSessionMetrics::toArray() const {
+    auto summary = [](std::vector<int64_t> &values, const LlamaLatencyHistogram &histogram) {
+        values.push_back((int64_t) histogram.count());
+        values.push_back(histogram.total());
+        values.push_back(histogram.percentile(0.5));
+        values.push_back(histogram.percentile(0.9));
+        values.push_back(histogram.percentile(0.99));
+        values.push_back(histogram.max());
+    };
+    std::vector<int64_t> values;
+    values.push_back(ttft_last_us);
+    summary(values, ttft);
+    summary(values, decode);
+    summary(values, prefill_chunk);
+    values.push_back((int64_t) n_prefill_tokens);
+    summary(values, sampler);
+    values.push_back((int64_t) n_context_shifts);
+    values.push_back((int64_t) n_shift_tokens_discarded);
+    values.push_back(kv_used);
+    values.push_back(kv_size);
+    return values;
+}
+
+std::string LlamaSessionMetrics::toJson() const {
+    std::ostringstream json;
+    auto summary = [&](const char *name, const LlamaLatencyHistogram &histogram) {
+        json << "\"" << name << "\": {"
+             << "\"count\": " << histogram.count() << ", "
+             << "\"total_us\": " << histogram.total() << ", "
+             << "\"p50_us\": " << histogram.percentile(0.5) << ", "
+             << "\"p90_us\": " << histogram.percentile(0.9) << ", "
+             << "\"p99_us\": " << histogram.percentile(0.99) << ", "
+             << "\"max_us\": " << histogram.max() << "}, ";
+    };
+    json << "{\"ttft_last_us\": " << ttft_last_us << ", ";
+    summary("ttft", ttft);
+    summary("decode", decode);
+    summary("prefill_chunk", prefill_chunk);
+    json << "\"prefill_tokens\": " << n_prefill_tokens << ", ";
+    summary("sampler", sampler);
+    json << "\"context_shifts\": " << n_context_shifts << ", "
+         << "\"shift_tokens_discarded\": " << n_shift_tokens_discarded << ", "
+         << "\"kv_used\": " << kv_used << ", "
+         << "\"kv_size\": " << kv_size << "}";
+    return json.str();
+}
@@ -0,0 +1,66 @@
+#ifndef LMPLAYGROUND_LLAMAMETRICS_H
+#define LMPLAYGROUND_LLAMAMETRICS_H
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Histogram of latencies in microseconds with log-linear buckets: exact below 8 us, then 8
+// buckets per power of two. A percentile is the upper bound of its bucket, so it is at most
+// 1/8 (12.5%) above the true value. Recording is a few instructions and never allocates, it
+// runs on the generation thread.
+class LlamaLatencyHistogram {
+public:
+    void record(int64_t us);
+
+    // Upper bound of the bucket holding the `p` quantile (0..1), 0 if nothing was recorded
+    int64_t percentile(double p) const;
+
+    uint64_t count() const { return n; }
+
+    int64_t total() const { return sum; }
+
+    int64_t max() const { return max_us; }
+
+private:
+    static const int SUB_BUCKET_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    // enough for 2^40 us, longer values land in the last bucket
+    static const int BUCKETS = SUB_BUCKETS + (40 - SUB_BUCKET_BITS) * SUB_BUCKETS;
+
+    static int bucketIndex(int64_t us);
+
+    static int64_t bucketUpperBound(int index);
+
+    std::array<uint32_t, BUCKETS> buckets = {};
+    uint64_t n = 0;
+    int64_t sum = 0;
+    int64_t max_us = 0;
+};
+
+// Performance counters of a generation session since it was created
+struct LlamaSessionMetrics {
+    // from addMessage() to the first generated token of the reply
+    LlamaLatencyHistogram ttft;
+    int64_t ttft_last_us = 0;
+    // between consecutive generated tokens of a reply, including sampling and speculation
+    LlamaLatencyHistogram decode;
+    // llama_decode() calls over more than one prompt token
+    LlamaLatencyHistogram prefill_chunk;
+    uint64_t n_prefill_tokens = 0;
+    LlamaLatencyHistogram sampler;
+    // context shifts and turn evictions, and the tokens they dropped
+    uint64_t n_context_shifts = 0;
+    uint64_t n_shift_tokens_discarded = 0;
+    // filled in when the metrics are read
+    int64_t kv_used = 0;
+    int64_t kv_size = 0;
+
+    // Flat values in the order of LlamaSessionMetrics.fromArray() on the Kotlin side
+    std::vector<int64_t> toArray() const;
+
+    std::string toJson() const;
+};
+
+#endif //LMPLAYGROUND_LLAMAMETRICS_H
@@ -2,7 +2,6 @@
 // Created by Andrew Druk on 24.01.2024.
 //
 
-#include <jni.h>
 #include <string>
 
 #include "LlamaCpp.h"
@@ -11,6 +10,7 @@
 #include "console.h"
 #include "log.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cinttypes>
 #include <cmath>
@@ -27,7 +27,6 @@
 
 #include <csignal>
 #include <unistd.h>
-#include <android/log.h>
 #include <fcntl.h>
 
 void LlamaModel::loadModel(const gpt_params& params_arg,
@@ -37,11 +36,11 @@ void LlamaModel::loadModel(const gpt_params& params_arg,
                            std::vector<std::string> antiprompt,
                            int32_t n_ctx,
                            int32_t n_gpu_layers,
+                           uint64_t memory_budget,
                            llama_progress_callback progress_callback,
                            void * progress_callback_user_data) {
     params = params_arg;
     params.interactive = true;
-    params.n_ctx = 2048;
     params.interactive_first = true;
     params.input_prefix = std::move(input_prefix);
     params.input_suffix = std::move(input_suffix);
@@ -56,12 +55,69 @@ void LlamaModel::loadModel(const gpt_params& params_arg,
     model = llama_load_model_from_file(params.model.c_str(), modelParams);
     if (model == nullptr) {
         LOG_ERR("%s: failed to load model '%s'\n", __func__, params.model.c_str());
+        return;
     }
+    model_hash = LlamaPromptCache::hashModelFile(params.model);
+    piece_table.build(model);
+    grammar_cache.setModel(model);
+
+    plan_n_ctx_max = n_ctx;
+    plan_budget_bytes = memory_budget;
+    setMemoryPlan(LlamaMemoryPlanner::plan(model, n_ctx, memory_budget, params.n_ubatch));
+}
+
+void LlamaModel::setMemoryPlan(const LlamaMemoryPlan &plan) {
+    memory_plan = plan;
+    params.n_ctx = memory_plan.n_ctx;
+    params.cache_type_k = ggml_type_name(memory_plan.type_k);
+    params.cache_type_v = ggml_type_name(memory_plan.type_v);
+    params.flash_attn = memory_plan.flash_attn;
 }
 
-LlamaGenerationSession* LlamaModel::createGenerationSession() {
+LlamaGenerationSession* LlamaModel::createGenerationSession(uint32_t seed) {
+    return createGenerationSession({}, seed);
+}
+
+LlamaGenerationSession* LlamaModel::createGenerationSession(const std::vector<llama_chat_msg> &messages, uint32_t seed) {
     auto *session = new LlamaGenerationSession();
-    session->init(model, params);
+    gpt_params session_params = params;
+    if (seed != LLAMA_DEFAULT_SEED) {
+        session_params.sparams.seed = seed;
+    }
+    const bool has_system = !messages.empty() && messages[0].role == "system";
+    if (has_system) {
+        session_params.prompt = messages[0].content;
+    }
+    session->init(model, session_params,
+                  std::vector<llama_chat_msg>(messages.begin() + (has_system ? 1 : 0), messages.end()));
+    session->attachPieceTable(piece_table);
+    session->attachGrammarCache(grammar_cache);
+    if (prompt_cache.isEnabled()) {
+        session->attachPromptCache(prompt_cache, model_hash);
+    }
+    if (draft_model != nullptr) {
+        session->attachDraftModel(draft_model);
+    } else if (prompt_lookup) {
+        session->attachPromptLookup();
+    }
+    return session;
+}
+
+LlamaBatchEngine* LlamaModel::createBatchEngine(int32_t n_slots) {
+    auto *engine = new LlamaBatchEngine();
+    if (!engine->init(model, params, n_slots)) {
+        delete engine;
+        return nullptr;
+    }
+    return engine;
+}
+
+LlamaEmbeddingSession* LlamaModel::createEmbeddingSession() {
+    auto *session = new LlamaEmbeddingSession();
+    if (!session->init(model, params)) {
+        delete session;
+        return nullptr;
+    }
     return session;
 }
 
@@ -72,8 +128,104 @@ uint64_t LlamaModel::getModelSize() {
     return llama_model_size(this->model);
 }
 
+const LlamaMemoryPlan &LlamaModel::getMemoryPlan() const {
+    return memory_plan;
+}
+
+void LlamaModel::setPromptCacheDirectory(const std::string &directory) {
+    prompt_cache = LlamaPromptCache(directory);
+}
+
+bool LlamaModel::loadDraftModel(const std::string &path) {
+    if (model == nullptr) {
+        return false;
+    }
+    gpt_params draft_params = params;
+    draft_params.model = path;
+    llama_model *loaded = llama_load_model_from_file(path.c_str(), llama_model_params_from_gpt_params(draft_params));
+    if (loaded == nullptr) {
+        LOG_ERR("%s: failed to load draft model '%s'\n", __func__, path.c_str());
+        return false;
+    }
+    if (!LlamaDraftModelProposer::isCompatible(model, loaded)) {
+        LOG_WRN("%s: '%s' does not share the vocabulary of the model\n", __func__, path.c_str());
+        llama_free_model(loaded);
+        return false;
+    }
+
+    // the draft shares the budget with the target, whose context shrinks to make room for it
+    const uint64_t draft_bytes = LlamaMemoryPlanner::draftBytes(loaded, LlamaDraftModelProposer::N_CTX, params.n_ubatch);
+    const LlamaMemoryPlan plan = LlamaMemoryPlanner::plan(model, plan_n_ctx_max, plan_budget_bytes,
+                                                          params.n_ubatch, draft_bytes);
+    if (!plan.fits) {
+        LOG_WRN("%s: '%s' does not fit the memory budget next to the model\n", __func__, path.c_str());
+        llama_free_model(loaded);
+        return false;
+    }
+    if (draft_model != nullptr) {
+        llama_free_model(draft_model);
+    }
+    draft_model = loaded;
+    setMemoryPlan(plan);
+    return true;
+}
+
+void LlamaModel::setPromptLookup(bool enabled) {
+    prompt_lookup = enabled;
+}
+
+LlamaThreadProfile LlamaModel::tuneThreads(const std::string &cache_directory) {
+    if (model == nullptr) {
+        return {};
+    }
+    LlamaThreadProfile profile = LlamaThreadTuner::loadOrTune(model, params, model_hash, cache_directory);
+    if (profile.isValid()) {
+        LlamaThreadTuner::apply(profile, params);
+    }
+    return profile;
+}
+
+bool LlamaModel::setKvCacheType(const std::string &type_k_name, const std::string &type_v_name) {
+    if (model == nullptr) {
+        return false;
+    }
+    ggml_type type_k;
+    ggml_type type_v;
+    if (!LlamaMemoryPlanner::parseKvCacheType(type_k_name, type_k) ||
+        !LlamaMemoryPlanner::parseKvCacheType(type_v_name, type_v)) {
+        LOG_WRN("%s: unsupported KV cache type '%s' / '%s'\n", __func__, type_k_name.c_str(), type_v_name.c_str());
+        return false;
+    }
+    if (!LlamaMemoryPlanner::isKvCacheTypeSupported(model, type_k, type_v)) {
+        LOG_WRN("%s: the attention heads of the model can not be stored as %s / %s\n",
+                __func__, type_k_name.c_str(), type_v_name.c_str());
+        return false;
+    }
+
+    memory_plan.type_k = type_k;
+    memory_plan.type_v = type_v;
+    memory_plan.flash_attn = ggml_is_quantized(type_v);
+    memory_plan.kv_bytes = LlamaMemoryPlanner::kvBytes(model, memory_plan.n_ctx, type_k, type_v);
+    memory_plan.compute_bytes = LlamaMemoryPlanner::computeBytes(model, memory_plan.n_ctx,
+                                                                 std::min(params.n_ubatch, memory_plan.n_ctx),
+                                                                 memory_plan.flash_attn);
+    memory_plan.fits = memory_plan.weights_bytes + memory_plan.draft_bytes + memory_plan.kv_bytes +
+                       memory_plan.compute_bytes <= memory_plan.budget_bytes;
+
+    params.cache_type_k = ggml_type_name(type_k);
+    params.cache_type_v = ggml_type_name(type_v);
+    params.flash_attn = memory_plan.flash_attn;
+    return true;
+}
+
 void LlamaModel::unloadModel() {
+    if (draft_model != nullptr) {
+        llama_free_model(draft_model);
+        draft_model = nullptr;
+    }
     if (model != nullptr) {
+        // the grammars refer to the vocabulary of the model
+        grammar_cache.setModel(nullptr);
         llama_free_model(model);
         model = nullptr;
     }
@@ -0,0 +1,152 @@
+#include "LlamaOutputRing.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// A writer blocked on a full ring re-checks the stream state at least this often,
+// so close() from another thread is noticed even if the reader went away
+static const int WRITER_WAIT_MS = 10;
+
+static size_t round_up_pow2(size_t value) {
+    size_t result = 1;
+    while (result < value) {
+        result <<= 1;
+    }
+    return result;
+}
+
+LlamaOutputRing::LlamaOutputRing(size_t capacity) :
+        buffer(round_up_pow2(std::max<size_t>(capacity, 64))),
+        mask(buffer.size() - 1) {
+    data_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    space_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+}
+
+LlamaOutputRing::~LlamaOutputRing() {
+    if (data_fd >= 0) {
+        ::close(data_fd);
+    }
+    if (space_fd >= 0) {
+        ::close(space_fd);
+    }
+}
+
+uint8_t *LlamaOutputRing::data() {
+    return buffer.data();
+}
+
+size_t LlamaOutputRing::capacity() const {
+    return buffer.size();
+}
+
+void LlamaOutputRing::open() {
+    closed.store(false);
+}
+
+bool LlamaOutputRing::write(const void *data, size_t size) {
+    const auto *bytes = static_cast<const uint8_t *>(data);
+    uint64_t w = write_pos.load(std::memory_order_relaxed);
+
+    while (size > 0) {
+        if (closed.load()) {
+            return false;
+        }
+        const size_t space = buffer.size() - (size_t) (w - read_pos.load(std::memory_order_acquire));
+        if (space == 0) {
+            writer_waiting.store(true);
+            // re-check after announcing the wait, release() might have missed the flag
+            if (w - read_pos.load() == buffer.size() && !closed.load()) {
+                wait(space_fd, WRITER_WAIT_MS);
+            }
+            writer_waiting.store(false);
+            continue;
+        }
+
+        const size_t n = std::min(size, space);
+        const size_t offset = (size_t) (w & mask);
+        const size_t first = std::min(n, buffer.size() - offset);
+        memcpy(buffer.data() + offset, bytes, first);
+        memcpy(buffer.data(), bytes + first, n - first);
+
+        w += n;
+        bytes += n;
+        size -= n;
+
+        write_pos.store(w);
+        if (reader_waiting.load()) {
+            signal(data_fd);
+        }
+    }
+    return true;
+}
+
+void LlamaOutputRing::close() {
+    closed.store(true);
+    if (reader_waiting.load()) {
+        signal(data_fd);
+    }
+}
+
+int64_t LlamaOutputRing::await(int timeout_ms) {
+    const uint64_t r = read_pos.load(std::memory_order_relaxed);
+    for (;;) {
+        uint64_t w = write_pos.load();
+        if (w != r) {
+            return (int64_t) w;
+        }
+        if (closed.load()) {
+            // the producer publishes its last bytes before closing
+            w = write_pos.load();
+            return w != r ? (int64_t) w : -1;
+        }
+        if (timeout_ms <= 0) {
+            return (int64_t) w;
+        }
+
+        reader_waiting.store(true);
+        // re-check after announcing the wait, write() might have missed the flag
+        const bool ready = write_pos.load() != r || closed.load();
+        if (!ready) {
+            wait(data_fd, timeout_ms);
+        }
+        reader_waiting.store(false);
+        if (!ready) {
+            // either woken up or timed out, report whatever is there now
+            w = write_pos.load();
+            if (w == r && closed.load()) {
+                return -1;
+            }
+            return (int64_t) w;
+        }
+    }
+}
+
+uint64_t LlamaOutputRing::readPosition() const {
+    return read_pos.load(std::memory_order_relaxed);
+}
+
+void LlamaOutputRing::release(uint64_t position) {
+    read_pos.store(position);
+    if (writer_waiting.load()) {
+        signal(space_fd);
+    }
+}
+
+void LlamaOutputRing::signal(int fd) {
+    const uint64_t value = 1;
+    ssize_t ignored = ::write(fd, &value, sizeof(value));
+    (void) ignored;
+}
+
+void LlamaOutputRing::wait(int fd, int timeout_ms) {
+    pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+        uint64_t value;
+        ssize_t ignored = ::read(fd, &value, sizeof(value));
+        (void) ignored;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef LMPLAYGROUND_LLAMAOUTPUTRING_H
+#define LMPLAYGROUND_LLAMAOUTPUTRING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Single-producer/single-consumer byte ring for generated text.
+// The decode thread writes detokenized bytes, the UI thread reads them straight from the
+// buffer (a direct ByteBuffer on the Java side) whenever it wants to redraw. Positions are
+// monotonic byte counters, the buffer offset of a position is `position % capacity()`.
+// Either side only sleeps on an eventfd when the ring is empty (reader) or full (writer),
+// otherwise no syscalls are made.
+class LlamaOutputRing {
+public:
+    // `capacity` is rounded up to a power of two
+    explicit LlamaOutputRing(size_t capacity);
+
+    ~LlamaOutputRing();
+
+    LlamaOutputRing(const LlamaOutputRing &) = delete;
+
+    LlamaOutputRing &operator=(const LlamaOutputRing &) = delete;
+
+    uint8_t *data();
+
+    size_t capacity() const;
+
+    // Producer side. open() starts a new stream, close() ends it; write() blocks while the
+    // ring is full and returns false if the stream was closed in the meantime.
+    void open();
+
+    bool write(const void *data, size_t size);
+
+    void close();
+
+    // Consumer side. await() waits up to `timeout_ms` for bytes after the read position and
+    // returns the write position, or -1 once the stream is closed and fully released.
+    int64_t await(int timeout_ms);
+
+    uint64_t readPosition() const;
+
+    void release(uint64_t position);
+
+private:
+    static void signal(int fd);
+
+    static void wait(int fd, int timeout_ms);
+
+    std::vector<uint8_t> buffer;
+    size_t mask;
+
+    alignas(64) std::atomic<uint64_t> write_pos{0};
+    alignas(64) std::atomic<uint64_t> read_pos{0};
+
+    std::atomic<bool> closed{true};
+    std::atomic<bool> reader_waiting{false};
+    std::atomic<bool> writer_waiting{false};
+
+    int data_fd = -1;
+    int space_fd = -1;
+};
+
+#endif //LMPLAYGROUND_LLAMAOUTPUTRING_H
@@ -0,0 +1,59 @@
+#include "LlamaPieceTable.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <vector>
+
+// Renders a token into `buf`, growing it if needed, and returns the length
+static int32_t render_piece(const llama_model *model, llama_token token, bool special, std::vector<char> &buf) {
+    int32_t n = llama_token_to_piece(model, token, buf.data(), (int32_t) buf.size(), 0, special);
+    if (n < 0) {
+        buf.resize(-n);
+        n = llama_token_to_piece(model, token, buf.data(), (int32_t) buf.size(), 0, special);
+    }
+    return std::max(n, 0);
+}
+
+void LlamaPieceTable::build(const llama_model *model) {
+    const int32_t n_vocab = llama_n_vocab(model);
+    arena.clear();
+    special_spans.resize(n_vocab);
+    plain_spans.resize(n_vocab);
+
+    std::vector<char> buf(64);
+    for (llama_token token = 0; token < n_vocab; token++) {
+        const int32_t n_special = render_piece(model, token, true, buf);
+        special_spans[token] = {(uint32_t) arena.size(), (uint32_t) n_special};
+        arena.append(buf.data(), n_special);
+
+        // most tokens render the same either way, only control tokens differ
+        const int32_t n_plain = render_piece(model, token, false, buf);
+        const Span &special_span = special_spans[token];
+        if (n_plain == n_special && arena.compare(special_span.offset, special_span.length, buf.data(), n_plain) == 0) {
+            plain_spans[token] = special_span;
+        } else {
+            plain_spans[token] = {(uint32_t) arena.size(), (uint32_t) n_plain};
+            arena.append(buf.data(), n_plain);
+        }
+    }
+    arena.shrink_to_fit();
+
+    LOG_INF("%s: %d tokens, %.1f KiB\n", __func__, n_vocab, memoryUsage() / 1024.0);
+}
+
+bool LlamaPieceTable::isEmpty() const {
+    return special_spans.empty();
+}
+
+std::string_view LlamaPieceTable::piece(llama_token token, bool special) const {
+    if (token < 0 || (size_t) token >= special_spans.size()) {
+        return {};
+    }
+    const Span &span = special ? special_spans[token] : plain_spans[token];
+    return {arena.data() + span.offset, span.length};
+}
+
+size_t LlamaPieceTable::memoryUsage() const {
+    return arena.capacity() + (special_spans.capacity() + plain_spans.capacity()) * sizeof(Span);
+}
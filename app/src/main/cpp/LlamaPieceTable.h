@@ -0,0 +1,39 @@
+#ifndef LMPLAYGROUND_LLAMAPIECETABLE_H
+#define LMPLAYGROUND_LLAMAPIECETABLE_H
+
+#include "llama.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Text of every vocabulary token, rendered once per model.
+//
+// All pieces live in one contiguous arena, so detokenizing a token is a lookup returning a view
+// into it instead of a llama_token_to_piece() call and a std::string allocation. The table is
+// read-only once built and shared by every session of the model.
+class LlamaPieceTable {
+public:
+    void build(const llama_model *model);
+
+    bool isEmpty() const;
+
+    // Same text as llama_token_to_piece(ctx, token, special), empty for unknown tokens
+    std::string_view piece(llama_token token, bool special) const;
+
+    size_t memoryUsage() const;
+
+private:
+    struct Span {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    std::string arena;
+    // per token, rendered with and without special tokens
+    std::vector<Span> special_spans;
+    std::vector<Span> plain_spans;
+};
+
+#endif //LMPLAYGROUND_LLAMAPIECETABLE_H
@@ -0,0 +1,152 @@
+#include "LlamaPromptCache.h"
+#include "common.h"
+
+#include "ggml.h"
+#include "llama.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <utility>
+#include <vector>
+
+static const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+static const uint64_t FNV_PRIME        = 0x100000001b3ULL;
+
+// The head of the file holds the GGUF metadata and tensor infos. For large vocabularies it
+// is mostly tokenizer data, so the weights are fingerprinted by samples across the tensor
+// data as well: requants of the same model with the same types differ only there.
+static const size_t MODEL_HASH_BYTES = 1024 * 1024;
+static const size_t MODEL_HASH_SAMPLES = 64;
+static const size_t MODEL_HASH_SAMPLE_BYTES = 4096;
+
+LlamaPromptCache::LlamaPromptCache(std::string directory_arg) : directory(std::move(directory_arg)) {
+    if (!directory.empty() && directory.back() != '/') {
+        directory += '/';
+    }
+    if (!directory.empty() && !fs_create_directory_with_parents(directory)) {
+        LOG_WRN("%s: failed to create prompt cache directory %s\n", __func__, directory.c_str());
+        directory.clear();
+    }
+}
+
+bool LlamaPromptCache::isEnabled() const {
+    return !directory.empty();
+}
+
+std::string LlamaPromptCache::getPath(uint64_t model_hash,
+                                      const std::string &chat_template,
+                                      const LlamaPromptCacheLayout &layout,
+                                      const std::vector<llama_token> &tokens) const {
+    uint64_t key = hash(&model_hash, sizeof(model_hash), FNV_OFFSET_BASIS);
+    key = hash(chat_template.data(), chat_template.size(), key);
+    // a state of another cell layout would only fail inside llama_state_load_file()
+    const int32_t fields[] = {(int32_t) layout.type_k, (int32_t) layout.type_v, (int32_t) layout.n_ctx,
+                              layout.flash_attn ? 1 : 0};
+    key = hash(fields, sizeof(fields), key);
+    key = hash(tokens.data(), tokens.size() * sizeof(llama_token), key);
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".bin", key);
+    return directory + name;
+}
+
+bool LlamaPromptCache::load(llama_context *ctx, const std::string &path, const std::vector<llama_token> &tokens) const {
+    if (!isEnabled()) {
+        return false;
+    }
+    std::ifstream file(path, std::ios::binary);
+    if (!file.good()) {
+        return false;
+    }
+    file.close();
+
+    std::vector<llama_token> cached(llama_n_ctx(ctx));
+    size_t n_cached = 0;
+    if (!llama_state_load_file(ctx, path.c_str(), cached.data(), cached.size(), &n_cached)) {
+        LOG_WRN("%s: failed to load prompt cache %s\n", __func__, path.c_str());
+        llama_kv_cache_clear(ctx);
+        return false;
+    }
+    cached.resize(n_cached);
+
+    // a hash collision must never leave foreign cells in the cache
+    if (cached != tokens) {
+        LOG_WRN("%s: prompt cache %s does not match the prompt\n", __func__, path.c_str());
+        llama_kv_cache_clear(ctx);
+        return false;
+    }
+    return true;
+}
+
+bool LlamaPromptCache::save(llama_context *ctx, const std::string &path, const std::vector<llama_token> &tokens) const {
+    if (!isEnabled()) {
+        return false;
+    }
+    // write to a temporary file first, so a crash never leaves a truncated state behind
+    const std::string tmp_path = path + ".tmp";
+    if (!llama_state_save_file(ctx, tmp_path.c_str(), tokens.data(), tokens.size())) {
+        LOG_WRN("%s: failed to save prompt cache %s\n", __func__, path.c_str());
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+uint64_t LlamaPromptCache::hash(const void *data, size_t size, uint64_t seed) {
+    const auto *bytes = static_cast<const uint8_t *>(data);
+    uint64_t value = seed;
+    for (size_t i = 0; i < size; i++) {
+        value ^= bytes[i];
+        value *= FNV_PRIME;
+    }
+    return value;
+}
+
+uint64_t LlamaPromptCache::hashModelFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.good()) {
+        return 0;
+    }
+    const uint64_t file_size = (uint64_t) file.tellg();
+    file.seekg(0);
+
+    std::vector<char> buffer(std::min<uint64_t>(file_size, MODEL_HASH_BYTES));
+    file.read(buffer.data(), (std::streamsize) buffer.size());
+
+    uint64_t value = hash(&file_size, sizeof(file_size), FNV_OFFSET_BASIS);
+    value = hash(buffer.data(), (size_t) file.gcount(), value);
+
+    // only the metadata is read, not the tensor data
+    gguf_init_params gguf_params = {/* .no_alloc = */ true, /* .ctx = */ nullptr};
+    gguf_context *gguf = gguf_init_from_file(path.c_str(), gguf_params);
+    if (gguf == nullptr) {
+        LOG_WRN("%s: failed to read the GGUF header of %s\n", __func__, path.c_str());
+        return value;
+    }
+    const uint64_t data_offset = gguf_get_data_offset(gguf);
+    gguf_free(gguf);
+    value = hash(&data_offset, sizeof(data_offset), value);
+    if (data_offset >= file_size) {
+        return value;
+    }
+
+    // samples at a fixed stride, the last one ends at the end of the file
+    const uint64_t data_size = file_size - data_offset;
+    const uint64_t sample_size = std::min<uint64_t>(data_size, MODEL_HASH_SAMPLE_BYTES);
+    const uint64_t stride = (data_size - sample_size) / (MODEL_HASH_SAMPLES - 1);
+    buffer.resize(sample_size);
+    file.clear();
+    for (size_t i = 0; i < MODEL_HASH_SAMPLES; i++) {
+        file.seekg((std::streamoff) (data_offset + i * stride));
+        file.read(buffer.data(), (std::streamsize) sample_size);
+        value = hash(buffer.data(), (size_t) file.gcount(), value);
+    }
+    return value;
+}
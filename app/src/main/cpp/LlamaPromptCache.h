@@ -0,0 +1,48 @@
+#ifndef LMPLAYGROUND_LLAMAPROMPTCACHE_H
+#define LMPLAYGROUND_LLAMAPROMPTCACHE_H
+
+#include "llama.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What decides the shape of the KV cells of a context, part of a prompt cache key
+struct LlamaPromptCacheLayout {
+    ggml_type type_k;
+    ggml_type type_v;
+    uint32_t n_ctx;
+    bool flash_attn;
+};
+
+// On-disk store of KV states for already ingested system prompts.
+// Entries are keyed by (model file hash, chat template, KV cache layout, prompt tokens), so a
+// state is only ever restored into a context that would have produced exactly the same cells.
+class LlamaPromptCache {
+public:
+    LlamaPromptCache() = default;
+
+    explicit LlamaPromptCache(std::string directory);
+
+    bool isEnabled() const;
+
+    std::string getPath(uint64_t model_hash,
+                        const std::string &chat_template,
+                        const LlamaPromptCacheLayout &layout,
+                        const std::vector<llama_token> &tokens) const;
+
+    // Restores the state saved at `path` if it was produced from exactly `tokens`
+    bool load(llama_context *ctx, const std::string &path, const std::vector<llama_token> &tokens) const;
+
+    bool save(llama_context *ctx, const std::string &path, const std::vector<llama_token> &tokens) const;
+
+    static uint64_t hash(const void *data, size_t size, uint64_t seed);
+
+    // Cheap fingerprint of a model file: its size, the GGUF metadata and samples of the tensor data
+    static uint64_t hashModelFile(const std::string &path);
+
+private:
+    std::string directory;
+};
+
+#endif //LMPLAYGROUND_LLAMAPROMPTCACHE_H
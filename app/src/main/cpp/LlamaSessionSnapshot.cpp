@@ -0,0 +1,408 @@
+#include "LlamaCpp.h"
+#include "common.h"
+
+#include "llama.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Snapshot file layout (native byte order):
+//
+//   uint32 magic, uint32 version
+//   records: uint32 type, uint64 size, payload
+//
+// A KV record holds llama_state_seq data for the cells written since the previous
+// record, a STATE record holds the session counters, the tails of embd_inp and
+// chat_msgs and the turn spans. Records are only ever appended; on restore all KV records are applied
+// in order and the last complete STATE record wins.
+
+static const uint32_t SNAPSHOT_MAGIC   = 0x53504d4c; // "LMPS"
+static const uint32_t SNAPSHOT_VERSION = 2;
+
+enum snapshot_record_type : uint32_t {
+    SNAPSHOT_RECORD_KV    = 1,
+    SNAPSHOT_RECORD_STATE = 2,
+};
+
+namespace {
+
+class SnapshotWriter {
+public:
+    std::vector<uint8_t> data;
+
+    void u8(uint8_t value) {
+        data.push_back(value);
+    }
+
+    void u32(uint32_t value) {
+        bytes(&value, sizeof(value));
+    }
+
+    void i32(int32_t value) {
+        bytes(&value, sizeof(value));
+    }
+
+    void u64(uint64_t value) {
+        bytes(&value, sizeof(value));
+    }
+
+    void tokens(const llama_token *tokens, size_t count) {
+        u32((uint32_t) count);
+        bytes(tokens, count * sizeof(llama_token));
+    }
+
+    void string(const std::string &value) {
+        u32((uint32_t) value.size());
+        bytes(value.data(), value.size());
+    }
+
+    void bytes(const void *src, size_t size) {
+        const auto *begin = static_cast<const uint8_t *>(src);
+        data.insert(data.end(), begin, begin + size);
+    }
+
+    void record(uint32_t type, const std::vector<uint8_t> &payload) {
+        u32(type);
+        u64(payload.size());
+        data.insert(data.end(), payload.begin(), payload.end());
+    }
+};
+
+class SnapshotReader {
+public:
+    SnapshotReader(const uint8_t *data, size_t size) : data(data), size(size) {}
+
+    bool ok = true;
+
+    size_t remaining() const {
+        return size - pos;
+    }
+
+    uint8_t u8() {
+        uint8_t value = 0;
+        bytes(&value, sizeof(value));
+        return value;
+    }
+
+    uint32_t u32() {
+        uint32_t value = 0;
+        bytes(&value, sizeof(value));
+        return value;
+    }
+
+    int32_t i32() {
+        int32_t value = 0;
+        bytes(&value, sizeof(value));
+        return value;
+    }
+
+    uint64_t u64() {
+        uint64_t value = 0;
+        bytes(&value, sizeof(value));
+        return value;
+    }
+
+    void tokens(std::vector<llama_token> &out) {
+        const uint32_t count = u32();
+        if (!ok || remaining() < (size_t) count * sizeof(llama_token)) {
+            ok = false;
+            return;
+        }
+        const size_t offset = out.size();
+        out.resize(offset + count);
+        bytes(out.data() + offset, count * sizeof(llama_token));
+    }
+
+    std::string string() {
+        const uint32_t length = u32();
+        if (!ok || remaining() < length) {
+            ok = false;
+            return {};
+        }
+        std::string value(reinterpret_cast<const char *>(data + pos), length);
+        pos += length;
+        return value;
+    }
+
+    const uint8_t *skip(size_t count) {
+        if (!ok || remaining() < count) {
+            ok = false;
+            return nullptr;
+        }
+        const uint8_t *begin = data + pos;
+        pos += count;
+        return begin;
+    }
+
+private:
+    const uint8_t *data;
+    size_t size;
+    size_t pos = 0;
+
+    void bytes(void *dst, size_t count) {
+        if (!ok || remaining() < count) {
+            ok = false;
+            return;
+        }
+        memcpy(dst, data + pos, count);
+        pos += count;
+    }
+};
+
+} // namespace
+
+bool LlamaGenerationSession::saveSnapshot(const std::string &path) {
+    if (ctx == nullptr) {
+        return false;
+    }
+    // cells of accepted but not yet generated draft tokens are not part of the conversation
+    discardSpeculation();
+
+    // appended records are only meaningful on top of the file we wrote last time
+    const bool rewrite = snapshot_needs_rewrite || path != snapshot_path;
+    return writeSnapshot(path, rewrite);
+}
+
+bool LlamaGenerationSession::writeSnapshot(const std::string &path, bool rewrite) {
+    const int from_pos = rewrite ? 0 : snapshot_n_past;
+    const size_t from_embd_inp = rewrite ? 0 : snapshot_n_embd_inp;
+    const size_t from_chat_msgs = rewrite ? 0 : snapshot_n_chat_msgs;
+
+    SnapshotWriter out;
+    if (rewrite) {
+        out.u32(SNAPSHOT_MAGIC);
+        out.u32(SNAPSHOT_VERSION);
+    }
+
+    // export only the new cells: tag them with the scratch sequence and serialize that one
+    if (n_past > from_pos) {
+        llama_kv_cache_seq_rm(ctx, SNAPSHOT_SCRATCH_SEQ, -1, -1);
+        llama_kv_cache_seq_cp(ctx, 0, SNAPSHOT_SCRATCH_SEQ, from_pos, n_past);
+
+        std::vector<uint8_t> kv(llama_state_seq_get_size(ctx, SNAPSHOT_SCRATCH_SEQ));
+        const size_t n_written = llama_state_seq_get_data(ctx, kv.data(), kv.size(), SNAPSHOT_SCRATCH_SEQ);
+        llama_kv_cache_seq_rm(ctx, SNAPSHOT_SCRATCH_SEQ, -1, -1);
+        if (n_written == 0) {
+            LOG_ERR("%s: failed to serialize the KV cache\n", __func__);
+            return false;
+        }
+        kv.resize(n_written);
+        out.record(SNAPSHOT_RECORD_KV, kv);
+    }
+
+    SnapshotWriter state;
+    state.i32(n_past);
+    state.i32(n_remain);
+    state.i32(n_consumed);
+    state.i32(n_prompt_tokens);
+    state.i32(ga_i);
+    state.u8(is_interacting);
+    state.u8(input_echo);
+    state.u8(need_insert_eot);
+    state.u32((uint32_t) from_embd_inp);
+    state.tokens(embd_inp.data() + from_embd_inp, embd_inp.size() - from_embd_inp);
+    state.tokens(embd.data(), embd.size());
+    state.tokens(sampler_prev.data(), sampler_prev.size());
+    state.i32(n_sampler_since_reset);
+    state.u32((uint32_t) from_chat_msgs);
+    state.u32((uint32_t) (chat_msgs.size() - from_chat_msgs));
+    for (size_t i = from_chat_msgs; i < chat_msgs.size(); i++) {
+        state.string(chat_msgs[i].role);
+        state.string(chat_msgs[i].content);
+    }
+    state.string(assistant_ss.str());
+    state.u32((uint32_t) turns.size());
+    for (const auto &turn : turns) {
+        state.i32(turn.pos_start);
+        state.u32((uint32_t) turn.msg_start);
+    }
+    out.record(SNAPSHOT_RECORD_STATE, state.data);
+
+    // a full snapshot replaces the old file atomically, an incremental one is appended
+    const std::string write_path = rewrite ? path + ".tmp" : path;
+    FILE *file = fopen(write_path.c_str(), rewrite ? "wb" : "ab");
+    if (file == nullptr) {
+        LOG_ERR("%s: failed to open %s\n", __func__, write_path.c_str());
+        return false;
+    }
+    const bool written = fwrite(out.data.data(), 1, out.data.size(), file) == out.data.size();
+    const bool closed = fclose(file) == 0;
+    if (!written || !closed || (rewrite && std::rename(write_path.c_str(), path.c_str()) != 0)) {
+        LOG_ERR("%s: failed to write %s\n", __func__, path.c_str());
+        // the file no longer matches our bookkeeping
+        snapshot_needs_rewrite = true;
+        return false;
+    }
+
+    LOG_DBG("%s: %s %zu bytes to %s\n", __func__, rewrite ? "wrote" : "appended", out.data.size(), path.c_str());
+
+    snapshot_path = path;
+    snapshot_n_past = n_past;
+    snapshot_n_embd_inp = embd_inp.size();
+    snapshot_n_chat_msgs = chat_msgs.size();
+    snapshot_needs_rewrite = false;
+    return true;
+}
+
+bool LlamaGenerationSession::restoreSnapshot(const std::string &path) {
+    if (ctx == nullptr) {
+        return false;
+    }
+
+    std::vector<uint8_t> data;
+    {
+        FILE *file = fopen(path.c_str(), "rb");
+        if (file == nullptr) {
+            LOG_ERR("%s: failed to open %s\n", __func__, path.c_str());
+            return false;
+        }
+        uint8_t buffer[64 * 1024];
+        size_t n_read;
+        while ((n_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            data.insert(data.end(), buffer, buffer + n_read);
+        }
+        fclose(file);
+    }
+
+    SnapshotReader in(data.data(), data.size());
+    if (in.u32() != SNAPSHOT_MAGIC || in.u32() != SNAPSHOT_VERSION || !in.ok) {
+        LOG_ERR("%s: %s is not a session snapshot\n", __func__, path.c_str());
+        return false;
+    }
+
+    llama_kv_cache_clear(ctx);
+    embd_inp.clear();
+    embd.clear();
+    spec_history.clear();
+    spec_accepted.clear();
+    spec_n_in_kv = 0;
+    chat_msgs.clear();
+    session_tokens.clear();
+    n_session_consumed = 0;
+    need_save_prompt_cache = false;
+
+    bool has_state = false;
+    while (in.remaining() > 0) {
+        const uint32_t type = in.u32();
+        const uint64_t size = in.u64();
+        const uint8_t *payload = in.skip(size);
+        if (!in.ok) {
+            // an interrupted append leaves a truncated last record, everything before it is valid
+            LOG_WRN("%s: ignoring truncated record at the end of %s\n", __func__, path.c_str());
+            break;
+        }
+
+        if (type == SNAPSHOT_RECORD_KV) {
+            if (llama_state_seq_set_data(ctx, payload, size, SNAPSHOT_SCRATCH_SEQ) == 0) {
+                LOG_ERR("%s: failed to restore the KV cache from %s\n", __func__, path.c_str());
+                llama_kv_cache_clear(ctx);
+                return false;
+            }
+            llama_kv_cache_seq_cp(ctx, SNAPSHOT_SCRATCH_SEQ, 0, -1, -1);
+            llama_kv_cache_seq_rm(ctx, SNAPSHOT_SCRATCH_SEQ, -1, -1);
+        } else if (type == SNAPSHOT_RECORD_STATE) {
+            SnapshotReader state(payload, size);
+            const int32_t state_n_past = state.i32();
+            const int32_t state_n_remain = state.i32();
+            const int32_t state_n_consumed = state.i32();
+            const int32_t state_n_prompt_tokens = state.i32();
+            const int32_t state_ga_i = state.i32();
+            const bool state_is_interacting = state.u8() != 0;
+            const bool state_input_echo = state.u8() != 0;
+            const bool state_need_insert_eot = state.u8() != 0;
+
+            const uint32_t embd_inp_offset = state.u32();
+            if (embd_inp_offset != embd_inp.size()) {
+                state.ok = false;
+            }
+            std::vector<llama_token> state_embd_inp(embd_inp);
+            state.tokens(state_embd_inp);
+            std::vector<llama_token> state_embd;
+            state.tokens(state_embd);
+            std::vector<llama_token> state_sampler_prev;
+            state.tokens(state_sampler_prev);
+            const int32_t state_n_sampler_since_reset = state.i32();
+
+            const uint32_t chat_msgs_offset = state.u32();
+            const uint32_t n_chat_msgs = state.u32();
+            if (chat_msgs_offset != chat_msgs.size()) {
+                state.ok = false;
+            }
+            std::vector<llama_chat_msg> state_chat_msgs(chat_msgs);
+            for (uint32_t i = 0; i < n_chat_msgs && state.ok; i++) {
+                std::string role = state.string();
+                std::string content = state.string();
+                state_chat_msgs.push_back({std::move(role), std::move(content)});
+            }
+            std::string state_assistant = state.string();
+            const uint32_t n_turns = state.u32();
+            std::vector<TurnSpan> state_turns;
+            for (uint32_t i = 0; i < n_turns && state.ok; i++) {
+                const int32_t pos_start = state.i32();
+                const uint32_t msg_start = state.u32();
+                state_turns.push_back({pos_start, msg_start});
+            }
+
+            if (!state.ok) {
+                LOG_ERR("%s: corrupted state record in %s\n", __func__, path.c_str());
+                llama_kv_cache_clear(ctx);
+                return false;
+            }
+
+            n_past = state_n_past;
+            n_remain = state_n_remain;
+            n_consumed = state_n_consumed;
+            n_prompt_tokens = state_n_prompt_tokens;
+            ga_i = state_ga_i;
+            is_interacting = state_is_interacting;
+            input_echo = state_input_echo;
+            need_insert_eot = state_need_insert_eot;
+            embd_inp = std::move(state_embd_inp);
+            embd = std::move(state_embd);
+            sampler_prev = std::move(state_sampler_prev);
+            n_sampler_since_reset = std::min(state_n_sampler_since_reset, (int32_t) sampler_prev.size());
+            chat_msgs = std::move(state_chat_msgs);
+            assistant_ss.str(state_assistant);
+            assistant_ss.seekp(0, std::ios_base::end);
+            turns = std::move(state_turns);
+            has_state = true;
+        }
+    }
+
+    if (!has_state) {
+        LOG_ERR("%s: %s has no session state\n", __func__, path.c_str());
+        llama_kv_cache_clear(ctx);
+        return false;
+    }
+
+    // cells of a KV record whose STATE record never made it to disk
+    llama_kv_cache_seq_rm(ctx, 0, n_past, -1);
+
+    // replay the sampler history: tokens before the last reset only feed the
+    // previous-token ring, the ones after it also feed the penalties
+    const size_t n_before_reset = sampler_prev.size() - n_sampler_since_reset;
+    for (size_t i = 0; i < n_before_reset; i++) {
+        gpt_sampler_accept(smpl, sampler_prev[i], /* accept_grammar= */ false);
+    }
+    gpt_sampler_reset(smpl);
+    fast_sampler.reset(gpt_sampler_get_seed(smpl));
+    for (size_t i = n_before_reset; i < sampler_prev.size(); i++) {
+        gpt_sampler_accept(smpl, sampler_prev[i], /* accept_grammar= */ false);
+    }
+    // the grammar state is not part of the snapshot
+    grammar_sampler.start(nullptr);
+
+    LOG_INF("%s: restored %d tokens and %zu messages from %s\n", __func__, n_past, chat_msgs.size(), path.c_str());
+
+    snapshot_path = path;
+    snapshot_n_past = n_past;
+    snapshot_n_embd_inp = embd_inp.size();
+    snapshot_n_chat_msgs = chat_msgs.size();
+    snapshot_needs_rewrite = false;
+    checkpoint.valid = false;
+    return true;
+}
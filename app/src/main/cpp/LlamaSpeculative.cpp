@@ -0,0 +1,198 @@
+#include "LlamaSpeculative.h"
+#include "common.h"
+
+#include "llama.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Number of leading vocabulary entries compared between the target and the draft model
+static const int32_t VOCAB_CHECK_TOKENS = 256;
+
+static const uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+static const uint64_t FNV_PRIME        = 0x100000001b3ULL;
+
+LlamaDraftModelProposer::~LlamaDraftModelProposer() {
+    if (ctx != nullptr) {
+        llama_batch_free(batch);
+        llama_free(ctx);
+    }
+}
+
+bool LlamaDraftModelProposer::init(llama_model *draft_model,
+                                   const gpt_params &params,
+                                   ggml_threadpool *threadpool,
+                                   ggml_threadpool *threadpool_batch,
+                                   ggml_abort_callback abort_callback,
+                                   void *abort_callback_data) {
+    model = draft_model;
+
+    auto cparams = llama_context_params_from_gpt_params(params);
+    cparams.n_ctx = N_CTX;
+    cparams.n_batch = std::min<uint32_t>(cparams.n_batch, N_CTX);
+    cparams.n_ubatch = std::min<uint32_t>(cparams.n_ubatch, N_CTX);
+    cparams.n_seq_max = 1;
+    ctx = llama_new_context_with_model(model, cparams);
+    if (ctx == nullptr) {
+        LOG_ERR("%s: failed to create draft context\n", __func__);
+        return false;
+    }
+    // the draft runs strictly between target decodes, so it can borrow the session's threads
+    llama_attach_threadpool(ctx, threadpool, threadpool_batch);
+    // a cancelled turn also stops a draft decode, which then just proposes nothing
+    llama_set_abort_callback(ctx, abort_callback, abort_callback_data);
+
+    n_ctx = (int32_t) llama_n_ctx(ctx);
+    n_batch = (int32_t) llama_n_batch(ctx);
+    batch = llama_batch_init(n_batch, 0, 1);
+    return true;
+}
+
+std::vector<llama_token> LlamaDraftModelProposer::propose(const std::vector<llama_token> &history,
+                                                          llama_token last,
+                                                          int32_t n_draft) {
+    const size_t n_total = history.size() + 1;
+    auto token_at = [&](size_t i) {
+        return i < history.size() ? history[i] : last;
+    };
+
+    // the draft only needs recent context, keep a window that leaves room for the drafts
+    if (offset >= n_total || n_total - offset + n_draft >= (size_t) n_ctx) {
+        const size_t n_window = std::max<size_t>(n_ctx / 2, 1);
+        offset = n_total > n_window ? n_total - n_window : 0;
+        cached.clear();
+        llama_kv_cache_clear(ctx);
+    }
+
+    // reuse the cells matching the history, the drafts rejected last time are dropped here
+    size_t n_common = 0;
+    while (n_common < cached.size() && offset + n_common < n_total && cached[n_common] == token_at(offset + n_common)) {
+        n_common++;
+    }
+    // the logits of the last token are needed, so it is decoded again if it is already cached
+    if (offset + n_common == n_total) {
+        n_common--;
+    }
+    llama_kv_cache_seq_rm(ctx, 0, (llama_pos) n_common, -1);
+    cached.resize(n_common);
+
+    for (size_t i = offset + n_common; i < n_total;) {
+        llama_batch_clear(batch);
+        for (; i < n_total && batch.n_tokens < n_batch; i++) {
+            llama_batch_add(batch, token_at(i), (llama_pos) cached.size(), {0}, i == n_total - 1);
+            cached.push_back(token_at(i));
+        }
+        if (llama_decode(ctx, batch)) {
+            LOG_ERR("%s: failed to decode the draft context\n", __func__);
+            cached.clear();
+            llama_kv_cache_clear(ctx);
+            return {};
+        }
+    }
+
+    const int32_t n_vocab = llama_n_vocab(model);
+    std::vector<llama_token> draft;
+    for (int32_t k = 0; k < n_draft; k++) {
+        const float *logits = llama_get_logits_ith(ctx, -1);
+        const llama_token best = (llama_token) (std::max_element(logits, logits + n_vocab) - logits);
+        draft.push_back(best);
+        if (llama_token_is_eog(model, best) || k == n_draft - 1) {
+            break;
+        }
+
+        llama_batch_clear(batch);
+        llama_batch_add(batch, best, (llama_pos) cached.size(), {0}, true);
+        if (llama_decode(ctx, batch)) {
+            break;
+        }
+        cached.push_back(best);
+    }
+    return draft;
+}
+
+const char *LlamaDraftModelProposer::name() const {
+    return "draft model";
+}
+
+bool LlamaDraftModelProposer::isCompatible(const llama_model *target_model, const llama_model *draft_model) {
+    if (llama_n_vocab(target_model) != llama_n_vocab(draft_model)) {
+        return false;
+    }
+    if (llama_token_bos(target_model) != llama_token_bos(draft_model) ||
+        llama_token_eos(target_model) != llama_token_eos(draft_model)) {
+        return false;
+    }
+    const int32_t n_check = std::min(llama_n_vocab(target_model), VOCAB_CHECK_TOKENS);
+    for (llama_token i = 0; i < n_check; i++) {
+        if (strcmp(llama_token_get_text(target_model, i), llama_token_get_text(draft_model, i)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+LlamaNgramProposer::LlamaNgramProposer(int32_t n_min_arg, int32_t n_max_arg) :
+        n_min(std::max(n_min_arg, 1)),
+        n_max(std::max(n_max_arg, n_min_arg)) {
+}
+
+uint64_t LlamaNgramProposer::key(const llama_token *tokens, int32_t n) {
+    // the length is part of the key, so n-grams of all sizes share one map
+    uint64_t value = (FNV_OFFSET_BASIS ^ (uint64_t) n) * FNV_PRIME;
+    for (int32_t i = 0; i < n; i++) {
+        value = (value ^ (uint32_t) tokens[i]) * FNV_PRIME;
+    }
+    return value;
+}
+
+void LlamaNgramProposer::update(const std::vector<llama_token> &history) {
+    // the history only shrinks when speculation is rolled back or a snapshot is restored
+    if (history.size() < indexed.size() ||
+        (!indexed.empty() && history[indexed.size() - 1] != indexed.back())) {
+        indexed.clear();
+        index.clear();
+    }
+    for (size_t p = indexed.size(); p < history.size(); p++) {
+        indexed.push_back(history[p]);
+        for (int32_t n = n_min; n <= n_max && n <= (int32_t) p + 1; n++) {
+            index[key(&indexed[p + 1 - n], n)] = (int32_t) p;
+        }
+    }
+}
+
+std::vector<llama_token> LlamaNgramProposer::propose(const std::vector<llama_token> &history,
+                                                     llama_token last,
+                                                     int32_t n_draft) {
+    update(history);
+
+    // the query is the tail of history + last, which is not part of the index yet
+    std::vector<llama_token> tail(indexed.end() - std::min<size_t>(indexed.size(), n_max - 1), indexed.end());
+    tail.push_back(last);
+
+    // the longest n-gram with an earlier occurrence wins
+    for (int32_t n = std::min<int32_t>(n_max, (int32_t) tail.size()); n >= n_min; n--) {
+        const llama_token *query = tail.data() + tail.size() - n;
+        auto it = index.find(key(query, n));
+        if (it == index.end()) {
+            continue;
+        }
+        const int32_t end = it->second;
+        if (!std::equal(query, query + n, indexed.begin() + end + 1 - n)) {
+            // hash collision
+            continue;
+        }
+
+        // what followed the occurrence; the token right after the most recent one may be `last`
+        std::vector<llama_token> draft;
+        for (int32_t p = end + 1; p < (int32_t) indexed.size() + 1 && (int32_t) draft.size() < n_draft; p++) {
+            draft.push_back(p < (int32_t) indexed.size() ? indexed[p] : last);
+        }
+        return draft;
+    }
+    return {};
+}
+
+const char *LlamaNgramProposer::name() const {
+    return "prompt lookup";
+}
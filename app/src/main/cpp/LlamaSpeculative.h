@@ -0,0 +1,87 @@
+#ifndef LMPLAYGROUND_LLAMASPECULATIVE_H
+#define LMPLAYGROUND_LLAMASPECULATIVE_H
+
+#include "common.h"
+
+#include <unordered_map>
+#include <vector>
+
+// Source of draft tokens for speculative decoding. LlamaGenerationSession verifies the
+// proposal with one batched decode on the target model, so a proposer only affects speed,
+// never the generated text.
+class LlamaDraftProposer {
+public:
+    virtual ~LlamaDraftProposer() = default;
+
+    // Proposes up to `n_draft` tokens following `history` + `last`, where `history` is every
+    // token decoded into the target context so far and `last` is the sampled one that is not
+    virtual std::vector<llama_token> propose(const std::vector<llama_token> &history, llama_token last, int32_t n_draft) = 0;
+
+    virtual const char *name() const = 0;
+};
+
+// Drafts greedily with a smaller model of the same family (the vocabularies must match)
+class LlamaDraftModelProposer : public LlamaDraftProposer {
+public:
+    // The draft only sees a sliding window of recent tokens, so its context stays small
+    // whatever the context of the target is
+    static constexpr int32_t N_CTX = 512;
+
+    LlamaDraftModelProposer() = default;
+
+    ~LlamaDraftModelProposer() override;
+
+    bool init(llama_model *draft_model,
+              const gpt_params &params,
+              ggml_threadpool *threadpool,
+              ggml_threadpool *threadpool_batch,
+              ggml_abort_callback abort_callback,
+              void *abort_callback_data);
+
+    std::vector<llama_token> propose(const std::vector<llama_token> &history, llama_token last, int32_t n_draft) override;
+
+    const char *name() const override;
+
+    // True if drafts of `draft_model` can be verified by `target_model`
+    static bool isCompatible(const llama_model *target_model, const llama_model *draft_model);
+
+private:
+    llama_model *model = nullptr;
+    llama_context *ctx = nullptr;
+    llama_batch batch = {};
+    int32_t n_ctx = 0;
+    int32_t n_batch = 0;
+
+    // tokens in the draft KV cache, they mirror history[offset, ...)
+    std::vector<llama_token> cached;
+    size_t offset = 0;
+};
+
+// Prompt lookup: drafts by finding the most recent earlier occurrence of the last few tokens
+// in the session history (system prompt, user messages and replies) and proposing what
+// followed it. Costs no model evaluation, which pays off when replies copy spans of the
+// input, e.g. summaries or rewrites, and needs no memory for a second model.
+class LlamaNgramProposer : public LlamaDraftProposer {
+public:
+    LlamaNgramProposer(int32_t n_min, int32_t n_max);
+
+    std::vector<llama_token> propose(const std::vector<llama_token> &history, llama_token last, int32_t n_draft) override;
+
+    const char *name() const override;
+
+private:
+    static uint64_t key(const llama_token *tokens, int32_t n);
+
+    // Adds the n-grams ending at history[indexed.size(), ...) to the index
+    void update(const std::vector<llama_token> &history);
+
+    int32_t n_min;
+    int32_t n_max;
+
+    // copy of the indexed history, the index is rebuilt when the history is rewritten
+    std::vector<llama_token> indexed;
+    // n-gram key -> position of its last token in the most recent occurrence
+    std::unordered_map<uint64_t, int32_t> index;
+};
+
+#endif //LMPLAYGROUND_LLAMASPECULATIVE_H
@@ -0,0 +1,94 @@
+#include "LlamaStopMatcher.h"
+#include "common.h"
+
+#include <algorithm>
+#include <deque>
+
+LlamaStopMatcher::LlamaStopMatcher() : nodes(1) {
+}
+
+LlamaStopMatcher::LlamaStopMatcher(const std::vector<std::string> &stop_strings, const llama_context *ctx) : nodes(1) {
+    // trie of the stop strings
+    for (size_t i = 0; i < stop_strings.size(); i++) {
+        const std::string &text = stop_strings[i];
+        if (text.empty()) {
+            continue;
+        }
+        int32_t node = 0;
+        for (unsigned char byte : text) {
+            int32_t next = child(node, byte);
+            if (next < 0) {
+                next = (int32_t) nodes.size();
+                auto &children = nodes[node].children;
+                children.insert(std::upper_bound(children.begin(), children.end(), std::make_pair(byte, INT32_MIN)),
+                                {byte, next});
+                nodes.emplace_back();
+            }
+            node = next;
+        }
+        if (nodes[node].match < 0) {
+            nodes[node].match = (int32_t) i;
+        }
+
+        if (ctx != nullptr) {
+            const std::vector<llama_token> tokens = ::llama_tokenize(ctx, text, false, true);
+            if (tokens.size() == 1) {
+                stop_tokens.insert(tokens[0]);
+            }
+        }
+    }
+
+    // failure links in breadth-first order, so the link of a node's parent is always known
+    std::deque<int32_t> queue;
+    for (const auto &edge : nodes[0].children) {
+        nodes[edge.second].fail = 0;
+        queue.push_back(edge.second);
+    }
+    while (!queue.empty()) {
+        const int32_t node = queue.front();
+        queue.pop_front();
+        if (nodes[node].match < 0) {
+            nodes[node].match = nodes[nodes[node].fail].match;
+        }
+        for (const auto &edge : nodes[node].children) {
+            int32_t fail = nodes[node].fail;
+            int32_t next = child(fail, edge.first);
+            while (next < 0 && fail != 0) {
+                fail = nodes[fail].fail;
+                next = child(fail, edge.first);
+            }
+            nodes[edge.second].fail = next >= 0 ? next : 0;
+            queue.push_back(edge.second);
+        }
+    }
+}
+
+bool LlamaStopMatcher::empty() const {
+    return nodes.size() == 1 && stop_tokens.empty();
+}
+
+int32_t LlamaStopMatcher::child(int32_t node, uint8_t byte) const {
+    const auto &children = nodes[node].children;
+    auto it = std::lower_bound(children.begin(), children.end(), std::make_pair(byte, INT32_MIN));
+    return it != children.end() && it->first == byte ? it->second : -1;
+}
+
+int32_t LlamaStopMatcher::feed(int32_t &state, const char *data, size_t size) const {
+    for (size_t i = 0; i < size; i++) {
+        const auto byte = (uint8_t) data[i];
+        int32_t next = child(state, byte);
+        while (next < 0 && state != 0) {
+            state = nodes[state].fail;
+            next = child(state, byte);
+        }
+        state = next >= 0 ? next : 0;
+        if (nodes[state].match >= 0) {
+            return nodes[state].match;
+        }
+    }
+    return -1;
+}
+
+bool LlamaStopMatcher::isStopToken(llama_token token) const {
+    return stop_tokens.count(token) > 0;
+}
@@ -0,0 +1,51 @@
+#ifndef LMPLAYGROUND_LLAMASTOPMATCHER_H
+#define LMPLAYGROUND_LLAMASTOPMATCHER_H
+
+#include "llama.h"
+
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Detects stop strings in streamed output.
+//
+// The stop strings are compiled once into an Aho-Corasick automaton over bytes, and the output
+// is fed piece by piece as it is generated, so every byte is looked at once no matter how many
+// stop strings there are or how they straddle token boundaries. The automaton is immutable
+// after construction; each stream keeps its own state, so one matcher serves many streams.
+// Stop strings that are a single (special) token are also kept in a token set.
+class LlamaStopMatcher {
+public:
+    // State of a stream that has not seen any output yet
+    static const int32_t INITIAL_STATE = 0;
+
+    LlamaStopMatcher();
+
+    // `ctx` tokenizes the stop strings to find the single token ones, it may be nullptr
+    LlamaStopMatcher(const std::vector<std::string> &stop_strings, const llama_context *ctx);
+
+    bool empty() const;
+
+    // Advances `state` over `size` bytes, returns the index of the first stop string that
+    // ends in them or -1
+    int32_t feed(int32_t &state, const char *data, size_t size) const;
+
+    bool isStopToken(llama_token token) const;
+
+private:
+    struct Node {
+        // sorted by byte
+        std::vector<std::pair<uint8_t, int32_t>> children;
+        int32_t fail = 0;
+        // stop string ending here or at one of the suffixes reachable through `fail`, or -1
+        int32_t match = -1;
+    };
+
+    int32_t child(int32_t node, uint8_t byte) const;
+
+    std::vector<Node> nodes;
+    std::unordered_set<llama_token> stop_tokens;
+};
+
+#endif //LMPLAYGROUND_LLAMASTOPMATCHER_H
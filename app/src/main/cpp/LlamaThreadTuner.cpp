@@ -0,0 +1,291 @@
+#include "LlamaThreadTuner.h"
+#include "LlamaPromptCache.h"
+#include "common.h"
+
+#include "ggml.h"
+#include "llama.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+
+#include <unistd.h>
+
+static const uint32_t TUNE_CTX = 256;
+static const int32_t TUNE_PREFILL_TOKENS = 64;
+static const int32_t TUNE_DECODE_TOKENS = 16;
+// a single thread is never competitive and slow to measure on large models
+static const int32_t TUNE_MIN_THREADS = 2;
+// part of the cache key, profiles of an older tuner are tuned again
+static const uint32_t TUNE_VERSION = 2;
+
+static bool read_int(const std::string &path, int64_t &value) {
+    std::ifstream file(path);
+    return static_cast<bool>(file >> value);
+}
+
+static void apply_cpu_params(int32_t n_threads, const std::vector<int32_t> &cpus, cpu_params &cpu) {
+    cpu.n_threads = n_threads;
+    std::fill(std::begin(cpu.cpumask), std::end(cpu.cpumask), false);
+    for (int32_t i : cpus) {
+        if (i >= 0 && i < GGML_MAX_N_THREADS) {
+            cpu.cpumask[i] = true;
+        }
+    }
+    cpu.mask_valid = !cpus.empty();
+}
+
+bool LlamaThreadProfile::isValid() const {
+    return n_threads > 0 && n_threads_batch > 0;
+}
+
+std::vector<LlamaCpuCluster> LlamaThreadTuner::readTopology() {
+    const long n_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    std::map<int64_t, std::vector<int32_t>, std::greater<>> by_freq;
+    for (int32_t cpu = 0; cpu < n_cpus; cpu++) {
+        const std::string dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+        int64_t online = 1;
+        // cpu0 usually has no "online" file as it can not be taken offline
+        if (read_int(dir + "/online", online) && online == 0) {
+            continue;
+        }
+        int64_t max_freq_khz = 0;
+        read_int(dir + "/cpufreq/cpuinfo_max_freq", max_freq_khz);
+        by_freq[max_freq_khz].push_back(cpu);
+    }
+
+    std::vector<LlamaCpuCluster> clusters;
+    for (auto &entry : by_freq) {
+        clusters.push_back({entry.first, std::move(entry.second)});
+    }
+    return clusters;
+}
+
+LlamaThreadProfile LlamaThreadTuner::defaultProfile(const std::vector<LlamaCpuCluster> &clusters) {
+    LlamaThreadProfile profile;
+    for (size_t i = 0; i < clusters.size(); i++) {
+        if (i + 1 < clusters.size() || clusters.size() == 1) {
+            profile.cpus.insert(profile.cpus.end(), clusters[i].cpus.begin(), clusters[i].cpus.end());
+        }
+        profile.n_threads_batch += (int32_t) clusters[i].cpus.size();
+    }
+    profile.n_threads = (int32_t) profile.cpus.size();
+    if (clusters.size() <= 1) {
+        // nothing to keep the threads away from
+        profile.cpus.clear();
+    }
+    return profile;
+}
+
+LlamaThreadProfile LlamaThreadTuner::tune(llama_model *model,
+                                          const gpt_params &params,
+                                          const std::vector<LlamaCpuCluster> &clusters) {
+    LlamaThreadProfile profile = defaultProfile(clusters);
+
+    // candidate core sets: the fastest cluster, the fastest two, ...; each with the powers of two
+    // thread counts that do not fit the previous set, and all of its cores. Decode on a large
+    // homogeneous machine often peaks well below the core count.
+    struct Candidate {
+        int32_t n_threads;
+        std::vector<int32_t> cpus;
+    };
+    std::vector<Candidate> candidates;
+    std::vector<int32_t> cpus;
+    for (const auto &cluster : clusters) {
+        const auto n_prev = (int32_t) cpus.size();
+        cpus.insert(cpus.end(), cluster.cpus.begin(), cluster.cpus.end());
+        const auto n_cpus = (int32_t) cpus.size();
+        const std::vector<int32_t> mask = clusters.size() > 1 ? cpus : std::vector<int32_t>();
+        for (int32_t n_threads = TUNE_MIN_THREADS; n_threads < n_cpus; n_threads *= 2) {
+            if (n_threads > n_prev) {
+                candidates.push_back({n_threads, mask});
+            }
+        }
+        candidates.push_back({n_cpus, mask});
+    }
+    if (candidates.size() < 2) {
+        return profile;
+    }
+
+    auto cparams = llama_context_params_from_gpt_params(params);
+    cparams.n_ctx = TUNE_CTX;
+    cparams.n_batch = TUNE_PREFILL_TOKENS;
+    cparams.n_ubatch = TUNE_PREFILL_TOKENS;
+    cparams.n_seq_max = 1;
+    llama_context *ctx = llama_new_context_with_model(model, cparams);
+    if (ctx == nullptr) {
+        LOG_WRN("%s: failed to create a context, using the default profile\n", __func__);
+        return profile;
+    }
+
+    const int32_t n_vocab = llama_n_vocab(model);
+    std::vector<llama_token> tokens(TUNE_PREFILL_TOKENS + TUNE_DECODE_TOKENS);
+    for (size_t i = 0; i < tokens.size(); i++) {
+        tokens[i] = (llama_token) ((i * 7919 + 1) % n_vocab);
+    }
+
+    // pages the weights in, otherwise the first candidate pays for it
+    llama_decode(ctx, llama_batch_get_one(tokens.data(), TUNE_PREFILL_TOKENS, 0, 0));
+    llama_synchronize(ctx);
+
+    double best_prefill = 0.0;
+    double best_decode = 0.0;
+    for (const auto &candidate : candidates) {
+        cpu_params cpu = params.cpuparams;
+        apply_cpu_params(candidate.n_threads, candidate.cpus, cpu);
+
+        struct ggml_threadpool_params tpp = ggml_threadpool_params_from_cpu_params(cpu);
+        struct ggml_threadpool *threadpool = ggml_threadpool_new(&tpp);
+        if (threadpool == nullptr) {
+            continue;
+        }
+        llama_attach_threadpool(ctx, threadpool, threadpool);
+
+        // warm-up: starts the threads and settles their caches and the core frequencies
+        llama_kv_cache_clear(ctx);
+        bool ok = llama_decode(ctx, llama_batch_get_one(tokens.data(), 1, 0, 0)) == 0;
+        llama_synchronize(ctx);
+
+        llama_kv_cache_clear(ctx);
+        const int64_t t_prefill_start = ggml_time_us();
+        ok = ok && llama_decode(ctx, llama_batch_get_one(tokens.data(), TUNE_PREFILL_TOKENS, 0, 0)) == 0;
+        llama_synchronize(ctx);
+        const int64_t t_prefill_us = ggml_time_us() - t_prefill_start;
+
+        // the median token is robust against a preemption or two during the short sample
+        std::vector<int64_t> t_tokens_us;
+        for (int32_t i = 0; i < TUNE_DECODE_TOKENS && ok; i++) {
+            const int64_t t_token_start = ggml_time_us();
+            ok = llama_decode(ctx, llama_batch_get_one(&tokens[TUNE_PREFILL_TOKENS + i], 1, TUNE_PREFILL_TOKENS + i, 0)) == 0;
+            llama_synchronize(ctx);
+            t_tokens_us.push_back(ggml_time_us() - t_token_start);
+        }
+
+        llama_detach_threadpool(ctx);
+        ggml_threadpool_free(threadpool);
+        if (!ok) {
+            continue;
+        }
+
+        std::nth_element(t_tokens_us.begin(), t_tokens_us.begin() + t_tokens_us.size() / 2, t_tokens_us.end());
+        const double prefill = 1e6 * TUNE_PREFILL_TOKENS / std::max<int64_t>(t_prefill_us, 1);
+        const double decode = 1e6 / std::max<int64_t>(t_tokens_us[t_tokens_us.size() / 2], 1);
+        LOG_INF("%s: %d threads on %zu cpus: prefill %.1f t/s, decode %.1f t/s\n",
+                __func__, candidate.n_threads, candidate.cpus.size(), prefill, decode);
+        if (prefill > best_prefill) {
+            best_prefill = prefill;
+            profile.n_threads_batch = candidate.n_threads;
+            profile.cpus_batch = candidate.cpus;
+        }
+        if (decode > best_decode) {
+            best_decode = decode;
+            profile.n_threads = candidate.n_threads;
+            profile.cpus = candidate.cpus;
+        }
+    }
+
+    llama_free(ctx);
+    LOG_INF("%s: decode %d threads, batch %d threads\n", __func__, profile.n_threads, profile.n_threads_batch);
+    return profile;
+}
+
+LlamaThreadProfile LlamaThreadTuner::loadOrTune(llama_model *model,
+                                                const gpt_params &params,
+                                                uint64_t model_hash,
+                                                const std::string &cache_directory) {
+    const std::vector<LlamaCpuCluster> clusters = readTopology();
+    std::string path;
+    if (!cache_directory.empty()) {
+        path = getCachePath(cache_directory, clusters, model_hash);
+        LlamaThreadProfile cached;
+        if (load(path, cached)) {
+            return cached;
+        }
+    }
+
+    LlamaThreadProfile profile = tune(model, params, clusters);
+    if (!path.empty() && !save(path, profile)) {
+        LOG_WRN("%s: failed to save the thread profile to %s\n", __func__, path.c_str());
+    }
+    return profile;
+}
+
+void LlamaThreadTuner::apply(const LlamaThreadProfile &profile, gpt_params &params) {
+    apply_cpu_params(profile.n_threads, profile.cpus, params.cpuparams);
+    apply_cpu_params(profile.n_threads_batch, profile.cpus_batch, params.cpuparams_batch);
+}
+
+std::string LlamaThreadTuner::getCachePath(const std::string &directory,
+                                           const std::vector<LlamaCpuCluster> &clusters,
+                                           uint64_t model_hash) {
+    // the device is identified by its topology, which is what the profile depends on
+    uint64_t key = LlamaPromptCache::hash(&model_hash, sizeof(model_hash), 0);
+    key = LlamaPromptCache::hash(&TUNE_VERSION, sizeof(TUNE_VERSION), key);
+    for (const auto &cluster : clusters) {
+        key = LlamaPromptCache::hash(&cluster.max_freq_khz, sizeof(cluster.max_freq_khz), key);
+        key = LlamaPromptCache::hash(cluster.cpus.data(), cluster.cpus.size() * sizeof(int32_t), key);
+    }
+
+    std::string dir = directory;
+    if (dir.back() != '/') {
+        dir += '/';
+    }
+    if (!fs_create_directory_with_parents(dir)) {
+        return "";
+    }
+    char name[48];
+    snprintf(name, sizeof(name), "threads-%016" PRIx64 ".txt", key);
+    return dir + name;
+}
+
+bool LlamaThreadTuner::load(const std::string &path, LlamaThreadProfile &profile) {
+    std::ifstream file(path);
+    if (!file.good()) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string name;
+        fields >> name;
+        int32_t value;
+        if (name == "n_threads") {
+            fields >> profile.n_threads;
+        } else if (name == "cpus") {
+            while (fields >> value) {
+                profile.cpus.push_back(value);
+            }
+        } else if (name == "n_threads_batch") {
+            fields >> profile.n_threads_batch;
+        } else if (name == "cpus_batch") {
+            while (fields >> value) {
+                profile.cpus_batch.push_back(value);
+            }
+        }
+    }
+    return profile.isValid();
+}
+
+bool LlamaThreadTuner::save(const std::string &path, const LlamaThreadProfile &profile) {
+    if (path.empty()) {
+        return false;
+    }
+    std::ofstream file(path);
+    auto write_cpus = [&](const char *name, const std::vector<int32_t> &cpus) {
+        file << name;
+        for (int32_t cpu : cpus) {
+            file << ' ' << cpu;
+        }
+        file << '\n';
+    };
+    file << "n_threads " << profile.n_threads << '\n';
+    write_cpus("cpus", profile.cpus);
+    file << "n_threads_batch " << profile.n_threads_batch << '\n';
+    write_cpus("cpus_batch", profile.cpus_batch);
+    return file.good();
+}
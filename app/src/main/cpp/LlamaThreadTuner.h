@@ -0,0 +1,68 @@
+#ifndef LMPLAYGROUND_LLAMATHREADTUNER_H
+#define LMPLAYGROUND_LLAMATHREADTUNER_H
+
+#include "common.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// CPUs sharing a maximum frequency, i.e. one core type of a big.LITTLE SoC
+struct LlamaCpuCluster {
+    int64_t max_freq_khz = 0;
+    std::vector<int32_t> cpus;
+};
+
+// Thread counts and CPU sets of the decode and the batch (prompt processing) threadpools.
+// An empty CPU set leaves the placement to the scheduler.
+struct LlamaThreadProfile {
+    int32_t n_threads = 0;
+    std::vector<int32_t> cpus;
+    int32_t n_threads_batch = 0;
+    std::vector<int32_t> cpus_batch;
+
+    bool isValid() const;
+};
+
+// Picks thread counts and core sets for a model on this device.
+//
+// Decode is memory bound and usually gets slower once threads land on the little cores, while
+// prompt processing is compute bound and may profit from every core, so both threadpools are
+// tuned separately: each candidate core set (fastest cluster, fastest two, ...) with a sweep
+// of thread counts is timed with a warm-up, a short prefill and a short decode on a scratch
+// context. The result is cached per device topology and model, so the tuning cost is paid once.
+class LlamaThreadTuner {
+public:
+    // Online CPUs grouped by cpufreq max frequency, fastest first. Without cpufreq (e.g. in
+    // some containers) all CPUs form one cluster.
+    static std::vector<LlamaCpuCluster> readTopology();
+
+    // Profile derived from the topology alone: decode on all but the slowest cluster, prompt
+    // processing on all cores
+    static LlamaThreadProfile defaultProfile(const std::vector<LlamaCpuCluster> &clusters);
+
+    // Runs the microbenchmarks, takes a few seconds on a phone
+    static LlamaThreadProfile tune(llama_model *model,
+                                   const gpt_params &params,
+                                   const std::vector<LlamaCpuCluster> &clusters);
+
+    // Returns the cached profile of (this device, `model_hash`) or tunes and caches it;
+    // an empty `cache_directory` disables the cache
+    static LlamaThreadProfile loadOrTune(llama_model *model,
+                                         const gpt_params &params,
+                                         uint64_t model_hash,
+                                         const std::string &cache_directory);
+
+    static void apply(const LlamaThreadProfile &profile, gpt_params &params);
+
+private:
+    static std::string getCachePath(const std::string &directory,
+                                    const std::vector<LlamaCpuCluster> &clusters,
+                                    uint64_t model_hash);
+
+    static bool load(const std::string &path, LlamaThreadProfile &profile);
+
+    static bool save(const std::string &path, const LlamaThreadProfile &profile);
+};
+
+#endif //LMPLAYGROUND_LLAMATHREADTUNER_H
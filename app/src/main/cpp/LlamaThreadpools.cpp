@@ -0,0 +1,99 @@
+#include "LlamaThreadpools.h"
+#include "common.h"
+
+#include "log.h"
+
+#include <algorithm>
+
+std::mutex LlamaThreadpoolManager::mutex;
+std::vector<std::weak_ptr<LlamaThreadpools>> LlamaThreadpoolManager::pools;
+
+LlamaThreadpools::~LlamaThreadpools() {
+    ggml_threadpool_free(decode);
+    ggml_threadpool_free(batch);
+}
+
+ggml_threadpool *LlamaThreadpools::getDecode() const {
+    return decode;
+}
+
+ggml_threadpool *LlamaThreadpools::getBatch() const {
+    return batch;
+}
+
+void LlamaThreadpools::resume() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (n_active++ == 0) {
+        ggml_threadpool_resume(decode);
+        if (batch != nullptr) {
+            ggml_threadpool_resume(batch);
+        }
+    }
+}
+
+void LlamaThreadpools::pause() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (n_active > 0 && --n_active == 0) {
+        ggml_threadpool_pause(decode);
+        if (batch != nullptr) {
+            ggml_threadpool_pause(batch);
+        }
+    }
+}
+
+std::mutex &LlamaThreadpools::computeMutex() {
+    return compute_mutex;
+}
+
+bool LlamaThreadpools::matches(const ggml_threadpool_params &other, const ggml_threadpool_params &other_batch) const {
+    // `paused` is only the initial state
+    ggml_threadpool_params a = tpp;
+    ggml_threadpool_params b = other;
+    a.paused = b.paused = false;
+    ggml_threadpool_params a_batch = tpp_batch;
+    ggml_threadpool_params b_batch = other_batch;
+    a_batch.paused = b_batch.paused = false;
+    return ggml_threadpool_params_match(&a, &b) && ggml_threadpool_params_match(&a_batch, &b_batch);
+}
+
+std::shared_ptr<LlamaThreadpools> LlamaThreadpoolManager::acquire(const cpu_params &cpu, const cpu_params &cpu_batch) {
+    struct ggml_threadpool_params tpp = ggml_threadpool_params_from_cpu_params(cpu);
+    struct ggml_threadpool_params tpp_batch = ggml_threadpool_params_from_cpu_params(cpu_batch);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    pools.erase(std::remove_if(pools.begin(), pools.end(), [](const std::weak_ptr<LlamaThreadpools> &entry) {
+        return entry.expired();
+    }), pools.end());
+    for (const auto &entry : pools) {
+        std::shared_ptr<LlamaThreadpools> existing = entry.lock();
+        if (existing && existing->matches(tpp, tpp_batch)) {
+            return existing;
+        }
+    }
+
+    LOG_INF("%s: llama threadpool init, n_threads = %d, n_threads_batch = %d\n",
+            __func__, tpp.n_threads, tpp_batch.n_threads);
+
+    std::shared_ptr<LlamaThreadpools> created(new LlamaThreadpools());
+    created->tpp = tpp;
+    created->tpp_batch = tpp_batch;
+
+    // both start paused, the threads only spin while a turn is being generated
+    tpp.paused = true;
+    tpp_batch.paused = true;
+    if (!ggml_threadpool_params_match(&created->tpp, &created->tpp_batch)) {
+        created->batch = ggml_threadpool_new(&tpp_batch);
+        if (created->batch == nullptr) {
+            LOG_ERR("%s: batch threadpool create failed : n_threads %d\n", __func__, tpp_batch.n_threads);
+            return nullptr;
+        }
+    }
+    created->decode = ggml_threadpool_new(&tpp);
+    if (created->decode == nullptr) {
+        LOG_ERR("%s: threadpool create failed : n_threads %d\n", __func__, tpp.n_threads);
+        return nullptr;
+    }
+
+    pools.push_back(created);
+    return created;
+}
@@ -0,0 +1,65 @@
+#ifndef LMPLAYGROUND_LLAMATHREADPOOLS_H
+#define LMPLAYGROUND_LLAMATHREADPOOLS_H
+
+#include "common.h"
+
+#include "ggml.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A decode and a batch (prompt processing) threadpool shared by every context created with the
+// same thread settings. A threadpool runs one graph at a time, so users hold computeMutex()
+// around their decodes; with one active session at a time it is never contended.
+class LlamaThreadpools {
+public:
+    ~LlamaThreadpools();
+
+    LlamaThreadpools(const LlamaThreadpools &) = delete;
+
+    LlamaThreadpools &operator=(const LlamaThreadpools &) = delete;
+
+    ggml_threadpool *getDecode() const;
+
+    // nullptr if the decode threadpool serves batches too
+    ggml_threadpool *getBatch() const;
+
+    // Wakes the threads up for a turn. Calls nest, the threads are paused again, and stop
+    // polling for work, once every resume() is matched by a pause().
+    void resume();
+
+    void pause();
+
+    std::mutex &computeMutex();
+
+private:
+    friend class LlamaThreadpoolManager;
+
+    LlamaThreadpools() = default;
+
+    bool matches(const ggml_threadpool_params &other, const ggml_threadpool_params &other_batch) const;
+
+    ggml_threadpool_params tpp = {};
+    ggml_threadpool_params tpp_batch = {};
+    ggml_threadpool *decode = nullptr;
+    ggml_threadpool *batch = nullptr;
+
+    std::mutex mutex;
+    int32_t n_active = 0;
+
+    std::mutex compute_mutex;
+};
+
+// Process-wide registry of threadpools. Sessions and engines with the same thread settings get
+// the same pools, which live as long as one of them holds a reference.
+class LlamaThreadpoolManager {
+public:
+    static std::shared_ptr<LlamaThreadpools> acquire(const cpu_params &cpu, const cpu_params &cpu_batch);
+
+private:
+    static std::mutex mutex;
+    static std::vector<std::weak_ptr<LlamaThreadpools>> pools;
+};
+
+#endif //LMPLAYGROUND_LLAMATHREADPOOLS_H
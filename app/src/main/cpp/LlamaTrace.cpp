@@ -0,0 +1,123 @@
+#include "LlamaTrace.h"
+
+#ifdef LMP_TRACE
+
+#include "log.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+struct TraceEvent {
+    const char *name;
+    int64_t t_start_us;
+    int64_t t_end_us;
+};
+
+// Written by its thread only; readers copy the events and then discard the ones the writer
+// may have overwritten in the meantime
+struct ThreadRing {
+    int32_t tid = 0;
+    std::atomic<uint64_t> head{0};
+    TraceEvent events[LlamaTrace::THREAD_CAPACITY];
+};
+
+std::mutex rings_mutex;
+
+// never freed, a thread may record until the process exits
+std::vector<ThreadRing *> &rings() {
+    static auto *all = new std::vector<ThreadRing *>();
+    return *all;
+}
+
+std::atomic<int64_t> t_epoch_us{0};
+
+thread_local ThreadRing *thread_ring = nullptr;
+
+}
+
+void LlamaTrace::setEnabled(bool enabled_arg) {
+    if (enabled_arg) {
+        t_epoch_us.store(ggml_time_us(), std::memory_order_relaxed);
+    }
+    enabled.store(enabled_arg, std::memory_order_relaxed);
+}
+
+void LlamaTrace::record(const char *name, int64_t t_start_us, int64_t t_end_us) {
+    if (!isEnabled() || t_start_us < t_epoch_us.load(std::memory_order_relaxed)) {
+        return;
+    }
+    ThreadRing *ring = thread_ring;
+    if (ring == nullptr) {
+        ring = new ThreadRing();
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        ring->tid = (int32_t) rings().size() + 1;
+        rings().push_back(ring);
+        thread_ring = ring;
+    }
+    const uint64_t head = ring->head.load(std::memory_order_relaxed);
+    ring->events[head % THREAD_CAPACITY] = {name, t_start_us, t_end_us};
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+bool LlamaTrace::writeChromeTrace(const std::string &path) {
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        LOG_ERR("%s: failed to open %s\n", __func__, path.c_str());
+        return false;
+    }
+
+    const int64_t t_epoch = t_epoch_us.load(std::memory_order_relaxed);
+    std::vector<ThreadRing *> all;
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        all = rings();
+    }
+
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    std::vector<TraceEvent> events;
+    for (ThreadRing *ring : all) {
+        const uint64_t head = ring->head.load(std::memory_order_acquire);
+        const uint64_t tail = head > THREAD_CAPACITY ? head - THREAD_CAPACITY : 0;
+        events.clear();
+        for (uint64_t i = tail; i < head; i++) {
+            events.push_back(ring->events[i % THREAD_CAPACITY]);
+        }
+        // the writer may have wrapped around onto the oldest copied events
+        const uint64_t head_after = ring->head.load(std::memory_order_acquire);
+        const uint64_t valid_tail = head_after > THREAD_CAPACITY ? head_after - THREAD_CAPACITY : 0;
+        const size_t skip = valid_tail > tail ? (size_t) std::min(valid_tail - tail, (uint64_t) events.size()) : 0;
+
+        for (size_t i = skip; i < events.size(); i++) {
+            const TraceEvent &event = events[i];
+            if (event.t_start_us < t_epoch) {
+                continue;
+            }
+            fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %" PRId64 ", \"dur\": %" PRId64 "}",
+                    first ? "" : ",\n", event.name, ring->tid, event.t_start_us - t_epoch,
+                    event.t_end_us - event.t_start_us);
+            first = false;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0;
+}
+
+#else
+
+void LlamaTrace::setEnabled(bool) {
+}
+
+void LlamaTrace::record(const char *, int64_t, int64_t) {
+}
+
+bool LlamaTrace::writeChromeTrace(const std::string &) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef LMPLAYGROUND_LLAMATRACE_H
+#define LMPLAYGROUND_LLAMATRACE_H
+
+#include "ggml.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Opt-in span tracing of the inference pipeline, written as a Chrome trace (JSON) that
+// chrome://tracing and ui.perfetto.dev open.
+//
+// Spans are only recorded in builds with LMP_TRACE defined (cmake -DLMP_TRACE=ON) and while
+// tracing is enabled at runtime. Without LMP_TRACE the macros expand to nothing. Each thread
+// records into its own ring of the last THREAD_CAPACITY spans, so recording takes no locks
+// and never allocates after the first span of a thread.
+//
+// Span names must be string literals, only the pointer is stored.
+#ifdef LMP_TRACE
+#define LMP_TRACE_CONCAT_(a, b) a##b
+#define LMP_TRACE_CONCAT(a, b) LMP_TRACE_CONCAT_(a, b)
+// Records the enclosing scope
+#define LMP_TRACE_SCOPE(name) LlamaTraceScope LMP_TRACE_CONCAT(lmp_trace_scope_, __LINE__)(name)
+// Records a span measured by the caller
+#define LMP_TRACE_SPAN(name, t_start_us, t_end_us) LlamaTrace::record(name, t_start_us, t_end_us)
+#else
+#define LMP_TRACE_SCOPE(name) ((void) 0)
+#define LMP_TRACE_SPAN(name, t_start_us, t_end_us) ((void) 0)
+#endif
+
+class LlamaTrace {
+public:
+    static const size_t THREAD_CAPACITY = 16384;
+
+    // Starts or stops recording, starting drops the spans of earlier recordings.
+    // Does nothing in builds without LMP_TRACE.
+    static void setEnabled(bool enabled);
+
+    static bool isEnabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    static void record(const char *name, int64_t t_start_us, int64_t t_end_us);
+
+    // Writes the spans recorded since tracing was enabled, the last THREAD_CAPACITY of each
+    // thread. Returns false if the file can not be written or tracing is compiled out.
+    static bool writeChromeTrace(const std::string &path);
+
+private:
+    static inline std::atomic<bool> enabled{false};
+};
+
+class LlamaTraceScope {
+public:
+    explicit LlamaTraceScope(const char *name_arg) :
+            name(name_arg),
+            t_start_us(LlamaTrace::isEnabled() ? ggml_time_us() : -1) {
+    }
+
+    ~LlamaTraceScope() {
+        if (t_start_us >= 0) {
+            LlamaTrace::record(name, t_start_us, ggml_time_us());
+        }
+    }
+
+    LlamaTraceScope(const LlamaTraceScope &) = delete;
+
+    LlamaTraceScope &operator=(const LlamaTraceScope &) = delete;
+
+private:
+    const char *name;
+    const int64_t t_start_us;
+};
+
+#endif //LMPLAYGROUND_LLAMATRACE_H
@@ -0,0 +1,393 @@
+#include "LlamaVectorStore.h"
+
+#include "log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// n is a multiple of 32
+int32_t dotScalar(const int8_t *a, const int8_t *b, size_t n) {
+    int32_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += (int32_t) a[i] * (int32_t) b[i];
+    }
+    return sum;
+}
+
+#if defined(__ARM_NEON)
+
+int32_t dotNeon(const int8_t *a, const int8_t *b, size_t n) {
+#if defined(__ARM_FEATURE_DOTPROD)
+    int32x4_t acc0 = vdupq_n_s32(0);
+    int32x4_t acc1 = vdupq_n_s32(0);
+    for (size_t i = 0; i < n; i += 32) {
+        acc0 = vdotq_s32(acc0, vld1q_s8(a + i), vld1q_s8(b + i));
+        acc1 = vdotq_s32(acc1, vld1q_s8(a + i + 16), vld1q_s8(b + i + 16));
+    }
+    return vaddvq_s32(vaddq_s32(acc0, acc1));
+#else
+    int32x4_t acc = vdupq_n_s32(0);
+    for (size_t i = 0; i < n; i += 16) {
+        const int8x16_t va = vld1q_s8(a + i);
+        const int8x16_t vb = vld1q_s8(b + i);
+        // |a * b| <= 128 * 128, two products fit an int16 lane before widening
+        acc = vpadalq_s16(acc, vmull_s8(vget_low_s8(va), vget_low_s8(vb)));
+        acc = vpadalq_s16(acc, vmull_s8(vget_high_s8(va), vget_high_s8(vb)));
+    }
+    return vaddvq_s32(acc);
+#endif
+}
+
+int32_t dot(const int8_t *a, const int8_t *b, size_t n) {
+    return dotNeon(a, b, n);
+}
+
+#elif defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+int32_t dotAvx2(const int8_t *a, const int8_t *b, size_t n) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t i = 0; i < n; i += 32) {
+        const __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        const __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        // maddubs multiplies unsigned by signed bytes, move the sign of a onto b. The values
+        // are within [-127, 127] so the pairwise int16 sums do not saturate.
+        const __m256i products = _mm256_maddubs_epi16(_mm256_sign_epi8(va, va), _mm256_sign_epi8(vb, va));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(products, ones));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+
+using DotFn = int32_t (*)(const int8_t *, const int8_t *, size_t);
+
+int32_t dot(const int8_t *a, const int8_t *b, size_t n) {
+    // chosen on first use, a static initializer may run before the CPU features are known
+    static const DotFn impl = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? dotAvx2 : dotScalar;
+    }();
+    return impl(a, b, n);
+}
+
+#else
+
+int32_t dot(const int8_t *a, const int8_t *b, size_t n) {
+    return dotScalar(a, b, n);
+}
+
+#endif
+
+struct HitWorse {
+    bool operator()(const LlamaVectorHit &lhs, const LlamaVectorHit &rhs) const {
+        return lhs.score > rhs.score;
+    }
+};
+
+}
+
+// Workers of the parallel scans. Starting threads on every query would cost about as much
+// as the scan of a few hundred thousand vectors, so they are kept and wait for work.
+class LlamaVectorStore::SearchPool {
+public:
+    ~SearchPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_available.notify_all();
+        for (auto &worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Runs task(0) .. task(n - 1), task(0) on the calling thread, and returns once all ran.
+    // Thread-safe, concurrent calls share the workers.
+    void run(size_t n, const std::function<void(size_t)> &task) {
+        size_t n_remaining = n - 1;
+        std::condition_variable done;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while (workers.size() < n - 1) {
+                workers.emplace_back([this] { work(); });
+            }
+            for (size_t i = 1; i < n; i++) {
+                tasks.emplace_back([&, i] {
+                    task(i);
+                    std::lock_guard<std::mutex> task_lock(mutex);
+                    if (--n_remaining == 0) {
+                        done.notify_all();
+                    }
+                });
+            }
+        }
+        work_available.notify_all();
+
+        task(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return n_remaining == 0; });
+    }
+
+private:
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            work_available.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            std::function<void()> task = std::move(tasks.front());
+            tasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+};
+
+LlamaVectorStore::LlamaVectorStore() : search_pool(std::make_unique<SearchPool>()) {
+}
+
+LlamaVectorStore::~LlamaVectorStore() {
+    close();
+}
+
+bool LlamaVectorStore::open(const std::string &path, uint32_t dim_arg) {
+    close();
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERR("%s: failed to open %s: %s\n", __func__, path.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat st = {};
+    if (fstat(fd, &st) != 0) {
+        LOG_ERR("%s: failed to stat %s: %s\n", __func__, path.c_str(), strerror(errno));
+        close();
+        return false;
+    }
+
+    Header header = {};
+    if (st.st_size == 0) {
+        if (dim_arg == 0) {
+            LOG_ERR("%s: %s is empty and no dimension is given\n", __func__, path.c_str());
+            close();
+            return false;
+        }
+        header.magic = MAGIC;
+        header.version = VERSION;
+        header.dim = dim_arg;
+        header.record_size = (uint32_t) recordSize(dim_arg);
+        header.count = 0;
+        if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)) {
+            LOG_ERR("%s: failed to write %s: %s\n", __func__, path.c_str(), strerror(errno));
+            close();
+            return false;
+        }
+    } else if (pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header)
+               || header.magic != MAGIC || header.version != VERSION) {
+        LOG_ERR("%s: %s is not a vector store\n", __func__, path.c_str());
+        close();
+        return false;
+    } else if (header.dim == 0 || header.record_size != recordSize(header.dim)) {
+        LOG_ERR("%s: %s has an invalid header\n", __func__, path.c_str());
+        close();
+        return false;
+    } else if (dim_arg != 0 && header.dim != dim_arg) {
+        LOG_ERR("%s: %s has dimension %u, expected %u\n", __func__, path.c_str(), header.dim, dim_arg);
+        close();
+        return false;
+    }
+
+    n_dim = header.dim;
+    dim_padded = header.record_size - (uint32_t) sizeof(float);
+    record_size = header.record_size;
+    // a record appended by an interrupted add() is not counted
+    count = std::min<uint64_t>(header.count, (uint64_t) (std::max<off_t>(st.st_size, HEADER_SIZE) - HEADER_SIZE) / record_size);
+    if (!remap(HEADER_SIZE + count * record_size)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void LlamaVectorStore::close() {
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+        mapping_size = 0;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    count = 0;
+}
+
+int64_t LlamaVectorStore::add(const float *vectors, size_t n) {
+    if (fd < 0) {
+        return -1;
+    }
+    const uint64_t first = count;
+    std::vector<uint8_t> records(n * record_size);
+    for (size_t i = 0; i < n; i++) {
+        quantize(vectors + i * n_dim, records.data() + i * record_size);
+    }
+
+    // records first, the count only once they are written
+    const off_t offset = (off_t) (HEADER_SIZE + first * record_size);
+    if (pwrite(fd, records.data(), records.size(), offset) != (ssize_t) records.size()) {
+        LOG_ERR("%s: failed to append %zu vectors: %s\n", __func__, n, strerror(errno));
+        return -1;
+    }
+    const uint64_t new_count = first + n;
+    if (pwrite(fd, &new_count, sizeof(new_count), offsetof(Header, count)) != (ssize_t) sizeof(new_count)) {
+        LOG_ERR("%s: failed to update the count: %s\n", __func__, strerror(errno));
+        return -1;
+    }
+    count = new_count;
+    if (!remap(HEADER_SIZE + count * record_size)) {
+        return -1;
+    }
+    return (int64_t) first;
+}
+
+std::vector<LlamaVectorHit> LlamaVectorStore::search(const float *query, size_t k, int32_t n_threads) const {
+    std::vector<LlamaVectorHit> hits;
+    if (mapping == nullptr || k == 0 || count == 0) {
+        return hits;
+    }
+
+    std::vector<uint8_t> query_record(record_size);
+    quantize(query, query_record.data());
+
+    // a thread per SEARCH_MIN_PER_THREAD records at most, handing out work costs more than
+    // scanning a small store
+    const uint64_t max_threads = std::max<uint64_t>(1, count / SEARCH_MIN_PER_THREAD);
+    const auto n_ranges = (uint64_t) std::clamp<int64_t>(n_threads, 1, (int64_t) max_threads);
+    std::vector<std::vector<LlamaVectorHit>> range_hits(n_ranges);
+    auto scan_range = [&](size_t r) {
+        range_hits[r] = scan(query_record.data(), count * r / n_ranges, count * (r + 1) / n_ranges, k);
+    };
+    if (n_ranges == 1) {
+        scan_range(0);
+    } else {
+        search_pool->run(n_ranges, scan_range);
+    }
+
+    for (const auto &range : range_hits) {
+        hits.insert(hits.end(), range.begin(), range.end());
+    }
+    std::sort(hits.begin(), hits.end(), [](const LlamaVectorHit &lhs, const LlamaVectorHit &rhs) {
+        return lhs.score > rhs.score || (lhs.score == rhs.score && lhs.index < rhs.index);
+    });
+    if (hits.size() > k) {
+        hits.resize(k);
+    }
+    return hits;
+}
+
+std::vector<LlamaVectorHit> LlamaVectorStore::scan(const uint8_t *query_record, uint64_t begin, uint64_t end, size_t k) const {
+    float query_scale;
+    memcpy(&query_scale, query_record, sizeof(float));
+    const auto *query_data = (const int8_t *) (query_record + sizeof(float));
+
+    // min-heap of the best k, its top is the worst hit kept
+    std::priority_queue<LlamaVectorHit, std::vector<LlamaVectorHit>, HitWorse> heap;
+    const uint8_t *record = mapping + HEADER_SIZE + begin * record_size;
+    for (uint64_t i = begin; i < end; i++, record += record_size) {
+        float scale;
+        memcpy(&scale, record, sizeof(float));
+        const float score = (float) dot(query_data, (const int8_t *) (record + sizeof(float)), dim_padded) * scale * query_scale;
+        if (heap.size() < k) {
+            heap.push({i, score});
+        } else if (score > heap.top().score) {
+            heap.pop();
+            heap.push({i, score});
+        }
+    }
+
+    std::vector<LlamaVectorHit> hits;
+    hits.reserve(heap.size());
+    while (!heap.empty()) {
+        hits.push_back(heap.top());
+        heap.pop();
+    }
+    return hits;
+}
+
+uint64_t LlamaVectorStore::size() const {
+    return count;
+}
+
+uint32_t LlamaVectorStore::dim() const {
+    return n_dim;
+}
+
+uint64_t LlamaVectorStore::recordSize(uint32_t dim) {
+    return sizeof(float) + ((uint64_t) dim + DIM_ALIGN - 1) / DIM_ALIGN * DIM_ALIGN;
+}
+
+void LlamaVectorStore::quantize(const float *vector, uint8_t *record) const {
+    float max_abs = 0.0f;
+    for (uint32_t i = 0; i < n_dim; i++) {
+        max_abs = std::max(max_abs, std::fabs(vector[i]));
+    }
+    const float scale = max_abs / 127.0f;
+    const float inv_scale = scale > 0.0f ? 1.0f / scale : 0.0f;
+    memcpy(record, &scale, sizeof(float));
+
+    auto *data = (int8_t *) (record + sizeof(float));
+    for (uint32_t i = 0; i < n_dim; i++) {
+        data[i] = (int8_t) std::clamp(std::lround(vector[i] * inv_scale), -127L, 127L);
+    }
+    memset(data + n_dim, 0, dim_padded - n_dim);
+}
+
+bool LlamaVectorStore::remap(size_t size) {
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_size);
+        mapping = nullptr;
+        mapping_size = 0;
+    }
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        LOG_ERR("%s: failed to map %zu bytes: %s\n", __func__, size, strerror(errno));
+        return false;
+    }
+    // every search scans all records
+    madvise(addr, size, MADV_WILLNEED);
+    mapping = (uint8_t *) addr;
+    mapping_size = size;
+    return true;
+}
@@ -0,0 +1,99 @@
+#ifndef LMPLAYGROUND_LLAMAVECTORSTORE_H
+#define LMPLAYGROUND_LLAMAVECTORSTORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct LlamaVectorHit {
+    uint64_t index;
+    float score;
+};
+
+// Append-only flat vector store in a memory-mapped file, searched by dot product.
+//
+// Vectors are stored quantized to int8 with one float scale per vector, a quarter of the
+// bandwidth of float32, which is what bounds a flat scan. The dot products run on NEON (sdot
+// where available) or AVX2, with a scalar fallback.
+//
+// The query is quantized the same way, so for normalized embeddings the score approximates
+// their cosine similarity: with the scales s = max|v_i| / 127 of the query and the vector, it
+// is off by at most sqrt(dim) * (s_query + s_vector) / 2, and by about 1e-3 in practice for
+// 384 to 1024 dimensions. Hits whose cosines are closer than that may be ranked differently.
+//
+// File layout: a 32 byte header, then count records of a float scale followed by the vector
+// zero-padded to a multiple of 32 values.
+//
+// Not thread-safe, searches may run concurrently with each other but not with add().
+class LlamaVectorStore {
+public:
+    LlamaVectorStore();
+
+    ~LlamaVectorStore();
+
+    LlamaVectorStore(const LlamaVectorStore &) = delete;
+
+    LlamaVectorStore &operator=(const LlamaVectorStore &) = delete;
+
+    // Opens or creates the store at path. dim may be 0 to take the dimension of an
+    // existing store, it must match otherwise.
+    bool open(const std::string &path, uint32_t dim);
+
+    void close();
+
+    // Appends n vectors of dim() floats, returns the index of the first one or -1 on failure
+    int64_t add(const float *vectors, size_t n);
+
+    // Returns the k best vectors by score, best first. Large stores are scanned in n_threads
+    // ranges in parallel, by workers that are started with the first such search and kept
+    // until the store is destroyed.
+    std::vector<LlamaVectorHit> search(const float *query, size_t k, int32_t n_threads = 1) const;
+
+    uint64_t size() const;
+
+    uint32_t dim() const;
+
+private:
+    static const uint32_t MAGIC = 0x56504d4c; // "LMPV"
+    static const uint32_t VERSION = 1;
+    static const size_t HEADER_SIZE = 32;
+    static const uint32_t DIM_ALIGN = 32;
+    static const uint64_t SEARCH_MIN_PER_THREAD = 16384;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t dim;
+        uint32_t record_size;
+        uint64_t count;
+        uint64_t reserved;
+    };
+
+    static_assert(sizeof(Header) == HEADER_SIZE, "unexpected header size");
+
+    // Size of a record of `dim` values: the scale and the values padded to DIM_ALIGN
+    static uint64_t recordSize(uint32_t dim);
+
+    // Writes dim floats as a record of a scale and dim_padded int8 values
+    void quantize(const float *vector, uint8_t *record) const;
+
+    // Returns the best k of records [begin, end) in no particular order
+    std::vector<LlamaVectorHit> scan(const uint8_t *query_record, uint64_t begin, uint64_t end, size_t k) const;
+
+    bool remap(size_t size);
+
+    class SearchPool;
+
+    std::unique_ptr<SearchPool> search_pool;
+    int fd = -1;
+    uint8_t *mapping = nullptr;
+    size_t mapping_size = 0;
+    uint32_t n_dim = 0;
+    uint32_t dim_padded = 0;
+    uint32_t record_size = 0;
+    uint64_t count = 0;
+};
+
+#endif //LMPLAYGROUND_LLAMAVECTORSTORE_H
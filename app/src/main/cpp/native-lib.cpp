@@ -2,6 +2,9 @@
 #include <string>
 
 #include "LlamaCpp.h"
+#include "LlamaHttpServer.h"
+#include "LlamaTrace.h"
+#include "LlamaVectorStore.h"
 #include "common.h"
 
 #include "console.h"
@@ -9,6 +12,7 @@
 #include "llama.h"
 #include "log.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cinttypes>
 #include <cmath>
@@ -43,19 +47,111 @@ protected:
 
 gpt_params g_params;
 
+// Class references, method and field IDs resolved once in JNI_OnLoad. Looking them up on
+// every call (and FindClass in particular) is far more expensive than the calls themselves.
+static struct {
+    jclass modelClass;
+    jmethodID modelConstructor;
+    jfieldID modelNativeHandle;
+
+    jclass sessionClass;
+    jmethodID sessionConstructor;
+    jfieldID sessionNativeHandle;
+
+    jclass embeddingSessionClass;
+    jmethodID embeddingSessionConstructor;
+    jfieldID embeddingSessionNativeHandle;
+
+    jfieldID vectorStoreNativeHandle;
+    jfieldID httpServerNativeHandle;
+
+    jmethodID generationCallbackNewTokens;
+    jmethodID progressCallbackOnProgress;
+} g_jni;
+
+static jclass findGlobalClass(JNIEnv *env, const char *name) {
+    jclass local = env->FindClass(name);
+    if (local == nullptr) {
+        return nullptr;
+    }
+    auto global = (jclass) env->NewGlobalRef(local);
+    env->DeleteLocalRef(local);
+    return global;
+}
+
+extern "C" JNIEXPORT jint JNICALL JNI_OnLoad(JavaVM *vm, void *reserved) {
+    JNIEnv *env;
+    if (vm->GetEnv((void **) &env, JNI_VERSION_1_6) != JNI_OK) {
+        return JNI_ERR;
+    }
+
+    g_jni.modelClass = findGlobalClass(env, "com/druk/llamacpp/LlamaModel");
+    g_jni.sessionClass = findGlobalClass(env, "com/druk/llamacpp/LlamaGenerationSession");
+    g_jni.embeddingSessionClass = findGlobalClass(env, "com/druk/llamacpp/LlamaEmbeddingSession");
+    jclass vectorStoreClass = env->FindClass("com/druk/llamacpp/LlamaVectorStore");
+    jclass httpServerClass = env->FindClass("com/druk/llamacpp/LlamaHttpServer");
+    jclass generationCallbackClass = env->FindClass("com/druk/llamacpp/LlamaGenerationCallback");
+    jclass progressCallbackClass = env->FindClass("com/druk/llamacpp/LlamaProgressCallback");
+    if (g_jni.modelClass == nullptr || g_jni.sessionClass == nullptr ||
+        g_jni.embeddingSessionClass == nullptr || vectorStoreClass == nullptr || httpServerClass == nullptr ||
+        generationCallbackClass == nullptr || progressCallbackClass == nullptr) {
+        return JNI_ERR;
+    }
+
+    g_jni.modelConstructor = env->GetMethodID(g_jni.modelClass, "<init>", "()V");
+    g_jni.modelNativeHandle = env->GetFieldID(g_jni.modelClass, "nativeHandle", "J");
+    g_jni.sessionConstructor = env->GetMethodID(g_jni.sessionClass, "<init>", "()V");
+    g_jni.sessionNativeHandle = env->GetFieldID(g_jni.sessionClass, "nativeHandle", "J");
+    g_jni.embeddingSessionConstructor = env->GetMethodID(g_jni.embeddingSessionClass, "<init>", "()V");
+    g_jni.embeddingSessionNativeHandle = env->GetFieldID(g_jni.embeddingSessionClass, "nativeHandle", "J");
+    g_jni.vectorStoreNativeHandle = env->GetFieldID(vectorStoreClass, "nativeHandle", "J");
+    g_jni.httpServerNativeHandle = env->GetFieldID(httpServerClass, "nativeHandle", "J");
+    g_jni.generationCallbackNewTokens = env->GetMethodID(generationCallbackClass, "newTokens", "([B)V");
+    g_jni.progressCallbackOnProgress = env->GetMethodID(progressCallbackClass, "onProgress", "(F)V");
+
+    env->DeleteLocalRef(vectorStoreClass);
+    env->DeleteLocalRef(httpServerClass);
+    env->DeleteLocalRef(generationCallbackClass);
+    env->DeleteLocalRef(progressCallbackClass);
+    return JNI_VERSION_1_6;
+}
+
+static LlamaModel *getModel(JNIEnv *env, jobject thiz) {
+    return (LlamaModel *) env->GetLongField(thiz, g_jni.modelNativeHandle);
+}
+
+static LlamaGenerationSession *getSession(JNIEnv *env, jobject thiz) {
+    return (LlamaGenerationSession *) env->GetLongField(thiz, g_jni.sessionNativeHandle);
+}
+
+static LlamaEmbeddingSession *getEmbeddingSession(JNIEnv *env, jobject thiz) {
+    return (LlamaEmbeddingSession *) env->GetLongField(thiz, g_jni.embeddingSessionNativeHandle);
+}
+
+static LlamaVectorStore *getVectorStore(JNIEnv *env, jobject thiz) {
+    return (LlamaVectorStore *) env->GetLongField(thiz, g_jni.vectorStoreNativeHandle);
+}
+
+static LlamaHttpServer *getHttpServer(JNIEnv *env, jobject thiz) {
+    return (LlamaHttpServer *) env->GetLongField(thiz, g_jni.httpServerNativeHandle);
+}
+
+// Passes a chunk of UTF-8 output to LlamaGenerationCallback.newTokens
+static void deliverTokens(JNIEnv *env, jobject callback, std::string_view response) {
+    LMP_TRACE_SCOPE("jni_callback");
+    auto len = (jsize) response.size();
+    jbyteArray result = env->NewByteArray(len);
+    env->SetByteArrayRegion(result, 0, len, (const jbyte *) response.data());
+    env->CallVoidMethod(callback, g_jni.generationCallbackNewTokens, result);
+    env->DeleteLocalRef(result);
+}
+
 static void llama_log_callback_logTee(ggml_log_level level, const char * text, void * user_data) {
     (void) level;
     (void) user_data;
     __android_log_print(ANDROID_LOG_INFO, "Llama", "%s", text);
 }
 
-gpt_params initLlamaCpp();
-int generate(gpt_params params,
-             llama_model *model,
-             llama_context * ctx_guidance,
-             JNIEnv *env,
-             jobject activity);
-
 extern "C" JNIEXPORT int
 JNICALL
 Java_com_druk_llamacpp_LlamaCpp_init(JNIEnv *env, jobject activity) {
@@ -67,10 +163,30 @@ Java_com_druk_llamacpp_LlamaCpp_init(JNIEnv *env, jobject activity) {
     // Now, std::cerr outputs to logcat
     // std::cerr << "This error message goes to logcat." << std::endl;
 
+#ifndef LOG_DISABLE_LOGS
+    LOG("Log start\n");
+    llama_log_set(llama_log_callback_logTee, nullptr);
+#endif // LOG_DISABLE_LOGS
+
     g_params = initLlamaCpp();
     return 0;
 }
 
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_druk_llamacpp_LlamaCpp_setTracing(JNIEnv *env, jobject thiz, jboolean enabled) {
+    LlamaTrace::setEnabled(enabled);
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_druk_llamacpp_LlamaCpp_writeTrace(JNIEnv *env, jobject thiz, jstring path) {
+    const char *pathCStr = env->GetStringUTFChars(path, nullptr);
+    bool result = LlamaTrace::writeChromeTrace(pathCStr);
+    env->ReleaseStringUTFChars(path, pathCStr);
+    return result;
+}
+
 extern "C" JNIEXPORT jobject
 JNICALL
 Java_com_druk_llamacpp_LlamaCpp_loadModel(JNIEnv *env,
@@ -79,6 +195,9 @@ Java_com_druk_llamacpp_LlamaCpp_loadModel(JNIEnv *env,
                    jstring inputPrefix,
                    jstring inputSuffix,
                    jobjectArray aniPrompt,
+                   jint contextSize,
+                   jint gpuLayers,
+                   jlong memoryBudget,
                    jobject progressCallback) {
 
     // Struct to hold multiple pointers
@@ -104,174 +223,489 @@ Java_com_druk_llamacpp_LlamaCpp_loadModel(JNIEnv *env,
                      std::string(inputPrefixCStr),
                      std::string(inputSuffixCStr),
                      antiprompt_vector,
-                     2048,
-                     -1,
+                     contextSize,
+                     gpuLayers,
+                     (uint64_t) memoryBudget,
                      [](float progress, void *ctx) -> bool {
                             auto* context = static_cast<CallbackContext*>(ctx);
-                            jclass clazz = context->env->GetObjectClass(context->progressCallback);
-                            jmethodID methodId = context->env->GetMethodID(clazz, "onProgress", "(F)V");
-                            context->env->CallVoidMethod(context->progressCallback, methodId, progress);
+                            context->env->CallVoidMethod(context->progressCallback,
+                                                         g_jni.progressCallbackOnProgress,
+                                                         progress);
                             return true;
                      },
                      &ctx
                      );
-    jclass clazz = env->FindClass("com/druk/llamacpp/LlamaModel");
-    jmethodID constructor = env->GetMethodID(clazz, "<init>", "()V");
-    jobject obj = env->NewObject(clazz, constructor);
-    jfieldID fid = env->GetFieldID(clazz, "nativeHandle", "J");
-    env->SetLongField(obj, fid, (long) model);
+    jobject obj = env->NewObject(g_jni.modelClass, g_jni.modelConstructor);
+    env->SetLongField(obj, g_jni.modelNativeHandle, (long) model);
     return obj;
 }
 
 extern "C"
 JNIEXPORT jlong JNICALL
 Java_com_druk_llamacpp_LlamaModel_getModelSize(JNIEnv *env, jobject thiz) {
-    jclass clazz = env->GetObjectClass(thiz);
-    jfieldID fid = env->GetFieldID(clazz, "nativeHandle", "J");
-    auto* model = (LlamaModel*) env->GetLongField(thiz, fid);
+    auto* model = getModel(env, thiz);
     return model->getModelSize();
 }
 
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_com_druk_llamacpp_LlamaModel_getMemoryPlanNative(JNIEnv *env, jobject thiz) {
+    auto* model = getModel(env, thiz);
+    const LlamaMemoryPlan &plan = model->getMemoryPlan();
+    // layout is mirrored by LlamaMemoryPlan.fromArray()
+    const jlong values[] = {
+            plan.n_ctx,
+            ggml_is_quantized(plan.type_k) ? 1 : 0,
+            (jlong) plan.weights_bytes,
+            (jlong) plan.kv_bytes,
+            (jlong) plan.compute_bytes,
+            (jlong) plan.budget_bytes,
+            plan.fits ? 1 : 0,
+            (jlong) plan.draft_bytes,
+    };
+    const jsize count = sizeof(values) / sizeof(values[0]);
+    jlongArray result = env->NewLongArray(count);
+    env->SetLongArrayRegion(result, 0, count, values);
+    return result;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_druk_llamacpp_LlamaModel_setPromptCacheDir(JNIEnv *env, jobject thiz, jstring path) {
+    auto* model = getModel(env, thiz);
+    const char *pathCStr = env->GetStringUTFChars(path, nullptr);
+    model->setPromptCacheDirectory(pathCStr);
+    env->ReleaseStringUTFChars(path, pathCStr);
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_druk_llamacpp_LlamaModel_loadDraftModel(JNIEnv *env, jobject thiz, jstring path) {
+    auto* model = getModel(env, thiz);
+    const char *pathCStr = env->GetStringUTFChars(path, nullptr);
+    bool result = model->loadDraftModel(pathCStr);
+    env->ReleaseStringUTFChars(path, pathCStr);
+    return result;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_druk_llamacpp_LlamaModel_setPromptLookup(JNIEnv *env, jobject thiz, jboolean enabled) {
+    auto* model = getModel(env, thiz);
+    model->setPromptLookup(enabled);
+}
+
+extern "C"
+JNIEXPORT jintArray JNICALL
+Java_com_druk_llamacpp_LlamaModel_tuneThreads(JNIEnv *env, jobject thiz, jstring cacheDir) {
+    auto* model = getModel(env, thiz);
+    const char *cacheDirCStr = env->GetStringUTFChars(cacheDir, nullptr);
+    LlamaThreadProfile profile = model->tuneThreads(cacheDirCStr);
+    env->ReleaseStringUTFChars(cacheDir, cacheDirCStr);
+    const jint values[] = {profile.n_threads, profile.n_threads_batch};
+    jintArray result = env->NewIntArray(2);
+    env->SetIntArrayRegion(result, 0, 2, values);
+    return result;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_druk_llamacpp_LlamaModel_setKvCacheType(JNIEnv *env, jobject thiz, jstring typeK, jstring typeV) {
+    auto* model = getModel(env, thiz);
+    const char *typeKCStr = env->GetStringUTFChars(typeK, nullptr);
+    const char *typeVCStr = env->GetStringUTFChars(typeV, nullptr);
+    bool result = model->setKvCacheType(typeKCStr, typeVCStr);
+    env->ReleaseStringUTFChars(typeK, typeKCStr);
+    env->ReleaseStringUTFChars(typeV, typeVCStr);
+    return result;
+}
+
 extern "C"
 JNIEXPORT void JNICALL
 Java_com_druk_llamacpp_LlamaModel_unloadModel(JNIEnv *env, jobject thiz) {
-    jclass clazz = env->GetObjectClass(thiz);
-    jfieldID fid = env->GetFieldID(clazz, "nativeHandle", "J");
-    auto* model = (LlamaModel*) env->GetLongField(thiz, fid);
+    auto* model = getModel(env, thiz);
     model->unloadModel();
     delete model;
 }
 
 extern "C"
 JNIEXPORT jobject JNICALL
-Java_com_druk_llamacpp_LlamaModel_createSession(JNIEnv *env, jobject thiz) {
+Java_com_druk_llamacpp_LlamaModel_createSessionNative(JNIEnv *env, jobject thiz, jlong seed) {
+    auto* model = getModel(env, thiz);
+
+    jobject obj = env->NewObject(g_jni.sessionClass, g_jni.sessionConstructor);
 
-    jclass clazz1 = env->GetObjectClass(thiz);
-    jfieldID fid1 = env->GetFieldID(clazz1, "nativeHandle", "J");
-    auto* model = (LlamaModel*) env->GetLongField(thiz, fid1);
+    LlamaGenerationSession* session = model->createGenerationSession((uint32_t) seed);
+    env->SetLongField(obj, g_jni.sessionNativeHandle, (long)session);
 
-    jclass clazz2 = env->FindClass("com/druk/llamacpp/LlamaGenerationSession");
-    jmethodID constructor = env->GetMethodID(clazz2, "<init>", "()V");
-    jobject obj = env->NewObject(clazz2, constructor);
+    return obj;
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_com_druk_llamacpp_LlamaModel_createEmbeddingSession(JNIEnv *env, jobject thiz) {
+    auto* model = getModel(env, thiz);
 
-    LlamaGenerationSession* session = model->createGenerationSession();
-    jclass clazz3 = env->GetObjectClass(obj);
-    jfieldID fid3 = env->GetFieldID(clazz3, "nativeHandle", "J");
-    env->SetLongField(obj, fid3, (long)session);
+    LlamaEmbeddingSession* session = model->createEmbeddingSession();
+    if (session == nullptr) {
+        return nullptr;
+    }
 
+    jobject obj = env->NewObject(g_jni.embeddingSessionClass, g_jni.embeddingSessionConstructor);
+    env->SetLongField(obj, g_jni.embeddingSessionNativeHandle, (long)session);
     return obj;
 }
 
 extern "C" JNIEXPORT jint JNICALL Java_com_druk_llamacpp_LlamaGenerationSession_generate
         (JNIEnv *env, jobject obj, jobject callback) {
-    jclass clazz = env->GetObjectClass(obj);
-    jfieldID fid = env->GetFieldID(clazz, "nativeHandle", "J");
-    auto *session = (LlamaGenerationSession*)env->GetLongField(obj, fid);
-
-    jclass javaClass = env->FindClass("com/druk/llamacpp/LlamaGenerationCallback");
-    jmethodID newTokensMethodId = env->GetMethodID(javaClass, "newTokens", "([B)V");
+    auto *session = getSession(env, obj);
 
     return session->generate(
-            [env, newTokensMethodId, callback](const std::string &response) {
-                const char *cStr = response.c_str();
-                jsize len = strlen(cStr);
-                jbyteArray result = env->NewByteArray(len);
-                env->SetByteArrayRegion(result, 0, len, (jbyte *) cStr);
-                env->CallVoidMethod(callback, newTokensMethodId, result);
-                env->DeleteLocalRef(result);
+            [env, callback](std::string_view response) {
+                deliverTokens(env, callback, response);
             }
     );
 }
 
+extern "C" JNIEXPORT jint JNICALL Java_com_druk_llamacpp_LlamaGenerationSession_generateChunked
+        (JNIEnv *env, jobject obj, jobject callback, jint flushBytes, jint flushIntervalMs) {
+    auto *session = getSession(env, obj);
+
+    return session->generateChunked(
+            [env, callback](std::string_view response) {
+                deliverTokens(env, callback, response);
+            },
+            (size_t) std::max(flushBytes, 1),
+            (int64_t) flushIntervalMs * 1000
+    );
+}
+
+extern "C" JNIEXPORT jint JNICALL Java_com_druk_llamacpp_LlamaGenerationSession_generateToRing
+        (JNIEnv *env, jobject obj) {
+    auto *session = getSession(env, obj);
+    return session->generateToRing();
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_startAsync(JNIEnv *env, jobject thiz) {
+    auto *session = getSession(env, thiz);
+    return session->startAsync();
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_cancel(JNIEnv *env, jobject thiz) {
+    auto *session = getSession(env, thiz);
+    if (session != nullptr) {
+        session->cancel();
+    }
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_pollAsync(JNIEnv *env, jobject thiz) {
+    auto *session = getSession(env, thiz);
+    return session->pollAsync();
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_waitAsync(JNIEnv *env, jobject thiz) {
+    auto *session = getSession(env, thiz);
+    return session->waitAsync();
+}
+
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_getOutputBuffer(JNIEnv *env, jobject thiz) {
+    auto *session = getSession(env, thiz);
+    LlamaOutputRing &ring = session->getOutputRing();
+    return env->NewDirectByteBuffer(ring.data(), (jlong) ring.capacity());
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_getOutputReadPosition(JNIEnv *env, jobject thiz) {
+    auto *session = getSession(env, thiz);
+    return (jlong) session->getOutputRing().readPosition();
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_awaitOutput(JNIEnv *env, jobject thiz, jint timeoutMs) {
+    auto *session = getSession(env, thiz);
+    return session->getOutputRing().await(timeoutMs);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_releaseOutput(JNIEnv *env, jobject thiz, jlong position) {
+    auto *session = getSession(env, thiz);
+    session->getOutputRing().release((uint64_t) position);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_stopGeneration(JNIEnv *env, jobject thiz) {
+    auto *session = getSession(env, thiz);
+    if (session != nullptr) {
+        session->stopGeneration();
+    }
+}
+
 extern "C"
 JNIEXPORT void JNICALL
 Java_com_druk_llamacpp_LlamaGenerationSession_addMessage(JNIEnv *env,
                                                          jobject thiz,
                                                          jstring message) {
-    jclass clazz = env->GetObjectClass(thiz);
-    jfieldID fid = env->GetFieldID(clazz, "nativeHandle", "J");
-    auto *session = (LlamaGenerationSession*)env->GetLongField(thiz, fid);
+    auto *session = getSession(env, thiz);
 
     session->addMessage(env->GetStringUTFChars(message, nullptr));
 }
 
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_setGrammar(JNIEnv *env, jobject thiz, jstring grammar) {
+    auto *session = getSession(env, thiz);
+    const char *grammarCStr = env->GetStringUTFChars(grammar, nullptr);
+    bool result = session->setGrammar(grammarCStr);
+    env->ReleaseStringUTFChars(grammar, grammarCStr);
+    return result;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_setJsonSchema(JNIEnv *env, jobject thiz, jstring schema) {
+    auto *session = getSession(env, thiz);
+    const char *schemaCStr = env->GetStringUTFChars(schema, nullptr);
+    bool result = session->setJsonSchema(schemaCStr);
+    env->ReleaseStringUTFChars(schema, schemaCStr);
+    return result;
+}
+
 extern "C"
 JNIEXPORT void JNICALL
 Java_com_druk_llamacpp_LlamaGenerationSession_printReport(JNIEnv *env, jobject thiz) {
-    jclass clazz = env->GetObjectClass(thiz);
-    jfieldID fid = env->GetFieldID(clazz, "nativeHandle", "J");
-    auto *session = (LlamaGenerationSession*)env->GetLongField(thiz, fid);
+    auto *session = getSession(env, thiz);
     session->printReport();
 }
 
 extern "C"
 JNIEXPORT jstring JNICALL
 Java_com_druk_llamacpp_LlamaGenerationSession_getReport(JNIEnv *env, jobject thiz) {
-    jclass clazz = env->GetObjectClass(thiz);
-    jfieldID fid = env->GetFieldID(clazz, "nativeHandle", "J");
-    auto *session = (LlamaGenerationSession*)env->GetLongField(thiz, fid);
+    auto *session = getSession(env, thiz);
     auto report = session->getReport();
     auto string = env->NewStringUTF(report.c_str());
     return string;
 }
 
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_getMetricsNative(JNIEnv *env, jobject thiz) {
+    auto *session = getSession(env, thiz);
+    // layout is mirrored by LlamaSessionMetrics.fromArray()
+    const std::vector<int64_t> values = session->getMetrics().toArray();
+    const auto count = (jsize) values.size();
+    jlongArray result = env->NewLongArray(count);
+    env->SetLongArrayRegion(result, 0, count, reinterpret_cast<const jlong *>(values.data()));
+    return result;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_saveSnapshot(JNIEnv *env, jobject thiz, jstring path) {
+    auto *session = getSession(env, thiz);
+    const char *pathCStr = env->GetStringUTFChars(path, nullptr);
+    bool result = session->saveSnapshot(pathCStr);
+    env->ReleaseStringUTFChars(path, pathCStr);
+    return result;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_druk_llamacpp_LlamaGenerationSession_restoreSnapshot(JNIEnv *env, jobject thiz, jstring path) {
+    auto *session = getSession(env, thiz);
+    const char *pathCStr = env->GetStringUTFChars(path, nullptr);
+    bool result = session->restoreSnapshot(pathCStr);
+    env->ReleaseStringUTFChars(path, pathCStr);
+    return result;
+}
+
 extern "C" JNIEXPORT void JNICALL Java_com_druk_llamacpp_LlamaGenerationSession_destroy
         (JNIEnv *env, jobject obj) {
-    jclass clazz = env->GetObjectClass(obj);
-    jfieldID fid = env->GetFieldID(clazz, "nativeHandle", "J");
-    auto *session = (LlamaGenerationSession*)env->GetLongField(obj, fid);
+    auto *session = getSession(env, obj);
 
     if (session != nullptr) {
         delete session;
-        env->SetLongField(obj, fid, (long)nullptr);
+        env->SetLongField(obj, g_jni.sessionNativeHandle, (long)nullptr);
         __android_log_print(ANDROID_LOG_DEBUG, "Llama", "Destroy");
     }
 }
 
-gpt_params initLlamaCpp() {
-    gpt_params params;
+extern "C"
+JNIEXPORT jint JNICALL
+Java_com_druk_llamacpp_LlamaEmbeddingSession_getDimension(JNIEnv *env, jobject thiz) {
+    auto *session = getEmbeddingSession(env, thiz);
+    return session->dimension();
+}
 
-#ifndef LOG_DISABLE_LOGS
-    LOG("Log start\n");
-    llama_log_set(llama_log_callback_logTee, nullptr);
-#endif // LOG_DISABLE_LOGS
+extern "C"
+JNIEXPORT jfloatArray JNICALL
+Java_com_druk_llamacpp_LlamaEmbeddingSession_embed(JNIEnv *env, jobject thiz, jobjectArray texts) {
+    auto *session = getEmbeddingSession(env, thiz);
+
+    const jsize n_texts = env->GetArrayLength(texts);
+    std::vector<std::string> inputs;
+    inputs.reserve(n_texts);
+    for (jsize i = 0; i < n_texts; i++) {
+        auto text = (jstring) env->GetObjectArrayElement(texts, i);
+        const char *textCStr = env->GetStringUTFChars(text, nullptr);
+        inputs.emplace_back(textCStr);
+        env->ReleaseStringUTFChars(text, textCStr);
+        env->DeleteLocalRef(text);
+    }
 
-    gpt_init();
+    const std::vector<float> embeddings = session->embed(inputs);
+    const auto count = (jsize) embeddings.size();
+    jfloatArray result = env->NewFloatArray(count);
+    env->SetFloatArrayRegion(result, 0, count, embeddings.data());
+    return result;
+}
+
+extern "C" JNIEXPORT void JNICALL Java_com_druk_llamacpp_LlamaEmbeddingSession_destroy
+        (JNIEnv *env, jobject obj) {
+    auto *session = getEmbeddingSession(env, obj);
 
-    if (params.logits_all) {
-        printf("\n************\n");
-        printf("%s: please use the 'perplexity' tool for perplexity calculations\n", __func__);
-        printf("************\n\n");
+    if (session != nullptr) {
+        delete session;
+        env->SetLongField(obj, g_jni.embeddingSessionNativeHandle, (long)nullptr);
     }
+}
 
-    if (params.embedding) {
-        printf("\n************\n");
-        printf("%s: please use the 'embedding' tool for embedding calculations\n", __func__);
-        printf("************\n\n");
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_com_druk_llamacpp_LlamaVectorStore_openNative(JNIEnv *env, jobject thiz, jstring path, jint dimension) {
+    auto *store = new LlamaVectorStore();
+    const char *pathCStr = env->GetStringUTFChars(path, nullptr);
+    bool result = store->open(pathCStr, (uint32_t) dimension);
+    env->ReleaseStringUTFChars(path, pathCStr);
+    if (!result) {
+        delete store;
+        return 0;
     }
+    return (jlong) store;
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_com_druk_llamacpp_LlamaVectorStore_getDimension(JNIEnv *env, jobject thiz) {
+    auto *store = getVectorStore(env, thiz);
+    return (jint) store->dim();
+}
 
-    if (params.n_ctx != 0 && params.n_ctx < 8) {
-        LOG("%s: warning: minimum context size is 8, using minimum size.\n", __func__);
-        params.n_ctx = 8;
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_com_druk_llamacpp_LlamaVectorStore_getSize(JNIEnv *env, jobject thiz) {
+    auto *store = getVectorStore(env, thiz);
+    return (jlong) store->size();
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_com_druk_llamacpp_LlamaVectorStore_add(JNIEnv *env, jobject thiz, jfloatArray vectors) {
+    auto *store = getVectorStore(env, thiz);
+    const jsize length = env->GetArrayLength(vectors);
+    if (store->dim() == 0 || length % store->dim() != 0) {
+        return -1;
     }
+    jfloat *values = env->GetFloatArrayElements(vectors, nullptr);
+    const int64_t first = store->add(values, length / store->dim());
+    env->ReleaseFloatArrayElements(vectors, values, JNI_ABORT);
+    return first;
+}
 
-    if (params.rope_freq_base != 0.0) {
-        LOG("%s: warning: changing RoPE frequency base to %g.\n", __func__, params.rope_freq_base);
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_com_druk_llamacpp_LlamaVectorStore_searchNative(JNIEnv *env, jobject thiz, jfloatArray query, jint k,
+                                                     jint threads, jfloatArray scores) {
+    auto *store = getVectorStore(env, thiz);
+    if (env->GetArrayLength(query) != (jsize) store->dim() || k <= 0) {
+        return env->NewLongArray(0);
     }
 
-    if (params.rope_freq_scale != 0.0) {
-        LOG("%s: warning: scaling RoPE frequency by %g.\n", __func__, params.rope_freq_scale);
+    jfloat *values = env->GetFloatArrayElements(query, nullptr);
+    const std::vector<LlamaVectorHit> hits = store->search(values, (size_t) k, threads);
+    env->ReleaseFloatArrayElements(query, values, JNI_ABORT);
+
+    // scores has k elements, the hits are at most k
+    const auto count = (jsize) hits.size();
+    std::vector<jlong> indices(count);
+    std::vector<jfloat> hitScores(count);
+    for (jsize i = 0; i < count; i++) {
+        indices[i] = (jlong) hits[i].index;
+        hitScores[i] = hits[i].score;
     }
+    env->SetFloatArrayRegion(scores, 0, count, hitScores.data());
+    jlongArray result = env->NewLongArray(count);
+    env->SetLongArrayRegion(result, 0, count, indices.data());
+    return result;
+}
 
-    LOG("%s: build = %d (%s)\n",      __func__, LLAMA_BUILD_NUMBER, LLAMA_COMMIT);
-    LOG("%s: built with %s for %s\n", __func__, LLAMA_COMPILER, LLAMA_BUILD_TARGET);
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_druk_llamacpp_LlamaVectorStore_close(JNIEnv *env, jobject thiz) {
+    auto *store = getVectorStore(env, thiz);
+    if (store != nullptr) {
+        delete store;
+        env->SetLongField(thiz, g_jni.vectorStoreNativeHandle, (long)nullptr);
+    }
+}
 
-    LOG("%s: llama backend init\n", __func__);
-    llama_backend_init();
-    llama_numa_init(params.numa);
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_com_druk_llamacpp_LlamaHttpServer_createNative(JNIEnv *env, jobject thiz, jobject model, jstring name,
+                                                   jint max_tokens) {
+    auto *llamaModel = getModel(env, model);
+    const char *nameCStr = env->GetStringUTFChars(name, nullptr);
+    auto *server = new LlamaHttpServer(*llamaModel, nameCStr, max_tokens);
+    env->ReleaseStringUTFChars(name, nameCStr);
+    return (jlong) server;
+}
 
-    params.cpuparams.n_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
-    params.cpuparams_batch.n_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+extern "C"
+JNIEXPORT jint JNICALL
+Java_com_druk_llamacpp_LlamaHttpServer_listenTcp(JNIEnv *env, jobject thiz, jint port) {
+    auto *server = getHttpServer(env, thiz);
+    if (port < 0 || port > 65535 || !server->listenTcp((uint16_t) port)) {
+        return -1;
+    }
+    return server->getPort();
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_druk_llamacpp_LlamaHttpServer_listenUnix(JNIEnv *env, jobject thiz, jstring path) {
+    auto *server = getHttpServer(env, thiz);
+    const char *pathCStr = env->GetStringUTFChars(path, nullptr);
+    bool result = server->listenUnix(pathCStr);
+    env->ReleaseStringUTFChars(path, pathCStr);
+    return result;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_druk_llamacpp_LlamaHttpServer_start(JNIEnv *env, jobject thiz) {
+    auto *server = getHttpServer(env, thiz);
+    return server->start();
+}
 
-    return params;
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_druk_llamacpp_LlamaHttpServer_close(JNIEnv *env, jobject thiz) {
+    auto *server = getHttpServer(env, thiz);
+    if (server != nullptr) {
+        delete server;
+        env->SetLongField(thiz, g_jni.httpServerNativeHandle, (long)nullptr);
+    }
 }
@@ -0,0 +1,28 @@
+#ifndef LMPLAYGROUND_TEST_CHECK_H
+#define LMPLAYGROUND_TEST_CHECK_H
+
+#include <cstdio>
+
+// A failed check is reported with its location and fails the test, the remaining checks still run
+static int test_failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(actual, expected) \
+    do { \
+        const auto check_actual = (actual); \
+        const auto check_expected = (expected); \
+        if (!(check_actual == check_expected)) { \
+            fprintf(stderr, "%s:%d: check failed: %s == %s (%lld vs %lld)\n", __FILE__, __LINE__, \
+                    #actual, #expected, (long long) check_actual, (long long) check_expected); \
+            test_failures++; \
+        } \
+    } while (0)
+
+#endif //LMPLAYGROUND_TEST_CHECK_H
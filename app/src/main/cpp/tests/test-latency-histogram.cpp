@@ -0,0 +1,86 @@
+//
+// Host test of LlamaLatencyHistogram: percentiles are exact below 8 us and otherwise the upper
+// bound of a bucket at most 1/8 wider than its values, clamped to the maximum.
+//
+
+#include "LlamaMetrics.h"
+#include "test-check.h"
+
+#include <cstdint>
+
+static void testEmpty() {
+    const LlamaLatencyHistogram histogram;
+    CHECK_EQ(histogram.count(), 0);
+    CHECK_EQ(histogram.total(), 0);
+    CHECK_EQ(histogram.max(), 0);
+    CHECK_EQ(histogram.percentile(0.5), 0);
+    CHECK_EQ(histogram.percentile(1.0), 0);
+}
+
+static void testSmallValuesAreExact() {
+    LlamaLatencyHistogram histogram;
+    for (int64_t us : {3, 5, 0, 7, 1}) {
+        histogram.record(us);
+    }
+    CHECK_EQ(histogram.count(), 5);
+    CHECK_EQ(histogram.total(), 16);
+    CHECK_EQ(histogram.max(), 7);
+    CHECK_EQ(histogram.percentile(0.0), 0);
+    CHECK_EQ(histogram.percentile(0.2), 0);
+    CHECK_EQ(histogram.percentile(0.4), 1);
+    CHECK_EQ(histogram.percentile(0.5), 3);
+    CHECK_EQ(histogram.percentile(0.8), 5);
+    CHECK_EQ(histogram.percentile(1.0), 7);
+}
+
+static void testRanks() {
+    LlamaLatencyHistogram histogram;
+    for (int64_t us = 1; us <= 100; us++) {
+        histogram.record(us);
+    }
+    CHECK_EQ(histogram.count(), 100);
+    CHECK_EQ(histogram.total(), 5050);
+    // the 50th value is in [48, 51]
+    CHECK_EQ(histogram.percentile(0.5), 51);
+    // the 90th value is in [88, 95]
+    CHECK_EQ(histogram.percentile(0.9), 95);
+    // the 99th value is in [96, 103], clamped to the maximum
+    CHECK_EQ(histogram.percentile(0.99), 100);
+    CHECK_EQ(histogram.percentile(1.0), 100);
+}
+
+static void testRelativeError() {
+    // every value is reported at most 1/8 above itself when it is not the maximum, the first
+    // one that is not is kept
+    const int64_t large = int64_t(1) << 36;
+    int64_t first_wrong = -1;
+    for (int64_t us = 0; us < (int64_t(1) << 34); us += us < 4096 ? 1 : us / 37) {
+        LlamaLatencyHistogram histogram;
+        histogram.record(us);
+        histogram.record(large);
+        const int64_t reported = histogram.percentile(0.5);
+        if (first_wrong < 0 && (reported < us || reported > us + us / 8)) {
+            first_wrong = us;
+        }
+    }
+    CHECK_EQ(first_wrong, -1);
+}
+
+static void testNegative() {
+    LlamaLatencyHistogram histogram;
+    histogram.record(-5);
+    histogram.record(10);
+    CHECK_EQ(histogram.count(), 2);
+    // a negative value, from a clock that went backwards, counts as 0
+    CHECK_EQ(histogram.percentile(0.5), 0);
+    CHECK_EQ(histogram.percentile(1.0), 10);
+}
+
+int main() {
+    testEmpty();
+    testSmallValuesAreExact();
+    testRanks();
+    testRelativeError();
+    testNegative();
+    return test_failures == 0 ? 0 : 1;
+}
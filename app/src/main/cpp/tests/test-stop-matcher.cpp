@@ -0,0 +1,105 @@
+//
+// Host test of LlamaStopMatcher: stop strings split across pieces, overlapping stop strings
+// and matches that are only found through failure links.
+//
+
+#include "LlamaStopMatcher.h"
+#include "test-check.h"
+
+#include <string>
+#include <vector>
+
+// Feeds the pieces in order, returns the first match and the index of the piece it ended in
+static std::pair<int32_t, int> feedPieces(const LlamaStopMatcher &matcher, const std::vector<std::string> &pieces) {
+    int32_t state = LlamaStopMatcher::INITIAL_STATE;
+    for (size_t i = 0; i < pieces.size(); i++) {
+        const int32_t match = matcher.feed(state, pieces[i].data(), pieces[i].size());
+        if (match >= 0) {
+            return {match, (int) i};
+        }
+    }
+    return {-1, -1};
+}
+
+static void testEmpty() {
+    const LlamaStopMatcher matcher;
+    CHECK(matcher.empty());
+    CHECK_EQ(feedPieces(matcher, {"anything at all"}).first, -1);
+
+    const LlamaStopMatcher no_strings({}, nullptr);
+    CHECK(no_strings.empty());
+    CHECK(!no_strings.isStopToken(0));
+}
+
+static void testSplitAcrossPieces() {
+    const LlamaStopMatcher matcher({"<|im_end|>"}, nullptr);
+    CHECK(!matcher.empty());
+    CHECK(feedPieces(matcher, {"Hello", " world", "<|im", "_", "end|>"}) == std::make_pair(0, 4));
+    CHECK(feedPieces(matcher, {"<", "|", "im_end", "|", ">", "more"}) == std::make_pair(0, 4));
+    CHECK(feedPieces(matcher, {"text<|im_end|>text"}) == std::make_pair(0, 0));
+    // a prefix that is abandoned must not be resumed later
+    CHECK_EQ(feedPieces(matcher, {"<|im", " and then ", "_end|>"}).first, -1);
+    CHECK_EQ(feedPieces(matcher, {"<|im_end|"}).first, -1);
+}
+
+static void testFailureLinks() {
+    // "aab" in "aaab" is only found by falling back from "aa" to "a"
+    const LlamaStopMatcher repeat({"aab"}, nullptr);
+    CHECK(feedPieces(repeat, {"a", "a", "a", "b"}) == std::make_pair(0, 3));
+
+    // "abcd" fails at 'x' and must continue in "bcx" instead of starting over
+    const LlamaStopMatcher shifted({"abcd", "bcx"}, nullptr);
+    CHECK(feedPieces(shifted, {"ab", "cx"}) == std::make_pair(1, 1));
+    CHECK(feedPieces(shifted, {"ab", "cd"}) == std::make_pair(0, 1));
+
+    // the same bytes split differently give the same result
+    const std::string text = "ushers";
+    const LlamaStopMatcher classic({"he", "she", "his", "hers"}, nullptr);
+    for (size_t split = 0; split <= text.size(); split++) {
+        int32_t state = LlamaStopMatcher::INITIAL_STATE;
+        int32_t match = classic.feed(state, text.data(), split);
+        if (match < 0) {
+            match = classic.feed(state, text.data() + split, text.size() - split);
+        }
+        // "she" and "he" both end at the fourth byte, the longer one is the node that is reached
+        CHECK_EQ(match, 1);
+    }
+}
+
+static void testOverlappingStrings() {
+    // a stop string inside a longer one is reported as soon as it ends
+    const LlamaStopMatcher inner({"abcdef", "cd"}, nullptr);
+    CHECK(feedPieces(inner, {"abc", "def"}) == std::make_pair(1, 1));
+
+    // the same stop string twice reports the first one
+    const LlamaStopMatcher duplicate({"stop", "stop"}, nullptr);
+    CHECK_EQ(feedPieces(duplicate, {"please stop"}).first, 0);
+}
+
+static void testIndependentStreams() {
+    const LlamaStopMatcher matcher({"END"}, nullptr);
+    int32_t first = LlamaStopMatcher::INITIAL_STATE;
+    int32_t second = LlamaStopMatcher::INITIAL_STATE;
+    CHECK_EQ(matcher.feed(first, "E", 1), -1);
+    CHECK_EQ(matcher.feed(second, "xx", 2), -1);
+    CHECK_EQ(matcher.feed(second, "ND", 2), -1);
+    CHECK_EQ(matcher.feed(first, "ND", 2), 0);
+}
+
+static void testNonAsciiBytes() {
+    const std::string stop = "\xe2\x80\x94stop";
+    const LlamaStopMatcher matcher({stop}, nullptr);
+    // split inside the multi-byte character, as token pieces can be
+    CHECK(feedPieces(matcher, {"a \xe2", "\x80", "\x94st", "op"}) == std::make_pair(0, 3));
+    CHECK_EQ(feedPieces(matcher, {"a \xe2\x80\x93stop"}).first, -1);
+}
+
+int main() {
+    testEmpty();
+    testSplitAcrossPieces();
+    testFailureLinks();
+    testOverlappingStrings();
+    testIndependentStreams();
+    testNonAsciiBytes();
+    return test_failures == 0 ? 0 : 1;
+}
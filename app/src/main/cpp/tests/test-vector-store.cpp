@@ -0,0 +1,168 @@
+//
+// Host test of LlamaVectorStore: appending and searching, reopening, and recovering a store
+// whose last add() was interrupted before or after its records reached the file.
+//
+
+#include "LlamaVectorStore.h"
+#include "test-check.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const uint32_t DIM = 40;
+// see the file layout in LlamaVectorStore.h: a float scale and DIM int8 values padded to 64
+static const off_t HEADER_SIZE = 32;
+static const off_t RECORD_SIZE = sizeof(float) + 64;
+
+// n random unit vectors of DIM values
+static std::vector<float> randomVectors(size_t n, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> normal;
+    std::vector<float> vectors(n * DIM);
+    for (size_t i = 0; i < n; i++) {
+        float *vector = vectors.data() + i * DIM;
+        double norm = 0;
+        for (uint32_t j = 0; j < DIM; j++) {
+            vector[j] = normal(rng);
+            norm += vector[j] * vector[j];
+        }
+        for (uint32_t j = 0; j < DIM; j++) {
+            vector[j] = (float) (vector[j] / std::sqrt(norm));
+        }
+    }
+    return vectors;
+}
+
+static off_t fileSize(const std::string &path) {
+    struct stat st = {};
+    return stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+// The best hit for a stored vector is itself, with a score close to 1
+static void checkFinds(const LlamaVectorStore &store, const float *vector, uint64_t index) {
+    const auto hits = store.search(vector, 3);
+    CHECK(!hits.empty());
+    if (!hits.empty()) {
+        CHECK_EQ(hits[0].index, index);
+        CHECK(std::fabs(hits[0].score - 1.0f) < 0.02f);
+    }
+}
+
+static void testAddAndSearch(const std::string &path) {
+    const auto vectors = randomVectors(8, 1);
+    LlamaVectorStore store;
+    CHECK(store.open(path, DIM));
+    CHECK_EQ(store.dim(), DIM);
+    CHECK_EQ(store.size(), 0);
+    CHECK(store.search(vectors.data(), 3).empty());
+
+    CHECK_EQ(store.add(vectors.data(), 5), 0);
+    CHECK_EQ(store.add(vectors.data() + 5 * DIM, 3), 5);
+    CHECK_EQ(store.size(), 8);
+    for (uint64_t i = 0; i < 8; i++) {
+        checkFinds(store, vectors.data() + i * DIM, i);
+    }
+
+    // hits are sorted best first and k is capped by the size
+    const auto hits = store.search(vectors.data(), 20);
+    CHECK_EQ(hits.size(), 8);
+    for (size_t i = 1; i < hits.size(); i++) {
+        CHECK(hits[i - 1].score >= hits[i].score);
+    }
+}
+
+static void testReopen(const std::string &path) {
+    const auto vectors = randomVectors(8, 1);
+    LlamaVectorStore store;
+    CHECK(!store.open(path, DIM + 1));
+    CHECK(store.open(path, 0));
+    CHECK_EQ(store.dim(), DIM);
+    CHECK_EQ(store.size(), 8);
+    checkFinds(store, vectors.data() + 6 * DIM, 6);
+}
+
+// Records written without the count that would have followed them
+static void testInterruptedAfterRecords(const std::string &path) {
+    const off_t size = fileSize(path);
+    const int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+    CHECK(fd >= 0);
+    if (fd >= 0) {
+        const std::vector<uint8_t> garbage(300, 0x7f);
+        CHECK_EQ(write(fd, garbage.data(), garbage.size()), (ssize_t) garbage.size());
+        close(fd);
+    }
+    CHECK(fileSize(path) > size);
+
+    const auto vectors = randomVectors(8, 1);
+    const auto more = randomVectors(1, 2);
+    {
+        LlamaVectorStore store;
+        CHECK(store.open(path, DIM));
+        CHECK_EQ(store.size(), 8);
+        checkFinds(store, vectors.data() + 7 * DIM, 7);
+        // the next add() continues the indices and writes over the uncounted records
+        CHECK_EQ(store.add(more.data(), 1), 8);
+        checkFinds(store, more.data(), 8);
+    }
+    LlamaVectorStore store;
+    CHECK(store.open(path, DIM));
+    CHECK_EQ(store.size(), 9);
+    checkFinds(store, more.data(), 8);
+    checkFinds(store, vectors.data(), 0);
+}
+
+// A count that is ahead of the records, as after a file was cut short
+static void testTruncated(const std::string &path) {
+    CHECK(fileSize(path) >= HEADER_SIZE + 9 * RECORD_SIZE);
+    CHECK(truncate(path.c_str(), HEADER_SIZE + 4 * RECORD_SIZE + RECORD_SIZE / 2) == 0);
+
+    const auto vectors = randomVectors(8, 1);
+    LlamaVectorStore store;
+    CHECK(store.open(path, DIM));
+    CHECK_EQ(store.size(), 4);
+    checkFinds(store, vectors.data() + 3 * DIM, 3);
+    CHECK_EQ(store.add(vectors.data() + 4 * DIM, 1), 4);
+    checkFinds(store, vectors.data() + 4 * DIM, 4);
+}
+
+static void testNotAStore(const std::string &path) {
+    FILE *file = fopen(path.c_str(), "w");
+    CHECK(file != nullptr);
+    if (file != nullptr) {
+        fputs("this is not a vector store, but it is longer than a header would be", file);
+        fclose(file);
+    }
+    LlamaVectorStore store;
+    CHECK(!store.open(path, DIM));
+    CHECK(!store.open(path, 0));
+    CHECK_EQ(store.add(randomVectors(1, 1).data(), 1), -1);
+}
+
+int main() {
+    char dir[] = "/tmp/lmp-test-vector-store-XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    const std::string path = std::string(dir) + "/store.bin";
+    const std::string other_path = std::string(dir) + "/other.bin";
+
+    testAddAndSearch(path);
+    testReopen(path);
+    testInterruptedAfterRecords(path);
+    testTruncated(path);
+    testNotAStore(other_path);
+
+    unlink(path.c_str());
+    unlink(other_path.c_str());
+    rmdir(dir);
+    return test_failures == 0 ? 0 : 1;
+}
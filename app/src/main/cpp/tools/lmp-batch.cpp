@@ -0,0 +1,175 @@
+//
+// Offline batch inference over a JSONL file of prompts.
+//
+// Loads the model once and runs every prompt of the input through LlamaBatchRunner on one batch
+// engine, writing a JSONL line per reply as soon as it finishes, then prints the aggregate
+// throughput to stderr.
+//
+
+#include "LlamaBatchRunner.h"
+#include "LlamaCpp.h"
+#include "common.h"
+
+#include "llama.h"
+#include "log.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct batch_args {
+    std::string model;
+    std::string input;
+    std::string output;
+    std::string system_prompt;
+    std::vector<std::string> antiprompt;
+    int32_t n_parallel = 8;
+    int32_t n_ctx = 2048;
+    int32_t n_predict = 256;
+    int32_t n_threads = -1;
+    int32_t n_threads_batch = -1;
+    int32_t n_gpu_layers = 0;
+    uint64_t memory_budget = 0;
+};
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s -m MODEL -i PROMPTS.jsonl [options]\n\n", argv0);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -m,  --model PATH         GGUF model\n");
+    fprintf(stderr, "  -i,  --input PATH         requests, one JSON object per line, - for stdin\n");
+    fprintf(stderr, "                            {\"id\": ..., \"prompt\": \"...\", \"system\": \"...\", \"n_predict\": N}\n");
+    fprintf(stderr, "  -o,  --output PATH        results, one JSON object per line (default: stdout)\n");
+    fprintf(stderr, "  -np, --parallel N         sequences decoded together (default: 8)\n");
+    fprintf(stderr, "  -s,  --system TEXT        system prompt of requests without \"system\"\n");
+    fprintf(stderr, "  -r,  --reverse-prompt TEXT  antiprompt, can be repeated\n");
+    fprintf(stderr, "  -c,  --ctx-size N         context size per sequence, 0 = training context (default: 2048)\n");
+    fprintf(stderr, "       --mem-budget MIB     memory for weights, KV cache and buffers (default: 70%% of available)\n");
+    fprintf(stderr, "  -n,  --n-predict N        max generated tokens of requests without \"n_predict\" (default: 256)\n");
+    fprintf(stderr, "  -t,  --threads N          decode threads (default: all cores)\n");
+    fprintf(stderr, "  -tb, --threads-batch N    prompt processing threads (default: same as -t)\n");
+    fprintf(stderr, "  -ngl, --n-gpu-layers N    layers to offload (default: 0)\n");
+}
+
+static bool parse_args(int argc, char ** argv, batch_args & args) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char * {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "-m" || arg == "--model") {
+            args.model = next();
+        } else if (arg == "-i" || arg == "--input") {
+            args.input = next();
+        } else if (arg == "-o" || arg == "--output") {
+            args.output = next();
+        } else if (arg == "-np" || arg == "--parallel") {
+            args.n_parallel = std::atoi(next());
+        } else if (arg == "-s" || arg == "--system") {
+            args.system_prompt = next();
+        } else if (arg == "-r" || arg == "--reverse-prompt") {
+            args.antiprompt.emplace_back(next());
+        } else if (arg == "-c" || arg == "--ctx-size") {
+            args.n_ctx = std::atoi(next());
+        } else if (arg == "--mem-budget") {
+            args.memory_budget = (uint64_t) std::atoll(next()) * 1024 * 1024;
+        } else if (arg == "-n" || arg == "--n-predict") {
+            args.n_predict = std::atoi(next());
+        } else if (arg == "-t" || arg == "--threads") {
+            args.n_threads = std::atoi(next());
+        } else if (arg == "-tb" || arg == "--threads-batch") {
+            args.n_threads_batch = std::atoi(next());
+        } else if (arg == "-ngl" || arg == "--n-gpu-layers") {
+            args.n_gpu_layers = std::atoi(next());
+        } else if (arg == "-h" || arg == "--help") {
+            return false;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return !args.model.empty() && !args.input.empty() && args.n_parallel > 0;
+}
+
+int main(int argc, char ** argv) {
+    batch_args args;
+    if (!parse_args(argc, argv, args)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::ifstream input_file;
+    if (args.input != "-") {
+        input_file.open(args.input);
+        if (!input_file) {
+            fprintf(stderr, "error: failed to open '%s'\n", args.input.c_str());
+            return 1;
+        }
+    }
+    std::istream & input = args.input == "-" ? std::cin : input_file;
+
+    std::ofstream output_file;
+    if (!args.output.empty()) {
+        output_file.open(args.output);
+        if (!output_file) {
+            fprintf(stderr, "error: failed to create '%s'\n", args.output.c_str());
+            return 1;
+        }
+    }
+    std::ostream & output = args.output.empty() ? std::cout : output_file;
+
+    gpt_params params = initLlamaCpp();
+    if (args.n_threads > 0) {
+        params.cpuparams.n_threads = args.n_threads;
+        params.cpuparams_batch.n_threads = args.n_threads;
+    }
+    if (args.n_threads_batch > 0) {
+        params.cpuparams_batch.n_threads = args.n_threads_batch;
+    }
+
+    LlamaModel model;
+    model.loadModel(params, args.model, "", "", args.antiprompt, args.n_ctx, args.n_gpu_layers,
+                    args.memory_budget, nullptr, nullptr);
+    if (model.getModelSize() == 0) {
+        fprintf(stderr, "error: failed to load model '%s'\n", args.model.c_str());
+        return 1;
+    }
+
+    LlamaBatchEngine * engine = model.createBatchEngine(args.n_parallel);
+    if (engine == nullptr) {
+        fprintf(stderr, "error: failed to create batch engine\n");
+        return 1;
+    }
+
+    LlamaBatchRunner runner(*engine, args.n_parallel);
+    runner.setDefaults(args.system_prompt, args.n_predict);
+    const bool written = runner.run(input, output);
+    const LlamaBatchRunner::Stats stats = runner.getStats();
+    delete engine;
+    model.unloadModel();
+    llama_backend_free();
+
+    if (!written) {
+        fprintf(stderr, "error: failed to write the results\n");
+        return 1;
+    }
+
+    const double t_total_s = stats.t_total_us / 1e6;
+    fprintf(stderr, "\n");
+    fprintf(stderr, "requests:     %lld (%lld invalid), %d in parallel\n", (long long) stats.n_requests,
+            (long long) stats.n_errors, args.n_parallel);
+    fprintf(stderr, "wall time:    %.2f s, %lld steps, %.2f s decoding\n", t_total_s, (long long) stats.n_steps,
+            stats.t_decode_us / 1e6);
+    fprintf(stderr, "prompt eval:  %lld tokens, %.2f tokens per second\n", (long long) stats.n_prompt_tokens,
+            t_total_s > 0.0 ? stats.n_prompt_tokens / t_total_s : 0.0);
+    fprintf(stderr, "decode:       %lld tokens, %.2f tokens per second aggregate\n",
+            (long long) stats.n_generated_tokens, t_total_s > 0.0 ? stats.n_generated_tokens / t_total_s : 0.0);
+    fprintf(stderr, "requests/min: %.1f\n", t_total_s > 0.0 ? 60.0 * (stats.n_requests - stats.n_errors) / t_total_s : 0.0);
+    return 0;
+}
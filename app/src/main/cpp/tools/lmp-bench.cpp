@@ -0,0 +1,481 @@
+//
+// Host benchmark for LlamaModel / LlamaGenerationSession.
+//
+// Drives loadModel -> createGenerationSession -> addMessage/generate over a scripted
+// conversation and reports time-to-first-token, prompt and decode throughput and peak RSS.
+//
+
+#include "LlamaCpp.h"
+#include "LlamaTrace.h"
+#include "common.h"
+
+#include "llama.h"
+#include "log.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+struct bench_args {
+    std::string model;
+    std::string model_draft;
+    std::string script;
+    std::string prompt_cache;
+    std::string system_prompt;
+    std::string input_prefix;
+    std::string input_suffix;
+    std::vector<std::string> antiprompt;
+    int32_t n_ctx = 2048;
+    int32_t n_predict = 128;
+    int32_t n_threads = -1;
+    int32_t n_threads_batch = -1;
+    int32_t n_gpu_layers = 0;
+    uint64_t memory_budget = 0;
+    std::string thread_profiles;
+    int32_t n_parallel = 0;
+    int32_t n_draft = -1;
+    bool lookup = false;
+    bool verbose = false;
+    std::string json;
+    std::string trace;
+    std::string grammar;
+    std::string json_schema;
+};
+
+static const std::vector<std::string> default_script = {
+        "Hi! Can you introduce yourself in two sentences?",
+        "Explain what a KV cache is in a transformer model.",
+        "Now summarise your previous answer as a short bullet list.",
+        "Write a haiku about running language models on a phone.",
+};
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s -m MODEL [options]\n\n", argv0);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -m,  --model PATH         GGUF model to benchmark\n");
+    fprintf(stderr, "  -md, --model-draft PATH   draft model for speculative decoding\n");
+    fprintf(stderr, "       --draft N            max draft tokens per step (default: 5)\n");
+    fprintf(stderr, "       --lookup             speculative decoding with prompt lookup (n-gram) drafts\n");
+    fprintf(stderr, "  -f,  --script PATH        conversation script, one user message per line\n");
+    fprintf(stderr, "  -s,  --system TEXT        system prompt\n");
+    fprintf(stderr, "       --prompt-cache DIR   cache the ingested system prompt in DIR\n");
+    fprintf(stderr, "       --in-prefix TEXT     input prefix\n");
+    fprintf(stderr, "       --in-suffix TEXT     input suffix\n");
+    fprintf(stderr, "  -r,  --reverse-prompt TEXT  antiprompt, can be repeated\n");
+    fprintf(stderr, "  -c,  --ctx-size N         max context size, 0 = training context (default: 2048)\n");
+    fprintf(stderr, "       --mem-budget MIB     memory for weights, KV cache and buffers (default: 70%% of available)\n");
+    fprintf(stderr, "  -n,  --n-predict N        max generated tokens per turn (default: 128)\n");
+    fprintf(stderr, "  -t,  --threads N          decode threads (default: all cores)\n");
+    fprintf(stderr, "  -tb, --threads-batch N    prompt processing threads (default: same as -t)\n");
+    fprintf(stderr, "       --tune-threads DIR   benchmark thread counts and cores, cache the profile in DIR\n");
+    fprintf(stderr, "  -ngl, --n-gpu-layers N    layers to offload (default: 0)\n");
+    fprintf(stderr, "  -np, --parallel N         run the script in N concurrent conversations on one batch engine\n");
+    fprintf(stderr, "  -v,  --verbose            print generated text\n");
+    fprintf(stderr, "       --json PATH          write the results and latency percentiles as JSON, - for stdout\n");
+    fprintf(stderr, "       --trace PATH         write a Chrome trace of the turns (needs -DLMP_TRACE=ON)\n");
+    fprintf(stderr, "       --grammar PATH       constrain every reply to the GBNF grammar in PATH\n");
+    fprintf(stderr, "       --json-schema PATH   constrain every reply to the JSON schema in PATH\n");
+}
+
+static bool parse_args(int argc, char ** argv, bench_args & args) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char * {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "-m" || arg == "--model") {
+            args.model = next();
+        } else if (arg == "-md" || arg == "--model-draft") {
+            args.model_draft = next();
+        } else if (arg == "--draft") {
+            args.n_draft = std::atoi(next());
+        } else if (arg == "--lookup") {
+            args.lookup = true;
+        } else if (arg == "-f" || arg == "--script") {
+            args.script = next();
+        } else if (arg == "-s" || arg == "--system") {
+            args.system_prompt = next();
+        } else if (arg == "--prompt-cache") {
+            args.prompt_cache = next();
+        } else if (arg == "--in-prefix") {
+            args.input_prefix = next();
+        } else if (arg == "--in-suffix") {
+            args.input_suffix = next();
+        } else if (arg == "-r" || arg == "--reverse-prompt") {
+            args.antiprompt.emplace_back(next());
+        } else if (arg == "-c" || arg == "--ctx-size") {
+            args.n_ctx = std::atoi(next());
+        } else if (arg == "--mem-budget") {
+            args.memory_budget = (uint64_t) std::atoll(next()) * 1024 * 1024;
+        } else if (arg == "-n" || arg == "--n-predict") {
+            args.n_predict = std::atoi(next());
+        } else if (arg == "-t" || arg == "--threads") {
+            args.n_threads = std::atoi(next());
+        } else if (arg == "-tb" || arg == "--threads-batch") {
+            args.n_threads_batch = std::atoi(next());
+        } else if (arg == "--tune-threads") {
+            args.thread_profiles = next();
+        } else if (arg == "-ngl" || arg == "--n-gpu-layers") {
+            args.n_gpu_layers = std::atoi(next());
+        } else if (arg == "-np" || arg == "--parallel") {
+            args.n_parallel = std::atoi(next());
+        } else if (arg == "-v" || arg == "--verbose") {
+            args.verbose = true;
+        } else if (arg == "--json") {
+            args.json = next();
+        } else if (arg == "--trace") {
+            args.trace = next();
+        } else if (arg == "--grammar") {
+            args.grammar = next();
+        } else if (arg == "--json-schema") {
+            args.json_schema = next();
+        } else if (arg == "-h" || arg == "--help") {
+            return false;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return !args.model.empty();
+}
+
+static std::vector<std::string> load_script(const std::string & path) {
+    if (path.empty()) {
+        return default_script;
+    }
+    std::vector<std::string> messages;
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "error: failed to open script '%s'\n", path.c_str());
+        exit(1);
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty()) {
+            messages.push_back(line);
+        }
+    }
+    return messages;
+}
+
+static std::string read_file(const std::string & path) {
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "error: failed to open '%s'\n", path.c_str());
+        exit(1);
+    }
+    std::ostringstream content;
+    content << file.rdbuf();
+    return content.str();
+}
+
+static long peak_rss_kb() {
+    struct rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static std::string json_string(const std::string & value) {
+    std::string result = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result + "\"";
+}
+
+static void write_trace(const bench_args & args) {
+    if (args.trace.empty()) {
+        return;
+    }
+    LlamaTrace::setEnabled(false);
+    if (!LlamaTrace::writeChromeTrace(args.trace)) {
+        fprintf(stderr, "error: failed to write the trace to '%s' (built without LMP_TRACE?)\n", args.trace.c_str());
+    }
+}
+
+static double tokens_per_second(int32_t n_tokens, double t_ms) {
+    return t_ms > 0.0 ? 1e3 * n_tokens / t_ms : 0.0;
+}
+
+// Every client walks through the script in its own conversation, sending the next message as
+// soon as the reply to the previous one is complete; the engine is driven from this thread.
+static int run_parallel(LlamaModel & model, const bench_args & args, const std::vector<std::string> & script) {
+    LlamaBatchEngine * engine = model.createBatchEngine(args.n_parallel);
+    if (engine == nullptr) {
+        fprintf(stderr, "error: failed to create batch engine\n");
+        return 1;
+    }
+
+    struct client {
+        int32_t conversation = -1;
+        size_t next_message = 0;
+        int64_t t_submit = 0;
+        bool waiting_first_token = false;
+    };
+    std::vector<client> clients(args.n_parallel);
+
+    double ttft_sum_ms = 0.0;
+    double ttft_max_ms = 0.0;
+    int32_t n_turns = 0;
+
+    std::function<void(client &)> submit_next = [&](client & c) {
+        if (c.next_message >= script.size()) {
+            return;
+        }
+        const std::string & message = script[c.next_message++];
+        c.t_submit = ggml_time_us();
+        c.waiting_first_token = true;
+        engine->submit(c.conversation, message, args.n_predict, [&, &c = c](const std::string & piece, bool finished) {
+            if (c.waiting_first_token && !piece.empty()) {
+                const double ttft_ms = (ggml_time_us() - c.t_submit) / 1e3;
+                ttft_sum_ms += ttft_ms;
+                ttft_max_ms = std::max(ttft_max_ms, ttft_ms);
+                c.waiting_first_token = false;
+            }
+            if (args.verbose && !piece.empty()) {
+                printf("[%d] %s\n", c.conversation, piece.c_str());
+            }
+            if (finished) {
+                n_turns++;
+                submit_next(c);
+            }
+        });
+    };
+
+    const int64_t t_start = ggml_time_us();
+    for (auto & c : clients) {
+        c.conversation = engine->createConversation(args.system_prompt);
+        submit_next(c);
+    }
+    while (!engine->isIdle()) {
+        engine->step();
+    }
+    const double t_total_ms = (ggml_time_us() - t_start) / 1e3;
+
+    const LlamaBatchEngine::Stats stats = engine->getStats();
+
+    printf("\n");
+    printf("clients:      %d x %zu turns\n", args.n_parallel, script.size());
+    printf("wall time:    %.2f ms, %lld steps, %lld evictions\n", t_total_ms, (long long) stats.n_steps, (long long) stats.n_evictions);
+    printf("ttft:         avg %.2f ms, max %.2f ms\n", n_turns > 0 ? ttft_sum_ms / n_turns : 0.0, ttft_max_ms);
+    printf("prompt eval:  %lld tokens\n", (long long) stats.n_prompt_tokens);
+    printf("decode:       %lld tokens, %.2f tokens per second aggregate\n",
+           (long long) stats.n_generated_tokens, tokens_per_second((int32_t) stats.n_generated_tokens, t_total_ms));
+    printf("peak rss:     %.2f MiB\n", peak_rss_kb() / 1024.0);
+
+    delete engine;
+    return 0;
+}
+
+int main(int argc, char ** argv) {
+    bench_args args;
+    if (!parse_args(argc, argv, args)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const std::vector<std::string> script = load_script(args.script);
+    const std::string grammar = args.grammar.empty() ? "" : read_file(args.grammar);
+    const std::string json_schema = args.json_schema.empty() ? "" : read_file(args.json_schema);
+
+    gpt_params params = initLlamaCpp();
+    if (args.n_threads > 0) {
+        params.cpuparams.n_threads = args.n_threads;
+        params.cpuparams_batch.n_threads = args.n_threads;
+    }
+    if (args.n_threads_batch > 0) {
+        params.cpuparams_batch.n_threads = args.n_threads_batch;
+    }
+    params.prompt = args.system_prompt;
+    if (args.n_draft >= 0) {
+        params.n_draft = args.n_draft;
+    }
+
+    const int64_t t_load_start = ggml_time_us();
+
+    LlamaModel model;
+    model.loadModel(params,
+                    args.model,
+                    args.input_prefix,
+                    args.input_suffix,
+                    args.antiprompt,
+                    args.n_ctx,
+                    args.n_gpu_layers,
+                    args.memory_budget,
+                    nullptr,
+                    nullptr);
+    if (model.getModelSize() == 0) {
+        fprintf(stderr, "error: failed to load model '%s'\n", args.model.c_str());
+        return 1;
+    }
+
+    if (!args.prompt_cache.empty()) {
+        model.setPromptCacheDirectory(args.prompt_cache);
+    }
+
+    if (!args.thread_profiles.empty()) {
+        const LlamaThreadProfile profile = model.tuneThreads(args.thread_profiles);
+        params.cpuparams.n_threads = profile.n_threads;
+        params.cpuparams_batch.n_threads = profile.n_threads_batch;
+    }
+
+    if (!args.model_draft.empty() && !model.loadDraftModel(args.model_draft)) {
+        fprintf(stderr, "error: failed to load draft model '%s'\n", args.model_draft.c_str());
+        return 1;
+    }
+    model.setPromptLookup(args.lookup);
+    LlamaTrace::setEnabled(!args.trace.empty());
+
+    if (args.n_parallel > 0) {
+        if (!grammar.empty() || !json_schema.empty()) {
+            fprintf(stderr, "warning: --grammar and --json-schema are ignored with --parallel\n");
+        }
+        const int ret = run_parallel(model, args, script);
+        write_trace(args);
+        model.unloadModel();
+        llama_backend_free();
+        return ret;
+    }
+
+    LlamaGenerationSession * session = model.createGenerationSession();
+
+    const double t_load_ms = (ggml_time_us() - t_load_start) / 1e3;
+
+    printf("\n");
+    printf("model: %s (%.2f MiB)\n", args.model.c_str(), model.getModelSize() / 1024.0 / 1024.0);
+    printf("load + session init: %.2f ms\n", t_load_ms);
+    const LlamaMemoryPlan & plan = model.getMemoryPlan();
+    printf("memory plan: n_ctx %d (%s KV), kv %.1f MiB, compute %.1f MiB, draft %.1f MiB, budget %.1f MiB%s\n",
+           plan.n_ctx, ggml_type_name(plan.type_k), plan.kv_bytes / 1024.0 / 1024.0,
+           plan.compute_bytes / 1024.0 / 1024.0, plan.draft_bytes / 1024.0 / 1024.0, plan.budget_bytes / 1024.0 / 1024.0,
+           plan.fits ? "" : " (does not fit)");
+    printf("threads: %d decode / %d batch\n", params.cpuparams.n_threads, params.cpuparams_batch.n_threads);
+    printf("\n");
+    printf("| turn | prompt tok |  ttft ms | prompt tok/s | gen tok | decode tok/s |\n");
+    printf("|-----:|-----------:|---------:|-------------:|--------:|-------------:|\n");
+
+    double ttft_sum_ms = 0.0;
+    double ttft_max_ms = 0.0;
+    int32_t n_turns = 0;
+    int32_t n_truncated = 0;
+
+    for (const auto & message : script) {
+        const llama_perf_context_data before = session->getPerfData();
+
+        const int64_t t_turn_start = ggml_time_us();
+        int64_t t_first_token = -1;
+        int32_t n_generated = 0;
+
+        session->addMessage(message.c_str());
+        if (!grammar.empty() && !session->setGrammar(grammar)) {
+            fprintf(stderr, "error: failed to parse the grammar\n");
+            return 1;
+        }
+        if (!json_schema.empty() && !session->setJsonSchema(json_schema)) {
+            fprintf(stderr, "error: failed to convert the JSON schema\n");
+            return 1;
+        }
+
+        if (args.verbose) {
+            printf("\n> %s\n", message.c_str());
+        }
+        bool reply_ended = false;
+        while (n_generated < args.n_predict) {
+            const int status = session->generate([&](std::string_view piece) {
+                if (t_first_token < 0) {
+                    t_first_token = ggml_time_us();
+                }
+                n_generated++;
+                if (args.verbose) {
+                    printf("%.*s", (int) piece.size(), piece.data());
+                    fflush(stdout);
+                }
+            });
+            if (status != 0) {
+                reply_ended = true;
+                break;
+            }
+        }
+        if (!reply_ended) {
+            // cut at n_predict: close the reply, so that the next turn follows a well-formed one
+            session->endReply();
+            n_truncated++;
+        }
+        if (args.verbose) {
+            printf("\n\n");
+        }
+
+        const llama_perf_context_data after = session->getPerfData();
+
+        const int32_t n_prompt = after.n_p_eval - before.n_p_eval;
+        const int32_t n_eval = after.n_eval - before.n_eval;
+        const double ttft_ms = t_first_token < 0 ? 0.0 : (t_first_token - t_turn_start) / 1e3;
+
+        ttft_sum_ms += ttft_ms;
+        ttft_max_ms = std::max(ttft_max_ms, ttft_ms);
+        n_turns++;
+
+        printf("| %4d | %10d | %8.2f | %12.2f | %7d | %12.2f |\n",
+               n_turns,
+               n_prompt,
+               ttft_ms,
+               tokens_per_second(n_prompt, after.t_p_eval_ms - before.t_p_eval_ms),
+               n_generated,
+               tokens_per_second(n_eval, after.t_eval_ms - before.t_eval_ms));
+    }
+
+    const llama_perf_context_data total = session->getPerfData();
+
+    printf("\n");
+    printf("ttft:         avg %.2f ms, max %.2f ms\n", n_turns > 0 ? ttft_sum_ms / n_turns : 0.0, ttft_max_ms);
+    printf("truncated:    %d of %d replies cut at %d tokens\n", n_truncated, n_turns, args.n_predict);
+    printf("prompt eval:  %d tokens, %.2f tokens per second\n", total.n_p_eval, tokens_per_second(total.n_p_eval, total.t_p_eval_ms));
+    printf("decode:       %d tokens, %.2f tokens per second\n", total.n_eval, tokens_per_second(total.n_eval, total.t_eval_ms));
+    printf("peak rss:     %.2f MiB\n", peak_rss_kb() / 1024.0);
+
+    const LlamaSessionMetrics metrics = session->getMetrics();
+    printf("token latency: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           metrics.decode.percentile(0.5) / 1e3, metrics.decode.percentile(0.9) / 1e3,
+           metrics.decode.percentile(0.99) / 1e3, metrics.decode.max() / 1e3);
+    if (!args.json.empty()) {
+        FILE * json = args.json == "-" ? stdout : fopen(args.json.c_str(), "w");
+        if (json == nullptr) {
+            fprintf(stderr, "error: failed to open '%s'\n", args.json.c_str());
+        } else {
+            fprintf(json, "{\"model\": %s, \"turns\": %d, \"truncated_turns\": %d, \"load_ms\": %.3f, "
+                          "\"prompt_tokens_per_second\": %.3f, \"decode_tokens_per_second\": %.3f, "
+                          "\"peak_rss_kb\": %ld, \"metrics\": %s}\n",
+                    json_string(args.model).c_str(), n_turns, n_truncated, t_load_ms,
+                    tokens_per_second(total.n_p_eval, total.t_p_eval_ms),
+                    tokens_per_second(total.n_eval, total.t_eval_ms),
+                    peak_rss_kb(), metrics.toJson().c_str());
+            if (json != stdout) {
+                fclose(json);
+            }
+        }
+    }
+    if (!args.model_draft.empty() || args.lookup || !grammar.empty() || !json_schema.empty()) {
+        printf("\n%s", session->getReport().c_str());
+    }
+
+    write_trace(args);
+    delete session;
+    model.unloadModel();
+    llama_backend_free();
+
+    return 0;
+}
@@ -0,0 +1,148 @@
+//
+// Host benchmark for chat message formatting.
+//
+// Replays a long conversation through the chat template and the tokenizer and reports the
+// per-message cost of incremental formatting next to formatting against the whole history.
+// Only the vocabulary is loaded, no weights.
+//
+
+#include "LlamaChatFormatter.h"
+#include "common.h"
+
+#include "ggml.h"
+#include "llama.h"
+#include "log.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+struct chat_bench_args {
+    std::string model;
+    std::string chat_template;
+    int32_t n_turns = 200;
+    int32_t n_repeat = 5;
+};
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s -m MODEL [options]\n\n", argv0);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -m,  --model PATH         GGUF model whose vocabulary and chat template to use\n");
+    fprintf(stderr, "       --chat-template NAME template override (default: the model's)\n");
+    fprintf(stderr, "  -n,  --turns N            conversation length in turns (default: 200)\n");
+    fprintf(stderr, "  -r,  --repeat N           runs to average (default: 5)\n");
+}
+
+static bool parse_args(int argc, char ** argv, chat_bench_args & args) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char * {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "-m" || arg == "--model") {
+            args.model = next();
+        } else if (arg == "--chat-template") {
+            args.chat_template = next();
+        } else if (arg == "-n" || arg == "--turns") {
+            args.n_turns = std::atoi(next());
+        } else if (arg == "-r" || arg == "--repeat") {
+            args.n_repeat = std::atoi(next());
+        } else if (arg == "-h" || arg == "--help") {
+            return false;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return !args.model.empty() && args.n_turns > 0 && args.n_repeat > 0;
+}
+
+static std::string user_message(int32_t turn) {
+    return "Turn " + std::to_string(turn) + ": could you summarize what we discussed so far and suggest "
+           "one more thing to look at?";
+}
+
+static std::string assistant_message(int32_t turn) {
+    return "Sure. In turn " + std::to_string(turn) + " we went over the previous points once more. "
+           "A good next step would be to measure it on a real device and compare the numbers.";
+}
+
+// Per-turn microseconds to format and tokenize the user message of each turn, the same work
+// addMessage() does. The assistant replies are formatted outside of the timing, as the
+// session does it when the reply ends.
+static std::vector<double> run(const llama_model * model, const chat_bench_args & args, bool incremental) {
+    LlamaChatFormatter formatter(model, args.chat_template);
+    std::vector<llama_chat_msg> chat_msgs;
+    formatter.addAndFormat(chat_msgs, "system", "You are a helpful assistant.");
+
+    std::vector<double> t_us(args.n_turns);
+    for (int32_t turn = 0; turn < args.n_turns; turn++) {
+        const int64_t t_start = ggml_time_us();
+        const std::string formatted = incremental
+                                      ? formatter.addAndFormat(chat_msgs, "user", user_message(turn + 1))
+                                      : formatter.addAndFormatFull(chat_msgs, "user", user_message(turn + 1), true);
+        const std::vector<llama_token> tokens = ::llama_tokenize(model, formatted, false, true);
+        t_us[turn] = (double) (ggml_time_us() - t_start);
+
+        if (incremental) {
+            formatter.addAndFormat(chat_msgs, "assistant", assistant_message(turn + 1));
+        } else {
+            formatter.addAndFormatFull(chat_msgs, "assistant", assistant_message(turn + 1), false);
+        }
+    }
+    return t_us;
+}
+
+int main(int argc, char ** argv) {
+    chat_bench_args args;
+    if (!parse_args(argc, argv, args)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    llama_backend_init();
+    llama_model_params mparams = llama_model_default_params();
+    mparams.vocab_only = true;
+    llama_model * model = llama_load_model_from_file(args.model.c_str(), mparams);
+    if (model == nullptr) {
+        fprintf(stderr, "error: failed to load model '%s'\n", args.model.c_str());
+        return 1;
+    }
+
+    std::vector<double> t_incremental(args.n_turns, 0.0);
+    std::vector<double> t_full(args.n_turns, 0.0);
+    for (int32_t i = 0; i < args.n_repeat; i++) {
+        const std::vector<double> incremental = run(model, args, true);
+        const std::vector<double> full = run(model, args, false);
+        for (int32_t turn = 0; turn < args.n_turns; turn++) {
+            t_incremental[turn] += incremental[turn] / args.n_repeat;
+            t_full[turn] += full[turn] / args.n_repeat;
+        }
+    }
+
+    printf("\n");
+    printf("model: %s, %d turns, %d runs\n", args.model.c_str(), args.n_turns, args.n_repeat);
+    printf("\n");
+    printf("|  turn | incremental us |   full us |\n");
+    printf("|------:|---------------:|----------:|\n");
+    std::vector<int32_t> rows;
+    for (int32_t turn : {1, 10, 50, 100, 200}) {
+        if (turn < args.n_turns) {
+            rows.push_back(turn);
+        }
+    }
+    rows.push_back(args.n_turns);
+    for (int32_t turn : rows) {
+        printf("| %5d | %14.1f | %9.1f |\n", turn, t_incremental[turn - 1], t_full[turn - 1]);
+    }
+    printf("\n");
+
+    llama_free_model(model);
+    llama_backend_free();
+    return 0;
+}
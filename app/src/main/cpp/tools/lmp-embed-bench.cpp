@@ -0,0 +1,225 @@
+//
+// Host benchmark for embeddings and vector search.
+//
+// Embeds a set of texts with LlamaEmbeddingSession and reports the throughput, then fills a
+// LlamaVectorStore with that many vectors again and again (perturbed copies of the embeddings)
+// up to the requested store size and reports the query latency and how often a vector finds
+// itself as the best hit.
+//
+
+#include "LlamaCpp.h"
+#include "LlamaVectorStore.h"
+#include "common.h"
+
+#include "ggml.h"
+#include "llama.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+struct embed_bench_args {
+    std::string model;
+    std::string texts;
+    std::string store = "lmp-embed-bench.vec";
+    int32_t n_texts = 1000;
+    int32_t n_vectors = 100000;
+    int32_t n_queries = 200;
+    int32_t k = 10;
+    int32_t n_threads = 0;
+    int32_t n_search_threads = 1;
+};
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s -m MODEL [options]\n\n", argv0);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -m,  --model PATH           GGUF embedding model\n");
+    fprintf(stderr, "  -f,  --file PATH            texts to embed, one per line (default: generated)\n");
+    fprintf(stderr, "  -n,  --texts N              number of generated texts (default: 1000)\n");
+    fprintf(stderr, "       --vectors N            vector store size (default: 100000)\n");
+    fprintf(stderr, "       --queries N            number of searches (default: 200)\n");
+    fprintf(stderr, "  -k   N                      results per search (default: 10)\n");
+    fprintf(stderr, "       --store PATH           vector store file, recreated (default: lmp-embed-bench.vec)\n");
+    fprintf(stderr, "  -t,  --threads N            embedding threads (default: llama.cpp default)\n");
+    fprintf(stderr, "       --search-threads N     search threads (default: 1)\n");
+}
+
+static bool parse_args(int argc, char ** argv, embed_bench_args & args) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char * {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "-m" || arg == "--model") {
+            args.model = next();
+        } else if (arg == "-f" || arg == "--file") {
+            args.texts = next();
+        } else if (arg == "-n" || arg == "--texts") {
+            args.n_texts = std::atoi(next());
+        } else if (arg == "--vectors") {
+            args.n_vectors = std::atoi(next());
+        } else if (arg == "--queries") {
+            args.n_queries = std::atoi(next());
+        } else if (arg == "-k") {
+            args.k = std::atoi(next());
+        } else if (arg == "--store") {
+            args.store = next();
+        } else if (arg == "-t" || arg == "--threads") {
+            args.n_threads = std::atoi(next());
+        } else if (arg == "--search-threads") {
+            args.n_search_threads = std::atoi(next());
+        } else if (arg == "-h" || arg == "--help") {
+            return false;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return !args.model.empty() && args.n_texts > 0 && args.n_vectors > 0 && args.n_queries > 0 && args.k > 0;
+}
+
+static std::vector<std::string> load_texts(const embed_bench_args & args) {
+    std::vector<std::string> texts;
+    if (!args.texts.empty()) {
+        std::ifstream file(args.texts);
+        std::string line;
+        while (std::getline(file, line)) {
+            if (!line.empty()) {
+                texts.push_back(line);
+            }
+        }
+        return texts;
+    }
+    static const char * subjects[] = {"The battery", "A small model", "The cache", "Our phone", "The scheduler"};
+    static const char * verbs[] = {"drains faster when", "runs quicker after", "gets slower because", "stays cool while"};
+    static const char * objects[] = {"the screen is on", "the prompt is long", "threads are pinned", "memory is low"};
+    for (int32_t i = 0; i < args.n_texts; i++) {
+        texts.push_back(std::string(subjects[i % 5]) + " " + verbs[(i / 5) % 4] + " " + objects[(i / 20) % 4] +
+                        ", note " + std::to_string(i) + ".");
+    }
+    return texts;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    std::sort(values.begin(), values.end());
+    const auto i = (size_t) std::min<double>(values.size() - 1, std::floor(p * values.size()));
+    return values[i];
+}
+
+int main(int argc, char ** argv) {
+    embed_bench_args args;
+    if (!parse_args(argc, argv, args)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const std::vector<std::string> texts = load_texts(args);
+    if (texts.empty()) {
+        fprintf(stderr, "error: no texts in '%s'\n", args.texts.c_str());
+        return 1;
+    }
+
+    gpt_params params = initLlamaCpp();
+    if (args.n_threads > 0) {
+        params.cpuparams.n_threads = args.n_threads;
+        params.cpuparams_batch.n_threads = args.n_threads;
+    }
+
+    LlamaModel model;
+    // the embedding session sizes its context itself
+    model.loadModel(params, args.model, "", "", {}, 512, 0, 0, nullptr, nullptr);
+    if (model.getModelSize() == 0) {
+        fprintf(stderr, "error: failed to load model '%s'\n", args.model.c_str());
+        return 1;
+    }
+    LlamaEmbeddingSession *session = model.createEmbeddingSession();
+    if (session == nullptr) {
+        fprintf(stderr, "error: the model has no embeddings\n");
+        return 1;
+    }
+    const int32_t dim = session->dimension();
+
+    // warm up, the first decode allocates the compute buffers
+    session->embed({texts[0]});
+
+    const int64_t t_embed_start = ggml_time_us();
+    const std::vector<float> embeddings = session->embed(texts);
+    const double t_embed_ms = (double) (ggml_time_us() - t_embed_start) / 1000.0;
+    delete session;
+    if (embeddings.empty()) {
+        fprintf(stderr, "error: failed to embed the texts\n");
+        return 1;
+    }
+
+    printf("\n");
+    printf("model: %s, dimension %d\n", args.model.c_str(), dim);
+    printf("embed: %zu texts in %.1f ms, %.0f embeddings/min\n", texts.size(), t_embed_ms,
+           (double) texts.size() * 60000.0 / t_embed_ms);
+
+    std::remove(args.store.c_str());
+    LlamaVectorStore store;
+    if (!store.open(args.store, (uint32_t) dim)) {
+        return 1;
+    }
+
+    // perturbed copies keep the distribution of real embeddings without embedding n_vectors texts
+    std::mt19937 rng(42);
+    std::normal_distribution<float> noise(0.0f, 0.02f);
+    std::vector<float> vectors;
+    const int64_t t_add_start = ggml_time_us();
+    for (int32_t i = 0; i < args.n_vectors; i++) {
+        const float *embedding = embeddings.data() + (size_t) (i % texts.size()) * dim;
+        const size_t offset = vectors.size();
+        float norm = 0.0f;
+        for (int32_t j = 0; j < dim; j++) {
+            const float value = embedding[j] + (i < (int32_t) texts.size() ? 0.0f : noise(rng));
+            vectors.push_back(value);
+            norm += value * value;
+        }
+        norm = 1.0f / std::sqrt(norm);
+        for (int32_t j = 0; j < dim; j++) {
+            vectors[offset + j] *= norm;
+        }
+        if (vectors.size() >= (size_t) 4096 * dim || i + 1 == args.n_vectors) {
+            if (store.add(vectors.data(), vectors.size() / dim) < 0) {
+                return 1;
+            }
+            vectors.clear();
+        }
+    }
+    printf("store: %llu vectors added in %.1f ms\n", (unsigned long long) store.size(),
+           (double) (ggml_time_us() - t_add_start) / 1000.0);
+
+    // every query is an embedding whose exact copy is in the store at the same index
+    std::vector<double> latencies_ms;
+    int32_t n_found = 0;
+    for (int32_t q = 0; q < args.n_queries; q++) {
+        const auto index = (size_t) q % texts.size();
+        const int64_t t_start = ggml_time_us();
+        const std::vector<LlamaVectorHit> hits = store.search(embeddings.data() + index * dim, (size_t) args.k,
+                                                              args.n_search_threads);
+        latencies_ms.push_back((double) (ggml_time_us() - t_start) / 1000.0);
+        if (!hits.empty() && hits[0].index == index) {
+            n_found++;
+        }
+    }
+    printf("search: k = %d, %d threads, p50 %.3f ms, p99 %.3f ms, top-1 self match %.1f%%\n",
+           args.k, args.n_search_threads, percentile(latencies_ms, 0.5), percentile(latencies_ms, 0.99),
+           100.0 * n_found / args.n_queries);
+
+    store.close();
+    std::remove(args.store.c_str());
+    model.unloadModel();
+    llama_backend_free();
+    return 0;
+}
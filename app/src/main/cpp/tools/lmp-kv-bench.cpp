@@ -0,0 +1,246 @@
+//
+// Host benchmark for KV cache types.
+//
+// For each cache type, measures decode throughput at half of the context and the perplexity
+// of a fixed text, so the memory saved by a quantized cache can be weighed against its cost.
+//
+
+#include "LlamaCpp.h"
+#include "LlamaMemoryPlanner.h"
+#include "common.h"
+
+#include "ggml.h"
+#include "llama.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct kv_bench_args {
+    std::string model;
+    std::string text;
+    std::vector<std::string> types = {"f16", "q8_0", "q4_0"};
+    int32_t n_ctx = 512;
+    int32_t n_chunks = 8;
+    int32_t n_gen = 64;
+    int32_t n_threads = -1;
+    int32_t n_gpu_layers = 0;
+};
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s -m MODEL -f TEXT [options]\n\n", argv0);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -m,  --model PATH         GGUF model to benchmark\n");
+    fprintf(stderr, "  -f,  --file PATH          text to compute the perplexity of\n");
+    fprintf(stderr, "       --types LIST         comma separated KV cache types (default: f16,q8_0,q4_0)\n");
+    fprintf(stderr, "  -c,  --ctx-size N         context size (default: 512)\n");
+    fprintf(stderr, "       --chunks N           max text chunks of N tokens to evaluate (default: 8)\n");
+    fprintf(stderr, "  -n,  --n-gen N            tokens to decode for the throughput (default: 64)\n");
+    fprintf(stderr, "  -t,  --threads N          threads (default: all cores)\n");
+    fprintf(stderr, "  -ngl, --n-gpu-layers N    layers to offload (default: 0)\n");
+}
+
+static bool parse_args(int argc, char ** argv, kv_bench_args & args) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char * {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "-m" || arg == "--model") {
+            args.model = next();
+        } else if (arg == "-f" || arg == "--file") {
+            args.text = next();
+        } else if (arg == "--types") {
+            args.types.clear();
+            std::stringstream list(next());
+            std::string type;
+            while (std::getline(list, type, ',')) {
+                args.types.push_back(type);
+            }
+        } else if (arg == "-c" || arg == "--ctx-size") {
+            args.n_ctx = std::atoi(next());
+        } else if (arg == "--chunks") {
+            args.n_chunks = std::atoi(next());
+        } else if (arg == "-n" || arg == "--n-gen") {
+            args.n_gen = std::atoi(next());
+        } else if (arg == "-t" || arg == "--threads") {
+            args.n_threads = std::atoi(next());
+        } else if (arg == "-ngl" || arg == "--n-gpu-layers") {
+            args.n_gpu_layers = std::atoi(next());
+        } else if (arg == "-h" || arg == "--help") {
+            return false;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return !args.model.empty() && !args.text.empty();
+}
+
+// Decodes `n_tokens` tokens at positions [pos0, pos0 + n_tokens) with logits for all of them
+static bool decode_all(llama_context * ctx, llama_batch & batch, const llama_token * tokens, int32_t n_tokens, int32_t pos0) {
+    const int32_t n_batch = (int32_t) llama_n_batch(ctx);
+    for (int32_t i = 0; i < n_tokens; i += n_batch) {
+        llama_batch_clear(batch);
+        for (int32_t j = i; j < std::min(i + n_batch, n_tokens); j++) {
+            llama_batch_add(batch, tokens[j], pos0 + j, {0}, true);
+        }
+        if (llama_decode(ctx, batch)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Perplexity over the second half of each chunk, the first half only provides context
+static double perplexity(llama_context * ctx, llama_batch & batch, const std::vector<llama_token> & tokens,
+                         int32_t n_ctx, int32_t n_chunks, int32_t & n_scored) {
+    const int32_t n_vocab = llama_n_vocab(llama_get_model(ctx));
+    double nll = 0.0;
+    n_scored = 0;
+    for (int32_t chunk = 0; chunk < n_chunks; chunk++) {
+        const llama_token * chunk_tokens = tokens.data() + (size_t) chunk * n_ctx;
+        llama_kv_cache_clear(ctx);
+        if (!decode_all(ctx, batch, chunk_tokens, n_ctx, 0)) {
+            return NAN;
+        }
+        for (int32_t i = n_ctx / 2; i < n_ctx - 1; i++) {
+            const float * logits = llama_get_logits_ith(ctx, i);
+            const float max_logit = *std::max_element(logits, logits + n_vocab);
+            double sum = 0.0;
+            for (int32_t v = 0; v < n_vocab; v++) {
+                sum += std::exp(logits[v] - max_logit);
+            }
+            nll += std::log(sum) + max_logit - logits[chunk_tokens[i + 1]];
+            n_scored++;
+        }
+    }
+    return std::exp(nll / std::max(n_scored, 1));
+}
+
+// Greedy decode throughput with half of the context filled
+static double decode_speed(llama_context * ctx, llama_batch & batch, const std::vector<llama_token> & tokens,
+                           int32_t n_ctx, int32_t n_gen) {
+    const int32_t n_vocab = llama_n_vocab(llama_get_model(ctx));
+    const int32_t n_prefill = std::min<int32_t>(n_ctx / 2, (int32_t) tokens.size());
+    llama_kv_cache_clear(ctx);
+    if (!decode_all(ctx, batch, tokens.data(), n_prefill, 0)) {
+        return 0.0;
+    }
+
+    const float * logits = llama_get_logits_ith(ctx, n_prefill - 1);
+    llama_token token = (llama_token) (std::max_element(logits, logits + n_vocab) - logits);
+    const int64_t t_start = ggml_time_us();
+    int32_t n_decoded = 0;
+    for (; n_decoded < n_gen && n_prefill + n_decoded < n_ctx; n_decoded++) {
+        llama_batch_clear(batch);
+        llama_batch_add(batch, token, n_prefill + n_decoded, {0}, true);
+        if (llama_decode(ctx, batch)) {
+            break;
+        }
+        logits = llama_get_logits_ith(ctx, -1);
+        token = (llama_token) (std::max_element(logits, logits + n_vocab) - logits);
+    }
+    const int64_t t_us = ggml_time_us() - t_start;
+    return t_us > 0 ? 1e6 * n_decoded / t_us : 0.0;
+}
+
+int main(int argc, char ** argv) {
+    kv_bench_args args;
+    if (!parse_args(argc, argv, args)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::ifstream file(args.text);
+    if (!file) {
+        fprintf(stderr, "error: failed to open '%s'\n", args.text.c_str());
+        return 1;
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+
+    gpt_params params = initLlamaCpp();
+    if (args.n_threads > 0) {
+        params.cpuparams.n_threads = args.n_threads;
+        params.cpuparams_batch.n_threads = args.n_threads;
+    }
+    params.model = args.model;
+    params.n_gpu_layers = args.n_gpu_layers;
+    params.n_ctx = args.n_ctx;
+    params.n_batch = args.n_ctx;
+    params.n_ubatch = std::min(params.n_ubatch, args.n_ctx);
+
+    llama_model * model = llama_load_model_from_file(args.model.c_str(), llama_model_params_from_gpt_params(params));
+    if (model == nullptr) {
+        fprintf(stderr, "error: failed to load model '%s'\n", args.model.c_str());
+        return 1;
+    }
+
+    const std::vector<llama_token> tokens = ::llama_tokenize(model, text.str(), true, false);
+    const int32_t n_chunks = std::min<int32_t>(args.n_chunks, (int32_t) (tokens.size() / args.n_ctx));
+    if (n_chunks == 0) {
+        fprintf(stderr, "error: the text has %zu tokens, at least %d are needed\n", tokens.size(), args.n_ctx);
+        llama_free_model(model);
+        return 1;
+    }
+
+    printf("\n");
+    printf("model: %s, n_ctx %d, %d chunks\n", args.model.c_str(), args.n_ctx, n_chunks);
+    printf("\n");
+    printf("| K / V        | KiB/token | KV MiB | decode tok/s |    ppl |  d ppl |\n");
+    printf("|:-------------|----------:|-------:|-------------:|-------:|-------:|\n");
+
+    double ppl_base = NAN;
+    for (const auto & type_name : args.types) {
+        ggml_type type;
+        if (!LlamaMemoryPlanner::parseKvCacheType(type_name, type)) {
+            fprintf(stderr, "error: unknown KV cache type '%s'\n", type_name.c_str());
+            continue;
+        }
+        if (!LlamaMemoryPlanner::isKvCacheTypeSupported(model, type, type)) {
+            printf("| %-12s | not supported by the model |\n", type_name.c_str());
+            continue;
+        }
+
+        params.cache_type_k = type_name;
+        params.cache_type_v = type_name;
+        params.flash_attn = ggml_is_quantized(type);
+        llama_context * ctx = llama_new_context_with_model(model, llama_context_params_from_gpt_params(params));
+        if (ctx == nullptr) {
+            printf("| %-12s | failed to create a context |\n", type_name.c_str());
+            continue;
+        }
+        llama_batch batch = llama_batch_init(args.n_ctx, 0, 1);
+
+        const double tok_s = decode_speed(ctx, batch, tokens, args.n_ctx, args.n_gen);
+        int32_t n_scored = 0;
+        const double ppl = perplexity(ctx, batch, tokens, args.n_ctx, n_chunks, n_scored);
+        if (std::isnan(ppl_base)) {
+            ppl_base = ppl;
+        }
+
+        const uint64_t bytes_per_token = LlamaMemoryPlanner::kvBytes(model, 1, type, type);
+        const std::string label = type_name + " / " + type_name;
+        printf("| %-12s | %9.1f | %6.1f | %12.2f | %6.3f | %+6.3f |\n",
+               label.c_str(), bytes_per_token / 1024.0, bytes_per_token * args.n_ctx / 1024.0 / 1024.0,
+               tok_s, ppl, ppl - ppl_base);
+
+        llama_batch_free(batch);
+        llama_free(ctx);
+    }
+
+    llama_free_model(model);
+    llama_backend_free();
+    return 0;
+}
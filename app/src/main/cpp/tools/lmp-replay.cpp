@@ -0,0 +1,320 @@
+//
+// Deterministic replay benchmark.
+//
+// Runs fixed prompts with greedy or seeded sampling, each in a fresh session, checks that
+// repeated runs generate the same tokens and compares tokens and throughput with a baseline
+// written by an earlier run. A token mismatch is a behaviour change, a throughput drop beyond
+// the tolerance with identical tokens is a performance change.
+//
+// Exit codes: 0 ok, 1 error, 2 tokens differ, 3 throughput below the baseline.
+//
+
+#include "LlamaCpp.h"
+#include "common.h"
+
+#include "ggml.h"
+#include "json.hpp"
+#include "llama.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+struct replay_args {
+    std::string model;
+    std::string prompts;
+    std::string system_prompt;
+    std::vector<std::string> antiprompt;
+    std::string baseline;
+    std::string write_baseline;
+    int64_t seed = -1;
+    int32_t n_predict = 64;
+    int32_t n_runs = 2;
+    int32_t n_ctx = 2048;
+    int32_t n_threads = -1;
+    int32_t n_gpu_layers = 0;
+    double tolerance = 5.0;
+};
+
+static const std::vector<std::string> default_prompts = {
+        "Write a haiku about the sea.",
+        "List three prime numbers greater than 100.",
+        "Explain in two sentences what a hash table is.",
+};
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s -m MODEL [options]\n\n", argv0);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -m,  --model PATH         GGUF model to replay\n");
+    fprintf(stderr, "  -f,  --prompts PATH       prompts, one per line (default: a built-in set)\n");
+    fprintf(stderr, "  -s,  --system TEXT        system prompt\n");
+    fprintf(stderr, "  -r,  --reverse-prompt TEXT  antiprompt, can be repeated\n");
+    fprintf(stderr, "       --seed N             sample with seed N (default: greedy)\n");
+    fprintf(stderr, "  -n,  --n-predict N        max generated tokens per prompt (default: 64)\n");
+    fprintf(stderr, "       --runs N             runs of each prompt, all must agree (default: 2)\n");
+    fprintf(stderr, "  -c,  --ctx-size N         max context size (default: 2048)\n");
+    fprintf(stderr, "  -t,  --threads N          threads (default: all cores)\n");
+    fprintf(stderr, "  -ngl, --n-gpu-layers N    layers to offload (default: 0)\n");
+    fprintf(stderr, "       --baseline PATH      compare with a baseline written by --write-baseline\n");
+    fprintf(stderr, "       --write-baseline PATH  write the tokens and throughput of this run\n");
+    fprintf(stderr, "       --tolerance PCT      allowed throughput drop against the baseline (default: 5)\n");
+}
+
+static bool parse_args(int argc, char ** argv, replay_args & args) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char * {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "-m" || arg == "--model") {
+            args.model = next();
+        } else if (arg == "-f" || arg == "--prompts") {
+            args.prompts = next();
+        } else if (arg == "-s" || arg == "--system") {
+            args.system_prompt = next();
+        } else if (arg == "-r" || arg == "--reverse-prompt") {
+            args.antiprompt.emplace_back(next());
+        } else if (arg == "--seed") {
+            args.seed = std::atoll(next());
+        } else if (arg == "-n" || arg == "--n-predict") {
+            args.n_predict = std::atoi(next());
+        } else if (arg == "--runs") {
+            args.n_runs = std::max(1, std::atoi(next()));
+        } else if (arg == "-c" || arg == "--ctx-size") {
+            args.n_ctx = std::atoi(next());
+        } else if (arg == "-t" || arg == "--threads") {
+            args.n_threads = std::atoi(next());
+        } else if (arg == "-ngl" || arg == "--n-gpu-layers") {
+            args.n_gpu_layers = std::atoi(next());
+        } else if (arg == "--baseline") {
+            args.baseline = next();
+        } else if (arg == "--write-baseline") {
+            args.write_baseline = next();
+        } else if (arg == "--tolerance") {
+            args.tolerance = std::atof(next());
+        } else if (arg == "-h" || arg == "--help") {
+            return false;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return !args.model.empty();
+}
+
+static std::vector<std::string> load_prompts(const std::string & path) {
+    if (path.empty()) {
+        return default_prompts;
+    }
+    std::vector<std::string> prompts;
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "error: failed to open prompts '%s'\n", path.c_str());
+        exit(1);
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty()) {
+            prompts.push_back(line);
+        }
+    }
+    return prompts;
+}
+
+// Index of the first differing token, -1 if the sequences are equal
+static int64_t first_difference(const std::vector<llama_token> & a, const std::vector<llama_token> & b) {
+    const size_t n = std::min(a.size(), b.size());
+    for (size_t i = 0; i < n; i++) {
+        if (a[i] != b[i]) {
+            return (int64_t) i;
+        }
+    }
+    return a.size() == b.size() ? -1 : (int64_t) n;
+}
+
+static double tokens_per_second(int64_t n_tokens, double t_ms) {
+    return t_ms > 0.0 ? 1e3 * n_tokens / t_ms : 0.0;
+}
+
+int main(int argc, char ** argv) {
+    replay_args args;
+    if (!parse_args(argc, argv, args)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const std::vector<std::string> prompts = load_prompts(args.prompts);
+
+    gpt_params params = initLlamaCpp();
+    if (args.n_threads > 0) {
+        params.cpuparams.n_threads = args.n_threads;
+        params.cpuparams_batch.n_threads = args.n_threads;
+    }
+    params.prompt = args.system_prompt;
+    if (args.seed < 0) {
+        // keeps only the most likely token
+        params.sparams.temp = 0.0f;
+    }
+
+    LlamaModel model;
+    model.loadModel(params,
+                    args.model,
+                    "",
+                    "",
+                    args.antiprompt,
+                    args.n_ctx,
+                    args.n_gpu_layers,
+                    0,
+                    nullptr,
+                    nullptr);
+    if (model.getModelSize() == 0) {
+        fprintf(stderr, "error: failed to load model '%s'\n", args.model.c_str());
+        return 1;
+    }
+
+    // a fixed seed also makes greedy runs independent of the random seeding
+    const auto seed = (uint32_t) (args.seed < 0 ? 0 : args.seed);
+
+    std::vector<std::vector<llama_token>> outputs(prompts.size());
+    int64_t n_prompt_tokens = 0;
+    int64_t n_decoded_tokens = 0;
+    double t_prompt_ms = 0.0;
+    double t_decode_ms = 0.0;
+    bool stable = true;
+
+    printf("\n");
+    printf("model: %s, %s, %d runs\n", args.model.c_str(),
+           args.seed < 0 ? "greedy" : ("seed " + std::to_string(args.seed)).c_str(), args.n_runs);
+    printf("\n");
+    printf("| prompt | run | gen tok | prompt tok/s | decode tok/s | stable |\n");
+    printf("|-------:|----:|--------:|-------------:|-------------:|:-------|\n");
+
+    for (size_t p = 0; p < prompts.size(); p++) {
+        for (int32_t run = 0; run < args.n_runs; run++) {
+            LlamaGenerationSession * session = model.createGenerationSession(seed);
+            // the system prompt is ingested by the first generate() calls, so the throughput
+            // includes it, same in every run
+            session->addMessage(prompts[p].c_str());
+            int32_t n_generated = 0;
+            while (n_generated < args.n_predict) {
+                const int status = session->generate([&](std::string_view) {});
+                n_generated = (int32_t) session->getReplyTokens().size();
+                if (status != 0) {
+                    break;
+                }
+            }
+
+            const llama_perf_context_data perf = session->getPerfData();
+            const std::vector<llama_token> tokens = session->getReplyTokens();
+            n_prompt_tokens += perf.n_p_eval;
+            n_decoded_tokens += perf.n_eval;
+            t_prompt_ms += perf.t_p_eval_ms;
+            t_decode_ms += perf.t_eval_ms;
+
+            const char * status = "yes";
+            if (run == 0) {
+                outputs[p] = tokens;
+            } else if (first_difference(outputs[p], tokens) >= 0) {
+                status = "NO";
+                stable = false;
+            }
+            printf("| %6zu | %3d | %7zu | %12.2f | %12.2f | %-6s |\n", p + 1, run + 1, tokens.size(),
+                   tokens_per_second(perf.n_p_eval, perf.t_p_eval_ms),
+                   tokens_per_second(perf.n_eval, perf.t_eval_ms), status);
+            delete session;
+        }
+    }
+
+    const double prompt_tok_s = tokens_per_second(n_prompt_tokens, t_prompt_ms);
+    const double decode_tok_s = tokens_per_second(n_decoded_tokens, t_decode_ms);
+    printf("\n");
+    printf("prompt eval:  %lld tokens, %.2f tokens per second\n", (long long) n_prompt_tokens, prompt_tok_s);
+    printf("decode:       %lld tokens, %.2f tokens per second\n", (long long) n_decoded_tokens, decode_tok_s);
+
+    int ret = 0;
+    if (!stable) {
+        printf("\nruns of the same prompt generated different tokens\n");
+        ret = 2;
+    }
+
+    if (!args.baseline.empty()) {
+        std::ifstream file(args.baseline);
+        json baseline;
+        try {
+            baseline = json::parse(file);
+        } catch (const std::exception & e) {
+            fprintf(stderr, "error: failed to read baseline '%s': %s\n", args.baseline.c_str(), e.what());
+            return 1;
+        }
+        const json & entries = baseline.at("prompts");
+        if (entries.size() != prompts.size() || baseline.value("seed", (int64_t) -1) != args.seed ||
+            baseline.value("n_predict", 0) != args.n_predict) {
+            fprintf(stderr, "error: the baseline was recorded with other prompts or settings\n");
+            return 1;
+        }
+
+        printf("\nbaseline %s:\n", args.baseline.c_str());
+        for (size_t p = 0; p < prompts.size(); p++) {
+            if (entries[p].value("prompt", "") != prompts[p]) {
+                fprintf(stderr, "error: prompt %zu differs from the baseline\n", p + 1);
+                return 1;
+            }
+            const auto expected = entries[p].at("tokens").get<std::vector<llama_token>>();
+            const int64_t diff = first_difference(expected, outputs[p]);
+            if (diff >= 0) {
+                printf("  prompt %zu: tokens differ from token %lld on\n", p + 1, (long long) diff);
+                ret = 2;
+            }
+        }
+
+        const double base_prompt_tok_s = baseline.value("prompt_tokens_per_second", 0.0);
+        const double base_decode_tok_s = baseline.value("decode_tokens_per_second", 0.0);
+        const double prompt_change = base_prompt_tok_s > 0.0 ? 100.0 * (prompt_tok_s / base_prompt_tok_s - 1.0) : 0.0;
+        const double decode_change = base_decode_tok_s > 0.0 ? 100.0 * (decode_tok_s / base_decode_tok_s - 1.0) : 0.0;
+        printf("  prompt eval: %.2f -> %.2f tokens per second (%+.1f%%)\n", base_prompt_tok_s, prompt_tok_s, prompt_change);
+        printf("  decode:      %.2f -> %.2f tokens per second (%+.1f%%)\n", base_decode_tok_s, decode_tok_s, decode_change);
+        if (ret == 0 && (prompt_change < -args.tolerance || decode_change < -args.tolerance)) {
+            printf("  throughput is more than %.1f%% below the baseline\n", args.tolerance);
+            ret = 3;
+        }
+        if (ret == 0) {
+            printf("  tokens identical, throughput within %.1f%%\n", args.tolerance);
+        }
+    }
+
+    if (!args.write_baseline.empty()) {
+        json entries = json::array();
+        for (size_t p = 0; p < prompts.size(); p++) {
+            entries.push_back({{"prompt", prompts[p]}, {"tokens", outputs[p]}});
+        }
+        const json baseline = {
+                {"model",                    args.model},
+                {"seed",                     args.seed},
+                {"n_predict",                args.n_predict},
+                {"prompt_tokens_per_second", prompt_tok_s},
+                {"decode_tokens_per_second", decode_tok_s},
+                {"prompts",                  entries},
+        };
+        std::ofstream file(args.write_baseline);
+        file << baseline.dump(2) << '\n';
+        if (!file.good()) {
+            fprintf(stderr, "error: failed to write baseline '%s'\n", args.write_baseline.c_str());
+            return 1;
+        }
+        printf("\nbaseline written to %s\n", args.write_baseline.c_str());
+    }
+
+    model.unloadModel();
+    llama_backend_free();
+    return ret;
+}
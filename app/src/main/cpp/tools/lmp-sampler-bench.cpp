@@ -0,0 +1,218 @@
+//
+// Host benchmark for LlamaFastSampler, no model needed.
+//
+// Samples synthetic logits of a large vocabulary with the llama.cpp sampler chain, built the way
+// gpt_sampler_init() builds it, and with LlamaFastSampler from the same parameters and seed.
+// Checks that both sample the same tokens and reports the time per token of each.
+//
+
+#include "LlamaFastSampler.h"
+#include "common.h"
+
+#include "ggml.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+struct sampler_bench_args {
+    int32_t n_vocab = 128256;
+    int32_t n_tokens = 2000;
+    uint32_t seed = 42;
+    float round = 0.0f;
+    gpt_sampler_params sparams;
+};
+
+// synthetic ids of the special tokens the penalties know about
+static const llama_token TOKEN_EOS = 2;
+static const llama_token TOKEN_NL = 13;
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s [options]\n\n", argv0);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "       --vocab N              vocabulary size (default: 128256)\n");
+    fprintf(stderr, "  -n,  --tokens N             number of tokens to sample (default: 2000)\n");
+    fprintf(stderr, "  -s,  --seed N               sampler seed (default: 42)\n");
+    fprintf(stderr, "       --top-k N              (default: 40)\n");
+    fprintf(stderr, "       --top-p N              (default: 0.95)\n");
+    fprintf(stderr, "       --min-p N              (default: 0.05)\n");
+    fprintf(stderr, "       --temp N               0 samples greedily (default: 0.8)\n");
+    fprintf(stderr, "       --repeat-penalty N     (default: 1.0)\n");
+    fprintf(stderr, "       --frequency-penalty N  (default: 0.0)\n");
+    fprintf(stderr, "       --presence-penalty N   (default: 0.0)\n");
+    fprintf(stderr, "       --round STEP           round the logits to STEP, makes equal logits common (default: off)\n");
+}
+
+static bool parse_args(int argc, char ** argv, sampler_bench_args & args) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char * {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "--vocab") {
+            args.n_vocab = std::atoi(next());
+        } else if (arg == "-n" || arg == "--tokens") {
+            args.n_tokens = std::atoi(next());
+        } else if (arg == "-s" || arg == "--seed") {
+            args.seed = (uint32_t) std::strtoul(next(), nullptr, 10);
+        } else if (arg == "--top-k") {
+            args.sparams.top_k = std::atoi(next());
+        } else if (arg == "--top-p") {
+            args.sparams.top_p = std::strtof(next(), nullptr);
+        } else if (arg == "--min-p") {
+            args.sparams.min_p = std::strtof(next(), nullptr);
+        } else if (arg == "--temp") {
+            args.sparams.temp = std::strtof(next(), nullptr);
+        } else if (arg == "--repeat-penalty") {
+            args.sparams.penalty_repeat = std::strtof(next(), nullptr);
+        } else if (arg == "--frequency-penalty") {
+            args.sparams.penalty_freq = std::strtof(next(), nullptr);
+        } else if (arg == "--presence-penalty") {
+            args.sparams.penalty_present = std::strtof(next(), nullptr);
+        } else if (arg == "--round") {
+            args.round = std::strtof(next(), nullptr);
+        } else if (arg == "-h" || arg == "--help") {
+            return false;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return args.n_vocab > TOKEN_NL && args.n_tokens > 0;
+}
+
+// the chain of gpt_sampler_init() without the grammar
+static llama_sampler * init_chain(const gpt_sampler_params & params, int32_t n_vocab, uint32_t seed) {
+    llama_sampler * chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    llama_sampler_chain_add(chain, llama_sampler_init_logit_bias(n_vocab, (int32_t) params.logit_bias.size(),
+                                                                 params.logit_bias.data()));
+    llama_sampler_chain_add(chain, llama_sampler_init_penalties(n_vocab, TOKEN_EOS, TOKEN_NL, params.penalty_last_n,
+                                                                params.penalty_repeat, params.penalty_freq,
+                                                                params.penalty_present, params.penalize_nl,
+                                                                params.ignore_eos));
+    if (params.temp > 0.0f) {
+        for (const auto & type : params.samplers) {
+            switch (type) {
+                case GPT_SAMPLER_TYPE_TOP_K:
+                    llama_sampler_chain_add(chain, llama_sampler_init_top_k(params.top_k));
+                    break;
+                case GPT_SAMPLER_TYPE_TFS_Z:
+                    llama_sampler_chain_add(chain, llama_sampler_init_tail_free(params.tfs_z, params.min_keep));
+                    break;
+                case GPT_SAMPLER_TYPE_TYPICAL_P:
+                    llama_sampler_chain_add(chain, llama_sampler_init_typical(params.typ_p, params.min_keep));
+                    break;
+                case GPT_SAMPLER_TYPE_TOP_P:
+                    llama_sampler_chain_add(chain, llama_sampler_init_top_p(params.top_p, params.min_keep));
+                    break;
+                case GPT_SAMPLER_TYPE_MIN_P:
+                    llama_sampler_chain_add(chain, llama_sampler_init_min_p(params.min_p, params.min_keep));
+                    break;
+                case GPT_SAMPLER_TYPE_TEMPERATURE:
+                    llama_sampler_chain_add(chain, llama_sampler_init_temp_ext(params.temp, params.dynatemp_range,
+                                                                               params.dynatemp_exponent));
+                    break;
+                default:
+                    break;
+            }
+        }
+        llama_sampler_chain_add(chain, llama_sampler_init_softmax());
+        llama_sampler_chain_add(chain, llama_sampler_init_dist(seed));
+    } else {
+        llama_sampler_chain_add(chain, llama_sampler_init_greedy());
+    }
+    return chain;
+}
+
+// a few likely tokens over a flat tail, like the logits of a language model
+static void fill_logits(std::vector<float> & logits, std::mt19937 & rng, float round) {
+    std::normal_distribution<float> tail(0.0f, 1.5f);
+    std::uniform_real_distribution<float> peak(6.0f, 14.0f);
+    std::uniform_int_distribution<int32_t> token(0, (int32_t) logits.size() - 1);
+    for (auto & logit : logits) {
+        logit = tail(rng);
+    }
+    for (int i = 0; i < 16; i++) {
+        logits[token(rng)] += peak(rng);
+    }
+    if (round > 0.0f) {
+        for (auto & logit : logits) {
+            logit = std::round(logit / round) * round;
+        }
+    }
+}
+
+int main(int argc, char ** argv) {
+    sampler_bench_args args;
+    if (!parse_args(argc, argv, args)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const gpt_sampler_params & sparams = args.sparams;
+
+    LlamaFastSampler fast_sampler;
+    if (!fast_sampler.init(args.n_vocab, TOKEN_EOS, TOKEN_NL, sparams, args.seed)) {
+        fprintf(stderr, "error: the sampler params need the chain, see LlamaFastSampler::init()\n");
+        return 1;
+    }
+    llama_sampler * chain = init_chain(sparams, args.n_vocab, args.seed);
+
+    // a prompt for the penalties, accepted like gpt_sampler_accept() accepts it
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<llama_token> random_token(0, args.n_vocab - 1);
+    std::vector<llama_token> history;
+    for (int i = 0; i < 64; i++) {
+        history.push_back(random_token(rng));
+        llama_sampler_accept(chain, history.back());
+    }
+
+    std::vector<float> logits((size_t) args.n_vocab);
+    std::vector<llama_token_data> cur((size_t) args.n_vocab);
+    int64_t t_chain_us = 0;
+    int64_t t_fast_us = 0;
+    for (int32_t i = 0; i < args.n_tokens; i++) {
+        fill_logits(logits, rng, args.round);
+
+        // what gpt_sampler_sample() does
+        int64_t t_start_us = ggml_time_us();
+        for (llama_token token = 0; token < args.n_vocab; token++) {
+            cur[token] = {token, logits[token], 0.0f};
+        }
+        llama_token_data_array cur_p = {cur.data(), cur.size(), -1, false};
+        llama_sampler_apply(chain, &cur_p);
+        const llama_token expected = cur_p.data[cur_p.selected].id;
+        t_chain_us += ggml_time_us() - t_start_us;
+
+        t_start_us = ggml_time_us();
+        const llama_token token = fast_sampler.sample(logits.data(), history.data(), history.size());
+        t_fast_us += ggml_time_us() - t_start_us;
+
+        if (token != expected) {
+            fprintf(stderr, "error: token %d differs, chain sampled %d, fast sampler %d\n", i, expected, token);
+            llama_sampler_free(chain);
+            return 2;
+        }
+        history.push_back(token);
+        llama_sampler_accept(chain, token);
+    }
+    llama_sampler_free(chain);
+
+    printf("\n");
+    printf("vocab %d, top-k %d, top-p %.2f, min-p %.2f, temp %.2f, repeat penalty %.2f\n", args.n_vocab,
+           sparams.top_k, sparams.top_p, sparams.min_p, sparams.temp, sparams.penalty_repeat);
+    printf("tokens: %d identical, %lld with tied logits sorted in full\n", args.n_tokens,
+           (long long) fast_sampler.getSlowSamples());
+    printf("chain: %.2f us/token\n", (double) t_chain_us / args.n_tokens);
+    printf("fast:  %.2f us/token (%.1fx)\n", (double) t_fast_us / args.n_tokens,
+           (double) t_chain_us / std::max<int64_t>(t_fast_us, 1));
+    return 0;
+}
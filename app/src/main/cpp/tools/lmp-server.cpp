@@ -0,0 +1,157 @@
+//
+// OpenAI-compatible chat completions server on the loopback interface or a Unix socket.
+//
+// Loads the model once and serves it with LlamaHttpServer until SIGINT or SIGTERM, e.g.
+//   curl -N http://127.0.0.1:8080/v1/chat/completions -d '{"messages": [{"role": "user", "content": "Hi"}], "stream": true}'
+//
+
+#include "LlamaCpp.h"
+#include "LlamaHttpServer.h"
+#include "common.h"
+
+#include "llama.h"
+#include "log.h"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+struct server_args {
+    std::string model;
+    std::string model_name;
+    std::string unix_path;
+    std::string system_prompt;
+    std::vector<std::string> antiprompt;
+    int32_t port = 8080;
+    int32_t n_ctx = 2048;
+    int32_t max_tokens = LlamaHttpServer::DEFAULT_MAX_TOKENS;
+    int32_t n_threads = -1;
+    int32_t n_threads_batch = -1;
+    int32_t n_gpu_layers = 0;
+    uint64_t memory_budget = 0;
+};
+
+static void print_usage(const char * argv0) {
+    fprintf(stderr, "usage: %s -m MODEL [options]\n\n", argv0);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -m,  --model PATH         GGUF model\n");
+    fprintf(stderr, "       --port N             port on 127.0.0.1, 0 = any free port, -1 = none (default: 8080)\n");
+    fprintf(stderr, "       --unix PATH          also listen on a Unix socket\n");
+    fprintf(stderr, "       --name NAME          model id reported by the API (default: the file name)\n");
+    fprintf(stderr, "  -s,  --system TEXT        system prompt of requests without a system message\n");
+    fprintf(stderr, "  -r,  --reverse-prompt TEXT  antiprompt, can be repeated\n");
+    fprintf(stderr, "  -c,  --ctx-size N         context size, 0 = training context (default: 2048)\n");
+    fprintf(stderr, "       --mem-budget MIB     memory for weights, KV cache and buffers (default: 70%% of available)\n");
+    fprintf(stderr, "  -n,  --max-tokens N       max generated tokens of requests without \"max_tokens\" (default: %d)\n",
+            LlamaHttpServer::DEFAULT_MAX_TOKENS);
+    fprintf(stderr, "  -t,  --threads N          decode threads (default: all cores)\n");
+    fprintf(stderr, "  -tb, --threads-batch N    prompt processing threads (default: same as -t)\n");
+    fprintf(stderr, "  -ngl, --n-gpu-layers N    layers to offload (default: 0)\n");
+}
+
+static bool parse_args(int argc, char ** argv, server_args & args) {
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto next = [&]() -> const char * {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "-m" || arg == "--model") {
+            args.model = next();
+        } else if (arg == "--port") {
+            args.port = std::atoi(next());
+        } else if (arg == "--unix") {
+            args.unix_path = next();
+        } else if (arg == "--name") {
+            args.model_name = next();
+        } else if (arg == "-s" || arg == "--system") {
+            args.system_prompt = next();
+        } else if (arg == "-r" || arg == "--reverse-prompt") {
+            args.antiprompt.emplace_back(next());
+        } else if (arg == "-c" || arg == "--ctx-size") {
+            args.n_ctx = std::atoi(next());
+        } else if (arg == "--mem-budget") {
+            args.memory_budget = (uint64_t) std::atoll(next()) * 1024 * 1024;
+        } else if (arg == "-n" || arg == "--max-tokens") {
+            args.max_tokens = std::atoi(next());
+        } else if (arg == "-t" || arg == "--threads") {
+            args.n_threads = std::atoi(next());
+        } else if (arg == "-tb" || arg == "--threads-batch") {
+            args.n_threads_batch = std::atoi(next());
+        } else if (arg == "-ngl" || arg == "--n-gpu-layers") {
+            args.n_gpu_layers = std::atoi(next());
+        } else if (arg == "-h" || arg == "--help") {
+            return false;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return !args.model.empty() && args.port <= 65535 && (args.port >= 0 || !args.unix_path.empty());
+}
+
+int main(int argc, char ** argv) {
+    server_args args;
+    if (!parse_args(argc, argv, args)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (args.model_name.empty()) {
+        const size_t slash = args.model.find_last_of('/');
+        args.model_name = slash == std::string::npos ? args.model : args.model.substr(slash + 1);
+    }
+
+    // handled by sigwait() below, blocked before any thread is started so that all of them inherit it
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    gpt_params params = initLlamaCpp();
+    params.prompt = args.system_prompt;
+    if (args.n_threads > 0) {
+        params.cpuparams.n_threads = args.n_threads;
+        params.cpuparams_batch.n_threads = args.n_threads;
+    }
+    if (args.n_threads_batch > 0) {
+        params.cpuparams_batch.n_threads = args.n_threads_batch;
+    }
+
+    LlamaModel model;
+    model.loadModel(params, args.model, "", "", args.antiprompt, args.n_ctx, args.n_gpu_layers,
+                    args.memory_budget, nullptr, nullptr);
+    if (model.getModelSize() == 0) {
+        fprintf(stderr, "error: failed to load model '%s'\n", args.model.c_str());
+        return 1;
+    }
+
+    int status = 0;
+    {
+        LlamaHttpServer server(model, args.model_name, args.max_tokens);
+        if ((args.port >= 0 && !server.listenTcp((uint16_t) args.port)) ||
+            (!args.unix_path.empty() && !server.listenUnix(args.unix_path)) || !server.start()) {
+            fprintf(stderr, "error: failed to start the server\n");
+            status = 1;
+        } else {
+            if (args.port >= 0) {
+                fprintf(stderr, "serving %s on http://127.0.0.1:%u\n", args.model_name.c_str(), server.getPort());
+            }
+            if (!args.unix_path.empty()) {
+                fprintf(stderr, "serving %s on %s\n", args.model_name.c_str(), args.unix_path.c_str());
+            }
+            int signal = 0;
+            sigwait(&signals, &signal);
+            fprintf(stderr, "stopping\n");
+            server.stop();
+        }
+    }
+    model.unloadModel();
+    llama_backend_free();
+    return status;
+}
@@ -19,6 +19,23 @@ class LlamaCpp {
      */
     external fun init(): Int
 
+    /**
+     * Starts or stops recording trace spans of the inference pipeline (decode batches, sampling,
+     * detokenization, callbacks). Starting drops the spans of earlier recordings.
+     * Only has an effect in native builds with `LMP_TRACE` enabled.
+     *
+     * @param enabled `true` to start recording.
+     */
+    external fun setTracing(enabled: Boolean)
+
+    /**
+     * Writes the recorded spans as a Chrome trace, which chrome://tracing and the Perfetto UI open.
+     *
+     * @param path The trace file.
+     * @return `true` if the trace was written, `false` if it failed or tracing is compiled out.
+     */
+    external fun writeTrace(path: String): Boolean
+
     /**
      * Loads a pre-trained LLM model from the specified file path.
      *
@@ -26,6 +43,12 @@ class LlamaCpp {
      * @param inputPrefix (Optional) A string to prefix to the generated text.
      * @param inputSuffix (Optional) A string to suffix to the generated text.
      * @param antiPrompt (Optional) A string to stops the generation.
+     * @param contextSize The largest context size to use, in tokens. The actual size is the
+     *                    largest that fits the memory budget, see [LlamaModel.getMemoryPlan].
+     *                    0 allows up to the training context of the model.
+     * @param gpuLayers The number of layers to offload to the GPU, -1 for the default.
+     * @param memoryBudget The memory the weights, the KV cache and the compute buffers may take,
+     *                     in bytes. 0 uses a share of the currently available memory.
      * @param progressCallback (Optional) A callback to receive progress updates during loading.
      * @return A `LlamaModel` instance representing the loaded model.
      */
@@ -33,5 +56,8 @@ class LlamaCpp {
                            inputPrefix: String?,
                            inputSuffix: String?,
                            antiPrompt: Array<String>,
+                           contextSize: Int,
+                           gpuLayers: Int,
+                           memoryBudget: Long,
                            progressCallback: LlamaProgressCallback): LlamaModel
 }
\ No newline at end of file
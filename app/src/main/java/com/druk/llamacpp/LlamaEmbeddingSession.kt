@@ -0,0 +1,40 @@
+package com.druk.llamacpp
+
+/**
+ * Computes embeddings of texts with a loaded model, for local retrieval together with
+ * [LlamaVectorStore].
+ *
+ * Many texts passed to a single [embed] call are computed in a few large batches, which is
+ * much faster than embedding them one by one.
+ */
+class LlamaEmbeddingSession {
+
+    /**
+     * The native handle to the embedding session in the llama.cpp library.
+     * This field is private and should not be modified directly.
+     */
+    private var nativeHandle: Long = 0
+
+    /**
+     * The number of values of an embedding.
+     */
+    val dimension: Int
+        get() = getDimension()
+
+    private external fun getDimension(): Int
+
+    /**
+     * Computes the L2-normalized embeddings of the texts. Texts longer than the batch size
+     * of the model are truncated.
+     *
+     * @param texts The texts to embed.
+     * @return `texts.size * dimension` values, the embedding of `texts[i]` starts at
+     *         `i * dimension`; an empty array on failure.
+     */
+    external fun embed(texts: Array<String>): FloatArray
+
+    /**
+     * Destroys the embedding session and releases associated resources.
+     */
+    external fun destroy()
+}
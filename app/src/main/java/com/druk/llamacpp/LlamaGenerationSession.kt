@@ -1,5 +1,7 @@
 package com.druk.llamacpp
 
+import java.nio.ByteBuffer
+
 /**
  * Represents a generation session with a loaded language model in the llama.cpp library.
  *
@@ -23,6 +25,86 @@ class LlamaGenerationSession {
      */
     external fun generate(callback: LlamaGenerationCallback): Int
 
+    /**
+     * Generates the whole response natively, without returning to the JVM after every token.
+     * Output is delivered in chunks of at least [flushBytes] bytes or at most every
+     * [flushIntervalMs] milliseconds, whichever comes first, and a chunk never ends in the
+     * middle of a UTF-8 sequence. The first chunk is delivered as soon as it is available.
+     *
+     * @param callback Receives the coalesced chunks of generated text.
+     * @param flushBytes Minimal chunk size in bytes.
+     * @param flushIntervalMs Maximal delay of a chunk in milliseconds.
+     * @return The status code of the last [generate] step, `0` if stopped by [stopGeneration].
+     */
+    external fun generateChunked(callback: LlamaGenerationCallback, flushBytes: Int, flushIntervalMs: Int): Int
+
+    /**
+     * Generates the whole response natively, writing it into the output ring instead of
+     * calling back into the JVM. Read the output concurrently with a [LlamaOutputReader].
+     *
+     * @return The status code of the last [generate] step, `0` if stopped by [stopGeneration].
+     */
+    external fun generateToRing(): Int
+
+    /**
+     * Starts [generateToRing] on a native worker thread and returns right away. Read the output
+     * with a [LlamaOutputReader] and call [waitAsync] before the next [addMessage].
+     *
+     * @return `false` if a generation is running already.
+     */
+    external fun startAsync(): Boolean
+
+    /**
+     * Cancels the running generation, also in the middle of processing a long prompt.
+     * A turn cancelled before its reply started is rolled back as if its message had never been
+     * added, a reply in progress is kept like with [stopGeneration]. Safe to call from any thread.
+     */
+    external fun cancel()
+
+    /**
+     * @return [ASYNC_RUNNING] while the generation started by [startAsync] runs, afterwards its
+     *         status code, [STATUS_CANCELLED] if its message was rolled back by [cancel].
+     */
+    external fun pollAsync(): Int
+
+    /**
+     * Waits for the generation started by [startAsync] to finish.
+     *
+     * @return The status code of the generation, [STATUS_CANCELLED] if its message was rolled
+     *         back by [cancel].
+     */
+    external fun waitAsync(): Int
+
+    /**
+     * Returns a direct `ByteBuffer` over the native output ring of this session.
+     * The buffer stays valid until [destroy] is called.
+     */
+    external fun getOutputBuffer(): ByteBuffer
+
+    /**
+     * Returns the position up to which the output ring has been read.
+     */
+    external fun getOutputReadPosition(): Long
+
+    /**
+     * Waits up to [timeoutMs] milliseconds for output after the read position.
+     *
+     * @return The write position of the output ring, or `-1` once the current response is
+     *         complete and all of it has been released.
+     */
+    external fun awaitOutput(timeoutMs: Int): Long
+
+    /**
+     * Marks the output ring as read up to [position], making room for the generation thread.
+     */
+    external fun releaseOutput(position: Long)
+
+    /**
+     * Makes a running [generateChunked] or [generateToRing] call return after the current token.
+     * Safe to call from any thread.
+     */
+    external fun stopGeneration()
+
     /**
      * Adds a message to the current context of the session.
      *
@@ -30,6 +112,25 @@ class LlamaGenerationSession {
      */
     external fun addMessage(message: String)
 
+    /**
+     * Constrains the reply to the last added message to a GBNF grammar with a `root` rule, e.g.
+     * for tool calls. Call it after [addMessage]; the next message removes the constraint.
+     * Grammars are compiled once per model and cached, so repeating the same grammar every
+     * turn is cheap.
+     *
+     * @param grammar The GBNF grammar, an empty string removes the constraint.
+     * @return `false` if the grammar can not be parsed, the reply is unconstrained then.
+     */
+    external fun setGrammar(grammar: String): Boolean
+
+    /**
+     * Constrains the reply to the last added message to JSON matching a schema, see [setGrammar].
+     *
+     * @param schema The JSON schema, an empty string removes the constraint.
+     * @return `false` if the schema is not valid or not supported.
+     */
+    external fun setJsonSchema(schema: String): Boolean
+
     /**
      * Prints a report about the current state of the generation session to the console.
      */
@@ -42,8 +143,51 @@ class LlamaGenerationSession {
      */
     external fun getReport(): String
 
+    /**
+     * Returns the latency histograms and counters of this session since it was created.
+     * Call it between turns, not while [generate] runs on another thread.
+     *
+     * @return A snapshot of the session metrics.
+     */
+    fun getMetrics(): LlamaSessionMetrics = LlamaSessionMetrics.fromArray(getMetricsNative())
+
+    private external fun getMetricsNative(): LongArray
+
+    /**
+     * Saves the conversation state (KV cache, history and sampler state) to a file.
+     * Saving repeatedly to the same path only appends what changed since the previous snapshot,
+     * so it is cheap enough to call after every turn.
+     *
+     * @param path The snapshot file.
+     * @return `true` if the snapshot was written.
+     */
+    external fun saveSnapshot(path: String): Boolean
+
+    /**
+     * Replaces the conversation state with a snapshot previously written by [saveSnapshot],
+     * e.g. to resume a conversation after the process was killed.
+     * If the restore fails the session should be destroyed.
+     *
+     * @param path The snapshot file.
+     * @return `true` if the conversation was restored.
+     */
+    external fun restoreSnapshot(path: String): Boolean
+
     /**
      * Destroys the generation session and releases associated resources.
      */
     external fun destroy()
+
+    companion object {
+        /**
+         * [pollAsync] status of a running generation.
+         */
+        const val ASYNC_RUNNING = -1
+
+        /**
+         * Status of a generation cancelled before its reply started: the session no longer has
+         * the message, see [cancel].
+         */
+        const val STATUS_CANCELLED = 2
+    }
 }
\ No newline at end of file
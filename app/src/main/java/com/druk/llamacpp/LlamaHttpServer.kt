@@ -0,0 +1,67 @@
+package com.druk.llamacpp
+
+/**
+ * An OpenAI-compatible HTTP server on the loopback interface or a Unix socket, so that other
+ * processes can use a loaded model without loading it again.
+ *
+ * It serves `POST /v1/chat/completions`, streamed as server-sent events with `"stream": true`,
+ * and `GET /v1/models` and `/health`. Completions run one at a time on a generation session of
+ * its own; a request continuing the conversation of the previous one only adds its last message.
+ * Sampling parameters of requests are ignored, the model's are used.
+ *
+ * Call [listenTcp] and/or [listenUnix], then [start]. The model must stay loaded until [close].
+ *
+ * @param model The loaded model to serve.
+ * @param name The model id reported by the API.
+ * @param maxTokens The reply length limit of requests without `max_tokens`.
+ */
+class LlamaHttpServer @JvmOverloads constructor(
+    model: LlamaModel,
+    name: String,
+    maxTokens: Int = DEFAULT_MAX_TOKENS
+) {
+
+    /**
+     * The native handle to the server.
+     * This field is private and should not be modified directly.
+     */
+    private var nativeHandle: Long = createNative(model, name, maxTokens)
+
+    /**
+     * Listens on `127.0.0.1`.
+     *
+     * @param port The port, or `0` to pick a free one.
+     * @return The port the server listens on, `-1` on failure.
+     */
+    external fun listenTcp(port: Int): Int
+
+    /**
+     * Listens on a Unix socket, replacing a stale socket file.
+     *
+     * @param path The path of the socket file.
+     * @return `true` on success.
+     */
+    external fun listenUnix(path: String): Boolean
+
+    /**
+     * Starts serving on background threads.
+     *
+     * @return `false` if the server is running already or listens on nothing.
+     */
+    external fun start(): Boolean
+
+    /**
+     * Stops the server, cancelling the running completion, and closes its sockets. The server
+     * can't be used afterwards.
+     */
+    external fun close()
+
+    private external fun createNative(model: LlamaModel, name: String, maxTokens: Int): Long
+
+    companion object {
+        /**
+         * The default reply length limit, see [LlamaHttpServer].
+         */
+        const val DEFAULT_MAX_TOKENS = 1024
+    }
+}
@@ -0,0 +1,45 @@
+package com.druk.llamacpp
+
+/**
+ * Memory a loaded model needs and the context size it was planned for, see
+ * [LlamaModel.getMemoryPlan].
+ *
+ * @property contextSize The context size sessions are created with, in tokens.
+ * @property quantizedKvCache Whether the KV cache is stored as Q8_0 to fit a larger context.
+ * @property weightsBytes The size of the model weights.
+ * @property kvCacheBytes The size of the KV cache of one session.
+ * @property computeBytes The estimated size of the compute buffers of one session.
+ * @property budgetBytes The memory budget the plan was made for.
+ * @property fits `false` if even the smallest context exceeds the budget.
+ * @property draftBytes The memory of the draft model, see [LlamaModel.loadDraftModel].
+ */
+data class LlamaMemoryPlan(
+    val contextSize: Int,
+    val quantizedKvCache: Boolean,
+    val weightsBytes: Long,
+    val kvCacheBytes: Long,
+    val computeBytes: Long,
+    val budgetBytes: Long,
+    val fits: Boolean,
+    val draftBytes: Long
+) {
+
+    /**
+     * The total memory the model and one session need.
+     */
+    val totalBytes: Long
+        get() = weightsBytes + draftBytes + kvCacheBytes + computeBytes
+
+    internal companion object {
+        fun fromArray(values: LongArray) = LlamaMemoryPlan(
+            contextSize = values[0].toInt(),
+            quantizedKvCache = values[1] != 0L,
+            weightsBytes = values[2],
+            kvCacheBytes = values[3],
+            computeBytes = values[4],
+            budgetBytes = values[5],
+            fits = values[6] != 0L,
+            draftBytes = values[7]
+        )
+    }
+}
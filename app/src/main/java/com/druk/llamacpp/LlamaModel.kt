@@ -17,9 +17,22 @@ class LlamaModel {
     /**
      * Creates a new generation session for the loaded model.
      *
+     * @param seed The seed of the sampler, sessions with the same seed and the same messages
+     *             generate the same text. [RANDOM_SEED] picks a random one.
      * @return A `LlamaGenerationSession` object for managing text generation.
      */
-    external fun createSession(): LlamaGenerationSession
+    @JvmOverloads
+    fun createSession(seed: Long = RANDOM_SEED): LlamaGenerationSession = createSessionNative(seed)
+
+    private external fun createSessionNative(seed: Long): LlamaGenerationSession
+
+    /**
+     * Creates a session computing embeddings of texts with the loaded model. It has a context
+     * of its own and can be used alongside generation sessions.
+     *
+     * @return A `LlamaEmbeddingSession`, or `null` if the model has no embeddings (e.g. a reranker).
+     */
+    external fun createEmbeddingSession(): LlamaEmbeddingSession?
 
     /**
      * Gets the size of the model in bytes.
@@ -28,9 +41,77 @@ class LlamaModel {
      */
     external fun getModelSize(): Long
 
+    /**
+     * Gets the memory plan made when the model was loaded: the context size and KV cache type
+     * sessions are created with, and how much memory the weights, the KV cache and the compute
+     * buffers take.
+     *
+     * @return The memory plan of the model.
+     */
+    fun getMemoryPlan(): LlamaMemoryPlan = LlamaMemoryPlan.fromArray(getMemoryPlanNative())
+
+    private external fun getMemoryPlanNative(): LongArray
+
+    /**
+     * Enables the on-disk cache of ingested system prompts for sessions created afterwards.
+     *
+     * @param path The directory where the KV states of system prompts are stored.
+     */
+    external fun setPromptCacheDir(path: String)
+
+    /**
+     * Loads a smaller model of the same family (e.g. Qwen2.5 0.5B for Qwen2.5 1.5B) that sessions
+     * created afterwards use to draft tokens for speculative decoding. The generated text is the
+     * same as without it; acceptance rate and effective speed are part of the session report.
+     * The draft takes part of the memory budget, so the context of [getMemoryPlan] may shrink.
+     *
+     * @param path The path to the draft model file.
+     * @return `true` if the draft model was loaded, shares the vocabulary of this model and fits
+     *         the memory budget next to it.
+     */
+    external fun loadDraftModel(path: String): Boolean
+
+    /**
+     * Enables prompt lookup speculative decoding for sessions created afterwards: draft tokens are
+     * taken from earlier occurrences of the last few tokens in the conversation, which speeds up
+     * replies that copy parts of the input. Needs no second model; a loaded draft model takes
+     * precedence.
+     *
+     * @param enabled Whether prompt lookup is used.
+     */
+    external fun setPromptLookup(enabled: Boolean)
+
+    /**
+     * Picks the number of threads and the CPU cores used by sessions created afterwards, separately
+     * for decoding and for prompt processing, by timing short benchmarks on the available core
+     * clusters. The result is cached per device and model, so only the first call takes a few
+     * seconds; call it from a background thread.
+     *
+     * @param cacheDir The directory where tuned profiles are stored.
+     * @return The decode and prompt processing thread counts.
+     */
+    external fun tuneThreads(cacheDir: String): IntArray
+
+    /**
+     * Overrides the KV cache type of sessions created afterwards. Quantized types take less memory
+     * per token at a small cost in quality; the context size of the memory plan is kept and its
+     * sizes are updated. The session report shows the KV cache size.
+     *
+     * @param typeK The type of the K cache: "f16", "q8_0", "q5_1", "q5_0", "q4_1" or "q4_0".
+     * @param typeV The type of the V cache, same values as [typeK].
+     * @return `true` if the model supports the types.
+     */
+    external fun setKvCacheType(typeK: String, typeV: String): Boolean
+
     /**
      * Unloads the model from memory and releases associated resources.
      */
     external fun unloadModel()
 
+    companion object {
+        /**
+         * Seeds the sampler of a session randomly, see [createSession].
+         */
+        const val RANDOM_SEED = -1L
+    }
 }
\ No newline at end of file
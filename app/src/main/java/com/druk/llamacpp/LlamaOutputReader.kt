@@ -0,0 +1,45 @@
+package com.druk.llamacpp
+
+import java.io.ByteArrayOutputStream
+
+/**
+ * Reads the output of [LlamaGenerationSession.generateToRing] directly from the native
+ * output ring, without any per-token allocations on the generation side.
+ *
+ * The reader is meant to be used from a single thread, typically at the UI frame rate,
+ * while the generation runs on another one.
+ *
+ * @param session The session to read the output of.
+ */
+class LlamaOutputReader(private val session: LlamaGenerationSession) {
+
+    private val buffer = session.getOutputBuffer()
+    private val scratch = ByteArray(buffer.capacity())
+    private var position = session.getOutputReadPosition()
+
+    /**
+     * Waits up to [timeoutMs] milliseconds for new output and appends it to [out].
+     *
+     * @param out The stream receiving the new bytes. A chunk may end in the middle of a
+     *            UTF-8 sequence, so decode the accumulated bytes rather than each chunk.
+     * @param timeoutMs How long to wait if there is no new output yet.
+     * @return `false` once the response is complete and all of it has been read.
+     */
+    fun read(out: ByteArrayOutputStream, timeoutMs: Int): Boolean {
+        val end = session.awaitOutput(timeoutMs)
+        if (end < 0) {
+            return false
+        }
+        val capacity = buffer.capacity()
+        while (position < end) {
+            val offset = (position % capacity).toInt()
+            val length = minOf(end - position, (capacity - offset).toLong()).toInt()
+            buffer.position(offset)
+            buffer.get(scratch, 0, length)
+            out.write(scratch, 0, length)
+            position += length
+        }
+        session.releaseOutput(position)
+        return true
+    }
+}
@@ -0,0 +1,83 @@
+package com.druk.llamacpp
+
+/**
+ * Distribution of a latency, see [LlamaSessionMetrics].
+ * Percentiles are rounded up to a histogram bucket, at most 12.5% above the true value.
+ *
+ * @property count The number of recorded values.
+ * @property totalUs The sum of the recorded values in microseconds.
+ * @property p50Us The median in microseconds.
+ * @property p90Us The 90th percentile in microseconds.
+ * @property p99Us The 99th percentile in microseconds.
+ * @property maxUs The largest recorded value in microseconds.
+ */
+data class LlamaLatencySummary(
+    val count: Long,
+    val totalUs: Long,
+    val p50Us: Long,
+    val p90Us: Long,
+    val p99Us: Long,
+    val maxUs: Long
+) {
+
+    internal companion object {
+        const val SIZE = 6
+
+        fun fromArray(values: LongArray, offset: Int) = LlamaLatencySummary(
+            count = values[offset],
+            totalUs = values[offset + 1],
+            p50Us = values[offset + 2],
+            p90Us = values[offset + 3],
+            p99Us = values[offset + 4],
+            maxUs = values[offset + 5]
+        )
+    }
+}
+
+/**
+ * Performance counters of a [LlamaGenerationSession] since it was created, see
+ * [LlamaGenerationSession.getMetrics].
+ *
+ * @property lastTimeToFirstTokenUs The time from [LlamaGenerationSession.addMessage] to the first
+ *                                  token of the last reply.
+ * @property timeToFirstToken The time to first token of all replies.
+ * @property tokenLatency The time between consecutive tokens of a reply.
+ * @property prefillChunk The time to process one batch of prompt tokens.
+ * @property prefillTokens The number of prompt tokens processed.
+ * @property sampler The time to sample one token.
+ * @property contextShifts How many times old tokens were dropped because the context was full.
+ * @property contextShiftTokens The number of tokens dropped by context shifts.
+ * @property kvCacheUsed The number of KV cache cells in use.
+ * @property kvCacheSize The number of KV cache cells.
+ */
+data class LlamaSessionMetrics(
+    val lastTimeToFirstTokenUs: Long,
+    val timeToFirstToken: LlamaLatencySummary,
+    val tokenLatency: LlamaLatencySummary,
+    val prefillChunk: LlamaLatencySummary,
+    val prefillTokens: Long,
+    val sampler: LlamaLatencySummary,
+    val contextShifts: Long,
+    val contextShiftTokens: Long,
+    val kvCacheUsed: Long,
+    val kvCacheSize: Long
+) {
+
+    internal companion object {
+        fun fromArray(values: LongArray): LlamaSessionMetrics {
+            val size = LlamaLatencySummary.SIZE
+            return LlamaSessionMetrics(
+                lastTimeToFirstTokenUs = values[0],
+                timeToFirstToken = LlamaLatencySummary.fromArray(values, 1),
+                tokenLatency = LlamaLatencySummary.fromArray(values, 1 + size),
+                prefillChunk = LlamaLatencySummary.fromArray(values, 1 + 2 * size),
+                prefillTokens = values[1 + 3 * size],
+                sampler = LlamaLatencySummary.fromArray(values, 2 + 3 * size),
+                contextShifts = values[2 + 4 * size],
+                contextShiftTokens = values[3 + 4 * size],
+                kvCacheUsed = values[4 + 4 * size],
+                kvCacheSize = values[5 + 4 * size]
+            )
+        }
+    }
+}
@@ -0,0 +1,83 @@
+package com.druk.llamacpp
+
+/**
+ * A search result of [LlamaVectorStore.search].
+ *
+ * @property index The position of the vector in the store, in the order it was added.
+ * @property score The dot product with the query, for normalized vectors their cosine similarity
+ *                 up to the 8-bit quantization of both, typically within 1e-3.
+ */
+data class LlamaVectorHit(val index: Long, val score: Float)
+
+/**
+ * An append-only store of vectors in a memory-mapped file, searched by dot product.
+ *
+ * Vectors are stored quantized to 8 bits, a quarter of the size of floats, and every search
+ * scans all of them; it is meant for up to a few hundred thousand vectors. The store is not
+ * thread-safe: searches may run concurrently with each other, but not with [add].
+ *
+ * @param path The file of the store, created if it does not exist.
+ * @param dimension The number of values of a vector, or `0` to take the one of an existing file.
+ * @throws IllegalArgumentException If the file can not be opened or has another dimension.
+ */
+class LlamaVectorStore(path: String, dimension: Int) {
+
+    /**
+     * The native handle to the vector store.
+     * This field is private and should not be modified directly.
+     */
+    private var nativeHandle: Long = openNative(path, dimension)
+
+    init {
+        require(nativeHandle != 0L) { "Can't open vector store $path" }
+    }
+
+    /**
+     * The number of values of a vector.
+     */
+    val dimension: Int
+        get() = getDimension()
+
+    /**
+     * The number of vectors in the store.
+     */
+    val size: Long
+        get() = getSize()
+
+    /**
+     * Appends vectors to the store.
+     *
+     * @param vectors `n * dimension` values, e.g. the result of [LlamaEmbeddingSession.embed].
+     * @return The index of the first added vector, `-1` on failure.
+     */
+    external fun add(vectors: FloatArray): Long
+
+    /**
+     * Finds the vectors with the highest dot product with the query.
+     *
+     * @param query `dimension` values.
+     * @param k The number of results.
+     * @param threads The number of threads scanning large stores, the workers are started with
+     *                the first such search and kept.
+     * @return Up to [k] results, best first.
+     */
+    @JvmOverloads
+    fun search(query: FloatArray, k: Int, threads: Int = 1): List<LlamaVectorHit> {
+        val scores = FloatArray(k)
+        val indices = searchNative(query, k, threads, scores)
+        return indices.indices.map { LlamaVectorHit(indices[it], scores[it]) }
+    }
+
+    /**
+     * Closes the file of the store. The store can't be used afterwards.
+     */
+    external fun close()
+
+    private external fun openNative(path: String, dimension: Int): Long
+
+    private external fun getDimension(): Int
+
+    private external fun getSize(): Long
+
+    private external fun searchNative(query: FloatArray, k: Int, threads: Int, scores: FloatArray): LongArray
+}
@@ -19,6 +19,10 @@ class ConversationUiState(
         _messages[_messages.size - 1] = message.copy(content = msg)
     }
 
+    fun removeLastMessages(count: Int) {
+        repeat(minOf(count, _messages.size)) { _messages.removeAt(_messages.size - 1) }
+    }
+
     fun resetMessages() {
         _messages.clear()
     }
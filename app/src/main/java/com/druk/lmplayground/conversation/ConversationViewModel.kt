@@ -19,21 +19,30 @@ import androidx.lifecycle.LiveData
 import androidx.lifecycle.MutableLiveData
 import androidx.lifecycle.viewModelScope
 import com.druk.llamacpp.LlamaCpp
-import com.druk.llamacpp.LlamaGenerationCallback
 import com.druk.llamacpp.LlamaGenerationSession
 import com.druk.llamacpp.LlamaModel
+import com.druk.llamacpp.LlamaOutputReader
 import com.druk.llamacpp.LlamaProgressCallback
 import com.druk.lmplayground.App
 import com.druk.lmplayground.models.ModelInfo
 import com.druk.lmplayground.models.ModelInfoProvider
 import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.Job
-import kotlinx.coroutines.isActive
+import kotlinx.coroutines.NonCancellable
 import kotlinx.coroutines.launch
 import kotlinx.coroutines.withContext
+import java.io.ByteArrayOutputStream
+import java.io.File
 import java.util.TreeMap
 import kotlin.math.round
 
+// How long a read of the generation output blocks, and how often the response is redrawn
+private const val OUTPUT_WAIT_MS = 100
+private const val OUTPUT_FRAME_MS = 16L
+// Upper bound of the planned context size, longer contexts would fit on some devices but make
+// every decode slower long before they are filled
+private const val MAX_CONTEXT_SIZE = 8192
+
 class ConversationViewModel(val app: Application) : AndroidViewModel(app) {
 
     private val llamaCpp: LlamaCpp? = (app as? App)?.llamaCpp
@@ -102,6 +111,7 @@ class ConversationViewModel(val app: Application) : AndroidViewModel(app) {
     }
 
     override fun onCleared() {
+        llamaSession?.cancel()
         generatingJob?.cancel()
         viewModelScope.launch {
             llamaModel?.unloadModel()
@@ -137,6 +147,9 @@ class ConversationViewModel(val app: Application) : AndroidViewModel(app) {
                     modelInfo.inputPrefix,
                     modelInfo.inputSuffix,
                     modelInfo.antiPrompt,
+                    MAX_CONTEXT_SIZE,
+                    -1,
+                    0L,
                     object: LlamaProgressCallback {
                         override fun onProgress(progress: Float) {
                             val progressDescription = "${round(100 * progress).toInt()}%"
@@ -149,8 +162,15 @@ class ConversationViewModel(val app: Application) : AndroidViewModel(app) {
                         }
                     }
                 )
-                val modelSize = llamaModel.getModelSize()
-                val modelDescription = Formatter.formatFileSize(app, modelSize)
+                llamaModel.setPromptCacheDir(File(app.cacheDir, "prompt-cache").path)
+                llamaModel.tuneThreads(File(app.filesDir, "thread-profiles").path)
+                val hasDraftModel = modelInfo.draftModelFile?.let { llamaModel.loadDraftModel(it.path) } ?: false
+                // without a draft model, speculate from the conversation itself
+                llamaModel.setPromptLookup(!hasDraftModel)
+                // planned again if the draft model took part of the budget
+                val memoryPlan = llamaModel.getMemoryPlan()
+                val modelDescription = "${Formatter.formatFileSize(app, memoryPlan.totalBytes)}, " +
+                        "${memoryPlan.contextSize} tokens"
                 val llamaSession = llamaModel.createSession()
                 this@ConversationViewModel.llamaModel = llamaModel
                 this@ConversationViewModel.llamaSession = llamaSession
@@ -179,22 +199,42 @@ class ConversationViewModel(val app: Application) : AndroidViewModel(app) {
         generatingJob = viewModelScope.launch {
             withContext(Dispatchers.Default) {
                 val llamaSession = llamaSession ?: return@withContext
+                // a cancelled generation may still be winding down
+                llamaSession.waitAsync()
                 llamaSession.addMessage(message.content)
 
-                val callback = object: LlamaGenerationCallback {
-                    var responseByteArray = ByteArray(0)
-                    override fun newTokens(newTokens: ByteArray) {
-                        responseByteArray += newTokens
-                        var string = String(responseByteArray, Charsets.UTF_8)
+                val reader = LlamaOutputReader(llamaSession)
+                // The whole response is generated natively into the output ring on a native
+                // worker, cancelGeneration() stops it early, also while the prompt is processed
+                if (!llamaSession.startAsync()) {
+                    uiState.removeLastMessages(2)
+                    _isGenerating.postValue(false)
+                    return@withContext
+                }
+
+                val response = ByteArrayOutputStream()
+                var shownBytes = 0
+                // Reads until the response is complete, which also happens after
+                // cancelGeneration() because cancelling the session closes the ring
+                while (reader.read(response, OUTPUT_WAIT_MS)) {
+                    if (response.size() != shownBytes) {
+                        shownBytes = response.size()
+                        var string = response.toString(Charsets.UTF_8.name())
                         for (suffix in antiPrompt ?: emptyArray()) {
                             string = string.removeSuffix(suffix)
                             string = string.removeSuffix(suffix + "\n")
                         }
                         uiState.updateLastMessage(string)
                     }
+                    // let the output accumulate instead of redrawing for every token
+                    Thread.sleep(OUTPUT_FRAME_MS)
+                }
+                val status = withContext(NonCancellable) {
+                    llamaSession.waitAsync()
                 }
-                while (this.isActive && llamaSession.generate(callback) == 0) {
-                    // wait for the response
+                if (status == LlamaGenerationSession.STATUS_CANCELLED) {
+                    // the session dropped the message, so does the conversation
+                    uiState.removeLastMessages(2)
                 }
                 llamaSession.printReport()
                 _isGenerating.postValue(false)
@@ -204,6 +244,7 @@ class ConversationViewModel(val app: Application) : AndroidViewModel(app) {
 
     @MainThread
     fun cancelGeneration() {
+        llamaSession?.cancel()
         generatingJob?.cancel()
         generatingJob = null
     }
@@ -216,6 +257,7 @@ class ConversationViewModel(val app: Application) : AndroidViewModel(app) {
         viewModelScope.launch {
             val loadedModel = _loadedModel.value ?: return@launch
             if (loadedModel.file != null) {
+                llamaSession?.cancel()
                 generatingJob?.cancel()
                 generatingJob = null
                 llamaSession?.destroy()
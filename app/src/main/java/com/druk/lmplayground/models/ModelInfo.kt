@@ -11,6 +11,7 @@ data class ModelInfo(
     val inputPrefix: String? = null,
     val inputSuffix: String? = null,
     val antiPrompt: Array<String> = emptyArray(),
+    val draftModelFile: File? = null,
     val description: String
 ) {
     override fun equals(other: Any?): Boolean {
@@ -26,6 +27,7 @@ data class ModelInfo(
         if (inputPrefix != other.inputPrefix) return false
         if (inputSuffix != other.inputSuffix) return false
         if (!antiPrompt.contentEquals(other.antiPrompt)) return false
+        if (draftModelFile != other.draftModelFile) return false
         if (description != other.description) return false
 
         return true
@@ -39,6 +41,7 @@ data class ModelInfo(
         result = 31 * result + (inputPrefix?.hashCode() ?: 0)
         result = 31 * result + (inputSuffix?.hashCode() ?: 0)
         result = 31 * result + antiPrompt.contentHashCode()
+        result = 31 * result + (draftModelFile?.hashCode() ?: 0)
         result = 31 * result + description.hashCode()
         return result
     }
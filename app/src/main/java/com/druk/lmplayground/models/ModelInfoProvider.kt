@@ -25,6 +25,7 @@ object ModelInfoProvider {
                 inputPrefix = "<|im_start|>user\n",
                 inputSuffix = "<|im_end|>\n<|im_start|>assistant\n",
                 antiPrompt = arrayOf("<|im_end|>"),
+                draftModelFile = files?.firstOrNull { it.name == "Qwen2.5-0.5B-Instruct-Q4_K_M.gguf" },
                 description = "1.5 billion parameters language model"
             ),
             ModelInfo(
@@ -43,6 +44,7 @@ object ModelInfoProvider {
                 inputPrefix = "<|start_header_id|>user<|end_header_id|>\n\n",
                 inputSuffix = "<|eot_id|><|start_header_id|>assistant<|end_header_id|>\n\n",
                 antiPrompt = arrayOf("<|eot_id|>"),
+                draftModelFile = files?.firstOrNull { it.name == "Llama-3.2-1B-Instruct-Q4_K_M.gguf" },
                 description = "3 billions parameters language model"
             ),
             ModelInfo(
@@ -78,6 +80,7 @@ object ModelInfoProvider {
                 inputPrefix = "<|start_header_id|>user<|end_header_id|>\n\n",
                 inputSuffix = "<|eot_id|><|start_header_id|>assistant<|end_header_id|>\n\n",
                 antiPrompt = arrayOf("<|eot_id|>"),
+                draftModelFile = files?.firstOrNull { it.name == "Llama-3.2-1B-Instruct-Q4_K_M.gguf" },
                 description = "8 billions parameters language model"
             ),
             ModelInfo(